@@ -0,0 +1,480 @@
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "batchmode.h"
+#include "twainthread.h"
+#include "encoderpool.h"
+#include "settings.h"
+#include "profile.h"
+
+#include <windows.h>
+#include <shellapi.h>
+#include <shlobj.h>
+
+struct BatchModeArgs {
+    BOOL             batch;
+    BOOL             help;
+    BOOL             hasSource;
+    TW_IDENTITY      source;
+    PageWriterSettings settings;
+    TwainScanOptions options;
+    WCHAR            profile[PROFILE_MAX_NAME];
+    WCHAR            saveProfile[PROFILE_MAX_NAME];
+};
+
+static const WCHAR g_batchModeWindowClass[] = L"TwainClientBatchMode";
+
+static HANDLE g_hOutput;
+static BOOL   g_outputIsConsole;
+static UINT   g_errorCount;
+
+// the source's settings after the batch, for /saveprofile
+static ScanProfile *g_capturedProfile;
+
+static void
+BatchMode_AttachConsole(void)
+{
+    // XP and newer, resolved at runtime like everything else that's newer than 2000
+    BOOL (WINAPI *attachConsole)(DWORD) = (BOOL (WINAPI *)(DWORD))(void*)GetProcAddress(GetModuleHandle(L"kernel32.dll"), "AttachConsole");
+
+    // a GUI program has no console, unless its output is redirected
+    g_hOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+    if ((!g_hOutput || g_hOutput == INVALID_HANDLE_VALUE) && attachConsole && attachConsole((DWORD)-1))
+        g_hOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+
+    DWORD mode;
+    g_outputIsConsole = g_hOutput && g_hOutput != INVALID_HANDLE_VALUE && GetConsoleMode(g_hOutput, &mode);
+}
+
+static void
+BatchMode_Print(const WCHAR *format, ...)
+{
+    if (!g_hOutput || g_hOutput == INVALID_HANDLE_VALUE)
+        return;
+
+    WCHAR buf[1024];
+    va_list args;
+    va_start(args, format);
+    int len = wvsprintf(buf, format, args);
+    va_end(args);
+
+    if (len <= 0)
+        return;
+
+    DWORD written = 0;
+    if (g_outputIsConsole) {
+        WriteConsole(g_hOutput, buf, (DWORD)len, &written, NULL);
+    } else {
+        char mb[2048];
+        int mblen = WideCharToMultiByte(CP_ACP, 0, buf, len, mb, sizeof(mb), NULL, NULL);
+        if (mblen > 0)
+            WriteFile(g_hOutput, mb, (DWORD)mblen, &written, NULL);
+    }
+}
+
+static void
+BatchMode_PrintUsage(void)
+{
+    BatchMode_Print(L"Usage: twainclient /batch [options]\r\n"
+                    L"  /source:NAME        product name of the source, default: the last one used\r\n"
+                    L"  /folder:PATH        output folder, default: My Pictures\r\n"
+                    L"  /name:PREFIX        file name prefix, default: scan\r\n"
+                    L"  /number:N           number of the first file, default: 0\r\n"
+                    L"  /format:NAME        format index, description or file extension\r\n"
+                    L"  /pages:N            stop after N pages\r\n"
+                    L"  /dpi:N              resolution\r\n"
+                    L"  /pixeltype:TYPE     bw, gray or rgb\r\n"
+                    L"  /bitdepth:N         bits per pixel, e.g. 1, 8 or 24\r\n"
+                    L"  /duplex:on|off      scan both sides\r\n"
+                    L"  /feeder:on|off      scan from the document feeder, default: on\r\n");
+
+    // wvsprintf() stops at 1024 characters
+    BatchMode_Print(L"  /deskew:on|off      let the scanner straighten pages\r\n"
+                    L"  /dropblank          drop blank back sides of duplex sheets\r\n"
+                    L"  /rotateback         turn back sides upside down (top to bottom flip)\r\n"
+                    L"  /separator:patch    patch code sheets start a new document\r\n"
+                    L"  /separator:barcode[:PREFIX]\r\n"
+                    L"                      the same for barcode sheets (text starting with PREFIX)\r\n"
+                    L"  /shard:date|batch|N subfolders per day, per batch or for every N files\r\n"
+                    L"  /manifest           describe every page in <name>-<batch id>.manifest\r\n"
+                    L"  /spool              journal pages as they arrive, written after a crash\r\n"
+                    L"  /zip:store|deflate  all pages into <name>-<batch id>.zip, single-page formats\r\n"
+                    L"  /profile:NAME       restore a scan profile, the other options override it\r\n"
+                    L"  /saveprofile:NAME   save the settings after scanning as a profile\r\n"
+                    L"Exit codes: 0 ok, 1 bad arguments, 2 errors, 3 no pages\r\n");
+}
+
+static BOOL
+BatchMode_ParseUInt(const WCHAR *s, UINT *pValue)
+{
+    UINT v = 0;
+    if (!*s)
+        return FALSE;
+
+    for (; *s; ++s) {
+        if (*s < '0' || *s > '9' || v > 100000000)
+            return FALSE;
+        v = v * 10 + (UINT)(*s - '0');
+    }
+
+    *pValue = v;
+    return TRUE;
+}
+
+// patch, barcode or barcode:PREFIX, may be given more than once
+static BOOL
+BatchMode_ParseSeparator(BatchModeArgs *a, const WCHAR *value)
+{
+    if (!lstrcmpi(value, L"patch")) {
+        a->options.separators |= TWAINTHREAD_SEPARATE_PATCHCODE;
+        return TRUE;
+    }
+
+    static const WCHAR barcode[] = L"barcode";
+    const UINT n = sizeof(barcode)/sizeof(barcode[0]) - 1;
+    if (CompareString(LOCALE_USER_DEFAULT, NORM_IGNORECASE, value, min(lstrlen(value), (int)n), barcode, n) != CSTR_EQUAL)
+        return FALSE;
+
+    if (value[n] == ':') {
+        if (!WideCharToMultiByte(CP_ACP, 0, value + n + 1, -1, a->options.separatorPrefix,
+                                 sizeof(a->options.separatorPrefix), NULL, NULL))
+            return FALSE;
+    } else if (value[n]) {
+        return FALSE;
+    }
+
+    a->options.separators |= TWAINTHREAD_SEPARATE_BARCODE;
+    return TRUE;
+}
+
+static BOOL
+BatchMode_ParseOption(BatchModeArgs *a, const WCHAR *name, const WCHAR *value)
+{
+    if (!lstrcmpi(name, L"batch")) {
+        a->batch = TRUE;
+        return TRUE;
+    } else if (!lstrcmpi(name, L"?") || !lstrcmpi(name, L"help")) {
+        a->help = TRUE;
+        return TRUE;
+    } else if (!lstrcmpi(name, L"dropblank") && !value) {
+        a->settings.backs |= PAGEWRITER_DROP_BLANK_BACKS;
+        return TRUE;
+    } else if (!lstrcmpi(name, L"rotateback") && !value) {
+        a->settings.backs |= PAGEWRITER_ROTATE_BACKS;
+        return TRUE;
+    } else if (!lstrcmpi(name, L"manifest") && !value) {
+        a->settings.manifest = TRUE;
+        return TRUE;
+    } else if (!lstrcmpi(name, L"spool") && !value) {
+        a->settings.spool = TRUE;
+        return TRUE;
+    }
+
+    if (!value)
+        return FALSE;
+
+    if (!lstrcmpi(name, L"source")) {
+        ZeroMemory(&a->source, sizeof(a->source));
+        a->hasSource = WideCharToMultiByte(CP_ACP, 0, value, -1, a->source.ProductName,
+                                           sizeof(a->source.ProductName), NULL, NULL) > 1;
+        return a->hasSource;
+    } else if (!lstrcmpi(name, L"folder")) {
+        lstrcpyn(a->settings.folder, value, sizeof(a->settings.folder)/sizeof(a->settings.folder[0]));
+    } else if (!lstrcmpi(name, L"name")) {
+        lstrcpyn(a->settings.filename, value, sizeof(a->settings.filename)/sizeof(a->settings.filename[0]));
+    } else if (!lstrcmpi(name, L"number")) {
+        return BatchMode_ParseUInt(value, &a->settings.counter) && a->settings.counter <= PAGEWRITER_MAX_NUMBER;
+    } else if (!lstrcmpi(name, L"format")) {
+        return PageWriter_FindFormat(value, &a->settings.format);
+    } else if (!lstrcmpi(name, L"pages")) {
+        return BatchMode_ParseUInt(value, &a->options.pageLimit) && a->options.pageLimit > 0;
+    } else if (!lstrcmpi(name, L"dpi")) {
+        return BatchMode_ParseUInt(value, &a->options.resolution)
+            && a->options.resolution > 0 && a->options.resolution < 32768;
+    } else if (!lstrcmpi(name, L"pixeltype")) {
+        if (!lstrcmpi(value, L"bw"))
+            a->options.pixelType = TWPT_BW;
+        else if (!lstrcmpi(value, L"gray"))
+            a->options.pixelType = TWPT_GRAY;
+        else if (!lstrcmpi(value, L"rgb"))
+            a->options.pixelType = TWPT_RGB;
+        else
+            return FALSE;
+    } else if (!lstrcmpi(name, L"bitdepth")) {
+        return BatchMode_ParseUInt(value, &a->options.bitDepth)
+            && a->options.bitDepth > 0 && a->options.bitDepth <= 64;
+    } else if (!lstrcmpi(name, L"duplex")) {
+        if (!lstrcmpi(value, L"on"))
+            a->options.duplex = TRUE;
+        else if (!lstrcmpi(value, L"off"))
+            a->options.duplex = FALSE;
+        else
+            return FALSE;
+    } else if (!lstrcmpi(name, L"feeder")) {
+        if (!lstrcmpi(value, L"on"))
+            a->options.feeder = TRUE;
+        else if (!lstrcmpi(value, L"off"))
+            a->options.feeder = FALSE;
+        else
+            return FALSE;
+    } else if (!lstrcmpi(name, L"deskew")) {
+        if (!lstrcmpi(value, L"on"))
+            a->options.deskew = TRUE;
+        else if (!lstrcmpi(value, L"off"))
+            a->options.deskew = FALSE;
+        else
+            return FALSE;
+    } else if (!lstrcmpi(name, L"shard")) {
+        if (!lstrcmpi(value, L"date"))
+            a->settings.shard = PAGEWRITER_SHARD_DATE;
+        else if (!lstrcmpi(value, L"batch"))
+            a->settings.shard = PAGEWRITER_SHARD_BATCH;
+        else if (BatchMode_ParseUInt(value, &a->settings.shardSize) && a->settings.shardSize > 0)
+            a->settings.shard = PAGEWRITER_SHARD_COUNT;
+        else
+            return FALSE;
+    } else if (!lstrcmpi(name, L"zip")) {
+        if (!lstrcmpi(value, L"store"))
+            a->settings.archive = PAGEWRITER_ARCHIVE_STORE;
+        else if (!lstrcmpi(value, L"deflate"))
+            a->settings.archive = PAGEWRITER_ARCHIVE_DEFLATE;
+        else
+            return FALSE;
+    } else if (!lstrcmpi(name, L"separator")) {
+        return BatchMode_ParseSeparator(a, value);
+    } else if (!lstrcmpi(name, L"profile")) {
+        lstrcpyn(a->profile, value, sizeof(a->profile)/sizeof(a->profile[0]));
+    } else if (!lstrcmpi(name, L"saveprofile")) {
+        lstrcpyn(a->saveProfile, value, sizeof(a->saveProfile)/sizeof(a->saveProfile[0]));
+    } else {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// Options look like /name:value (or -name:value). Returns FALSE and
+// reports the offending argument on errors.
+static BOOL
+BatchMode_ParseArgs(BatchModeArgs *a)
+{
+    ZeroMemory(a, sizeof(*a));
+    TwainThread_DefaultOptions(&a->options);
+    lstrcpy(a->settings.filename, L"scan");
+    SHGetFolderPath(NULL, CSIDL_MYPICTURES|CSIDL_FLAG_CREATE, NULL, SHGFP_TYPE_CURRENT, a->settings.folder);
+
+    int argc = 0;
+    WCHAR **argv = CommandLineToArgvW(GetCommandLine(), &argc);
+    if (!argv)
+        return FALSE;
+
+    BOOL ok = TRUE;
+    for (int i = 1; i < argc && ok; ++i) {
+        WCHAR *name = argv[i];
+        if (*name != '/' && *name != '-') {
+            ok = FALSE;
+        } else {
+            ++name;
+            WCHAR *value = name;
+            while (*value && *value != ':')
+                ++value;
+            if (*value)
+                *value++ = 0;
+            else
+                value = NULL;
+
+            ok = BatchMode_ParseOption(a, name, value);
+        }
+
+        if (!ok)
+            BatchMode_Print(L"Invalid argument: %s\r\n", argv[i]);
+    }
+
+    LocalFree(argv);
+    return ok;
+}
+
+// Looks at every argument, valid or not: a bad one must still end up
+// in BatchMode_Run(), which reports it, rather than in a dialog nobody
+// sees under a scheduler
+BOOL
+BatchMode_IsRequested(void)
+{
+    int argc = 0;
+    WCHAR **argv = CommandLineToArgvW(GetCommandLine(), &argc);
+    if (!argv)
+        return FALSE;
+
+    BOOL requested = FALSE;
+    for (int i = 1; i < argc && !requested; ++i) {
+        WCHAR *name = argv[i];
+        if (*name != '/' && *name != '-')
+            continue;
+
+        ++name;
+        WCHAR *value = name;
+        while (*value && *value != ':')
+            ++value;
+        *value = 0;
+
+        requested = !lstrcmpi(name, L"batch") || !lstrcmpi(name, L"?") || !lstrcmpi(name, L"help");
+    }
+
+    LocalFree(argv);
+    return requested;
+}
+
+static LRESULT CALLBACK
+BatchMode_WndProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
+{
+    switch (uMsg) {
+    case TWAINTHREAD_WM_ERROR:
+    case ENCODERPOOL_WM_ERROR:
+        BatchMode_Print(L"Error: %s\r\n", (const WCHAR *)lParam);
+        g_errorCount++;
+        return 0;
+    case TWAINTHREAD_WM_HUNG:
+        // the session may never end, so don't wait for it
+        BatchMode_Print(L"Error: The scanner driver stopped responding, see the Logs folder\r\n");
+        g_errorCount++;
+        PostQuitMessage(0);
+        return 0;
+    case TWAINTHREAD_WM_PAGESKIPPED:
+        BatchMode_Print(L"Error: page %u failed to transfer and was skipped\r\n", (UINT)wParam);
+        g_errorCount++;
+        return 0;
+    case TWAINTHREAD_WM_ENDED:
+        TwainThread_Reap((TwainThread *)lParam);
+        PostQuitMessage(0);
+        return 0;
+    case TWAINTHREAD_WM_PROFILECAPTURED:
+        Profile_Free(g_capturedProfile);
+        g_capturedProfile = (ScanProfile *)lParam;
+        return 0;
+    }
+
+    return DefWindowProc(hwnd, uMsg, wParam, lParam);
+}
+
+int
+BatchMode_Run(void)
+{
+    BatchMode_AttachConsole();
+
+    BatchModeArgs args;
+    if (!BatchMode_ParseArgs(&args) || args.help) {
+        BatchMode_PrintUsage();
+        return BATCHMODE_EXIT_USAGE;
+    }
+
+    ScanProfile *profile = NULL;
+    if (args.profile[0]) {
+        profile = Profile_Load(args.profile);
+        if (!profile) {
+            BatchMode_Print(L"Scan profile not found: %s\r\n", args.profile);
+            return BATCHMODE_EXIT_USAGE;
+        }
+
+        // a profile belongs to the source it was made with
+        if (!args.hasSource) {
+            args.source = profile->source;
+            args.hasSource = TRUE;
+        }
+    }
+
+    if (!args.hasSource && !Settings_LoadSource(&args.source)) {
+        BatchMode_Print(L"No source given and none used before\r\n");
+        return BATCHMODE_EXIT_USAGE;
+    }
+
+    // never fall back to MSG_USERSELECT, nobody is watching
+    args.options.flags = TWAINTHREAD_NO_UI | TWAINTHREAD_NO_INDICATORS;
+    if (args.saveProfile[0])
+        args.options.flags |= TWAINTHREAD_CAPTURE_PROFILE;
+    args.options.profile = profile;
+
+    WNDCLASS wc;
+    ZeroMemory(&wc, sizeof(wc));
+    wc.lpfnWndProc = BatchMode_WndProc;
+    wc.hInstance = GetModuleHandle(NULL);
+    wc.lpszClassName = g_batchModeWindowClass;
+    RegisterClass(&wc);
+
+    // receives the messages of the session and the encoder pool
+    HWND hwnd = CreateWindow(g_batchModeWindowClass, L"", 0, 0, 0, 0, 0,
+                             HWND_MESSAGE, NULL, GetModuleHandle(NULL), NULL);
+    if (!hwnd) {
+        BatchMode_Print(L"Error: Failed to create the notification window\r\n");
+        Profile_Free(profile);
+        return BATCHMODE_EXIT_FAILED;
+    }
+
+    EncoderPool_Start(hwnd, 8);
+    // without a pool, pages are written on the session thread
+
+    DWORD startTicks = GetTickCount();
+    UINT pages = 0;
+
+    PageWriterBatch *batch = PageWriter_CreateBatch(&args.settings);
+    ScanJob *job = batch ? ScanJob_Create(batch, 1, REORDER_CONCATENATE) : NULL;
+    PageWriter_ReleaseBatch(batch);
+
+    if (!job || !TwainThread_Start(hwnd, job, 0, &args.source, &args.options)) {
+        BatchMode_Print(L"Error: Failed to start scanning\r\n");
+        g_errorCount++;
+    } else {
+        MSG msg;
+        while (GetMessage(&msg, NULL, 0, 0)) {
+            TranslateMessage(&msg);
+            DispatchMessage(&msg);
+        }
+    }
+
+    TwainThread_StopAll();
+    EncoderPool_Stop();
+
+    // errors of the pages that were still being written
+    MSG msg;
+    while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE))
+        DispatchMessage(&msg);
+
+    if (job) {
+        pages = ScanJob_PageCount(job);
+        ScanJob_Release(job); // also finishes a multi-page document
+    }
+
+    DestroyWindow(hwnd);
+
+    if (args.saveProfile[0]) {
+        if (!g_capturedProfile || !Profile_Save(args.saveProfile, g_capturedProfile)) {
+            BatchMode_Print(L"Error: Failed to save the scan profile\r\n");
+            g_errorCount++;
+        }
+    }
+
+    Profile_Free(g_capturedProfile);
+    g_capturedProfile = NULL;
+    Profile_Free(profile);
+
+    DWORD ms = GetTickCount() - startTicks;
+    DWORD pagesPerMinute = ms ? (DWORD)((ULONGLONG)pages * 60000 / ms) : 0;
+    BatchMode_Print(L"%u pages in %u.%u s (%u pages/min), %u errors\r\n",
+                    pages, ms / 1000, (ms % 1000) / 100, pagesPerMinute, g_errorCount);
+
+    if (g_errorCount)
+        return BATCHMODE_EXIT_FAILED;
+    if (!pages)
+        return BATCHMODE_EXIT_NO_PAGES;
+    return BATCHMODE_EXIT_OK;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <windows.h>
+
+// Headless scanning for job schedulers: everything comes from the
+// command line, the source is enabled without its UI and no window is
+// shown. A summary goes to the console of the parent process, the
+// result is the exit code.
+//
+//   twainclient.exe /batch [/source:NAME] [/folder:PATH] [/name:PREFIX]
+//                   [/number:N] [/format:NAME] [/pages:N] [/dpi:N]
+//                   [/pixeltype:bw|gray|rgb] [/duplex:on|off]
+enum {
+    BATCHMODE_EXIT_OK       = 0,
+    BATCHMODE_EXIT_USAGE    = 1,  // bad arguments, nothing scanned
+    BATCHMODE_EXIT_FAILED   = 2,  // errors, some pages may be written
+    BATCHMODE_EXIT_NO_PAGES = 3   // no errors, but the source had nothing
+};
+
+// TRUE if the command line asks for batch mode
+BOOL
+BatchMode_IsRequested(void);
+
+// Needs COM, GDI+ and the page writer to be initialized already.
+// Returns the exit code.
+int
+BatchMode_Run(void);
@@ -0,0 +1,240 @@
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "capcache.h"
+#include "settings.h"
+
+#include <windows.h>
+
+// everything a session or profile may want to set or check
+static const TW_UINT16 g_capCacheCaps[] = {
+    ICAP_PIXELTYPE,
+    ICAP_BITDEPTH,
+    ICAP_XRESOLUTION,
+    ICAP_YRESOLUTION,
+    ICAP_COMPRESSION,
+    CAP_DUPLEX,
+    CAP_DUPLEXENABLED,
+    CAP_FEEDERENABLED,
+    CAP_AUTOFEED,
+    CAP_AUTOSCAN,
+    CAP_MAXBATCHBUFFERS,
+    CAP_INDICATORS,
+    CAP_XFERCOUNT,
+    ICAP_AUTOMATICDESKEW,
+    ICAP_AUTOMATICROTATE,
+    ICAP_AUTODISCARDBLANKPAGES,
+    ICAP_PATCHCODEDETECTIONENABLED
+};
+
+static const UINT g_capCacheCapCount = sizeof(g_capCacheCaps) / sizeof(g_capCacheCaps[0]);
+
+#define CAPCACHE_MAGIC 0x31434354 // "TCC1"
+
+struct CapCacheFileHeader {
+    DWORD magic;
+    DWORD size;   // sizeof(CapCache), changes whenever the layout does
+};
+
+static BOOL
+CapCache_FilePath(const TW_IDENTITY *pSource, WCHAR *path)
+{
+    WCHAR dir[MAX_PATH];
+    if (!Settings_GetDataDir(L"Capabilities", dir))
+        return FALSE;
+
+    char name[sizeof(pSource->Manufacturer) + sizeof(pSource->ProductName) + 1];
+    wsprintfA(name, "%s %s", pSource->Manufacturer, pSource->ProductName);
+
+    WCHAR wname[sizeof(name)];
+    if (!MultiByteToWideChar(CP_ACP, 0, name, -1, wname, sizeof(wname)/sizeof(wname[0])))
+        return FALSE;
+
+    return Settings_DataFilePath(dir, wname, L".caps", path);
+}
+
+static BOOL
+CapCache_SameDriver(const TW_IDENTITY *a, const TW_IDENTITY *b)
+{
+    return TwainHelper_IsSameSource(a, b)
+        && a->Version.MajorNum == b->Version.MajorNum
+        && a->Version.MinorNum == b->Version.MinorNum
+        && lstrcmpA(a->Version.Info, b->Version.Info) == 0;
+}
+
+BOOL
+CapCache_Load(const TW_IDENTITY *pSource, CapCache *pCache)
+{
+    WCHAR path[MAX_PATH + 80];
+    if (!CapCache_FilePath(pSource, path))
+        return FALSE;
+
+    HANDLE hFile = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    CapCacheFileHeader header;
+    DWORD read = 0;
+    BOOL ok = ReadFile(hFile, &header, sizeof(header), &read, NULL) && read == sizeof(header)
+           && header.magic == CAPCACHE_MAGIC && header.size == sizeof(*pCache)
+           && ReadFile(hFile, pCache, sizeof(*pCache), &read, NULL) && read == sizeof(*pCache);
+
+    CloseHandle(hFile);
+
+    if (!ok || pCache->count > CAPCACHE_MAX_CAPS)
+        return FALSE;
+
+    for (UINT i = 0; i < pCache->count; ++i) {
+        if (pCache->entries[i].value.count > TWAINHELPER_MAX_CAP_ITEMS)
+            return FALSE;
+    }
+
+    pCache->source.Manufacturer[sizeof(pCache->source.Manufacturer) - 1] = 0;
+    pCache->source.ProductFamily[sizeof(pCache->source.ProductFamily) - 1] = 0;
+    pCache->source.ProductName[sizeof(pCache->source.ProductName) - 1] = 0;
+    pCache->source.Version.Info[sizeof(pCache->source.Version.Info) - 1] = 0;
+
+    return CapCache_SameDriver(&pCache->source, pSource);
+}
+
+BOOL
+CapCache_Save(const CapCache *pCache)
+{
+    WCHAR path[MAX_PATH + 80];
+    WCHAR tmp[MAX_PATH + 100];
+    if (!CapCache_FilePath(&pCache->source, path))
+        return FALSE;
+
+    // sessions of the same model may save at the same time
+    wsprintf(tmp, L"%s.%lu.tmp", path, GetCurrentThreadId());
+
+    HANDLE hFile = CreateFile(tmp, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    CapCacheFileHeader header;
+    header.magic = CAPCACHE_MAGIC;
+    header.size = sizeof(*pCache);
+
+    DWORD written = 0;
+    BOOL ok = WriteFile(hFile, &header, sizeof(header), &written, NULL) && written == sizeof(header)
+           && WriteFile(hFile, pCache, sizeof(*pCache), &written, NULL) && written == sizeof(*pCache);
+
+    CloseHandle(hFile);
+
+    if (ok)
+        ok = MoveFileEx(tmp, path, MOVEFILE_REPLACE_EXISTING);
+    if (!ok)
+        DeleteFile(tmp);
+
+    return ok;
+}
+
+void
+CapCache_Query(TwainSession *pSession, CapCache *pCache)
+{
+    ZeroMemory(pCache, sizeof(*pCache));
+    pCache->source = pSession->source;
+
+    for (UINT i = 0; i < g_capCacheCapCount && pCache->count < CAPCACHE_MAX_CAPS; ++i) {
+        CapCacheEntry *e = &pCache->entries[pCache->count];
+        TW_UINT16 cc;
+
+        if (TwainHelper_GetCap(pSession, MSG_GET, g_capCacheCaps[i], &e->value, &cc) == TWRC_SUCCESS) {
+            e->supported = TRUE;
+            pCache->count++;
+        } else if (cc == TWCC_CAPUNSUPPORTED || cc == TWCC_BADCAP) {
+            e->supported = FALSE;
+            pCache->count++;
+        }
+        // anything else doesn't tell us about the capability
+    }
+}
+
+const CapCacheEntry *
+CapCache_Find(const CapCache *pCache, TW_UINT16 cap)
+{
+    for (UINT i = 0; i < pCache->count; ++i) {
+        if (pCache->entries[i].value.cap == cap)
+            return &pCache->entries[i];
+    }
+
+    return NULL;
+}
+
+static TW_INT32
+CapCache_Compare(TW_UINT16 itemType, TW_UINT32 a, TW_UINT32 b)
+{
+    switch (itemType) {
+    case TWTY_FIX32:
+        return TwainHelper_Fix32ToInt(a) - TwainHelper_Fix32ToInt(b);
+    case TWTY_INT8:
+    case TWTY_INT16:
+    case TWTY_INT32:
+        return (TW_INT32)a < (TW_INT32)b ? -1 : (TW_INT32)a > (TW_INT32)b;
+    default:
+        return a < b ? -1 : a > b;
+    }
+}
+
+// The cache has what the source offered under the settings the batch
+// before the query left behind. Where that depends on other settings,
+// e.g. the bit depths and resolutions on the pixel type or duplex mode,
+// or the feeder's capabilities on the feeder being enabled, only the
+// source can tell.
+static BOOL
+CapCache_DependsOnSettings(TW_UINT16 cap)
+{
+    switch (cap) {
+    case ICAP_BITDEPTH:
+    case ICAP_XRESOLUTION:
+    case ICAP_YRESOLUTION:
+    case CAP_AUTOFEED:
+    case CAP_AUTOSCAN:
+    case CAP_MAXBATCHBUFFERS:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+BOOL
+CapCache_Allows(const CapCache *pCache, TW_UINT16 cap, TW_UINT32 item)
+{
+    if (CapCache_DependsOnSettings(cap))
+        return TRUE;
+
+    const CapCacheEntry *e = CapCache_Find(pCache, cap);
+    if (!e)
+        return TRUE;
+    if (!e->supported)
+        return FALSE;
+
+    const TwainCapValue *v = &e->value;
+    switch (v->conType) {
+    case TWON_RANGE:
+        return CapCache_Compare(v->itemType, item, v->minValue) >= 0
+            && CapCache_Compare(v->itemType, item, v->maxValue) <= 0;
+    case TWON_ENUMERATION:
+    case TWON_ARRAY:
+        for (UINT i = 0; i < v->count; ++i) {
+            if (CapCache_Compare(v->itemType, item, v->items[i]) == 0)
+                return TRUE;
+        }
+        return v->truncated;
+    default:
+        // a single value is often just the current one, not the only one
+        return TRUE;
+    }
+}
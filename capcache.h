@@ -0,0 +1,62 @@
+#pragma once
+
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <windows.h>
+#include "twainhelper.h"
+
+// What a source supports (MSG_GET of the capabilities we care about),
+// kept on disk per source model and driver version. Sessions validate
+// their settings against it instead of asking the source every time, and
+// query the source again only when the driver changed. The cache lives in
+// %LOCALAPPDATA%\Genosse Einhorn\TWAIN Example Application\Capabilities.
+
+enum {
+    CAPCACHE_MAX_CAPS = 24
+};
+
+struct CapCacheEntry {
+    BOOL          supported;  // FALSE if the source said TWCC_CAPUNSUPPORTED
+    TwainCapValue value;
+};
+
+struct CapCache {
+    TW_IDENTITY   source;     // manufacturer, product and version are the key
+    UINT          count;
+    CapCacheEntry entries[CAPCACHE_MAX_CAPS];
+};
+
+// FALSE if there is no cache for this source or it was made with
+// another driver version
+BOOL
+CapCache_Load(const TW_IDENTITY *pSource, CapCache *pCache);
+
+BOOL
+CapCache_Save(const CapCache *pCache);
+
+// Asks the open source (state 4) about every capability in the list.
+// Takes a while on some drivers, so do it when nobody is waiting.
+void
+CapCache_Query(TwainSession *pSession, CapCache *pCache);
+
+// NULL if the capability wasn't queried
+const CapCacheEntry *
+CapCache_Find(const CapCache *pCache, TW_UINT16 cap);
+
+// FALSE only if the cache knows the source won't take the value.
+// Capabilities whose values depend on other settings, like the
+// resolutions on the pixel type, are always left to the source.
+BOOL
+CapCache_Allows(const CapCache *pCache, TW_UINT16 cap, TW_UINT32 item);
@@ -0,0 +1,393 @@
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "overflow.h"
+#include "encoderpool.h"
+
+#include <windows.h>
+
+typedef void (*EncoderWorkFn)(void *param);
+
+struct EncoderJob {
+    EncoderJob   *next;
+    EncoderWorkFn fn;
+    void         *param;
+};
+
+struct EncoderPageWork {
+    PageWriterBatch   *batch;
+    PageWriterFile     file;
+    OverflowDib        front;
+    PageWriterPageInfo info;
+    PageWriterFile     backFile;
+    OverflowDib        back;      // of a duplex sheet, or empty
+    PageWriterPageInfo backInfo;
+    UINT               backs;     // PAGEWRITER_*_BACKS
+};
+
+// the back side of a sheet that holds up its document
+struct EncoderSheetWork {
+    PageWriterBatch      *batch;
+    PageWriterQueuedPage *sheet;
+    OverflowDib           back;
+    UINT                  backs;
+};
+
+enum {
+    ENCODERPOOL_MAX_THREADS = 16
+};
+
+static HWND             g_hwndNotify;
+static HANDLE           g_hThreads[ENCODERPOOL_MAX_THREADS];
+static UINT             g_threadCount;
+static HANDLE           g_hJobSemaphore;
+static CRITICAL_SECTION g_queueLock;
+static EncoderJob      *g_queueHead;
+static EncoderJob      *g_queueTail;
+static BOOL             g_stopping;
+
+static EncoderJob *
+EncoderPool_Dequeue(void)
+{
+    EncoderJob *job;
+
+    EnterCriticalSection(&g_queueLock);
+    job = g_queueHead;
+    if (job) {
+        g_queueHead = job->next;
+        if (!g_queueHead)
+            g_queueTail = NULL;
+    }
+    LeaveCriticalSection(&g_queueLock);
+
+    return job;
+}
+
+static void
+EncoderPool_WritePage(void *param)
+{
+    EncoderPageWork *work = (EncoderPageWork *)param;
+
+    // read back from the overflow file if they were parked
+    BOOL hasBack = work->back.size != 0;
+    HGLOBAL hDib = Overflow_Take(&work->front);
+    HGLOBAL hBack = Overflow_Take(&work->back);
+
+    const WCHAR *error = L"Out of memory";
+    BOOL ok = hDib && (hBack || !hasBack);
+    if (!ok) {
+        PageWriter_DiscardFile(&work->file);
+        if (hasBack)
+            PageWriter_DiscardFile(&work->backFile);
+    }
+
+    if (ok && hBack) {
+        PageWriter_PrepareBack(work->backs, &hBack);
+        if (!hBack) {
+            PageWriter_DiscardFile(&work->backFile);
+            PageWriter_PageDropped(work->batch, &work->backInfo);
+        }
+    }
+
+    if (ok)
+        ok = PageWriter_WriteImage(work->batch, &work->file, hDib, &work->info, &error);
+    if (hDib && hBack && !PageWriter_WriteImage(work->batch, &work->backFile, hBack, &work->backInfo, &error))
+        ok = FALSE;
+
+    if (ok) {
+        PostMessage(g_hwndNotify, ENCODERPOOL_WM_PAGEWRITTEN, (WPARAM)PageWriter_NextCounter(work->batch), 0);
+    } else {
+        PostMessage(g_hwndNotify, ENCODERPOOL_WM_ERROR, 0, (LPARAM)error);
+    }
+
+    if (hDib)
+        GlobalFree(hDib);
+    if (hBack)
+        GlobalFree(hBack);
+    PageWriter_ReleaseBatch(work->batch);
+    HeapFree(GetProcessHeap(), 0, work);
+}
+
+static void
+EncoderPool_DrainDocument(void *param)
+{
+    PageWriterBatch *batch = (PageWriterBatch *)param;
+
+    const WCHAR *error = NULL;
+    if (PageWriter_DrainDocument(batch, &error)) {
+        PostMessage(g_hwndNotify, ENCODERPOOL_WM_PAGEWRITTEN, (WPARAM)PageWriter_NextCounter(batch), 0);
+    } else {
+        PostMessage(g_hwndNotify, ENCODERPOOL_WM_ERROR, 0, (LPARAM)error);
+    }
+
+    PageWriter_ReleaseBatch(batch);
+}
+
+static void EncoderPool_QueueWork(EncoderWorkFn fn, void *param);
+
+static void
+EncoderPool_PrepareSheet(void *param)
+{
+    EncoderSheetWork *work = (EncoderSheetWork *)param;
+
+    // the document goes on without a back side that can't be read back
+    HGLOBAL hBack = Overflow_Take(&work->back);
+    if (hBack)
+        PageWriter_PrepareBack(work->backs, &hBack);
+    else
+        PostMessage(g_hwndNotify, ENCODERPOOL_WM_ERROR, 0, (LPARAM)L"Out of memory");
+
+    BOOL scheduleDrain = FALSE;
+    PageWriter_DocumentSheetReady(work->batch, work->sheet, hBack, &scheduleDrain);
+    if (scheduleDrain) {
+        // hands our reference over to the drain
+        EncoderPool_QueueWork(EncoderPool_DrainDocument, work->batch);
+    } else {
+        PageWriter_ReleaseBatch(work->batch);
+    }
+
+    HeapFree(GetProcessHeap(), 0, work);
+}
+
+static DWORD WINAPI
+EncoderPool_WorkerMain(LPVOID param)
+{
+    (void)param;
+
+    // GDI+ encoders may use COM
+    CoInitialize(NULL);
+
+    for (;;) {
+        WaitForSingleObject(g_hJobSemaphore, INFINITE);
+
+        EncoderJob *job = EncoderPool_Dequeue();
+        if (job) {
+            job->fn(job->param);
+            HeapFree(GetProcessHeap(), 0, job);
+        } else if (g_stopping) {
+            break;
+        }
+    }
+
+    CoUninitialize();
+
+    return 0;
+}
+
+BOOL
+EncoderPool_Start(HWND hwndNotify, UINT maxThreads)
+{
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+
+    UINT count = si.dwNumberOfProcessors;
+    if (count > maxThreads)
+        count = maxThreads;
+    if (count > ENCODERPOOL_MAX_THREADS)
+        count = ENCODERPOOL_MAX_THREADS;
+    if (count < 1)
+        count = 1;
+
+    g_hwndNotify = hwndNotify;
+    g_stopping = FALSE;
+    InitializeCriticalSection(&g_queueLock);
+
+    g_hJobSemaphore = CreateSemaphore(NULL, 0, 0x7fffffff, NULL);
+    if (!g_hJobSemaphore)
+        return FALSE;
+
+    for (g_threadCount = 0; g_threadCount < count; ++g_threadCount) {
+        g_hThreads[g_threadCount] = CreateThread(NULL, 0, EncoderPool_WorkerMain, NULL, 0, NULL);
+        if (!g_hThreads[g_threadCount])
+            break;
+    }
+
+    return g_threadCount > 0;
+}
+
+void
+EncoderPool_Stop(void)
+{
+    if (!g_hJobSemaphore)
+        return;
+
+    // jobs are dequeued before the stop flag is checked, so the queue drains first
+    g_stopping = TRUE;
+    ReleaseSemaphore(g_hJobSemaphore, (LONG)g_threadCount, NULL);
+
+    WaitForMultipleObjects(g_threadCount, g_hThreads, TRUE, INFINITE);
+
+    for (UINT i = 0; i < g_threadCount; ++i)
+        CloseHandle(g_hThreads[i]);
+    g_threadCount = 0;
+
+    CloseHandle(g_hJobSemaphore);
+    g_hJobSemaphore = NULL;
+    DeleteCriticalSection(&g_queueLock);
+}
+
+// runs fn on a worker, or right here if there is no pool
+static void
+EncoderPool_QueueWork(EncoderWorkFn fn, void *param)
+{
+    EncoderJob *job = NULL;
+    if (g_threadCount)
+        job = (EncoderJob *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(*job));
+
+    if (!job) {
+        fn(param);
+        return;
+    }
+
+    job->fn = fn;
+    job->param = param;
+
+    EnterCriticalSection(&g_queueLock);
+    if (g_queueTail)
+        g_queueTail->next = job;
+    else
+        g_queueHead = job;
+    g_queueTail = job;
+    LeaveCriticalSection(&g_queueLock);
+
+    ReleaseSemaphore(g_hJobSemaphore, 1, NULL);
+}
+
+static void
+EncoderPool_QueueDocumentSheet(PageWriterBatch *pBatch, OverflowDib *pFront, const PageWriterPageInfo *pFrontInfo,
+                               OverflowDib *pBack, const PageWriterPageInfo *pBackInfo, UINT backs)
+{
+    EncoderSheetWork *work = NULL;
+    if (pBack && pBack->size && backs)
+        work = (EncoderSheetWork *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(*work));
+
+    // without preparation (or memory for it), the sheet is ready right away
+    BOOL scheduleDrain = FALSE;
+    PageWriterQueuedPage *sheet = PageWriter_QueueDocumentSheet(pBatch, pFront, pFrontInfo, pBack, pBackInfo,
+                                                                !work, &scheduleDrain);
+    if (!sheet) {
+        PostMessage(g_hwndNotify, ENCODERPOOL_WM_ERROR, 0, (LPARAM)L"Out of memory");
+        if (work) {
+            Overflow_Drop(pBack);
+            HeapFree(GetProcessHeap(), 0, work);
+        }
+        return;
+    }
+
+    if (scheduleDrain) {
+        PageWriter_AddRefBatch(pBatch);
+        EncoderPool_QueueWork(EncoderPool_DrainDocument, pBatch);
+    }
+
+    if (work) {
+        PageWriter_AddRefBatch(pBatch);
+        work->batch = pBatch;
+        work->sheet = sheet;
+        Overflow_Move(&work->back, pBack);
+        work->backs = backs;
+        EncoderPool_QueueWork(EncoderPool_PrepareSheet, work);
+    }
+}
+
+void
+EncoderPool_QueueSheet(PageWriterBatch *pBatch, OverflowDib *pFront, const PageWriterPageInfo *pFrontInfo,
+                       OverflowDib *pBack, const PageWriterPageInfo *pBackInfo, UINT backs)
+{
+    if (pBack && !pBack->size)
+        pBack = NULL;
+
+    if (PageWriter_IsMultiPage(pBatch)) {
+        EncoderPool_QueueDocumentSheet(pBatch, pFront, pFrontInfo, pBack, pBackInfo, backs);
+        return;
+    }
+
+    EncoderPageWork *work = (EncoderPageWork *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(*work));
+    if (!work) {
+        PostMessage(g_hwndNotify, ENCODERPOOL_WM_ERROR, 0, (LPARAM)L"Out of memory");
+        Overflow_Drop(pFront);
+        if (pBack)
+            Overflow_Drop(pBack);
+        return;
+    }
+
+    // the back side gets its name now, even if it's dropped later
+    const WCHAR *error = NULL;
+    BOOL ok = PageWriter_ClaimFile(pBatch, &work->file, &error);
+    if (ok && pBack && !PageWriter_ClaimBackFile(pBatch, &work->file, &work->backFile, &error)) {
+        PageWriter_DiscardFile(&work->file);
+        ok = FALSE;
+    }
+
+    if (!ok) {
+        PostMessage(g_hwndNotify, ENCODERPOOL_WM_ERROR, 0, (LPARAM)error);
+        Overflow_Drop(pFront);
+        if (pBack)
+            Overflow_Drop(pBack);
+        HeapFree(GetProcessHeap(), 0, work);
+        return;
+    }
+
+    PageWriter_AddRefBatch(pBatch);
+    work->batch = pBatch;
+    work->info = *pFrontInfo;
+    if (pBack)
+        work->backInfo = *pBackInfo;
+
+    // counted, and parked if the queue is long, since they were transferred
+    Overflow_Move(&work->front, pFront);
+    if (pBack)
+        Overflow_Move(&work->back, pBack);
+    work->backs = backs;
+
+    EncoderPool_QueueWork(EncoderPool_WritePage, work);
+}
+
+void
+EncoderPool_QueuePage(PageWriterBatch *pBatch, OverflowDib *pDib, const PageWriterPageInfo *pInfo)
+{
+    EncoderPool_QueueSheet(pBatch, pDib, pInfo, NULL, NULL, 0);
+}
+
+void
+EncoderPool_QueueDocumentBreak(PageWriterBatch *pBatch)
+{
+    if (!PageWriter_IsMultiPage(pBatch))
+        return;
+
+    BOOL scheduleDrain = FALSE;
+    if (!PageWriter_QueueDocumentBreak(pBatch, &scheduleDrain)) {
+        PostMessage(g_hwndNotify, ENCODERPOOL_WM_ERROR, 0, (LPARAM)L"Out of memory");
+        return;
+    }
+
+    if (scheduleDrain) {
+        PageWriter_AddRefBatch(pBatch);
+        EncoderPool_QueueWork(EncoderPool_DrainDocument, pBatch);
+    }
+}
+
+void
+EncoderPool_QueueSeparator(PageWriterBatch *pBatch, OverflowDib *pFront, const PageWriterPageInfo *pFrontInfo,
+                           OverflowDib *pBack, const PageWriterPageInfo *pBackInfo)
+{
+    // a parked separator isn't read back just to be freed
+    PageWriter_PageDropped(pBatch, pFrontInfo);
+    Overflow_Drop(pFront);
+    if (pBack && pBack->size) {
+        PageWriter_PageDropped(pBatch, pBackInfo);
+        Overflow_Drop(pBack);
+    }
+
+    EncoderPool_QueueDocumentBreak(pBatch);
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <windows.h>
+#include "pagewriter.h"
+
+// A fixed set of worker threads that encode and write the transferred
+// pages of all sources, so the TWAIN threads can go straight back to
+// the next transfer.
+//
+// Results are posted to the notify window:
+enum {
+    ENCODERPOOL_WM_PAGEWRITTEN = WM_APP + 0x200, // wParam: next file number of the batch
+    ENCODERPOOL_WM_ERROR                         // lParam: static error message (const WCHAR *)
+};
+
+// one worker per CPU, at most maxThreads
+BOOL
+EncoderPool_Start(HWND hwndNotify, UINT maxThreads);
+
+// writes out everything still queued, then stops the workers
+void
+EncoderPool_Stop(void);
+
+// Hands a page to the batch, which must happen in output order: numbered
+// files get their name right away, document pages are queued in order.
+// The encoding itself happens on the pool. Takes over the queued DIB
+// (see Overflow_Put()) in any case, it isn't counted again; failures are
+// reported through ENCODERPOOL_WM_ERROR. pInfo is copied.
+void
+EncoderPool_QueuePage(PageWriterBatch *pBatch, OverflowDib *pDib, const PageWriterPageInfo *pInfo);
+
+// The same for both sides of a duplex sheet, which stay together: the
+// back side is named after the front, or follows it in the document.
+// Back sides go through the given PAGEWRITER_*_BACKS stages on the pool,
+// one sheet per worker. pBack and pBackInfo may be NULL, or pBack empty,
+// if the sheet has no back side.
+void
+EncoderPool_QueueSheet(PageWriterBatch *pBatch, OverflowDib *pFront, const PageWriterPageInfo *pFrontInfo,
+                       OverflowDib *pBack, const PageWriterPageInfo *pBackInfo, UINT backs);
+
+// Ends a multi-page document after the pages queued so far, so it's
+// complete on disk; the next page starts a new one
+void
+EncoderPool_QueueDocumentBreak(PageWriterBatch *pBatch);
+
+// A separator sheet, also in output order: it isn't written, and a
+// multi-page document ends there so the next page starts a new one.
+// pBack and pBackInfo may be NULL.
+void
+EncoderPool_QueueSeparator(PageWriterBatch *pBatch, OverflowDib *pFront, const PageWriterPageInfo *pFrontInfo,
+                           OverflowDib *pBack, const PageWriterPageInfo *pBackInfo);
@@ -0,0 +1,387 @@
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "filewriter.h"
+
+// a chunk of file data; the completion packet leads back to it
+struct FileWriterChunk {
+    OVERLAPPED       ov;        // must come first
+    FileWriter      *writer;
+    FileWriterChunk *next;      // in the pool
+    DWORD            used;
+    IC_UINT8        *data;      // FILEWRITER_CHUNK_SIZE bytes from VirtualAlloc(), page aligned
+};
+
+// chunks kept around for the next file instead of VirtualFree()
+#define FILEWRITER_POOL_MAX 8
+
+static HANDLE           g_hPort;
+static HANDLE           g_hThread;
+static CRITICAL_SECTION g_lock;        // the pool, and pending counts against their waiters
+static BOOL             g_lockReady;
+static FileWriterChunk *g_pool;
+static UINT             g_poolCount;
+
+static DWORD WINAPI
+FileWriter_IoThreadMain(LPVOID param)
+{
+    (void)param;
+
+    for (;;) {
+        DWORD bytes = 0;
+        ULONG_PTR key = 0;
+        OVERLAPPED *ov = NULL;
+        BOOL ok = GetQueuedCompletionStatus(g_hPort, &bytes, &key, &ov, INFINITE);
+        if (!ov)
+            break; // FileWriter_Stop(), or the port is gone
+
+        FileWriterChunk *chunk = (FileWriterChunk *)ov;
+        FileWriter *w = chunk->writer;
+        if (!ok || bytes != chunk->used)
+            InterlockedExchange(&w->failed, TRUE);
+
+        // the writer may be closed as soon as it sees pending drop, so
+        // this is the last time it is touched
+        EnterCriticalSection(&g_lock);
+        BOOL keep = g_poolCount < FILEWRITER_POOL_MAX;
+        if (keep) {
+            chunk->next = g_pool;
+            g_pool = chunk;
+            g_poolCount++;
+        }
+        w->pending--;
+        SetEvent(w->hCompleted);
+        LeaveCriticalSection(&g_lock);
+
+        if (!keep) {
+            VirtualFree(chunk->data, 0, MEM_RELEASE);
+            HeapFree(GetProcessHeap(), 0, chunk);
+        }
+    }
+
+    return 0;
+}
+
+BOOL
+FileWriter_Start(void)
+{
+    InitializeCriticalSection(&g_lock);
+    g_lockReady = TRUE;
+
+    g_hPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+    if (!g_hPort)
+        return FALSE;
+
+    g_hThread = CreateThread(NULL, 0, FileWriter_IoThreadMain, NULL, 0, NULL);
+    if (!g_hThread) {
+        CloseHandle(g_hPort);
+        g_hPort = NULL;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+void
+FileWriter_Stop(void)
+{
+    if (g_hThread) {
+        PostQueuedCompletionStatus(g_hPort, 0, 0, NULL);
+        WaitForSingleObject(g_hThread, INFINITE);
+        CloseHandle(g_hThread);
+        g_hThread = NULL;
+    }
+
+    if (g_hPort) {
+        CloseHandle(g_hPort);
+        g_hPort = NULL;
+    }
+
+    while (g_pool) {
+        FileWriterChunk *chunk = g_pool;
+        g_pool = chunk->next;
+        VirtualFree(chunk->data, 0, MEM_RELEASE);
+        HeapFree(GetProcessHeap(), 0, chunk);
+    }
+    g_poolCount = 0;
+
+    if (g_lockReady) {
+        DeleteCriticalSection(&g_lock);
+        g_lockReady = FALSE;
+    }
+}
+
+static FileWriterChunk *
+FileWriter_AcquireChunk(FileWriter *w)
+{
+    FileWriterChunk *chunk = NULL;
+
+    if (g_lockReady) {
+        EnterCriticalSection(&g_lock);
+        chunk = g_pool;
+        if (chunk) {
+            g_pool = chunk->next;
+            g_poolCount--;
+        }
+        LeaveCriticalSection(&g_lock);
+    }
+
+    if (!chunk) {
+        chunk = (FileWriterChunk *)HeapAlloc(GetProcessHeap(), 0, sizeof(*chunk));
+        if (!chunk)
+            return NULL;
+
+        chunk->data = (IC_UINT8 *)VirtualAlloc(NULL, FILEWRITER_CHUNK_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (!chunk->data) {
+            HeapFree(GetProcessHeap(), 0, chunk);
+            return NULL;
+        }
+    }
+
+    chunk->writer = w;
+    chunk->next = NULL;
+    chunk->used = 0;
+    return chunk;
+}
+
+static void
+FileWriter_ReleaseChunk(FileWriterChunk *chunk)
+{
+    if (g_lockReady) {
+        EnterCriticalSection(&g_lock);
+        BOOL keep = g_poolCount < FILEWRITER_POOL_MAX;
+        if (keep) {
+            chunk->next = g_pool;
+            g_pool = chunk;
+            g_poolCount++;
+        }
+        LeaveCriticalSection(&g_lock);
+
+        if (keep)
+            return;
+    }
+
+    VirtualFree(chunk->data, 0, MEM_RELEASE);
+    HeapFree(GetProcessHeap(), 0, chunk);
+}
+
+// waits until at most maxPending chunks are in flight
+static void
+FileWriter_WaitPending(FileWriter *w, LONG maxPending)
+{
+    for (;;) {
+        EnterCriticalSection(&g_lock);
+        BOOL done = w->pending <= maxPending;
+        LeaveCriticalSection(&g_lock);
+
+        if (done)
+            break;
+
+        WaitForSingleObject(w->hCompleted, INFINITE);
+    }
+}
+
+// a write the caller waits for, e.g. without the I/O thread; the tagged
+// event keeps its completion away from the port
+static BOOL
+FileWriter_WriteNow(FileWriter *w, IC_UINT64 offset, const void *data, DWORD size)
+{
+    OVERLAPPED ov;
+    ZeroMemory(&ov, sizeof(ov));
+    ov.Offset = (DWORD)(offset & 0xffffffff);
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+    ov.hEvent = (HANDLE)((DWORD_PTR)w->hPatched | 1);
+
+    DWORD written = 0;
+    if (!WriteFile(w->hFile, data, size, NULL, &ov) && GetLastError() != ERROR_IO_PENDING)
+        return FALSE;
+
+    return GetOverlappedResult(w->hFile, &ov, &written, TRUE) && written == size;
+}
+
+// sends the current chunk off
+static void
+FileWriter_Submit(FileWriter *w)
+{
+    FileWriterChunk *chunk = w->chunk;
+    if (!chunk)
+        return;
+
+    w->chunk = NULL;
+    IC_UINT64 offset = w->chunkOffset;
+    w->chunkOffset += chunk->used;
+
+    if (!w->async) {
+        if (!FileWriter_WriteNow(w, offset, chunk->data, chunk->used))
+            w->failed = TRUE;
+        FileWriter_ReleaseChunk(chunk);
+        return;
+    }
+
+    FileWriter_WaitPending(w, FILEWRITER_MAX_PENDING - 1);
+
+    ZeroMemory(&chunk->ov, sizeof(chunk->ov));
+    chunk->ov.Offset = (DWORD)(offset & 0xffffffff);
+    chunk->ov.OffsetHigh = (DWORD)(offset >> 32);
+
+    EnterCriticalSection(&g_lock);
+    w->pending++;
+    LeaveCriticalSection(&g_lock);
+
+    // even a write that finishes right away is reported through the port
+    if (!WriteFile(w->hFile, chunk->data, chunk->used, NULL, &chunk->ov) && GetLastError() != ERROR_IO_PENDING) {
+        InterlockedExchange(&w->failed, TRUE);
+        EnterCriticalSection(&g_lock);
+        w->pending--;
+        LeaveCriticalSection(&g_lock);
+        FileWriter_ReleaseChunk(chunk);
+    }
+}
+
+static bool
+FileWriter_SinkWrite(void *ctx, const void *data, size_t size)
+{
+    return FileWriter_Write((FileWriter *)ctx, data, size) != FALSE;
+}
+
+static bool
+FileWriter_SinkWriteAt(void *ctx, IC_UINT64 offset, const void *data, size_t size)
+{
+    return FileWriter_WriteAt((FileWriter *)ctx, offset, data, size) != FALSE;
+}
+
+BOOL
+FileWriter_Open(FileWriter *w, HANDLE hFile, IC_UINT64 sizeHint)
+{
+    ZeroMemory(w, sizeof(*w));
+    w->hFile = INVALID_HANDLE_VALUE;
+    w->sink.ctx = w;
+    w->sink.write = FileWriter_SinkWrite;
+    w->sink.writeAt = FileWriter_SinkWriteAt;
+
+    w->hCompleted = CreateEvent(NULL, FALSE, FALSE, NULL);
+    w->hPatched = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (!w->hCompleted || !w->hPatched) {
+        if (w->hCompleted)
+            CloseHandle(w->hCompleted);
+        if (w->hPatched)
+            CloseHandle(w->hPatched);
+        return FALSE;
+    }
+
+    w->hFile = hFile;
+    w->async = g_hPort && CreateIoCompletionPort(hFile, g_hPort, 0, 0) == g_hPort;
+
+    // only a hint, the file grows anyway
+    LONG high = (LONG)(sizeHint >> 32);
+    if (sizeHint
+        && (SetFilePointer(hFile, (LONG)(sizeHint & 0xffffffff), &high, FILE_BEGIN) != INVALID_SET_FILE_POINTER
+            || GetLastError() == NO_ERROR)
+        && SetEndOfFile(hFile))
+        w->allocated = sizeHint;
+
+    return TRUE;
+}
+
+BOOL
+FileWriter_Write(FileWriter *w, const void *data, size_t size)
+{
+    const IC_UINT8 *p = (const IC_UINT8 *)data;
+
+    while (size && !w->failed) {
+        if (!w->chunk) {
+            w->chunk = FileWriter_AcquireChunk(w);
+            if (!w->chunk) {
+                w->failed = TRUE;
+                break;
+            }
+        }
+
+        FileWriterChunk *chunk = w->chunk;
+        DWORD n = FILEWRITER_CHUNK_SIZE - chunk->used;
+        if (n > size)
+            n = (DWORD)size;
+
+        CopyMemory(chunk->data + chunk->used, p, n);
+        chunk->used += n;
+        w->size += n;
+        p += n;
+        size -= n;
+
+        if (chunk->used == FILEWRITER_CHUNK_SIZE)
+            FileWriter_Submit(w);
+    }
+
+    return !w->failed;
+}
+
+BOOL
+FileWriter_WriteAt(FileWriter *w, IC_UINT64 offset, const void *data, size_t size)
+{
+    const IC_UINT8 *p = (const IC_UINT8 *)data;
+    if (offset + size > w->size) {
+        w->failed = TRUE;
+        return FALSE;
+    }
+
+    // the part that has been sent off already
+    if (offset < w->chunkOffset && !w->failed) {
+        DWORD n = (DWORD)min((IC_UINT64)size, w->chunkOffset - offset);
+
+        // a chunk in flight may cover it and would overwrite the patch
+        if (w->async)
+            FileWriter_WaitPending(w, 0);
+        if (!FileWriter_WriteNow(w, offset, p, n))
+            w->failed = TRUE;
+
+        offset += n;
+        p += n;
+        size -= n;
+    }
+
+    // the part still waiting in the current chunk
+    if (size && !w->failed)
+        CopyMemory(w->chunk->data + (offset - w->chunkOffset), p, size);
+
+    return !w->failed;
+}
+
+BOOL
+FileWriter_Close(FileWriter *w)
+{
+    if (w->hFile == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    FileWriter_Submit(w);
+    if (w->async)
+        FileWriter_WaitPending(w, 0);
+
+    // give back what the size hint took too much
+    if (w->allocated > w->size) {
+        LONG high = (LONG)(w->size >> 32);
+        if ((SetFilePointer(w->hFile, (LONG)(w->size & 0xffffffff), &high, FILE_BEGIN) == INVALID_SET_FILE_POINTER
+             && GetLastError() != NO_ERROR)
+            || !SetEndOfFile(w->hFile))
+            w->failed = TRUE;
+    }
+
+    if (!CloseHandle(w->hFile))
+        w->failed = TRUE;
+    w->hFile = INVALID_HANDLE_VALUE;
+
+    CloseHandle(w->hCompleted);
+    CloseHandle(w->hPatched);
+
+    return !w->failed;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <windows.h>
+#include "imagecore/icbuffer.h"
+
+// Writes a file with overlapped I/O from large, page-aligned buffers, so
+// several writes are on their way at once. On a network share, a single
+// synchronous WriteFile() leaves the link idle for every round trip.
+//
+// Data is collected in chunks of FILEWRITER_CHUNK_SIZE bytes; a full
+// chunk is sent off while the next one fills, with at most
+// FILEWRITER_MAX_PENDING of them in flight per file. Completions are
+// picked up by one I/O thread for all files. If the final size is known
+// when the file is opened, the file is extended to it first
+// (SetEndOfFile), so the file system doesn't grow it write by write.
+//
+// A FileWriter is used by one thread at a time.
+
+#define FILEWRITER_CHUNK_SIZE  (1024 * 1024)
+#define FILEWRITER_MAX_PENDING 3
+
+struct FileWriterChunk;
+
+struct FileWriter {
+    HANDLE           hFile;        // opened with FILE_FLAG_OVERLAPPED
+    BOOL             async;        // completions go to the I/O thread
+    IC_UINT64        size;         // bytes written so far
+    IC_UINT64        allocated;    // what SetEndOfFile() extended it to
+    IC_UINT64        chunkOffset;  // where the current chunk goes
+    FileWriterChunk *chunk;        // being filled, or NULL
+    volatile LONG    pending;      // chunks on their way
+    volatile LONG    failed;
+    HANDLE           hCompleted;   // auto-reset, set after each completion
+    HANDLE           hPatched;     // for writes that don't go through the I/O thread
+    IcSink           sink;         // for the imagecore encoders
+};
+
+// Starts the I/O thread. Without it, writes still work, one chunk at
+// a time.
+BOOL
+FileWriter_Start(void);
+
+// every FileWriter must be closed by now
+void
+FileWriter_Stop(void);
+
+// Takes over hFile, opened with GENERIC_WRITE and FILE_FLAG_OVERLAPPED.
+// sizeHint is the final size if known, 0 otherwise. On failure the
+// handle remains the caller's.
+BOOL
+FileWriter_Open(FileWriter *w, HANDLE hFile, IC_UINT64 sizeHint);
+
+// Appends; the data may be reused as soon as this returns
+BOOL
+FileWriter_Write(FileWriter *w, const void *data, size_t size);
+
+// Overwrites bytes already written, e.g. a TIFF's IFD links. Waits for
+// the writes in flight if they cover the range.
+BOOL
+FileWriter_WriteAt(FileWriter *w, IC_UINT64 offset, const void *data, size_t size);
+
+// Sends the rest, waits for all writes, cuts the file to the size written
+// and closes it. Returns FALSE if any write failed.
+BOOL
+FileWriter_Close(FileWriter *w);
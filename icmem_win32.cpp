@@ -0,0 +1,41 @@
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "imagecore/icmem.h"
+
+#include <windows.h>
+
+// The imaging core allocates from the process heap, see imagecore/icmem.h
+
+void *
+IcMem_Alloc(size_t size)
+{
+    return HeapAlloc(GetProcessHeap(), 0, size ? size : 1);
+}
+
+void *
+IcMem_Realloc(void *p, size_t size)
+{
+    if (!p)
+        return IcMem_Alloc(size);
+
+    return HeapReAlloc(GetProcessHeap(), 0, p, size ? size : 1);
+}
+
+void
+IcMem_Free(void *p)
+{
+    if (p)
+        HeapFree(GetProcessHeap(), 0, p);
+}
@@ -0,0 +1,184 @@
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+// Throughput benchmark for the imaging core kernels and encoders,
+// run by `make -f Makefile.host bench`.
+//
+// Every kernel is repeated on each corpus page until it ran for at least
+// the requested time. Throughput is reported in pages per second and in
+// MB/s of uncompressed input pixels.
+
+#include "../tests/iccorpus.h"
+#include "../dib.h"
+#include "../imgconv.h"
+#include "../bmpenc.h"
+#include "../tiffenc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+struct BenchCtx {
+    const IcCorpusFile *file;
+    const IcImage      *img;
+    IcBuffer            out;
+    IcSink              sink;
+};
+
+static double
+Bench_Now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static bool
+Bench_DibImport(BenchCtx *c)
+{
+    DibInfo info;
+    IcImage img;
+    if (!Dib_Parse(c->file->dib, c->file->dibSize, &info) || !Dib_ToImage(&info, &img))
+        return false;
+    IcImage_Free(&img);
+    return true;
+}
+
+static bool
+Bench_ToGray8(BenchCtx *c)
+{
+    IcImage img;
+    if (!ImgConv_ToGray8(c->img, &img))
+        return false;
+    IcImage_Free(&img);
+    return true;
+}
+
+static bool
+Bench_ToBitonal(BenchCtx *c)
+{
+    IcImage img;
+    if (!ImgConv_ToBitonal(c->img, 128, &img))
+        return false;
+    IcImage_Free(&img);
+    return true;
+}
+
+static bool
+Bench_Rotate180(BenchCtx *c)
+{
+    IcImage img;
+    if (!ImgConv_Rotate180(c->img, &img))
+        return false;
+    IcImage_Free(&img);
+    return true;
+}
+
+static bool
+Bench_EncodeBmp(BenchCtx *c)
+{
+    IcBuffer_Clear(&c->out);
+    return BmpEncoder_Write(c->img, &c->sink);
+}
+
+static bool
+Bench_EncodeTiffRaw(BenchCtx *c)
+{
+    IcBuffer_Clear(&c->out);
+    return TiffEncoder_Write(c->img, TIFF_COMPRESSION_NONE, &c->sink);
+}
+
+static bool
+Bench_EncodeTiffPackBits(BenchCtx *c)
+{
+    IcBuffer_Clear(&c->out);
+    return TiffEncoder_Write(c->img, TIFF_COMPRESSION_PACKBITS, &c->sink);
+}
+
+static const struct {
+    const char *name;
+    bool (*fn)(BenchCtx *c);
+    bool encoder;
+} g_benchmarks[] = {
+    { "dib_import",      Bench_DibImport,          false },
+    { "to_gray8",        Bench_ToGray8,            false },
+    { "to_bitonal",      Bench_ToBitonal,          false },
+    { "rotate180",       Bench_Rotate180,          false },
+    { "enc_bmp",         Bench_EncodeBmp,          true },
+    { "enc_tiff_raw",    Bench_EncodeTiffRaw,      true },
+    { "enc_tiff_packbits", Bench_EncodeTiffPackBits, true }
+};
+
+int
+main(int argc, char **argv)
+{
+    const char *corpusDir = argc > 1 ? argv[1] : "imagecore/corpus";
+    double minSeconds = argc > 2 ? atof(argv[2]) : 0.5;
+
+    printf("%-18s %-20s %10s %10s %8s\n", "kernel", "page", "pages/s", "MB/s", "ratio");
+
+    int rc = 0;
+    for (unsigned i = 0; i < g_icCorpusCount; ++i) {
+        IcCorpusFile f;
+        if (!IcCorpus_Load(corpusDir, g_icCorpusNames[i], &f))
+            return 2;
+
+        DibInfo info;
+        IcImage img;
+        if (!Dib_Parse(f.dib, f.dibSize, &info) || !Dib_ToImage(&info, &img)) {
+            fprintf(stderr, "%s: unsupported DIB\n", f.name);
+            IcCorpus_Free(&f);
+            return 2;
+        }
+
+        BenchCtx c;
+        c.file = &f;
+        c.img = &img;
+        IcBuffer_Init(&c.out);
+        IcBuffer_InitSink(&c.out, &c.sink);
+
+        double mb = (double)IcImage_ByteSize(&img) / (1024.0 * 1024.0);
+
+        for (unsigned b = 0; b < sizeof(g_benchmarks) / sizeof(g_benchmarks[0]); ++b) {
+            unsigned long iterations = 0;
+            double start = Bench_Now();
+            double elapsed = 0;
+
+            do {
+                if (!g_benchmarks[b].fn(&c)) {
+                    fprintf(stderr, "%s on %s failed\n", g_benchmarks[b].name, f.name);
+                    rc = 1;
+                    break;
+                }
+                ++iterations;
+                elapsed = Bench_Now() - start;
+            } while (elapsed < minSeconds);
+
+            double pps = elapsed > 0 ? (double)iterations / elapsed : 0;
+            if (g_benchmarks[b].encoder) {
+                printf("%-18s %-20s %10.1f %10.1f %8.3f\n", g_benchmarks[b].name, f.name,
+                       pps, pps * mb, (double)c.out.size / (double)IcImage_ByteSize(&img));
+            } else {
+                printf("%-18s %-20s %10.1f %10.1f %8s\n", g_benchmarks[b].name, f.name,
+                       pps, pps * mb, "-");
+            }
+        }
+
+        IcBuffer_Free(&c.out);
+        IcImage_Free(&img);
+        IcCorpus_Free(&f);
+    }
+
+    return rc;
+}
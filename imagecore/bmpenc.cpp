@@ -0,0 +1,79 @@
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "bmpenc.h"
+#include "dib.h"
+
+bool
+BmpEncoder_Write(const IcImage *img, IcSink *sink)
+{
+    IC_UINT32 paletteEntries = 0;
+    if (img->format == IC_PIXEL_BW1)
+        paletteEntries = 2;
+    else if (img->format == IC_PIXEL_GRAY8)
+        paletteEntries = 256;
+
+    IC_UINT64 bitsSize = (IC_UINT64)IcImage_ByteSize(img);
+    IC_UINT64 bitsOffset = DIB_FILEHEADER_SIZE + DIB_INFOHEADER_SIZE + 4 * paletteEntries;
+    if (bitsOffset + bitsSize > 0xffffffffu)
+        return false;
+
+    IC_UINT8 hdr[DIB_FILEHEADER_SIZE + DIB_INFOHEADER_SIZE];
+    IC_UINT8 *h = hdr;
+
+    // BITMAPFILEHEADER
+    h[0] = 'B';
+    h[1] = 'M';
+    Ic_PutU32LE(h + 2, (IC_UINT32)(bitsOffset + bitsSize));
+    Ic_PutU32LE(h + 6, 0);
+    Ic_PutU32LE(h + 10, (IC_UINT32)bitsOffset);
+
+    // BITMAPINFOHEADER
+    h += DIB_FILEHEADER_SIZE;
+    Ic_PutU32LE(h + 0, DIB_INFOHEADER_SIZE);
+    Ic_PutU32LE(h + 4, (IC_UINT32)img->width);
+    Ic_PutU32LE(h + 8, (IC_UINT32)img->height); // bottom-up
+    Ic_PutU16LE(h + 12, 1);
+    Ic_PutU16LE(h + 14, (IC_UINT16)img->format);
+    Ic_PutU32LE(h + 16, DIB_BI_RGB);
+    Ic_PutU32LE(h + 20, (IC_UINT32)bitsSize);
+    Ic_PutU32LE(h + 24, (IC_UINT32)Dib_DpiToPelsPerMeter(img->xDpi));
+    Ic_PutU32LE(h + 28, (IC_UINT32)Dib_DpiToPelsPerMeter(img->yDpi));
+    Ic_PutU32LE(h + 32, paletteEntries);
+    Ic_PutU32LE(h + 36, 0);
+
+    if (!sink->write(sink->ctx, hdr, sizeof(hdr)))
+        return false;
+
+    if (paletteEntries) {
+        IC_UINT8 palette[256 * 4];
+        for (IC_UINT32 i = 0; i < paletteEntries; ++i) {
+            IC_UINT8 v = (IC_UINT8)(paletteEntries == 2 ? i * 255 : i);
+            palette[4 * i + 0] = v;
+            palette[4 * i + 1] = v;
+            palette[4 * i + 2] = v;
+            palette[4 * i + 3] = 0;
+        }
+
+        if (!sink->write(sink->ctx, palette, 4 * paletteEntries))
+            return false;
+    }
+
+    for (IC_INT32 y = img->height - 1; y >= 0; --y) {
+        if (!sink->write(sink->ctx, IcImage_Row(img, y), img->stride))
+            return false;
+    }
+
+    return true;
+}
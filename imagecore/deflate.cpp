@@ -0,0 +1,186 @@
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "deflate.h"
+#include "icmem.h"
+
+#define DEFLATE_WINDOW    32768
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+
+static const IC_UINT16 g_lengthBase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const IC_UINT8 g_lengthExtra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const IC_UINT16 g_distBase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const IC_UINT8 g_distExtra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+// bits go out least significant first
+struct DeflateBits {
+    IcBuffer *out;
+    IC_UINT32 acc;
+    unsigned  count;
+};
+
+static void
+Deflate_PutBits(DeflateBits *b, IC_UINT32 value, unsigned n)
+{
+    b->acc |= value << b->count;
+    b->count += n;
+    while (b->count >= 8) {
+        IcBuffer_AppendByte(b->out, (IC_UINT8)b->acc);
+        b->acc >>= 8;
+        b->count -= 8;
+    }
+}
+
+// Huffman codes are defined most significant bit first
+static void
+Deflate_PutCode(DeflateBits *b, IC_UINT32 code, unsigned n)
+{
+    IC_UINT32 reversed = 0;
+    for (unsigned i = 0; i < n; ++i) {
+        reversed = (reversed << 1) | (code & 1);
+        code >>= 1;
+    }
+    Deflate_PutBits(b, reversed, n);
+}
+
+// a literal/length symbol in the fixed code
+static void
+Deflate_PutSymbol(DeflateBits *b, unsigned sym)
+{
+    if (sym < 144)
+        Deflate_PutCode(b, 0x30 + sym, 8);
+    else if (sym < 256)
+        Deflate_PutCode(b, 0x190 + sym - 144, 9);
+    else if (sym < 280)
+        Deflate_PutCode(b, sym - 256, 7);
+    else
+        Deflate_PutCode(b, 0xc0 + sym - 280, 8);
+}
+
+static void
+Deflate_PutMatch(DeflateBits *b, unsigned length, unsigned dist)
+{
+    unsigned i = 28;
+    while (g_lengthBase[i] > length)
+        --i;
+    Deflate_PutSymbol(b, 257 + i);
+    Deflate_PutBits(b, length - g_lengthBase[i], g_lengthExtra[i]);
+
+    unsigned d = 29;
+    while (g_distBase[d] > dist)
+        --d;
+    Deflate_PutCode(b, d, 5);
+    Deflate_PutBits(b, dist - g_distBase[d], g_distExtra[d]);
+}
+
+static inline unsigned
+Deflate_Hash(const IC_UINT8 *p)
+{
+    return (((unsigned)p[0] << 10) ^ ((unsigned)p[1] << 5) ^ p[2]) & ((1u << DEFLATE_HASH_BITS) - 1);
+}
+
+bool
+Deflate_Compress(const void *data, size_t size, IcBuffer *out)
+{
+    const IC_UINT8 *src = (const IC_UINT8 *)data;
+
+    // positions + 1, 0 for none; prev links positions with the same hash
+    IC_UINT32 *head = (IC_UINT32 *)IcMem_Alloc(((size_t)1 << DEFLATE_HASH_BITS) * sizeof(IC_UINT32));
+    IC_UINT32 *prev = (IC_UINT32 *)IcMem_Alloc(DEFLATE_WINDOW * sizeof(IC_UINT32));
+    if (!head || !prev || size > 0xffffffffu) {
+        IcMem_Free(head);
+        IcMem_Free(prev);
+        return false;
+    }
+
+    for (size_t i = 0; i < ((size_t)1 << DEFLATE_HASH_BITS); ++i)
+        head[i] = 0;
+
+    DeflateBits b;
+    b.out = out;
+    b.acc = 0;
+    b.count = 0;
+
+    // one final block with the fixed codes
+    Deflate_PutBits(&b, 1, 1);
+    Deflate_PutBits(&b, 1, 2);
+
+    size_t pos = 0;
+    while (pos < size) {
+        unsigned bestLength = 0;
+        unsigned bestDist = 0;
+
+        if (size - pos >= DEFLATE_MIN_MATCH) {
+            unsigned h = Deflate_Hash(src + pos);
+            size_t maxLength = size - pos < DEFLATE_MAX_MATCH ? size - pos : DEFLATE_MAX_MATCH;
+
+            IC_UINT32 candidate = head[h];
+            for (unsigned chain = 0; candidate && chain < DEFLATE_MAX_CHAIN; ++chain) {
+                size_t from = candidate - 1;
+                if (pos - from > DEFLATE_WINDOW)
+                    break;
+
+                unsigned length = 0;
+                while (length < maxLength && src[from + length] == src[pos + length])
+                    ++length;
+                if (length > bestLength) {
+                    bestLength = length;
+                    bestDist = (unsigned)(pos - from);
+                    if (length == maxLength)
+                        break;
+                }
+
+                candidate = prev[from % DEFLATE_WINDOW];
+            }
+        }
+
+        if (bestLength < DEFLATE_MIN_MATCH) {
+            bestLength = 1;
+            Deflate_PutSymbol(&b, src[pos]);
+        } else {
+            Deflate_PutMatch(&b, bestLength, bestDist);
+        }
+
+        // every position covered goes into the chains, for later matches
+        for (size_t end = pos + bestLength; pos < end; ++pos) {
+            if (size - pos >= DEFLATE_MIN_MATCH) {
+                unsigned h = Deflate_Hash(src + pos);
+                prev[pos % DEFLATE_WINDOW] = head[h];
+                head[h] = (IC_UINT32)(pos + 1);
+            }
+        }
+    }
+
+    Deflate_PutSymbol(&b, 256);
+    if (b.count)
+        Deflate_PutBits(&b, 0, 8 - b.count);
+
+    IcMem_Free(head);
+    IcMem_Free(prev);
+    return !IcBuffer_Failed(out);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "icbuffer.h"
+
+// Raw deflate (RFC 1951, no zlib or gzip wrapper), as used in zip.
+// Greedy LZ77 over a 32 KB window with short hash chains and the fixed
+// Huffman codes: much faster than a full deflate, and close enough for
+// uncompressed scans, which are mostly long runs. Data that doesn't
+// compress comes out slightly larger, callers store it instead.
+
+// a match is searched among at most this many earlier positions
+#define DEFLATE_MAX_CHAIN 8
+
+// appends the compressed data to out
+bool
+Deflate_Compress(const void *data, size_t size, IcBuffer *out);
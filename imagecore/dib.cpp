@@ -0,0 +1,313 @@
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "dib.h"
+#include "icbuffer.h"
+
+#include <string.h>
+
+IC_UINT32
+Dib_PelsPerMeterToDpi(IC_INT32 ppm)
+{
+    if (ppm <= 0)
+        return 0;
+
+    return (IC_UINT32)(((IC_UINT64)ppm * 254 + 5000) / 10000);
+}
+
+IC_INT32
+Dib_DpiToPelsPerMeter(IC_UINT32 dpi)
+{
+    return (IC_INT32)(((IC_UINT64)dpi * 10000 + 127) / 254);
+}
+
+bool
+Dib_Parse(const void *packedDib, size_t size, DibInfo *info)
+{
+    const IC_UINT8 *p = (const IC_UINT8 *)packedDib;
+
+    memset(info, 0, sizeof(*info));
+
+    if (!p || size < DIB_INFOHEADER_SIZE)
+        return false;
+
+    IC_UINT32 headerSize = Ic_GetU32LE(p);
+    if (headerSize < DIB_INFOHEADER_SIZE || headerSize > size)
+        return false;
+
+    IC_INT32 width  = (IC_INT32)Ic_GetU32LE(p + 4);
+    IC_INT32 height = (IC_INT32)Ic_GetU32LE(p + 8);
+    IC_UINT16 planes = Ic_GetU16LE(p + 12);
+
+    info->bitCount = Ic_GetU16LE(p + 14);
+    info->compression = Ic_GetU32LE(p + 16);
+    info->xDpi = Dib_PelsPerMeterToDpi((IC_INT32)Ic_GetU32LE(p + 24));
+    info->yDpi = Dib_PelsPerMeterToDpi((IC_INT32)Ic_GetU32LE(p + 28));
+    IC_UINT32 clrUsed = Ic_GetU32LE(p + 32);
+
+    if (planes != 1 || width <= 0 || height == 0 || height == (IC_INT32)0x80000000)
+        return false;
+
+    info->width = width;
+    info->topDown = height < 0;
+    info->height = height < 0 ? -height : height;
+
+    switch (info->bitCount) {
+    case 1: case 4: case 8: case 24:
+        if (info->compression != DIB_BI_RGB)
+            return false;
+        break;
+    case 16:
+    case 32:
+        if (info->compression != DIB_BI_RGB && info->compression != DIB_BI_BITFIELDS)
+            return false;
+        break;
+    default:
+        return false;
+    }
+
+    size_t offset = headerSize;
+
+    if (info->compression == DIB_BI_BITFIELDS) {
+        // masks follow a plain BITMAPINFOHEADER, but are part of V4/V5 headers
+        const IC_UINT8 *m = p + DIB_INFOHEADER_SIZE;
+        if (headerSize == DIB_INFOHEADER_SIZE) {
+            if (size - offset < 12)
+                return false;
+            offset += 12;
+        } else if (headerSize < DIB_INFOHEADER_SIZE + 12) {
+            return false;
+        }
+
+        info->masks[0] = Ic_GetU32LE(m);
+        info->masks[1] = Ic_GetU32LE(m + 4);
+        info->masks[2] = Ic_GetU32LE(m + 8);
+    } else if (info->bitCount == 16) {
+        info->masks[0] = 0x7c00;
+        info->masks[1] = 0x03e0;
+        info->masks[2] = 0x001f;
+    } else if (info->bitCount == 32) {
+        info->masks[0] = 0xff0000;
+        info->masks[1] = 0x00ff00;
+        info->masks[2] = 0x0000ff;
+    }
+
+    if (info->bitCount <= 8) {
+        IC_UINT32 maxEntries = 1u << info->bitCount;
+        info->paletteEntries = clrUsed && clrUsed < maxEntries ? clrUsed : maxEntries;
+    } else {
+        // optional palette for optimizing display on palette devices
+        info->paletteEntries = clrUsed <= 256 ? clrUsed : 0;
+    }
+
+    if ((size - offset) / 4 < info->paletteEntries)
+        return false;
+
+    info->palette = p + offset;
+    offset += info->paletteEntries * 4;
+
+    info->stride = (size_t)((((IC_UINT64)width * info->bitCount) + 31) / 32 * 4);
+
+    IC_UINT64 bitsSize = (IC_UINT64)info->stride * (IC_UINT64)info->height;
+    if (bitsSize > (IC_UINT64)(size - offset))
+        return false;
+
+    info->bitsOffset = offset;
+    info->bits = p + offset;
+
+    return true;
+}
+
+static bool
+Dib_PaletteIsGray(const DibInfo *info)
+{
+    for (IC_UINT32 i = 0; i < info->paletteEntries; ++i) {
+        const IC_UINT8 *e = info->palette + 4 * i;
+        if (e[0] != e[1] || e[1] != e[2])
+            return false;
+    }
+
+    return true;
+}
+
+static unsigned
+Dib_IndexAt(const IC_UINT8 *row, IC_INT32 x, IC_UINT16 bitCount)
+{
+    switch (bitCount) {
+    case 1:
+        return (row[x >> 3] >> (7 - (x & 7))) & 1;
+    case 4:
+        return (row[x >> 1] >> ((x & 1) ? 0 : 4)) & 15;
+    default:
+        return row[x];
+    }
+}
+
+static unsigned
+Dib_MaskShift(IC_UINT32 mask)
+{
+    unsigned shift = 0;
+    while (mask && !(mask & 1)) {
+        mask >>= 1;
+        ++shift;
+    }
+    return shift;
+}
+
+static IC_UINT8
+Dib_ExtractChannel(IC_UINT32 pixel, IC_UINT32 mask, unsigned shift)
+{
+    if (!mask)
+        return 0;
+
+    IC_UINT32 max = mask >> shift;
+    IC_UINT32 v = (pixel & mask) >> shift;
+    return (IC_UINT8)((v * 255 + max / 2) / max);
+}
+
+bool
+Dib_ToImage(const DibInfo *info, IcImage *img)
+{
+    IcPixelFormat format = IC_PIXEL_BGR24;
+
+    if (info->bitCount <= 8 && Dib_PaletteIsGray(info)) {
+        format = IC_PIXEL_GRAY8;
+
+        // a black-and-white palette (in either order) stays bitonal
+        if (info->bitCount == 1 && info->paletteEntries == 2
+            && (info->palette[0] ^ info->palette[4]) == 0xff
+            && (info->palette[0] == 0 || info->palette[0] == 0xff))
+            format = IC_PIXEL_BW1;
+    }
+
+    if (!IcImage_Create(img, info->width, info->height, format))
+        return false;
+
+    img->xDpi = info->xDpi;
+    img->yDpi = info->yDpi;
+
+    for (IC_INT32 y = 0; y < info->height; ++y) {
+        const IC_UINT8 *src = info->bits + info->stride * (size_t)(info->topDown ? y : info->height - 1 - y);
+        IC_UINT8 *dst = IcImage_Row(img, y);
+
+        if (format == IC_PIXEL_BW1) {
+            size_t rowBytes = ((size_t)info->width + 7) / 8;
+            if (info->palette[0] == 0) {
+                memcpy(dst, src, rowBytes);
+            } else {
+                for (size_t i = 0; i < rowBytes; ++i)
+                    dst[i] = (IC_UINT8)~src[i];
+            }
+        } else if (info->bitCount == 8 && format == IC_PIXEL_GRAY8) {
+            IC_UINT8 lut[256];
+            for (unsigned i = 0; i < 256; ++i)
+                lut[i] = i < info->paletteEntries ? info->palette[4 * i] : 0;
+            for (IC_INT32 x = 0; x < info->width; ++x)
+                dst[x] = lut[src[x]];
+        } else if (info->bitCount <= 8) {
+            for (IC_INT32 x = 0; x < info->width; ++x) {
+                unsigned idx = Dib_IndexAt(src, x, info->bitCount);
+                const IC_UINT8 *e = idx < info->paletteEntries ? info->palette + 4 * idx : NULL;
+                if (format == IC_PIXEL_GRAY8) {
+                    dst[x] = e ? e[0] : 0;
+                } else if (e) {
+                    dst[3 * x + 0] = e[0];
+                    dst[3 * x + 1] = e[1];
+                    dst[3 * x + 2] = e[2];
+                }
+            }
+        } else if (info->bitCount == 24) {
+            memcpy(dst, src, (size_t)info->width * 3);
+        } else {
+            unsigned shifts[3];
+            for (int c = 0; c < 3; ++c)
+                shifts[c] = Dib_MaskShift(info->masks[c]);
+
+            for (IC_INT32 x = 0; x < info->width; ++x) {
+                IC_UINT32 px = info->bitCount == 16 ? Ic_GetU16LE(src + 2 * x) : Ic_GetU32LE(src + 4 * x);
+                dst[3 * x + 0] = Dib_ExtractChannel(px, info->masks[2], shifts[2]);
+                dst[3 * x + 1] = Dib_ExtractChannel(px, info->masks[1], shifts[1]);
+                dst[3 * x + 2] = Dib_ExtractChannel(px, info->masks[0], shifts[0]);
+            }
+        }
+    }
+
+    return true;
+}
+
+// one pixel of fewer than 8 bits, MSB first
+static inline unsigned
+Dib_GetSubPixel(const IC_UINT8 *row, IC_INT32 x, unsigned bitCount)
+{
+    unsigned bit = (unsigned)x * bitCount;
+    unsigned shift = 8 - bitCount - bit % 8;
+    return (row[bit / 8] >> shift) & ((1u << bitCount) - 1);
+}
+
+static inline void
+Dib_SetSubPixel(IC_UINT8 *row, IC_INT32 x, unsigned bitCount, unsigned value)
+{
+    unsigned bit = (unsigned)x * bitCount;
+    unsigned shift = 8 - bitCount - bit % 8;
+    unsigned mask = ((1u << bitCount) - 1) << shift;
+    row[bit / 8] = (IC_UINT8)((row[bit / 8] & ~mask) | (value << shift));
+}
+
+// swaps pixel x of a with pixel width-1-x of b, for count pixels
+static void
+Dib_SwapMirrored(IC_UINT8 *a, IC_UINT8 *b, IC_INT32 width, IC_INT32 count, unsigned bitCount)
+{
+    if (bitCount < 8) {
+        for (IC_INT32 x = 0; x < count; ++x) {
+            unsigned pa = Dib_GetSubPixel(a, x, bitCount);
+            unsigned pb = Dib_GetSubPixel(b, width - 1 - x, bitCount);
+            Dib_SetSubPixel(a, x, bitCount, pb);
+            Dib_SetSubPixel(b, width - 1 - x, bitCount, pa);
+        }
+        return;
+    }
+
+    size_t bpp = bitCount / 8;
+    for (IC_INT32 x = 0; x < count; ++x) {
+        IC_UINT8 *pa = a + (size_t)x * bpp;
+        IC_UINT8 *pb = b + (size_t)(width - 1 - x) * bpp;
+        for (size_t i = 0; i < bpp; ++i) {
+            IC_UINT8 t = pa[i];
+            pa[i] = pb[i];
+            pb[i] = t;
+        }
+    }
+}
+
+bool
+Dib_Rotate180(const DibInfo *info, IC_UINT8 *bits)
+{
+    unsigned bitCount = info->bitCount;
+    if (bitCount != 1 && bitCount != 4 && bitCount != 8 && bitCount != 16
+        && bitCount != 24 && bitCount != 32)
+        return false;
+
+    // the row order doesn't matter, upside down is upside down
+    IC_INT32 w = info->width;
+    IC_INT32 h = info->height;
+    for (IC_INT32 y = 0; y < h / 2; ++y)
+        Dib_SwapMirrored(bits + (size_t)y * info->stride, bits + (size_t)(h - 1 - y) * info->stride, w, w, bitCount);
+
+    if (h % 2) {
+        IC_UINT8 *middle = bits + (size_t)(h / 2) * info->stride;
+        Dib_SwapMirrored(middle, middle, w, w / 2, bitCount);
+    }
+
+    return true;
+}
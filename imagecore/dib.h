@@ -0,0 +1,71 @@
+#pragma once
+
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "ictypes.h"
+#include "icimage.h"
+
+// Parsing of packed DIBs, i.e. a BITMAPINFOHEADER (or one of its larger
+// successors) followed by optional color masks, the palette and the
+// pixel bits. This is what DAT_IMAGENATIVEXFER hands us on Windows.
+
+enum {
+    DIB_BI_RGB       = 0,
+    DIB_BI_BITFIELDS = 3
+};
+
+enum {
+    DIB_INFOHEADER_SIZE = 40,
+    DIB_FILEHEADER_SIZE = 14
+};
+
+struct DibInfo {
+    IC_INT32        width;
+    IC_INT32        height;        // always positive, see topDown
+    bool            topDown;
+    IC_UINT16       bitCount;
+    IC_UINT32       compression;
+    IC_UINT32       masks[3];      // red, green, blue for 16 and 32 bpp
+    IC_UINT32       paletteEntries;
+    const IC_UINT8 *palette;       // RGBQUADs: blue, green, red, reserved
+    size_t          bitsOffset;    // from the start of the packed DIB
+    const IC_UINT8 *bits;
+    size_t          stride;
+    IC_UINT32       xDpi;          // 0 if unknown
+    IC_UINT32       yDpi;
+};
+
+// Validates the header and checks that the pixel data fits into size bytes.
+// Only uncompressed DIBs (BI_RGB, BI_BITFIELDS) are accepted.
+bool
+Dib_Parse(const void *packedDib, size_t size, DibInfo *info);
+
+// Converts into one of the core pixel formats with top-down rows.
+// Bitonal and gray palettes are kept compact, everything else becomes BGR24.
+bool
+Dib_ToImage(const DibInfo *info, IcImage *img);
+
+// Turns the pixels upside down in place, e.g. for the back side of a
+// duplex sheet, without converting the DIB. bits is the writable
+// version of info->bits; fails for bit counts other than 1, 4, 8, 16,
+// 24 and 32.
+bool
+Dib_Rotate180(const DibInfo *info, IC_UINT8 *bits);
+
+IC_UINT32
+Dib_PelsPerMeterToDpi(IC_INT32 ppm);
+
+IC_INT32
+Dib_DpiToPelsPerMeter(IC_UINT32 dpi);
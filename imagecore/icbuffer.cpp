@@ -0,0 +1,151 @@
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "icbuffer.h"
+#include "icmem.h"
+
+#include <string.h>
+
+void
+IcBuffer_Init(IcBuffer *b)
+{
+    b->data = NULL;
+    b->size = 0;
+    b->capacity = 0;
+    b->failed = false;
+}
+
+void
+IcBuffer_Free(IcBuffer *b)
+{
+    IcMem_Free(b->data);
+    IcBuffer_Init(b);
+}
+
+void
+IcBuffer_Clear(IcBuffer *b)
+{
+    b->size = 0;
+    b->failed = false;
+}
+
+bool
+IcBuffer_Reserve(IcBuffer *b, size_t capacity)
+{
+    if (b->failed)
+        return false;
+
+    if (capacity <= b->capacity)
+        return true;
+
+    size_t newcap = b->capacity ? b->capacity : 4096;
+    while (newcap < capacity) {
+        if (newcap > ((size_t)-1) / 2) {
+            newcap = capacity;
+            break;
+        }
+        newcap *= 2;
+    }
+
+    IC_UINT8 *n = (IC_UINT8 *)IcMem_Realloc(b->data, newcap);
+    if (!n) {
+        b->failed = true;
+        return false;
+    }
+
+    b->data = n;
+    b->capacity = newcap;
+    return true;
+}
+
+bool
+IcBuffer_Append(IcBuffer *b, const void *data, size_t size)
+{
+    if (b->failed)
+        return false;
+
+    if (size > ((size_t)-1) - b->size) {
+        b->failed = true;
+        return false;
+    }
+
+    if (!IcBuffer_Reserve(b, b->size + size))
+        return false;
+
+    if (size)
+        memcpy(b->data + b->size, data, size);
+    b->size += size;
+    return true;
+}
+
+bool
+IcBuffer_AppendByte(IcBuffer *b, IC_UINT8 v)
+{
+    if (b->size < b->capacity && !b->failed) {
+        b->data[b->size++] = v;
+        return true;
+    }
+
+    return IcBuffer_Append(b, &v, 1);
+}
+
+bool
+IcBuffer_AppendU16LE(IcBuffer *b, IC_UINT16 v)
+{
+    IC_UINT8 tmp[2];
+    Ic_PutU16LE(tmp, v);
+    return IcBuffer_Append(b, tmp, sizeof(tmp));
+}
+
+bool
+IcBuffer_AppendU32LE(IcBuffer *b, IC_UINT32 v)
+{
+    IC_UINT8 tmp[4];
+    Ic_PutU32LE(tmp, v);
+    return IcBuffer_Append(b, tmp, sizeof(tmp));
+}
+
+bool
+IcBuffer_PutAt(IcBuffer *b, size_t offset, const void *data, size_t size)
+{
+    if (b->failed || offset > b->size || size > b->size - offset)
+        return false;
+
+    memcpy(b->data + offset, data, size);
+    return true;
+}
+
+static bool
+IcBuffer_SinkWrite(void *ctx, const void *data, size_t size)
+{
+    return IcBuffer_Append((IcBuffer *)ctx, data, size);
+}
+
+static bool
+IcBuffer_SinkWriteAt(void *ctx, IC_UINT64 offset, const void *data, size_t size)
+{
+    IcBuffer *b = (IcBuffer *)ctx;
+    if (offset > b->size)
+        return false;
+
+    return IcBuffer_PutAt(b, (size_t)offset, data, size);
+}
+
+void
+IcBuffer_InitSink(IcBuffer *b, IcSink *sink)
+{
+    sink->ctx = b;
+    sink->write = IcBuffer_SinkWrite;
+    sink->writeAt = IcBuffer_SinkWriteAt;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "ictypes.h"
+
+// A growable byte buffer. Once an allocation failed, the buffer stays
+// in the failed state and all further appends are ignored, so callers
+// only need to check IcBuffer_Failed() once at the end.
+struct IcBuffer {
+    IC_UINT8 *data;
+    size_t    size;
+    size_t    capacity;
+    bool      failed;
+};
+
+void
+IcBuffer_Init(IcBuffer *b);
+
+void
+IcBuffer_Free(IcBuffer *b);
+
+// resets size to zero but keeps the allocation around for reuse
+void
+IcBuffer_Clear(IcBuffer *b);
+
+bool
+IcBuffer_Reserve(IcBuffer *b, size_t capacity);
+
+bool
+IcBuffer_Append(IcBuffer *b, const void *data, size_t size);
+
+bool
+IcBuffer_AppendByte(IcBuffer *b, IC_UINT8 v);
+
+bool
+IcBuffer_AppendU16LE(IcBuffer *b, IC_UINT16 v);
+
+bool
+IcBuffer_AppendU32LE(IcBuffer *b, IC_UINT32 v);
+
+// overwrite already appended bytes
+bool
+IcBuffer_PutAt(IcBuffer *b, size_t offset, const void *data, size_t size);
+
+inline bool
+IcBuffer_Failed(const IcBuffer *b)
+{
+    return b->failed;
+}
+
+// helpers for writing little-endian values into raw memory
+inline void
+Ic_PutU16LE(IC_UINT8 *p, IC_UINT16 v)
+{
+    p[0] = (IC_UINT8)(v & 0xff);
+    p[1] = (IC_UINT8)(v >> 8);
+}
+
+inline void
+Ic_PutU32LE(IC_UINT8 *p, IC_UINT32 v)
+{
+    p[0] = (IC_UINT8)(v & 0xff);
+    p[1] = (IC_UINT8)((v >> 8) & 0xff);
+    p[2] = (IC_UINT8)((v >> 16) & 0xff);
+    p[3] = (IC_UINT8)(v >> 24);
+}
+
+inline IC_UINT16
+Ic_GetU16LE(const IC_UINT8 *p)
+{
+    return (IC_UINT16)(p[0] | (p[1] << 8));
+}
+
+inline IC_UINT32
+Ic_GetU32LE(const IC_UINT8 *p)
+{
+    return (IC_UINT32)p[0] | ((IC_UINT32)p[1] << 8) | ((IC_UINT32)p[2] << 16) | ((IC_UINT32)p[3] << 24);
+}
+
+// Output target for encoders and containers. write() appends at the
+// current end, writeAt() patches bytes that have already been written
+// (e.g. IFD links in a multi-page TIFF). Both return false on error.
+struct IcSink {
+    void *ctx;
+    bool (*write)(void *ctx, const void *data, size_t size);
+    bool (*writeAt)(void *ctx, IC_UINT64 offset, const void *data, size_t size);
+};
+
+// sink that appends to the given buffer
+void
+IcBuffer_InitSink(IcBuffer *b, IcSink *sink);
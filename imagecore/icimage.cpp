@@ -0,0 +1,61 @@
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "icimage.h"
+#include "icmem.h"
+
+#include <string.h>
+
+size_t
+IcImage_StrideFor(IC_INT32 width, IcPixelFormat format)
+{
+    if (width <= 0)
+        return 0;
+
+    IC_UINT64 bits = (IC_UINT64)width * (IC_UINT64)format;
+    return (size_t)(((bits + 31) / 32) * 4);
+}
+
+bool
+IcImage_Create(IcImage *img, IC_INT32 width, IC_INT32 height, IcPixelFormat format)
+{
+    img->width = width;
+    img->height = height;
+    img->format = format;
+    img->stride = IcImage_StrideFor(width, format);
+    img->pixels = NULL;
+    img->xDpi = 0;
+    img->yDpi = 0;
+
+    if (width <= 0 || height <= 0)
+        return false;
+
+    IC_UINT64 size = (IC_UINT64)img->stride * (IC_UINT64)height;
+    if (size != (size_t)size)
+        return false;
+
+    img->pixels = (IC_UINT8 *)IcMem_Alloc((size_t)size);
+    if (!img->pixels)
+        return false;
+
+    memset(img->pixels, 0, (size_t)size);
+    return true;
+}
+
+void
+IcImage_Free(IcImage *img)
+{
+    IcMem_Free(img->pixels);
+    img->pixels = NULL;
+}
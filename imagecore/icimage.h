@@ -0,0 +1,59 @@
+#pragma once
+
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "ictypes.h"
+
+// Pixel layouts the imaging core works with. Anything a scanner might
+// deliver gets converted to one of these by Dib_ToImage().
+enum IcPixelFormat {
+    IC_PIXEL_BW1   = 1,  // 1 bit per pixel, MSB first, set bit = white
+    IC_PIXEL_GRAY8 = 8,  // 8 bit luminance, 0 = black
+    IC_PIXEL_BGR24 = 24  // blue, green, red byte order like a 24bpp DIB
+};
+
+// An uncompressed image with top-down rows, each padded to 4 bytes
+// so it can be handed to GDI/GDI+ without copying.
+struct IcImage {
+    IC_INT32      width;
+    IC_INT32      height;
+    IcPixelFormat format;
+    size_t        stride;
+    IC_UINT8     *pixels;
+    IC_UINT32     xDpi; // 0 if unknown
+    IC_UINT32     yDpi;
+};
+
+size_t
+IcImage_StrideFor(IC_INT32 width, IcPixelFormat format);
+
+// allocates zero-initialized pixels, returns false on overflow or OOM
+bool
+IcImage_Create(IcImage *img, IC_INT32 width, IC_INT32 height, IcPixelFormat format);
+
+void
+IcImage_Free(IcImage *img);
+
+inline size_t
+IcImage_ByteSize(const IcImage *img)
+{
+    return img->stride * (size_t)img->height;
+}
+
+inline IC_UINT8 *
+IcImage_Row(const IcImage *img, IC_INT32 y)
+{
+    return img->pixels + img->stride * (size_t)y;
+}
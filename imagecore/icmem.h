@@ -0,0 +1,32 @@
+#pragma once
+
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "ictypes.h"
+
+// The imaging core does not allocate through the C runtime directly,
+// because the WDK build of the client runs without CRT initialization.
+// Every program linking the core provides these three functions:
+// icmem_stdc.cpp for hosted builds, icmem_win32.cpp for the client.
+
+void *
+IcMem_Alloc(size_t size);
+
+// like realloc(), returns NULL and leaves the old block alone on failure
+void *
+IcMem_Realloc(void *p, size_t size);
+
+void
+IcMem_Free(void *p);
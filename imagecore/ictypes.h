@@ -0,0 +1,37 @@
+#pragma once
+
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+// Fixed-size integer types for the portable imaging core.
+// The WDK7 compiler predates <stdint.h>, so we can't rely on it everywhere.
+
+#include <stddef.h>
+
+#if defined(_MSC_VER) && _MSC_VER < 1600
+typedef unsigned __int8     IC_UINT8;
+typedef unsigned __int16    IC_UINT16;
+typedef unsigned __int32    IC_UINT32;
+typedef unsigned __int64    IC_UINT64;
+typedef signed __int32      IC_INT32;
+typedef signed __int64      IC_INT64;
+#else
+#include <stdint.h>
+typedef uint8_t             IC_UINT8;
+typedef uint16_t            IC_UINT16;
+typedef uint32_t            IC_UINT32;
+typedef uint64_t            IC_UINT64;
+typedef int32_t             IC_INT32;
+typedef int64_t             IC_INT64;
+#endif
@@ -0,0 +1,196 @@
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "imgconv.h"
+
+#include <string.h>
+
+static void
+ImgConv_CopyResolution(const IcImage *src, IcImage *dst)
+{
+    dst->xDpi = src->xDpi;
+    dst->yDpi = src->yDpi;
+}
+
+bool
+ImgConv_ToGray8(const IcImage *src, IcImage *dst)
+{
+    IcImage out;
+    if (!IcImage_Create(&out, src->width, src->height, IC_PIXEL_GRAY8))
+        return false;
+
+    ImgConv_CopyResolution(src, &out);
+
+    for (IC_INT32 y = 0; y < src->height; ++y) {
+        const IC_UINT8 *s = IcImage_Row(src, y);
+        IC_UINT8 *d = IcImage_Row(&out, y);
+
+        switch (src->format) {
+        case IC_PIXEL_BW1:
+            for (IC_INT32 x = 0; x < src->width; ++x)
+                d[x] = ((s[x >> 3] >> (7 - (x & 7))) & 1) ? 255 : 0;
+            break;
+        case IC_PIXEL_GRAY8:
+            memcpy(d, s, (size_t)src->width);
+            break;
+        case IC_PIXEL_BGR24:
+            for (IC_INT32 x = 0; x < src->width; ++x, s += 3)
+                d[x] = ImgConv_Luminance(s[0], s[1], s[2]);
+            break;
+        }
+    }
+
+    *dst = out;
+    return true;
+}
+
+bool
+ImgConv_ToBitonal(const IcImage *src, IC_UINT8 threshold, IcImage *dst)
+{
+    IcImage out;
+    if (!IcImage_Create(&out, src->width, src->height, IC_PIXEL_BW1))
+        return false;
+
+    ImgConv_CopyResolution(src, &out);
+
+    for (IC_INT32 y = 0; y < src->height; ++y) {
+        const IC_UINT8 *s = IcImage_Row(src, y);
+        IC_UINT8 *d = IcImage_Row(&out, y);
+
+        if (src->format == IC_PIXEL_BW1) {
+            memcpy(d, s, out.stride);
+            continue;
+        }
+
+        unsigned acc = 0;
+        IC_INT32 x = 0;
+        for (; x < src->width; ++x) {
+            IC_UINT8 v = src->format == IC_PIXEL_GRAY8 ? s[x]
+                       : ImgConv_Luminance(s[3 * x], s[3 * x + 1], s[3 * x + 2]);
+
+            acc = (acc << 1) | (v >= threshold ? 1u : 0u);
+            if ((x & 7) == 7) {
+                d[x >> 3] = (IC_UINT8)acc;
+                acc = 0;
+            }
+        }
+
+        if (x & 7)
+            d[x >> 3] = (IC_UINT8)(acc << (8 - (x & 7)));
+    }
+
+    *dst = out;
+    return true;
+}
+
+static IC_UINT8
+ImgConv_ReverseBits(IC_UINT8 v)
+{
+    v = (IC_UINT8)(((v & 0xf0) >> 4) | ((v & 0x0f) << 4));
+    v = (IC_UINT8)(((v & 0xcc) >> 2) | ((v & 0x33) << 2));
+    v = (IC_UINT8)(((v & 0xaa) >> 1) | ((v & 0x55) << 1));
+    return v;
+}
+
+bool
+ImgConv_Rotate180(const IcImage *src, IcImage *dst)
+{
+    IcImage out;
+    if (!IcImage_Create(&out, src->width, src->height, src->format))
+        return false;
+
+    ImgConv_CopyResolution(src, &out);
+
+    IC_UINT8 reversed[256];
+    for (unsigned i = 0; i < 256; ++i)
+        reversed[i] = ImgConv_ReverseBits((IC_UINT8)i);
+
+    for (IC_INT32 y = 0; y < src->height; ++y) {
+        const IC_UINT8 *s = IcImage_Row(src, src->height - 1 - y);
+        IC_UINT8 *d = IcImage_Row(&out, y);
+        IC_INT32 w = src->width;
+
+        switch (src->format) {
+        case IC_PIXEL_BW1: {
+            // reverse whole bytes, then shift out the padding bits
+            size_t n = ((size_t)w + 7) / 8;
+            unsigned pad = (unsigned)(n * 8 - (size_t)w);
+            for (size_t i = 0; i < n; ++i)
+                d[i] = reversed[s[n - 1 - i]];
+            if (pad) {
+                for (size_t i = 0; i < n; ++i) {
+                    unsigned next = i + 1 < n ? d[i + 1] : 0;
+                    d[i] = (IC_UINT8)((d[i] << pad) | (next >> (8 - pad)));
+                }
+            }
+            break;
+        }
+        case IC_PIXEL_GRAY8:
+            for (IC_INT32 x = 0; x < w; ++x)
+                d[x] = s[w - 1 - x];
+            break;
+        case IC_PIXEL_BGR24:
+            for (IC_INT32 x = 0; x < w; ++x) {
+                const IC_UINT8 *p = s + 3 * (w - 1 - x);
+                d[3 * x + 0] = p[0];
+                d[3 * x + 1] = p[1];
+                d[3 * x + 2] = p[2];
+            }
+            break;
+        }
+    }
+
+    *dst = out;
+    return true;
+}
+
+bool
+ImgConv_IsBlank(const IcImage *img, unsigned maxInk)
+{
+    IC_INT32 x0 = img->width / 20, x1 = img->width - img->width / 20;
+    IC_INT32 y0 = img->height / 20, y1 = img->height - img->height / 20;
+    if (x1 <= x0 || y1 <= y0)
+        return true;
+
+    IC_UINT64 total = (IC_UINT64)(x1 - x0) * (IC_UINT64)(y1 - y0);
+    IC_UINT64 limit = total * maxInk / 10000;
+    IC_UINT64 ink = 0;
+
+    for (IC_INT32 y = y0; y < y1; ++y) {
+        const IC_UINT8 *s = IcImage_Row(img, y);
+
+        switch (img->format) {
+        case IC_PIXEL_BW1:
+            for (IC_INT32 x = x0; x < x1; ++x)
+                ink += !(s[x / 8] & (0x80 >> (x % 8)));
+            break;
+        case IC_PIXEL_GRAY8:
+            for (IC_INT32 x = x0; x < x1; ++x)
+                ink += s[x] < 128;
+            break;
+        case IC_PIXEL_BGR24:
+            for (IC_INT32 x = x0; x < x1; ++x) {
+                const IC_UINT8 *p = s + 3 * x;
+                ink += ImgConv_Luminance(p[0], p[1], p[2]) < 128;
+            }
+            break;
+        }
+
+        // most pages with content give up early
+        if (ink > limit)
+            return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "icimage.h"
+
+// Pixel conversions. All functions allocate the destination image
+// themselves and leave it untouched if they fail.
+
+// BW1, GRAY8 or BGR24 to 8 bit luminance (ITU-R BT.601 weights)
+bool
+ImgConv_ToGray8(const IcImage *src, IcImage *dst);
+
+// global threshold, pixels >= threshold become white
+bool
+ImgConv_ToBitonal(const IcImage *src, IC_UINT8 threshold, IcImage *dst);
+
+// turns the image upside down, e.g. for the back side of a duplex sheet
+bool
+ImgConv_Rotate180(const IcImage *src, IcImage *dst);
+
+// True if at most maxInk out of 10000 pixels are darker than mid gray,
+// ignoring a margin of 5% on every edge where scanners leave shadows
+// and punch holes. Meant for dropping empty back sides.
+bool
+ImgConv_IsBlank(const IcImage *img, unsigned maxInk);
+
+inline IC_UINT8
+ImgConv_Luminance(IC_UINT8 b, IC_UINT8 g, IC_UINT8 r)
+{
+    return (IC_UINT8)((b * 29u + g * 150u + r * 77u + 128u) >> 8);
+}
@@ -0,0 +1,118 @@
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "numset.h"
+#include "icmem.h"
+
+void
+NumberSet_Init(NumberSet *set)
+{
+    set->items = NULL;
+    set->count = 0;
+    set->capacity = 0;
+    set->sealed = false;
+}
+
+void
+NumberSet_Free(NumberSet *set)
+{
+    IcMem_Free(set->items);
+    NumberSet_Init(set);
+}
+
+bool
+NumberSet_Add(NumberSet *set, IC_UINT32 n)
+{
+    if (set->sealed)
+        return false;
+
+    if (set->count == set->capacity) {
+        size_t cap = set->capacity ? set->capacity * 2 : 256;
+        if (cap > (size_t)-1 / sizeof(IC_UINT32))
+            return false;
+
+        IC_UINT32 *items = (IC_UINT32 *)IcMem_Realloc(set->items, cap * sizeof(IC_UINT32));
+        if (!items)
+            return false;
+
+        set->items = items;
+        set->capacity = cap;
+    }
+
+    set->items[set->count++] = n;
+    return true;
+}
+
+static void
+NumberSet_SiftDown(IC_UINT32 *a, size_t root, size_t count)
+{
+    for (;;) {
+        size_t child = 2 * root + 1;
+        if (child >= count)
+            break;
+        if (child + 1 < count && a[child + 1] > a[child])
+            ++child;
+        if (a[root] >= a[child])
+            break;
+
+        IC_UINT32 t = a[root];
+        a[root] = a[child];
+        a[child] = t;
+        root = child;
+    }
+}
+
+void
+NumberSet_Seal(NumberSet *set)
+{
+    // heapsort: no recursion, no extra memory, and folder listings
+    // come in any order
+    IC_UINT32 *a = set->items;
+    size_t n = set->count;
+
+    for (size_t i = n / 2; i-- > 0; )
+        NumberSet_SiftDown(a, i, n);
+
+    for (size_t end = n; end > 1; --end) {
+        IC_UINT32 t = a[0];
+        a[0] = a[end - 1];
+        a[end - 1] = t;
+        NumberSet_SiftDown(a, 0, end - 1);
+    }
+
+    size_t unique = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (!unique || a[unique - 1] != a[i])
+            a[unique++] = a[i];
+    }
+
+    set->count = unique;
+    set->sealed = true;
+}
+
+bool
+NumberSet_Contains(const NumberSet *set, IC_UINT32 n)
+{
+    size_t lo = 0;
+    size_t hi = set->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (set->items[mid] < n)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo < set->count && set->items[lo] == n;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "ictypes.h"
+
+// A set of numbers that is filled once and then only queried, e.g. the
+// file numbers already taken in an output folder. Numbers are appended
+// in any order, NumberSet_Seal() sorts them once, lookups are binary
+// searches.
+//
+// Not thread-safe while it's filled; sealed sets may be queried from
+// any thread.
+
+struct NumberSet {
+    IC_UINT32 *items;
+    size_t     count;
+    size_t     capacity;
+    bool       sealed;
+};
+
+void
+NumberSet_Init(NumberSet *set);
+
+void
+NumberSet_Free(NumberSet *set);
+
+// false on allocation failure
+bool
+NumberSet_Add(NumberSet *set, IC_UINT32 n);
+
+// sorts and drops duplicates, no more NumberSet_Add() afterwards
+void
+NumberSet_Seal(NumberSet *set);
+
+bool
+NumberSet_Contains(const NumberSet *set, IC_UINT32 n);
@@ -0,0 +1,182 @@
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "reorder.h"
+#include "icmem.h"
+
+#include <string.h>
+
+bool
+ReorderBuffer_Init(ReorderBuffer *rb, unsigned deviceCount, ReorderPolicy policy)
+{
+    rb->policy = policy;
+    rb->deviceCount = deviceCount;
+    rb->current = 0;
+    rb->pending = 0;
+    rb->devices = NULL;
+
+    if (!deviceCount)
+        return false;
+
+    rb->devices = (ReorderDevice *)IcMem_Alloc(deviceCount * sizeof(ReorderDevice));
+    if (!rb->devices)
+        return false;
+
+    memset(rb->devices, 0, deviceCount * sizeof(ReorderDevice));
+    return true;
+}
+
+void
+ReorderBuffer_Free(ReorderBuffer *rb)
+{
+    if (rb->devices) {
+        for (unsigned i = 0; i < rb->deviceCount; ++i)
+            IcMem_Free(rb->devices[i].slots);
+        IcMem_Free(rb->devices);
+    }
+
+    rb->devices = NULL;
+    rb->deviceCount = 0;
+}
+
+static bool
+ReorderBuffer_Grow(ReorderDevice *d, IC_UINT32 minCapacity)
+{
+    IC_UINT32 cap = d->capacity ? d->capacity : 16;
+    while (cap < minCapacity) {
+        if (cap > 0x7fffffffu)
+            return false;
+        cap *= 2;
+    }
+
+    void **slots = (void **)IcMem_Alloc(cap * sizeof(void *));
+    if (!slots)
+        return false;
+
+    memset(slots, 0, cap * sizeof(void *));
+    for (IC_UINT32 i = 0; i < d->capacity; ++i)
+        slots[i] = d->slots[(d->head + i) % d->capacity];
+
+    IcMem_Free(d->slots);
+    d->slots = slots;
+    d->capacity = cap;
+    d->head = 0;
+    return true;
+}
+
+bool
+ReorderBuffer_Push(ReorderBuffer *rb, unsigned device, IC_UINT32 seq, void *item)
+{
+    if (device >= rb->deviceCount || !item)
+        return false;
+
+    ReorderDevice *d = &rb->devices[device];
+    if (seq < d->next || (d->finished && seq >= d->total))
+        return false;
+
+    IC_UINT32 offset = seq - d->next;
+    if (offset >= d->capacity && !ReorderBuffer_Grow(d, offset + 1))
+        return false;
+
+    void **slot = &d->slots[(d->head + offset) % d->capacity];
+    if (*slot)
+        return false;
+
+    *slot = item;
+    rb->pending++;
+    return true;
+}
+
+void
+ReorderBuffer_Finish(ReorderBuffer *rb, unsigned device, IC_UINT32 pageCount)
+{
+    if (device >= rb->deviceCount)
+        return;
+
+    rb->devices[device].finished = true;
+    rb->devices[device].total = pageCount;
+}
+
+static bool
+ReorderBuffer_Exhausted(const ReorderDevice *d)
+{
+    return d->finished && d->next >= d->total;
+}
+
+static void *
+ReorderBuffer_Take(ReorderBuffer *rb, ReorderDevice *d)
+{
+    if (!d->capacity)
+        return NULL;
+
+    void *item = d->slots[d->head];
+    if (item) {
+        d->slots[d->head] = NULL;
+        d->head = (d->head + 1) % d->capacity;
+        d->next++;
+        rb->pending--;
+    }
+
+    return item;
+}
+
+bool
+ReorderBuffer_Pop(ReorderBuffer *rb, void **pItem, unsigned *pDevice, IC_UINT32 *pSeq)
+{
+    // skip devices that have nothing left, at most once around
+    for (unsigned tries = 0; tries < rb->deviceCount; ++tries) {
+        if (rb->policy == REORDER_CONCATENATE && rb->current >= rb->deviceCount)
+            return false;
+
+        ReorderDevice *d = &rb->devices[rb->current];
+        if (!ReorderBuffer_Exhausted(d))
+            break;
+
+        if (rb->policy == REORDER_CONCATENATE)
+            rb->current++;
+        else
+            rb->current = (rb->current + 1) % rb->deviceCount;
+    }
+
+    if (rb->current >= rb->deviceCount)
+        return false;
+
+    ReorderDevice *d = &rb->devices[rb->current];
+    IC_UINT32 seq = d->next;
+    void *item = ReorderBuffer_Take(rb, d);
+    if (!item)
+        return false;
+
+    if (rb->policy == REORDER_INTERLEAVE)
+        rb->current = (rb->current + 1) % rb->deviceCount;
+
+    *pItem = item;
+    if (pDevice)
+        *pDevice = (unsigned)(d - rb->devices);
+    if (pSeq)
+        *pSeq = seq;
+
+    return true;
+}
+
+bool
+ReorderBuffer_Done(const ReorderBuffer *rb)
+{
+    for (unsigned i = 0; i < rb->deviceCount; ++i) {
+        if (!ReorderBuffer_Exhausted(&rb->devices[i]))
+            return false;
+    }
+
+    return true;
+}
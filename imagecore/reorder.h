@@ -0,0 +1,76 @@
+#pragma once
+
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "ictypes.h"
+
+// Merges the pages of several devices into one deterministic order.
+//
+// Every page is tagged with its device and its sequence number on that
+// device. Pages may be pushed in any order, but come out in an order
+// that only depends on the tags and on how many pages each device
+// delivered in the end, never on timing:
+//
+//  REORDER_CONCATENATE: all pages of device 0, then device 1, ...
+//                       (the operator split one stack into piles)
+//  REORDER_INTERLEAVE:  one page of each device in turn, skipping
+//                       devices that have run out of pages
+//
+// Not thread-safe, callers serialize access.
+
+enum ReorderPolicy {
+    REORDER_CONCATENATE = 0,
+    REORDER_INTERLEAVE  = 1
+};
+
+struct ReorderDevice {
+    void    **slots;    // ring buffer, slot of seq is (head + seq - next) % capacity
+    IC_UINT32 capacity;
+    IC_UINT32 head;
+    IC_UINT32 next;     // sequence number expected next
+    IC_UINT32 total;    // number of pages, valid once finished
+    bool      finished;
+};
+
+struct ReorderBuffer {
+    ReorderPolicy  policy;
+    unsigned       deviceCount;
+    ReorderDevice *devices;
+    unsigned       current;  // device whose turn it is
+    size_t         pending;  // pushed but not popped yet
+};
+
+bool
+ReorderBuffer_Init(ReorderBuffer *rb, unsigned deviceCount, ReorderPolicy policy);
+
+void
+ReorderBuffer_Free(ReorderBuffer *rb);
+
+// item must not be NULL; fails for duplicates, sequence numbers
+// already emitted and on allocation failure
+bool
+ReorderBuffer_Push(ReorderBuffer *rb, unsigned device, IC_UINT32 seq, void *item);
+
+// the device won't deliver more than pageCount pages (0 .. pageCount-1)
+void
+ReorderBuffer_Finish(ReorderBuffer *rb, unsigned device, IC_UINT32 pageCount);
+
+// returns the next page in output order if it has arrived yet
+bool
+ReorderBuffer_Pop(ReorderBuffer *rb, void **pItem, unsigned *pDevice, IC_UINT32 *pSeq);
+
+// every device finished and every page popped
+bool
+ReorderBuffer_Done(const ReorderBuffer *rb);
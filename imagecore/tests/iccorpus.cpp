@@ -0,0 +1,75 @@
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "iccorpus.h"
+#include "../dib.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const char *const g_icCorpusNames[] = {
+    "letter-bitonal.bmp",
+    "letter-gray.bmp",
+    "letter-color.bmp"
+};
+
+const unsigned g_icCorpusCount = sizeof(g_icCorpusNames) / sizeof(g_icCorpusNames[0]);
+
+bool
+IcCorpus_Load(const char *dir, const char *name, IcCorpusFile *f)
+{
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+    memset(f, 0, sizeof(*f));
+    f->name = name;
+
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "cannot open %s\n", path);
+        return false;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    if (size <= DIB_FILEHEADER_SIZE) {
+        fclose(fp);
+        return false;
+    }
+
+    f->file = (IC_UINT8 *)malloc((size_t)size);
+    if (!f->file || fread(f->file, 1, (size_t)size, fp) != (size_t)size || f->file[0] != 'B' || f->file[1] != 'M') {
+        fclose(fp);
+        IcCorpus_Free(f);
+        return false;
+    }
+
+    fclose(fp);
+
+    f->dib = f->file + DIB_FILEHEADER_SIZE;
+    f->dibSize = (size_t)size - DIB_FILEHEADER_SIZE;
+    return true;
+}
+
+void
+IcCorpus_Free(IcCorpusFile *f)
+{
+    free(f->file);
+    f->file = NULL;
+    f->dib = NULL;
+    f->dibSize = 0;
+}
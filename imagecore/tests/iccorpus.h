@@ -0,0 +1,36 @@
+#pragma once
+
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "../ictypes.h"
+
+// Loads BMP files from the checked-in corpus as packed DIBs,
+// shared between the unit tests and the benchmark.
+
+struct IcCorpusFile {
+    const char *name;
+    IC_UINT8   *file;   // whole .bmp file
+    IC_UINT8   *dib;    // points behind the BITMAPFILEHEADER
+    size_t      dibSize;
+};
+
+extern const char *const g_icCorpusNames[];
+extern const unsigned    g_icCorpusCount;
+
+bool
+IcCorpus_Load(const char *dir, const char *name, IcCorpusFile *f);
+
+void
+IcCorpus_Free(IcCorpusFile *f);
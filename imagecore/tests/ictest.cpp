@@ -0,0 +1,701 @@
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+// Unit tests for the portable imaging core, run by `make -f Makefile.host check`
+
+#include "iccorpus.h"
+#include "../dib.h"
+#include "../imgconv.h"
+#include "../bmpenc.h"
+#include "../tiffenc.h"
+#include "../reorder.h"
+#include "../numset.h"
+#include "../crc32.h"
+#include "../deflate.h"
+#include "../zipwriter.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static const char *g_corpusDir = "imagecore/corpus";
+static int         g_failures;
+
+#define IC_CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            ++g_failures; \
+        } \
+    } while (0)
+
+static bool
+Test_ImagesEqual(const IcImage *a, const IcImage *b)
+{
+    if (a->width != b->width || a->height != b->height || a->format != b->format)
+        return false;
+
+    size_t rowBytes = a->format == IC_PIXEL_BW1 ? ((size_t)a->width + 7) / 8
+                                                : (size_t)a->width * (a->format / 8);
+    for (IC_INT32 y = 0; y < a->height; ++y) {
+        if (memcmp(IcImage_Row(a, y), IcImage_Row(b, y), rowBytes) != 0)
+            return false;
+    }
+
+    return true;
+}
+
+static bool
+Test_LoadImage(unsigned index, IcImage *img)
+{
+    IcCorpusFile f;
+    if (!IcCorpus_Load(g_corpusDir, g_icCorpusNames[index], &f))
+        return false;
+
+    DibInfo info;
+    bool ok = Dib_Parse(f.dib, f.dibSize, &info) && Dib_ToImage(&info, img);
+    IcCorpus_Free(&f);
+    return ok;
+}
+
+static void
+Test_DibParseCorpus(void)
+{
+    static const struct {
+        IC_INT32 width, height;
+        IC_UINT16 bitCount;
+        IcPixelFormat format;
+        IC_UINT32 dpi;
+    } expected[] = {
+        { 1275, 1650, 1, IC_PIXEL_BW1, 150 },
+        { 425, 550, 8, IC_PIXEL_GRAY8, 50 },
+        { 320, 412, 24, IC_PIXEL_BGR24, 37 }
+    };
+
+    for (unsigned i = 0; i < g_icCorpusCount; ++i) {
+        IcCorpusFile f;
+        IC_CHECK(IcCorpus_Load(g_corpusDir, g_icCorpusNames[i], &f));
+        if (!f.file)
+            continue;
+
+        DibInfo info;
+        IC_CHECK(Dib_Parse(f.dib, f.dibSize, &info));
+        IC_CHECK(info.width == expected[i].width);
+        IC_CHECK(info.height == expected[i].height);
+        IC_CHECK(info.bitCount == expected[i].bitCount);
+        IC_CHECK(!info.topDown);
+        IC_CHECK(info.xDpi == expected[i].dpi);
+
+        IcImage img;
+        IC_CHECK(Dib_ToImage(&info, &img));
+        IC_CHECK(img.format == expected[i].format);
+        IcImage_Free(&img);
+
+        // truncated pixel data must be rejected
+        IC_CHECK(!Dib_Parse(f.dib, f.dibSize - 1, &info));
+
+        IcCorpus_Free(&f);
+    }
+}
+
+static void
+Test_DibPaletteUsesClrUsed(void)
+{
+    // 2x2 8 bpp DIB with a 16 entry palette, bits must start behind it
+    IC_UINT8 dib[40 + 16 * 4 + 2 * 4];
+    memset(dib, 0, sizeof(dib));
+    Ic_PutU32LE(dib, 40);
+    Ic_PutU32LE(dib + 4, 2);
+    Ic_PutU32LE(dib + 8, (IC_UINT32)-2);
+    Ic_PutU16LE(dib + 12, 1);
+    Ic_PutU16LE(dib + 14, 8);
+    Ic_PutU32LE(dib + 32, 16);
+    for (unsigned i = 0; i < 16; ++i)
+        memset(dib + 40 + 4 * i, (int)(i * 17), 3);
+    IC_UINT8 *bits = dib + 40 + 64;
+    bits[0] = 0;
+    bits[1] = 15;
+    bits[4] = 5;
+    bits[5] = 10;
+
+    DibInfo info;
+    IC_CHECK(Dib_Parse(dib, sizeof(dib), &info));
+    IC_CHECK(info.paletteEntries == 16);
+    IC_CHECK(info.bitsOffset == 40 + 64);
+    IC_CHECK(info.topDown);
+
+    IcImage img;
+    IC_CHECK(Dib_ToImage(&info, &img));
+    IC_CHECK(img.format == IC_PIXEL_GRAY8);
+    IC_CHECK(IcImage_Row(&img, 0)[0] == 0 && IcImage_Row(&img, 0)[1] == 255);
+    IC_CHECK(IcImage_Row(&img, 1)[0] == 85 && IcImage_Row(&img, 1)[1] == 170);
+    IcImage_Free(&img);
+}
+
+static void
+Test_BmpRoundTrip(void)
+{
+    for (unsigned i = 0; i < g_icCorpusCount; ++i) {
+        IcImage img;
+        IC_CHECK(Test_LoadImage(i, &img));
+
+        IcBuffer buf;
+        IcSink sink;
+        IcBuffer_Init(&buf);
+        IcBuffer_InitSink(&buf, &sink);
+        IC_CHECK(BmpEncoder_Write(&img, &sink));
+
+        DibInfo info;
+        IcImage back;
+        IC_CHECK(Dib_Parse(buf.data + DIB_FILEHEADER_SIZE, buf.size - DIB_FILEHEADER_SIZE, &info));
+        IC_CHECK(Dib_ToImage(&info, &back));
+        IC_CHECK(Test_ImagesEqual(&img, &back));
+        IC_CHECK(back.xDpi == img.xDpi);
+
+        IcImage_Free(&back);
+        IcBuffer_Free(&buf);
+        IcImage_Free(&img);
+    }
+}
+
+static void
+Test_GrayAndThreshold(void)
+{
+    IcImage color;
+    IC_CHECK(IcImage_Create(&color, 9, 1, IC_PIXEL_BGR24));
+    IC_UINT8 *p = IcImage_Row(&color, 0);
+    for (int x = 0; x < 9; ++x)
+        memset(p + 3 * x, x < 5 ? 0 : 255, 3);
+    p[3 * 8 + 0] = 255; p[3 * 8 + 1] = 0; p[3 * 8 + 2] = 0; // pure blue is dark
+
+    IcImage gray, bw;
+    IC_CHECK(ImgConv_ToGray8(&color, &gray));
+    IC_CHECK(IcImage_Row(&gray, 0)[0] == 0);
+    IC_CHECK(IcImage_Row(&gray, 0)[5] == 255);
+    IC_CHECK(IcImage_Row(&gray, 0)[8] == 29);
+
+    IC_CHECK(ImgConv_ToBitonal(&color, 128, &bw));
+    IC_CHECK(IcImage_Row(&bw, 0)[0] == 0x07); // pixels 5..7 white
+    IC_CHECK(IcImage_Row(&bw, 0)[1] == 0x00);
+
+    IcImage_Free(&bw);
+    IcImage_Free(&gray);
+    IcImage_Free(&color);
+}
+
+static void
+Test_Rotate180(void)
+{
+    static const IcPixelFormat formats[] = { IC_PIXEL_BW1, IC_PIXEL_GRAY8, IC_PIXEL_BGR24 };
+
+    for (unsigned f = 0; f < 3; ++f) {
+        IcImage img, once, twice;
+        IC_CHECK(IcImage_Create(&img, 13, 3, formats[f]));
+        for (IC_INT32 y = 0; y < img.height; ++y)
+            for (size_t i = 0; i < img.stride; ++i)
+                IcImage_Row(&img, y)[i] = (IC_UINT8)(y * 31 + i * 7 + 1);
+
+        // clear BW1 padding bits so the comparison is meaningful
+        if (formats[f] == IC_PIXEL_BW1)
+            for (IC_INT32 y = 0; y < img.height; ++y)
+                IcImage_Row(&img, y)[1] &= 0xf8;
+
+        IC_CHECK(ImgConv_Rotate180(&img, &once));
+        IC_CHECK(ImgConv_Rotate180(&once, &twice));
+        IC_CHECK(Test_ImagesEqual(&img, &twice));
+
+        if (formats[f] == IC_PIXEL_BW1) {
+            // first pixel of the last row ends up last in the first row
+            bool first = (IcImage_Row(&img, 2)[0] & 0x80) != 0;
+            bool last = (IcImage_Row(&once, 0)[1] & 0x08) != 0;
+            IC_CHECK(first == last);
+        } else if (formats[f] == IC_PIXEL_GRAY8) {
+            IC_CHECK(IcImage_Row(&once, 0)[12] == IcImage_Row(&img, 2)[0]);
+        }
+
+        IcImage_Free(&twice);
+        IcImage_Free(&once);
+        IcImage_Free(&img);
+    }
+}
+
+static void
+Test_DibRotate180(void)
+{
+    // 5x3 4 bpp, bottom-up, rows padded to 4 bytes
+    IC_UINT8 dib[40 + 16 * 4 + 3 * 4];
+    memset(dib, 0, sizeof(dib));
+    Ic_PutU32LE(dib, 40);
+    Ic_PutU32LE(dib + 4, 5);
+    Ic_PutU32LE(dib + 8, 3);
+    Ic_PutU16LE(dib + 12, 1);
+    Ic_PutU16LE(dib + 14, 4);
+    IC_UINT8 *bits = dib + 40 + 64;
+    for (unsigned y = 0; y < 3; ++y)
+        for (unsigned x = 0; x < 5; ++x)
+            bits[y * 4 + x / 2] |= (IC_UINT8)(((y * 5 + x) & 15) << (x % 2 ? 0 : 4));
+
+    IC_UINT8 original[3 * 4];
+    memcpy(original, bits, sizeof(original));
+
+    DibInfo info;
+    IC_CHECK(Dib_Parse(dib, sizeof(dib), &info));
+    IC_CHECK(Dib_Rotate180(&info, bits));
+
+    // pixel 0 of row 0 and pixel 4 of row 2 swapped places, the middle pixel stays
+    IC_CHECK((bits[2 * 4 + 2] >> 4) == 0);
+    IC_CHECK((bits[0] >> 4) == 14);
+    IC_CHECK((bits[1 * 4 + 1] >> 4) == 7);
+
+    IC_CHECK(Dib_Rotate180(&info, bits));
+    IC_CHECK(memcmp(bits, original, sizeof(original)) == 0);
+}
+
+static void
+Test_IsBlank(void)
+{
+    IcImage img;
+    IC_CHECK(IcImage_Create(&img, 200, 100, IC_PIXEL_GRAY8));
+    for (IC_INT32 y = 0; y < img.height; ++y)
+        memset(IcImage_Row(&img, y), 255, (size_t)img.width);
+
+    // a black edge is a scanner shadow, a few specks are dust
+    for (IC_INT32 y = 0; y < img.height; ++y)
+        memset(IcImage_Row(&img, y), 0, 8);
+    IcImage_Row(&img, 50)[100] = 0;
+    IcImage_Row(&img, 51)[120] = 0;
+    IC_CHECK(ImgConv_IsBlank(&img, 10));
+
+    // a line of text is not
+    for (IC_INT32 y = 40; y < 48; ++y)
+        memset(IcImage_Row(&img, y) + 30, 0, 120);
+    IC_CHECK(!ImgConv_IsBlank(&img, 10));
+
+    IcImage bw;
+    IC_CHECK(ImgConv_ToBitonal(&img, 128, &bw));
+    IC_CHECK(!ImgConv_IsBlank(&bw, 10));
+    IcImage_Free(&bw);
+
+    IcImage_Free(&img);
+}
+
+static bool
+Test_PackBitsDecode(const IC_UINT8 *src, size_t n, IcBuffer *out)
+{
+    size_t i = 0;
+    while (i < n) {
+        IC_UINT8 c = src[i++];
+        if (c < 128) {
+            if (i + c + 1 > n)
+                return false;
+            IcBuffer_Append(out, src + i, c + 1u);
+            i += c + 1u;
+        } else if (c > 128) {
+            if (i >= n)
+                return false;
+            for (unsigned k = 0; k < 257u - c; ++k)
+                IcBuffer_AppendByte(out, src[i]);
+            ++i;
+        }
+    }
+    return true;
+}
+
+static void
+Test_PackBitsRoundTrip(void)
+{
+    IC_UINT8 data[1000];
+    unsigned seed = 1;
+    for (size_t i = 0; i < sizeof(data); ++i) {
+        seed = seed * 1103515245u + 12345u;
+        // mix of literal stretches and long runs
+        data[i] = (i / 50) % 2 ? (IC_UINT8)(seed >> 24) : (IC_UINT8)(i / 200);
+    }
+
+    IcBuffer enc, dec;
+    IcBuffer_Init(&enc);
+    IcBuffer_Init(&dec);
+    IC_CHECK(PackBits_Encode(data, sizeof(data), &enc));
+    IC_CHECK(Test_PackBitsDecode(enc.data, enc.size, &dec));
+    IC_CHECK(dec.size == sizeof(data) && memcmp(dec.data, data, sizeof(data)) == 0);
+
+    IcBuffer_Free(&dec);
+    IcBuffer_Free(&enc);
+}
+
+static void
+Test_TiffMultiPage(void)
+{
+    IcBuffer buf;
+    IcSink sink;
+    IcBuffer_Init(&buf);
+    IcBuffer_InitSink(&buf, &sink);
+
+    TiffWriter w;
+    IC_CHECK(TiffWriter_Begin(&w, &sink));
+
+    IcImage img[3];
+    for (unsigned i = 0; i < g_icCorpusCount; ++i) {
+        IC_CHECK(Test_LoadImage(i, &img[i]));
+        IC_CHECK(TiffWriter_AddPage(&w, &img[i], i == 1 ? TIFF_COMPRESSION_NONE : TIFF_COMPRESSION_PACKBITS));
+    }
+
+    IC_CHECK(TiffWriter_Finish(&w));
+    IC_CHECK(buf.size > 8 && buf.data[0] == 'I' && buf.data[2] == 42);
+
+    // walk the IFD chain
+    unsigned pages = 0;
+    IC_UINT32 ifd = Ic_GetU32LE(buf.data + 4);
+    while (ifd && ifd + 2 <= buf.size && pages < 10) {
+        IC_UINT16 n = Ic_GetU16LE(buf.data + ifd);
+        IC_CHECK(ifd + 2 + n * 12u + 4 <= buf.size);
+
+        IC_UINT32 width = 0, compression = 0, offset = 0, count = 0;
+        for (IC_UINT16 e = 0; e < n; ++e) {
+            const IC_UINT8 *p = buf.data + ifd + 2 + 12 * e;
+            IC_UINT16 tag = Ic_GetU16LE(p);
+            IC_UINT32 v = Ic_GetU16LE(p + 2) == 3 ? Ic_GetU16LE(p + 8) : Ic_GetU32LE(p + 8);
+            IC_UINT32 cnt = Ic_GetU32LE(p + 4);
+            if (tag == 256) width = v;
+            if (tag == 259) compression = v;
+            if (tag == 273) offset = cnt == 1 ? v : Ic_GetU32LE(buf.data + v);
+            if (tag == 279) count = cnt == 1 ? v : Ic_GetU32LE(buf.data + v);
+        }
+
+        IC_CHECK(width == (IC_UINT32)img[pages].width);
+        IC_CHECK(compression == (pages == 1 ? 1u : 32773u));
+
+        // the first row of the first strip must decode to the image's first row
+        if (pages == 0) {
+            IcBuffer dec;
+            IcBuffer_Init(&dec);
+            IC_CHECK(offset + count <= buf.size);
+            IC_CHECK(Test_PackBitsDecode(buf.data + offset, count, &dec));
+            IC_CHECK(dec.size >= (width + 7) / 8);
+            IC_CHECK(memcmp(dec.data, IcImage_Row(&img[0], 0), (width + 7) / 8) == 0);
+            IcBuffer_Free(&dec);
+        }
+
+        ++pages;
+        ifd = Ic_GetU32LE(buf.data + ifd + 2 + n * 12u);
+    }
+
+    IC_CHECK(pages == 3);
+
+    for (unsigned i = 0; i < g_icCorpusCount; ++i)
+        IcImage_Free(&img[i]);
+    IcBuffer_Free(&buf);
+}
+
+static void
+Test_ReorderPolicy(ReorderPolicy policy, const char *expected)
+{
+    // device 0 delivers 3 pages, device 1 delivers 1, device 2 delivers 2;
+    // pages are pushed in a scrambled order and popped whenever possible
+    static const struct { unsigned device; IC_UINT32 seq; } pushes[] = {
+        { 2, 1 }, { 1, 0 }, { 0, 2 }, { 2, 0 }, { 0, 0 }, { 0, 1 }
+    };
+    static char labels[3][3][3];
+
+    ReorderBuffer rb;
+    IC_CHECK(ReorderBuffer_Init(&rb, 3, policy));
+
+    char order[64] = "";
+    size_t n = 0;
+
+    for (unsigned i = 0; i < sizeof(pushes) / sizeof(pushes[0]); ++i) {
+        char *label = labels[pushes[i].device][pushes[i].seq];
+        label[0] = (char)('a' + pushes[i].device);
+        label[1] = (char)('0' + pushes[i].seq);
+        IC_CHECK(ReorderBuffer_Push(&rb, pushes[i].device, pushes[i].seq, label));
+
+        // the counts become known while pages are still outstanding
+        if (i == 1)
+            ReorderBuffer_Finish(&rb, 1, 1);
+        if (i == 3)
+            ReorderBuffer_Finish(&rb, 2, 2);
+
+        void *item;
+        while (ReorderBuffer_Pop(&rb, &item, NULL, NULL)) {
+            order[n++] = ((char *)item)[0];
+            order[n++] = ((char *)item)[1];
+        }
+    }
+
+    IC_CHECK(!ReorderBuffer_Done(&rb));
+    ReorderBuffer_Finish(&rb, 0, 3);
+
+    void *item;
+    while (ReorderBuffer_Pop(&rb, &item, NULL, NULL)) {
+        order[n++] = ((char *)item)[0];
+        order[n++] = ((char *)item)[1];
+    }
+    order[n] = 0;
+
+    IC_CHECK(strcmp(order, expected) == 0);
+    IC_CHECK(ReorderBuffer_Done(&rb));
+
+    // duplicates and pages that were already emitted are refused
+    IC_CHECK(!ReorderBuffer_Push(&rb, 0, 1, labels[0][1]));
+
+    ReorderBuffer_Free(&rb);
+}
+
+static void
+Test_Reorder(void)
+{
+    Test_ReorderPolicy(REORDER_CONCATENATE, "a0a1a2b0c0c1");
+    Test_ReorderPolicy(REORDER_INTERLEAVE, "a0b0c0a1c1a2");
+}
+
+static void
+Test_NumberSet(void)
+{
+    NumberSet set;
+    NumberSet_Init(&set);
+
+    // every multiple of 3 below 3000, scrambled and twice, plus the extremes
+    for (IC_UINT32 i = 0; i < 2000; ++i)
+        IC_CHECK(NumberSet_Add(&set, (i * 7919u) % 1000u * 3u));
+    IC_CHECK(NumberSet_Add(&set, 0xffffffffu));
+    NumberSet_Seal(&set);
+
+    IC_CHECK(set.count == 1001);
+    IC_CHECK(NumberSet_Contains(&set, 0));
+    IC_CHECK(NumberSet_Contains(&set, 2997));
+    IC_CHECK(NumberSet_Contains(&set, 0xffffffffu));
+    IC_CHECK(!NumberSet_Contains(&set, 1));
+    IC_CHECK(!NumberSet_Contains(&set, 3000));
+
+    bool sorted = true;
+    for (size_t i = 1; i < set.count; ++i)
+        sorted = sorted && set.items[i - 1] < set.items[i];
+    IC_CHECK(sorted);
+
+    // sealed sets don't change anymore
+    IC_CHECK(!NumberSet_Add(&set, 1));
+
+    NumberSet_Free(&set);
+    IC_CHECK(!NumberSet_Contains(&set, 0));
+}
+
+static void
+Test_Crc32(void)
+{
+    static const char check[] = "123456789";
+
+    IC_CHECK(Crc32_Update(0, check, 0) == 0);
+    IC_CHECK(Crc32_Update(0, check, 9) == 0xcbf43926u);
+
+    // in pieces, as files are written
+    IC_UINT32 crc = Crc32_Update(0, check, 4);
+    IC_CHECK(Crc32_Update(crc, check + 4, 5) == 0xcbf43926u);
+}
+
+// Just enough inflate for what Deflate_Compress() writes: fixed codes only
+struct TestBitReader {
+    const IC_UINT8 *p;
+    size_t          size;
+    size_t          bit;
+};
+
+static unsigned
+Test_GetBits(TestBitReader *r, unsigned n)
+{
+    unsigned v = 0;
+    for (unsigned i = 0; i < n && r->bit / 8 < r->size; ++i, ++r->bit)
+        v |= (unsigned)((r->p[r->bit / 8] >> (r->bit % 8)) & 1) << i;
+    return v;
+}
+
+static unsigned
+Test_GetCode(TestBitReader *r, unsigned n, unsigned code)
+{
+    for (unsigned i = 0; i < n; ++i)
+        code = (code << 1) | Test_GetBits(r, 1);
+    return code;
+}
+
+static bool
+Test_InflateFixed(const IC_UINT8 *data, size_t size, IcBuffer *out)
+{
+    static const unsigned lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                             35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    static const unsigned distBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385,
+                                           513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+
+    TestBitReader r = { data, size, 0 };
+    if (Test_GetBits(&r, 1) != 1 || Test_GetBits(&r, 2) != 1)
+        return false;
+
+    while (r.bit / 8 < size) {
+        unsigned sym;
+        unsigned code = Test_GetCode(&r, 7, 0);
+        if (code < 24) {
+            sym = 256 + code;
+        } else {
+            code = Test_GetCode(&r, 1, code);
+            if (code >= 0x30 && code < 0xc0)
+                sym = code - 0x30;
+            else if (code >= 0xc0 && code < 0xc8)
+                sym = 280 + code - 0xc0;
+            else
+                sym = 144 + Test_GetCode(&r, 1, code) - 0x190;
+        }
+
+        if (sym < 256) {
+            IcBuffer_AppendByte(out, (IC_UINT8)sym);
+            continue;
+        }
+        if (sym == 256)
+            return !IcBuffer_Failed(out);
+
+        unsigned li = sym - 257;
+        unsigned lengthExtra = li < 8 || li == 28 ? 0 : (li - 4) / 4;
+        unsigned length = lengthBase[li] + Test_GetBits(&r, lengthExtra);
+        unsigned di = Test_GetCode(&r, 5, 0);
+        unsigned distExtra = di < 4 ? 0 : (di - 2) / 2;
+        unsigned dist = distBase[di] + Test_GetBits(&r, distExtra);
+        if (dist > out->size)
+            return false;
+
+        for (unsigned i = 0; i < length; ++i)
+            IcBuffer_AppendByte(out, out->data[out->size - dist]);
+    }
+
+    return false;
+}
+
+static void
+Test_Deflate(void)
+{
+    for (unsigned i = 0; i < g_icCorpusCount; ++i) {
+        IcCorpusFile f;
+        IC_CHECK(IcCorpus_Load(g_corpusDir, g_icCorpusNames[i], &f));
+
+        IcBuffer packed, unpacked;
+        IcBuffer_Init(&packed);
+        IcBuffer_Init(&unpacked);
+
+        IC_CHECK(Deflate_Compress(f.dib, f.dibSize, &packed));
+        IC_CHECK(packed.size < f.dibSize / 2);  // scans are mostly paper
+        IC_CHECK(Test_InflateFixed(packed.data, packed.size, &unpacked));
+        IC_CHECK(unpacked.size == f.dibSize && memcmp(unpacked.data, f.dib, f.dibSize) == 0);
+
+        IcBuffer_Free(&packed);
+        IcBuffer_Free(&unpacked);
+        IcCorpus_Free(&f);
+    }
+
+    // nothing at all is an end code
+    IcBuffer empty;
+    IcBuffer_Init(&empty);
+    IC_CHECK(Deflate_Compress("", 0, &empty));
+    IC_CHECK(empty.size == 2);
+    IcBuffer_Free(&empty);
+}
+
+static void
+Test_ZipWriter(void)
+{
+    IcBuffer buf;
+    IcSink sink;
+    IcBuffer_Init(&buf);
+    IcBuffer_InitSink(&buf, &sink);
+
+    static const char first[] = "first page";
+    static const char second[] = "second page, second page, second page";
+
+    IcBuffer packed;
+    IcBuffer_Init(&packed);
+    IC_CHECK(Deflate_Compress(second, sizeof(second), &packed));
+
+    ZipWriter w;
+    IC_UINT64 offsets[2] = { 0, 0 };
+    IC_CHECK(ZipWriter_Begin(&w, &sink));
+    IC_CHECK(ZipWriter_AddEntry(&w, "scan0000.tif", ZIP_METHOD_STORE, first, sizeof(first),
+                                Crc32_Update(0, first, sizeof(first)), sizeof(first), 0x5b530000u, &offsets[0]));
+    IC_CHECK(ZipWriter_AddEntry(&w, "0000/scan0001.tif", ZIP_METHOD_DEFLATE, packed.data, packed.size,
+                                Crc32_Update(0, second, sizeof(second)), sizeof(second), 0x5b530000u, &offsets[1]));
+    IC_CHECK(ZipWriter_Finish(&w));
+
+    // the data is where the writer said, right after its local header
+    IC_CHECK(offsets[0] == 30 + 12);
+    IC_CHECK(memcmp(buf.data + offsets[0], first, sizeof(first)) == 0);
+    IC_CHECK(memcmp(buf.data + offsets[1], packed.data, packed.size) == 0);
+    IC_CHECK(Ic_GetU32LE(buf.data) == 0x04034b50u);
+    IC_CHECK(Ic_GetU16LE(buf.data + 8) == 0);
+    IC_CHECK(Ic_GetU32LE(buf.data + 14) == Crc32_Update(0, first, sizeof(first)));
+
+    // the end record leads to the central directory, and that to the local headers
+    IC_CHECK(buf.size >= 22);
+    const IC_UINT8 *end = buf.data + buf.size - 22;
+    IC_CHECK(Ic_GetU32LE(end) == 0x06054b50u);
+    IC_CHECK(Ic_GetU16LE(end + 10) == 2);
+
+    IC_UINT32 central = Ic_GetU32LE(end + 16);
+    IC_CHECK(central + Ic_GetU32LE(end + 12) == buf.size - 22);
+
+    const IC_UINT8 *c = buf.data + central;
+    for (unsigned i = 0; i < 2 && c + 46 <= end; ++i) {
+        IC_CHECK(Ic_GetU32LE(c) == 0x02014b50u);
+        IC_CHECK(Ic_GetU16LE(c + 10) == (i ? 8 : 0));
+        IC_UINT16 nameLength = Ic_GetU16LE(c + 28);
+        IC_UINT32 local = Ic_GetU32LE(c + 42);
+        IC_CHECK(local + 30 + nameLength == offsets[i]);
+        IC_CHECK(memcmp(c + 46, buf.data + local + 30, nameLength) == 0);
+        c += 46 + nameLength + Ic_GetU16LE(c + 30);
+    }
+
+    IcBuffer_Free(&packed);
+    IcBuffer_Free(&buf);
+}
+
+static const struct {
+    const char *name;
+    void (*fn)(void);
+} g_tests[] = {
+    { "dib_parse_corpus", Test_DibParseCorpus },
+    { "dib_palette_uses_clrused", Test_DibPaletteUsesClrUsed },
+    { "bmp_roundtrip", Test_BmpRoundTrip },
+    { "gray_and_threshold", Test_GrayAndThreshold },
+    { "rotate180", Test_Rotate180 },
+    { "dib_rotate180", Test_DibRotate180 },
+    { "is_blank", Test_IsBlank },
+    { "packbits_roundtrip", Test_PackBitsRoundTrip },
+    { "tiff_multipage", Test_TiffMultiPage },
+    { "reorder", Test_Reorder },
+    { "number_set", Test_NumberSet },
+    { "crc32", Test_Crc32 },
+    { "deflate", Test_Deflate },
+    { "zip_writer", Test_ZipWriter }
+};
+
+int
+main(int argc, char **argv)
+{
+    if (argc > 1)
+        g_corpusDir = argv[1];
+
+    int failedTests = 0;
+    for (unsigned i = 0; i < sizeof(g_tests) / sizeof(g_tests[0]); ++i) {
+        int before = g_failures;
+        g_tests[i].fn();
+        printf("%-32s %s\n", g_tests[i].name, g_failures == before ? "ok" : "FAILED");
+        if (g_failures != before)
+            ++failedTests;
+    }
+
+    printf("%d of %u tests failed\n", failedTests, (unsigned)(sizeof(g_tests) / sizeof(g_tests[0])));
+    return failedTests ? 1 : 0;
+}
@@ -0,0 +1,316 @@
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "tiffenc.h"
+
+#include <string.h>
+
+enum {
+    TIFF_TAG_IMAGEWIDTH       = 256,
+    TIFF_TAG_IMAGELENGTH      = 257,
+    TIFF_TAG_BITSPERSAMPLE    = 258,
+    TIFF_TAG_COMPRESSION      = 259,
+    TIFF_TAG_PHOTOMETRIC      = 262,
+    TIFF_TAG_STRIPOFFSETS     = 273,
+    TIFF_TAG_SAMPLESPERPIXEL  = 277,
+    TIFF_TAG_ROWSPERSTRIP     = 278,
+    TIFF_TAG_STRIPBYTECOUNTS  = 279,
+    TIFF_TAG_XRESOLUTION      = 282,
+    TIFF_TAG_YRESOLUTION      = 283,
+    TIFF_TAG_PLANARCONFIG     = 284,
+    TIFF_TAG_RESOLUTIONUNIT   = 296
+};
+
+enum {
+    TIFF_TYPE_SHORT    = 3,
+    TIFF_TYPE_LONG     = 4,
+    TIFF_TYPE_RATIONAL = 5
+};
+
+enum {
+    TIFF_IFD_ENTRIES    = 13,
+    TIFF_STRIP_TARGET   = 64 * 1024
+};
+
+bool
+PackBits_Encode(const IC_UINT8 *src, size_t n, IcBuffer *out)
+{
+    size_t i = 0;
+
+    while (i < n) {
+        size_t run = 1;
+        while (i + run < n && run < 128 && src[i + run] == src[i])
+            ++run;
+
+        if (run >= 2) {
+            IcBuffer_AppendByte(out, (IC_UINT8)(257 - run));
+            IcBuffer_AppendByte(out, src[i]);
+            i += run;
+            continue;
+        }
+
+        // literal run, stopping where at least three equal bytes begin
+        size_t start = i;
+        while (i < n && i - start < 128) {
+            if (i + 2 < n && src[i] == src[i + 1] && src[i] == src[i + 2])
+                break;
+            ++i;
+        }
+
+        IcBuffer_AppendByte(out, (IC_UINT8)(i - start - 1));
+        IcBuffer_Append(out, src + start, i - start);
+    }
+
+    return !IcBuffer_Failed(out);
+}
+
+static bool
+TiffWriter_Write(TiffWriter *w, const void *data, size_t size)
+{
+    if (w->failed)
+        return false;
+
+    if (w->pos + size > 0xffffffffu || !w->sink->write(w->sink->ctx, data, size)) {
+        w->failed = true;
+        return false;
+    }
+
+    w->pos += size;
+    return true;
+}
+
+static bool
+TiffWriter_Align(TiffWriter *w)
+{
+    static const IC_UINT8 zero = 0;
+
+    if (w->pos & 1)
+        return TiffWriter_Write(w, &zero, 1);
+
+    return !w->failed;
+}
+
+bool
+TiffWriter_Begin(TiffWriter *w, IcSink *sink)
+{
+    w->sink = sink;
+    w->pos = 0;
+    w->linkPos = 4;
+    w->pageCount = 0;
+    w->failed = false;
+    IcBuffer_Init(&w->strip);
+    IcBuffer_Init(&w->stripInfo);
+
+    // little endian header, first IFD offset gets patched in later
+    static const IC_UINT8 header[8] = { 'I', 'I', 42, 0, 0, 0, 0, 0 };
+    return TiffWriter_Write(w, header, sizeof(header));
+}
+
+static void
+TiffWriter_PackRow(IC_UINT8 *dst, const IC_UINT8 *src, const IcImage *img)
+{
+    if (img->format == IC_PIXEL_BGR24) {
+        for (IC_INT32 x = 0; x < img->width; ++x) {
+            dst[3 * x + 0] = src[3 * x + 2];
+            dst[3 * x + 1] = src[3 * x + 1];
+            dst[3 * x + 2] = src[3 * x + 0];
+        }
+    } else {
+        memcpy(dst, src, IcImage_StrideFor(img->width, img->format));
+    }
+}
+
+static bool
+TiffWriter_FlushStrip(TiffWriter *w)
+{
+    IcBuffer_AppendU32LE(&w->stripInfo, (IC_UINT32)w->pos);
+    IcBuffer_AppendU32LE(&w->stripInfo, (IC_UINT32)w->strip.size);
+
+    if (IcBuffer_Failed(&w->stripInfo) || IcBuffer_Failed(&w->strip)) {
+        w->failed = true;
+        return false;
+    }
+
+    bool ok = TiffWriter_Write(w, w->strip.data, w->strip.size);
+    IcBuffer_Clear(&w->strip);
+    return ok;
+}
+
+static void
+TiffWriter_PutEntry(IC_UINT8 *e, IC_UINT16 tag, IC_UINT16 type, IC_UINT32 count, IC_UINT32 value)
+{
+    Ic_PutU16LE(e, tag);
+    Ic_PutU16LE(e + 2, type);
+    Ic_PutU32LE(e + 4, count);
+
+    if (type == TIFF_TYPE_SHORT && count == 1) {
+        Ic_PutU16LE(e + 8, (IC_UINT16)value);
+        Ic_PutU16LE(e + 10, 0);
+    } else {
+        Ic_PutU32LE(e + 8, value);
+    }
+}
+
+bool
+TiffWriter_AddPage(TiffWriter *w, const IcImage *img, TiffCompression compression)
+{
+    if (w->failed)
+        return false;
+
+    size_t rowBytes = (img->format == IC_PIXEL_BW1) ? ((size_t)img->width + 7) / 8
+                                                    : (size_t)img->width * (img->format / 8);
+    IC_UINT32 rowsPerStrip = (IC_UINT32)(TIFF_STRIP_TARGET / rowBytes);
+    if (rowsPerStrip < 1)
+        rowsPerStrip = 1;
+    if (rowsPerStrip > (IC_UINT32)img->height)
+        rowsPerStrip = (IC_UINT32)img->height;
+
+    IcBuffer_Clear(&w->stripInfo);
+    IcBuffer_Clear(&w->strip);
+
+    // worst case for PackBits is one extra byte per 128
+    IcBuffer row;
+    IcBuffer_Init(&row);
+    if (!IcBuffer_Reserve(&row, img->stride)
+        || !IcBuffer_Reserve(&w->strip, rowsPerStrip * (rowBytes + rowBytes / 128 + 1))) {
+        IcBuffer_Free(&row);
+        w->failed = true;
+        return false;
+    }
+
+    for (IC_INT32 y = 0; y < img->height; ++y) {
+        TiffWriter_PackRow(row.data, IcImage_Row(img, y), img);
+
+        if (compression == TIFF_COMPRESSION_PACKBITS)
+            PackBits_Encode(row.data, rowBytes, &w->strip);
+        else
+            IcBuffer_Append(&w->strip, row.data, rowBytes);
+
+        if ((IC_UINT32)(y + 1) % rowsPerStrip == 0 || y + 1 == img->height) {
+            if (!TiffWriter_FlushStrip(w))
+                break;
+        }
+    }
+
+    IcBuffer_Free(&row);
+
+    if (w->failed || !TiffWriter_Align(w))
+        return false;
+
+    // out-of-line values go after the IFD
+    IC_UINT32 stripCount = (IC_UINT32)(w->stripInfo.size / 8);
+    IC_UINT32 ifdPos = (IC_UINT32)w->pos;
+    IC_UINT32 extraPos = ifdPos + 2 + TIFF_IFD_ENTRIES * 12 + 4;
+    IC_UINT32 bpsPos = extraPos;
+    IC_UINT32 xresPos = bpsPos + 8;
+    IC_UINT32 yresPos = xresPos + 8;
+    IC_UINT32 offsetsPos = yresPos + 8;
+    IC_UINT32 countsPos = offsetsPos + 4 * stripCount;
+
+    IcBuffer ifd;
+    IcBuffer_Init(&ifd);
+    if (!IcBuffer_Reserve(&ifd, countsPos + 4 * stripCount - ifdPos)) {
+        w->failed = true;
+        return false;
+    }
+    ifd.size = countsPos + 4 * stripCount - ifdPos;
+    memset(ifd.data, 0, ifd.size);
+
+    IC_UINT8 *e = ifd.data;
+    Ic_PutU16LE(e, TIFF_IFD_ENTRIES);
+    e += 2;
+
+    IC_UINT16 spp = img->format == IC_PIXEL_BGR24 ? 3 : 1;
+    IC_UINT16 bps = img->format == IC_PIXEL_BW1 ? 1 : 8;
+
+    TiffWriter_PutEntry(e, TIFF_TAG_IMAGEWIDTH, TIFF_TYPE_LONG, 1, (IC_UINT32)img->width);
+    TiffWriter_PutEntry(e += 12, TIFF_TAG_IMAGELENGTH, TIFF_TYPE_LONG, 1, (IC_UINT32)img->height);
+    if (spp == 3)
+        TiffWriter_PutEntry(e += 12, TIFF_TAG_BITSPERSAMPLE, TIFF_TYPE_SHORT, 3, bpsPos);
+    else
+        TiffWriter_PutEntry(e += 12, TIFF_TAG_BITSPERSAMPLE, TIFF_TYPE_SHORT, 1, bps);
+    TiffWriter_PutEntry(e += 12, TIFF_TAG_COMPRESSION, TIFF_TYPE_SHORT, 1, (IC_UINT32)compression);
+    TiffWriter_PutEntry(e += 12, TIFF_TAG_PHOTOMETRIC, TIFF_TYPE_SHORT, 1, spp == 3 ? 2 : 1);
+    if (stripCount == 1)
+        TiffWriter_PutEntry(e += 12, TIFF_TAG_STRIPOFFSETS, TIFF_TYPE_LONG, 1, Ic_GetU32LE(w->stripInfo.data));
+    else
+        TiffWriter_PutEntry(e += 12, TIFF_TAG_STRIPOFFSETS, TIFF_TYPE_LONG, stripCount, offsetsPos);
+    TiffWriter_PutEntry(e += 12, TIFF_TAG_SAMPLESPERPIXEL, TIFF_TYPE_SHORT, 1, spp);
+    TiffWriter_PutEntry(e += 12, TIFF_TAG_ROWSPERSTRIP, TIFF_TYPE_LONG, 1, rowsPerStrip);
+    if (stripCount == 1)
+        TiffWriter_PutEntry(e += 12, TIFF_TAG_STRIPBYTECOUNTS, TIFF_TYPE_LONG, 1, Ic_GetU32LE(w->stripInfo.data + 4));
+    else
+        TiffWriter_PutEntry(e += 12, TIFF_TAG_STRIPBYTECOUNTS, TIFF_TYPE_LONG, stripCount, countsPos);
+    TiffWriter_PutEntry(e += 12, TIFF_TAG_XRESOLUTION, TIFF_TYPE_RATIONAL, 1, xresPos);
+    TiffWriter_PutEntry(e += 12, TIFF_TAG_YRESOLUTION, TIFF_TYPE_RATIONAL, 1, yresPos);
+    TiffWriter_PutEntry(e += 12, TIFF_TAG_PLANARCONFIG, TIFF_TYPE_SHORT, 1, 1);
+    TiffWriter_PutEntry(e += 12, TIFF_TAG_RESOLUTIONUNIT, TIFF_TYPE_SHORT, 1, 2);
+    // next IFD offset stays zero
+
+    IC_UINT8 *x = ifd.data + (bpsPos - ifdPos);
+    Ic_PutU16LE(x, 8);
+    Ic_PutU16LE(x + 2, 8);
+    Ic_PutU16LE(x + 4, 8);
+
+    x = ifd.data + (xresPos - ifdPos);
+    Ic_PutU32LE(x, img->xDpi ? img->xDpi : 72);
+    Ic_PutU32LE(x + 4, 1);
+
+    x = ifd.data + (yresPos - ifdPos);
+    Ic_PutU32LE(x, img->yDpi ? img->yDpi : 72);
+    Ic_PutU32LE(x + 4, 1);
+
+    for (IC_UINT32 i = 0; i < stripCount; ++i) {
+        memcpy(ifd.data + (offsetsPos - ifdPos) + 4 * i, w->stripInfo.data + 8 * i, 4);
+        memcpy(ifd.data + (countsPos - ifdPos) + 4 * i, w->stripInfo.data + 8 * i + 4, 4);
+    }
+
+    bool ok = TiffWriter_Write(w, ifd.data, ifd.size);
+    IcBuffer_Free(&ifd);
+
+    // now that the page is complete, link it into the chain
+    IC_UINT8 link[4];
+    Ic_PutU32LE(link, ifdPos);
+    if (ok && !w->sink->writeAt(w->sink->ctx, w->linkPos, link, sizeof(link))) {
+        w->failed = true;
+        ok = false;
+    }
+
+    w->linkPos = ifdPos + 2 + TIFF_IFD_ENTRIES * 12;
+    w->pageCount++;
+
+    return ok;
+}
+
+bool
+TiffWriter_Finish(TiffWriter *w)
+{
+    IcBuffer_Free(&w->strip);
+    IcBuffer_Free(&w->stripInfo);
+
+    return !w->failed && w->pageCount > 0;
+}
+
+bool
+TiffEncoder_Write(const IcImage *img, TiffCompression compression, IcSink *sink)
+{
+    TiffWriter w;
+    if (!TiffWriter_Begin(&w, sink)) {
+        TiffWriter_Finish(&w);
+        return false;
+    }
+
+    TiffWriter_AddPage(&w, img, compression);
+    return TiffWriter_Finish(&w);
+}
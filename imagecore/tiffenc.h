@@ -0,0 +1,58 @@
+#pragma once
+
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "icimage.h"
+#include "icbuffer.h"
+
+// Baseline TIFF writer for single and multi-page documents.
+//
+// Pages are streamed: each page's strips go out first, followed by its
+// IFD, and only then is the previous IFD linked to the new one. The file
+// is therefore a valid TIFF containing all complete pages at any time,
+// even if the writer is never finished.
+
+enum TiffCompression {
+    TIFF_COMPRESSION_NONE     = 1,
+    TIFF_COMPRESSION_PACKBITS = 32773
+};
+
+struct TiffWriter {
+    IcSink   *sink;
+    IC_UINT64 pos;          // bytes written so far
+    IC_UINT32 linkPos;      // where to store the offset of the next IFD
+    IC_UINT32 pageCount;
+    bool      failed;
+    IcBuffer  strip;        // scratch for the strip being encoded
+    IcBuffer  stripInfo;    // offsets and byte counts of the current page
+};
+
+bool
+TiffWriter_Begin(TiffWriter *w, IcSink *sink);
+
+bool
+TiffWriter_AddPage(TiffWriter *w, const IcImage *img, TiffCompression compression);
+
+// releases scratch memory; returns false if any earlier step failed
+bool
+TiffWriter_Finish(TiffWriter *w);
+
+// single page convenience wrapper
+bool
+TiffEncoder_Write(const IcImage *img, TiffCompression compression, IcSink *sink);
+
+// Appends the PackBits encoding of one row to out.
+bool
+PackBits_Encode(const IC_UINT8 *src, size_t n, IcBuffer *out);
@@ -0,0 +1,188 @@
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "zipwriter.h"
+
+#include <string.h>
+
+enum {
+    ZIP_SIG_LOCAL         = 0x04034b50,
+    ZIP_SIG_CENTRAL       = 0x02014b50,
+    ZIP_SIG_END           = 0x06054b50,
+    ZIP_SIG_END64         = 0x06064b50,
+    ZIP_SIG_END64_LOCATOR = 0x07064b50
+};
+
+enum {
+    ZIP_VERSION       = 20,     // 2.0: deflate, folders
+    ZIP_VERSION_ZIP64 = 45,
+    ZIP_FLAG_UTF8     = 0x0800, // names are UTF-8
+    ZIP_EXTRA_ZIP64   = 0x0001
+};
+
+static bool
+ZipWriter_Write(ZipWriter *w, const void *data, size_t size)
+{
+    if (w->failed || !w->sink->write(w->sink->ctx, data, size)) {
+        w->failed = true;
+        return false;
+    }
+
+    w->pos += size;
+    return true;
+}
+
+static void
+ZipWriter_AppendU64LE(IcBuffer *b, IC_UINT64 v)
+{
+    IcBuffer_AppendU32LE(b, (IC_UINT32)v);
+    IcBuffer_AppendU32LE(b, (IC_UINT32)(v >> 32));
+}
+
+bool
+ZipWriter_Begin(ZipWriter *w, IcSink *sink)
+{
+    w->sink = sink;
+    w->pos = 0;
+    w->entryCount = 0;
+    w->zip64 = false;
+    w->failed = false;
+    IcBuffer_Init(&w->central);
+    return true;
+}
+
+bool
+ZipWriter_AddEntry(ZipWriter *w, const char *name, ZipMethod method,
+                   const void *data, size_t dataSize, IC_UINT32 crc, size_t size,
+                   IC_UINT32 dosDateTime, IC_UINT64 *pDataOffset)
+{
+    size_t nameLength = strlen(name);
+    if (w->failed || nameLength > 0xffff || dataSize >= 0xffffffffu || size >= 0xffffffffu) {
+        w->failed = true;
+        return false;
+    }
+
+    IC_UINT64 headerOffset = w->pos;
+
+    IC_UINT8 local[30];
+    Ic_PutU32LE(local, ZIP_SIG_LOCAL);
+    Ic_PutU16LE(local + 4, ZIP_VERSION);
+    Ic_PutU16LE(local + 6, ZIP_FLAG_UTF8);
+    Ic_PutU16LE(local + 8, (IC_UINT16)method);
+    Ic_PutU32LE(local + 10, dosDateTime);
+    Ic_PutU32LE(local + 14, crc);
+    Ic_PutU32LE(local + 18, (IC_UINT32)dataSize);
+    Ic_PutU32LE(local + 22, (IC_UINT32)size);
+    Ic_PutU16LE(local + 26, (IC_UINT16)nameLength);
+    Ic_PutU16LE(local + 28, 0);
+
+    if (!ZipWriter_Write(w, local, sizeof(local)) || !ZipWriter_Write(w, name, nameLength))
+        return false;
+
+    *pDataOffset = w->pos;
+    if (!ZipWriter_Write(w, data, dataSize))
+        return false;
+
+    // entries beyond 4 GB keep their offset in a ZIP64 extra field
+    bool far = headerOffset >= 0xffffffffu;
+    if (far)
+        w->zip64 = true;
+
+    IcBuffer *c = &w->central;
+    IcBuffer_AppendU32LE(c, ZIP_SIG_CENTRAL);
+    IcBuffer_AppendU16LE(c, far ? ZIP_VERSION_ZIP64 : ZIP_VERSION);  // made by, MS-DOS
+    IcBuffer_AppendU16LE(c, far ? ZIP_VERSION_ZIP64 : ZIP_VERSION);  // needed
+    IcBuffer_AppendU16LE(c, ZIP_FLAG_UTF8);
+    IcBuffer_AppendU16LE(c, (IC_UINT16)method);
+    IcBuffer_AppendU32LE(c, dosDateTime);
+    IcBuffer_AppendU32LE(c, crc);
+    IcBuffer_AppendU32LE(c, (IC_UINT32)dataSize);
+    IcBuffer_AppendU32LE(c, (IC_UINT32)size);
+    IcBuffer_AppendU16LE(c, (IC_UINT16)nameLength);
+    IcBuffer_AppendU16LE(c, far ? 12 : 0);  // extra field
+    IcBuffer_AppendU16LE(c, 0);             // comment
+    IcBuffer_AppendU16LE(c, 0);             // disk
+    IcBuffer_AppendU16LE(c, 0);             // internal attributes
+    IcBuffer_AppendU32LE(c, 0);             // external attributes
+    IcBuffer_AppendU32LE(c, far ? 0xffffffffu : (IC_UINT32)headerOffset);
+    IcBuffer_Append(c, name, nameLength);
+    if (far) {
+        IcBuffer_AppendU16LE(c, ZIP_EXTRA_ZIP64);
+        IcBuffer_AppendU16LE(c, 8);
+        ZipWriter_AppendU64LE(c, headerOffset);
+    }
+
+    if (IcBuffer_Failed(c)) {
+        w->failed = true;
+        return false;
+    }
+
+    w->entryCount++;
+    return true;
+}
+
+bool
+ZipWriter_Finish(ZipWriter *w)
+{
+    IC_UINT64 centralOffset = w->pos;
+    IC_UINT64 centralSize = w->central.size;
+
+    if (!w->failed && w->central.size)
+        ZipWriter_Write(w, w->central.data, w->central.size);
+    IcBuffer_Free(&w->central);
+
+    bool zip64 = w->zip64 || w->entryCount >= 0xffff
+        || centralOffset >= 0xffffffffu || centralSize >= 0xffffffffu;
+
+    IcBuffer end;
+    IcBuffer_Init(&end);
+
+    if (zip64) {
+        IC_UINT64 end64Offset = w->pos;
+
+        IcBuffer_AppendU32LE(&end, ZIP_SIG_END64);
+        ZipWriter_AppendU64LE(&end, 44);  // the rest of the record
+        IcBuffer_AppendU16LE(&end, ZIP_VERSION_ZIP64);
+        IcBuffer_AppendU16LE(&end, ZIP_VERSION_ZIP64);
+        IcBuffer_AppendU32LE(&end, 0);    // this disk
+        IcBuffer_AppendU32LE(&end, 0);    // disk of the central directory
+        ZipWriter_AppendU64LE(&end, w->entryCount);
+        ZipWriter_AppendU64LE(&end, w->entryCount);
+        ZipWriter_AppendU64LE(&end, centralSize);
+        ZipWriter_AppendU64LE(&end, centralOffset);
+
+        IcBuffer_AppendU32LE(&end, ZIP_SIG_END64_LOCATOR);
+        IcBuffer_AppendU32LE(&end, 0);
+        ZipWriter_AppendU64LE(&end, end64Offset);
+        IcBuffer_AppendU32LE(&end, 1);    // disks
+    }
+
+    IC_UINT16 count = zip64 ? 0xffff : (IC_UINT16)w->entryCount;
+    IcBuffer_AppendU32LE(&end, ZIP_SIG_END);
+    IcBuffer_AppendU16LE(&end, 0);
+    IcBuffer_AppendU16LE(&end, 0);
+    IcBuffer_AppendU16LE(&end, count);
+    IcBuffer_AppendU16LE(&end, count);
+    IcBuffer_AppendU32LE(&end, zip64 ? 0xffffffffu : (IC_UINT32)centralSize);
+    IcBuffer_AppendU32LE(&end, zip64 ? 0xffffffffu : (IC_UINT32)centralOffset);
+    IcBuffer_AppendU16LE(&end, 0);        // comment
+
+    if (IcBuffer_Failed(&end))
+        w->failed = true;
+    else
+        ZipWriter_Write(w, end.data, end.size);
+    IcBuffer_Free(&end);
+
+    return !w->failed;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "icbuffer.h"
+
+// Streaming ZIP writer: each entry's local header and data go out as
+// soon as it's added, the central directory when the archive is
+// finished. Local headers carry the sizes and CRC (no data descriptors),
+// so an archive that was never finished can still be salvaged entry by
+// entry, e.g. with zip -FF or 7-Zip. The ZIP64 end records are added
+// once the archive passes 4 GB or 65535 entries; single entries stay
+// below 4 GB.
+//
+// The data is compressed by the caller, see deflate.h, so that can
+// happen on several threads while entries are added one at a time.
+
+enum ZipMethod {
+    ZIP_METHOD_STORE   = 0,
+    ZIP_METHOD_DEFLATE = 8
+};
+
+struct ZipWriter {
+    IcSink   *sink;
+    IC_UINT64 pos;          // bytes written so far
+    IC_UINT64 entryCount;
+    bool      zip64;        // an entry starts beyond 4 GB
+    bool      failed;
+    IcBuffer  central;      // the central directory so far
+};
+
+bool
+ZipWriter_Begin(ZipWriter *w, IcSink *sink);
+
+// Adds an entry whose data is already compressed with the given method.
+// name is UTF-8 with / between folders; crc and size are those of the
+// uncompressed data; dosDateTime is the MS-DOS date in the high word and
+// time in the low one. *pDataOffset is where the data starts.
+bool
+ZipWriter_AddEntry(ZipWriter *w, const char *name, ZipMethod method,
+                   const void *data, size_t dataSize, IC_UINT32 crc, size_t size,
+                   IC_UINT32 dosDateTime, IC_UINT64 *pDataOffset);
+
+// writes the central directory and releases it; returns false if any
+// earlier step failed
+bool
+ZipWriter_Finish(ZipWriter *w);
@@ -0,0 +1,256 @@
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "overflow.h"
+#include "spool.h"
+#include "tracelog.h"
+
+static CRITICAL_SECTION g_lock;
+static BOOL             g_started;
+static HANDLE           g_hFile = INVALID_HANDLE_VALUE;
+static DWORD            g_granularity;  // of view offsets
+static IC_UINT64        g_writeOffset;  // where the next page is parked
+static SIZE_T           g_memoryBytes;  // queued pages in memory
+static UINT             g_parkedCount;
+static BOOL             g_overflowing;  // new pages go to the file
+
+void
+Overflow_Start(void)
+{
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    g_granularity = si.dwAllocationGranularity ? si.dwAllocationGranularity : 64 * 1024;
+
+    InitializeCriticalSection(&g_lock);
+    g_started = TRUE;
+}
+
+void
+Overflow_Stop(void)
+{
+    if (!g_started)
+        return;
+
+    if (g_hFile != INVALID_HANDLE_VALUE) {
+        CloseHandle(g_hFile);
+        g_hFile = INVALID_HANDLE_VALUE;
+    }
+
+    DeleteCriticalSection(&g_lock);
+    g_started = FALSE;
+}
+
+// called with the lock held
+static BOOL
+Overflow_OpenFile(void)
+{
+    if (g_hFile != INVALID_HANDLE_VALUE)
+        return TRUE;
+
+    WCHAR dir[MAX_PATH];
+    WCHAR path[MAX_PATH];
+    if (!GetTempPath(MAX_PATH, dir) || !GetTempFileName(dir, L"tcq", 0, path))
+        return FALSE;
+
+    g_hFile = CreateFile(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                         FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+    if (g_hFile == INVALID_HANDLE_VALUE) {
+        DeleteFile(path);
+        return FALSE;
+    }
+
+    TraceLog_Write(L"overflow: parking queued pages in %s", path);
+    return TRUE;
+}
+
+// Copies between a DIB and its place in the file, one view at a time;
+// the mapping grows the file as needed
+static BOOL
+Overflow_Copy(IC_UINT64 offset, IC_UINT8 *dib, SIZE_T size, BOOL toFile)
+{
+    IC_UINT64 end = offset + size;
+    HANDLE hMap = CreateFileMapping(g_hFile, NULL, PAGE_READWRITE, (DWORD)(end >> 32), (DWORD)end, NULL);
+    if (!hMap)
+        return FALSE;
+
+    BOOL ok = TRUE;
+    for (SIZE_T done = 0; done < size; ) {
+        IC_UINT64 pos = offset + done;
+        IC_UINT64 base = pos - pos % g_granularity;
+        SIZE_T skip = (SIZE_T)(pos - base);
+        SIZE_T n = size - done;
+        if (n > OVERFLOW_VIEW_SIZE - skip)
+            n = OVERFLOW_VIEW_SIZE - skip;
+
+        IC_UINT8 *view = (IC_UINT8 *)MapViewOfFile(hMap, toFile ? FILE_MAP_WRITE : FILE_MAP_READ,
+                                                   (DWORD)(base >> 32), (DWORD)base, skip + n);
+        if (!view) {
+            ok = FALSE;
+            break;
+        }
+
+        if (toFile)
+            CopyMemory(view + skip, dib + done, n);
+        else
+            CopyMemory(dib + done, view + skip, n);
+
+        UnmapViewOfFile(view);
+        done += n;
+    }
+
+    CloseHandle(hMap);
+    return ok;
+}
+
+// a parked page is out of the file again; called with the lock held
+static void
+Overflow_Unpark(void)
+{
+    // the backlog is gone, start over at the front of the file
+    if (--g_parkedCount == 0 && g_overflowing) {
+        g_overflowing = FALSE;
+        g_writeOffset = 0;
+        TraceLog_Write(L"overflow: the queue is back in memory");
+    }
+}
+
+void
+Overflow_Put(OverflowDib *pDib, HGLOBAL hDib)
+{
+    SIZE_T size = GlobalSize(hDib);
+    pDib->hDib = hDib;
+    pDib->offset = 0;
+    pDib->size = size;
+    pDib->spooled = NULL;
+
+    if (!g_started)
+        return;
+
+    EnterCriticalSection(&g_lock);
+
+    if (!g_overflowing && g_memoryBytes + size > OVERFLOW_THRESHOLD && Overflow_OpenFile()) {
+        g_overflowing = TRUE;
+        TraceLog_Write(L"overflow: %lu MB of pages queued, parking the next ones",
+                       (DWORD)(g_memoryBytes / (1024 * 1024)));
+    }
+
+    // each page gets its place up front, so they're copied in parallel
+    BOOL park = g_overflowing;
+    IC_UINT64 offset = g_writeOffset;
+    if (park) {
+        g_writeOffset += size;
+        g_parkedCount++;
+    } else {
+        g_memoryBytes += size;
+    }
+
+    LeaveCriticalSection(&g_lock);
+
+    if (!park)
+        return;
+
+    IC_UINT8 *dib = (IC_UINT8 *)GlobalLock(hDib);
+    BOOL ok = dib && Overflow_Copy(offset, dib, size, TRUE);
+    if (dib)
+        GlobalUnlock(hDib);
+
+    if (ok) {
+        GlobalFree(hDib);
+        pDib->hDib = NULL;
+        pDib->offset = offset;
+        return;
+    }
+
+    // it stays in memory then
+    EnterCriticalSection(&g_lock);
+    g_memoryBytes += size;
+    Overflow_Unpark();
+    LeaveCriticalSection(&g_lock);
+}
+
+HGLOBAL
+Overflow_Take(OverflowDib *pDib)
+{
+    HGLOBAL hDib = pDib->hDib;
+    SIZE_T size = pDib->size;
+    IC_UINT64 offset = pDib->offset;
+    SpoolItem *spooled = pDib->spooled;
+    pDib->hDib = NULL;
+    pDib->size = 0;
+    pDib->spooled = NULL;
+
+    if (!size)
+        return NULL;
+    if (spooled)
+        return Spool_TakePage(spooled);
+
+    if (hDib) {
+        if (g_started) {
+            EnterCriticalSection(&g_lock);
+            g_memoryBytes -= size;
+            LeaveCriticalSection(&g_lock);
+        }
+        return hDib;
+    }
+
+    hDib = GlobalAlloc(GMEM_MOVEABLE, size);
+    IC_UINT8 *dib = hDib ? (IC_UINT8 *)GlobalLock(hDib) : NULL;
+    BOOL ok = dib && Overflow_Copy(offset, dib, size, FALSE);
+    if (dib)
+        GlobalUnlock(hDib);
+    if (!ok && hDib) {
+        GlobalFree(hDib);
+        hDib = NULL;
+    }
+
+    EnterCriticalSection(&g_lock);
+    Overflow_Unpark();
+    LeaveCriticalSection(&g_lock);
+
+    return hDib;
+}
+
+void
+Overflow_Drop(OverflowDib *pDib)
+{
+    if (!pDib->size)
+        return;
+
+    if (pDib->spooled) {
+        Spool_DropPage(pDib->spooled);
+        pDib->spooled = NULL;
+        pDib->size = 0;
+        return;
+    }
+
+    // a parked page doesn't need reading back just to be freed
+    if (!pDib->hDib) {
+        pDib->size = 0;
+        EnterCriticalSection(&g_lock);
+        Overflow_Unpark();
+        LeaveCriticalSection(&g_lock);
+        return;
+    }
+
+    GlobalFree(Overflow_Take(pDib));
+}
+
+void
+Overflow_Move(OverflowDib *pTo, OverflowDib *pFrom)
+{
+    *pTo = *pFrom;
+    pFrom->hDib = NULL;
+    pFrom->size = 0;
+    pFrom->spooled = NULL;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <windows.h>
+#include "imagecore/ictypes.h"
+
+// Keeps the pages queued for the encoders, or waiting in a scan job's
+// reorder buffer for their turn, from filling the address space of the
+// 32-bit build when the encoders or one of the devices fall behind. As
+// long as the queued pages take less than OVERFLOW_THRESHOLD bytes, they
+// stay in memory. Once that's exceeded, each new page is copied into a
+// temporary file through a mapped view and its memory is freed; it's
+// read back when its turn comes. The file is filled front to back, and
+// once the last page parked there is taken out again, the queue is back
+// to memory and the file starts over. Transfers never wait for the
+// encoders either way.
+//
+// The file is in %TEMP%, created on the first page that needs it and
+// deleted when it's closed.
+
+#ifdef _WIN64
+#define OVERFLOW_THRESHOLD (1024 * 1024 * 1024)
+#else
+#define OVERFLOW_THRESHOLD (256 * 1024 * 1024)
+#endif
+
+// pages are copied through views of at most this size, so a huge page
+// doesn't need as much contiguous address space
+#define OVERFLOW_VIEW_SIZE (16 * 1024 * 1024)
+
+struct SpoolItem;
+
+// A queued DIB, in memory, in the overflow file or in the batch's spool
+// (see spool.h); empty if size is 0
+struct OverflowDib {
+    HGLOBAL    hDib;     // NULL while parked in the file
+    IC_UINT64  offset;   // in the file
+    SIZE_T     size;
+    SpoolItem *spooled;  // the spool has it, not counted here
+};
+
+void
+Overflow_Start(void);
+
+// closes the file; every page must have been taken out again
+void
+Overflow_Stop(void);
+
+// Queues hDib, which must be unlocked, and takes ownership of it; the
+// page is parked in the file if the queue is over the threshold. Safe to
+// call from several threads at once.
+void
+Overflow_Put(OverflowDib *pDib, HGLOBAL hDib);
+
+// Takes the page out of the queue, reading it back if it was parked.
+// Returns NULL if it was empty or couldn't be read back (out of memory);
+// pDib is empty afterwards either way.
+HGLOBAL
+Overflow_Take(OverflowDib *pDib);
+
+// takes the page out and frees it
+void
+Overflow_Drop(OverflowDib *pDib);
+
+// Hands a queued page on, it stays counted; pFrom is empty afterwards
+void
+Overflow_Move(OverflowDib *pTo, OverflowDib *pFrom);
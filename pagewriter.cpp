@@ -0,0 +1,1265 @@
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "pagewriter.h"
+
+#include <windows.h>
+#include <gdiplus.h>
+#include "imagecore/dib.h"
+#include "imagecore/imgconv.h"
+#include "imagecore/bmpenc.h"
+#include "imagecore/tiffenc.h"
+#include "imagecore/crc32.h"
+#include "imagecore/deflate.h"
+#include "filewriter.h"
+#include "spool.h"
+#include "overflow.h"
+
+static Gdiplus::ImageCodecInfo *g_gdiplusEncoders;
+static UINT                     g_gdiplusEncoderCount;
+
+static bool
+PageWriter_EncodeTiffPackBits(const IcImage *img, IcSink *sink)
+{
+    return TiffEncoder_Write(img, TIFF_COMPRESSION_PACKBITS, sink);
+}
+
+// Encoders from the portable imaging core, listed after the GDI+ ones
+static const struct {
+    const WCHAR *description;
+    const WCHAR *extension;
+    bool (*encode)(const IcImage *img, IcSink *sink); // NULL for multi-page
+} g_builtinEncoders[] = {
+    { L"TIFF, PackBits (built-in)", L"*.TIF;*.TIFF", PageWriter_EncodeTiffPackBits },
+    { L"Multi-page TIFF, PackBits (built-in)", L"*.TIF;*.TIFF", NULL },
+    { L"BMP (built-in)", L"*.BMP", BmpEncoder_Write }
+};
+
+// blank back sides may have this much ink, in 1/10000 of the page
+#define PAGEWRITER_BLANK_MAX_INK 20
+
+// names CreateFile() may find taken before PageWriter_ClaimFile() gives up
+#define PAGEWRITER_MAX_CLAIM_ATTEMPTS 10000
+
+struct PageWriterQueuedPage {
+    PageWriterQueuedPage *next;
+    OverflowDib           front;   // empty: the document ends here
+    OverflowDib           back;    // of a duplex sheet, or empty
+    BOOL                  ready;   // the back side is prepared
+    PageWriterPageInfo    info;
+    PageWriterPageInfo    backInfo;
+};
+
+// One line of the manifest, see PageWriterBatch
+struct PageWriterRecord {
+    const WCHAR              *kind;
+    const WCHAR              *path;
+    UINT                      number;
+    IC_UINT64                 offset;
+    IC_UINT64                 size;
+    UINT                      width;   // 0 for documents
+    UINT                      height;
+    UINT                      xDpi;
+    UINT                      yDpi;
+    BOOL                      hasCrc;
+    IC_UINT32                 crc;
+    const PageWriterPageInfo *info;    // NULL for documents
+    DWORD                     writeStart;
+    const WCHAR              *entry;   // name in the archive, or NULL
+    const WCHAR              *compression;
+};
+
+static const UINT g_builtinEncoderCount = sizeof(g_builtinEncoders) / sizeof(g_builtinEncoders[0]);
+
+BOOL
+PageWriter_Initialize(void)
+{
+    // without the I/O thread, files are written one chunk at a time
+    FileWriter_Start();
+    Overflow_Start();
+
+    UINT bytesize = 0;
+    Gdiplus::GetImageEncodersSize(&g_gdiplusEncoderCount, &bytesize);
+    g_gdiplusEncoders = (Gdiplus::ImageCodecInfo *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, bytesize);
+    if (!g_gdiplusEncoders) {
+        g_gdiplusEncoderCount = 0;
+        return FALSE;
+    }
+
+    return Gdiplus::GetImageEncoders(g_gdiplusEncoderCount, bytesize, g_gdiplusEncoders) == Gdiplus::Ok;
+}
+
+void
+PageWriter_Teardown(void)
+{
+    FileWriter_Stop();
+    Overflow_Stop();
+
+    HeapFree(GetProcessHeap(), 0, g_gdiplusEncoders);
+    g_gdiplusEncoders = NULL;
+    g_gdiplusEncoderCount = 0;
+}
+
+UINT
+PageWriter_FormatCount(void)
+{
+    return g_gdiplusEncoderCount + g_builtinEncoderCount;
+}
+
+const WCHAR *
+PageWriter_FormatDescription(UINT format)
+{
+    if (format < g_gdiplusEncoderCount)
+        return g_gdiplusEncoders[format].FormatDescription;
+
+    if (format - g_gdiplusEncoderCount < g_builtinEncoderCount)
+        return g_builtinEncoders[format - g_gdiplusEncoderCount].description;
+
+    return L"";
+}
+
+static void
+PageWriter_CopyFileExtension(WCHAR *buf, SIZE_T bufsize, const WCHAR *s)
+{
+    while (*s == '*' || *s == '.')
+        ++s;
+
+    while (*s && *s != ';' && bufsize > 1) {
+        *buf++ = (WCHAR)(DWORD_PTR)CharLowerW((WCHAR *)(DWORD_PTR)*s++);
+        bufsize--;
+    }
+
+    *buf = 0;
+}
+
+static const WCHAR *
+PageWriter_FormatExtension(UINT format)
+{
+    if (format < g_gdiplusEncoderCount)
+        return g_gdiplusEncoders[format].FilenameExtension;
+
+    return g_builtinEncoders[format - g_gdiplusEncoderCount].extension;
+}
+
+BOOL
+PageWriter_FindFormat(const WCHAR *name, UINT *pFormat)
+{
+    UINT count = PageWriter_FormatCount();
+
+    // an index
+    UINT index = 0;
+    const WCHAR *p = name;
+    while (*p >= '0' && *p <= '9')
+        index = index * 10 + (UINT)(*p++ - '0');
+    if (p != name && !*p && index < count) {
+        *pFormat = index;
+        return TRUE;
+    }
+
+    for (UINT i = 0; i < count; ++i) {
+        if (lstrcmpi(PageWriter_FormatDescription(i), name) == 0) {
+            *pFormat = i;
+            return TRUE;
+        }
+    }
+
+    WCHAR wanted[32];
+    PageWriter_CopyFileExtension(wanted, sizeof(wanted)/sizeof(wanted[0]), name);
+
+    for (UINT i = 0; i < count; ++i) {
+        WCHAR ext[32];
+        PageWriter_CopyFileExtension(ext, sizeof(ext)/sizeof(ext[0]), PageWriter_FormatExtension(i));
+        if (lstrcmp(ext, wanted) == 0) {
+            *pFormat = i;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+// called with archiveLock held
+static BOOL
+PageWriter_OpenArchive(PageWriterBatch *pBatch)
+{
+    if (pBatch->archiveFile.hFile != INVALID_HANDLE_VALUE)
+        return TRUE;
+    if (pBatch->archiveFailed)
+        return FALSE;
+
+    // another batch may have started in the same second
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+    for (UINT suffix = 1; hFile == INVALID_HANDLE_VALUE && suffix < 100; ++suffix) {
+        int len = wsprintf(pBatch->archivePath, L"%s\\%s-%s", pBatch->settings.folder,
+                           pBatch->settings.filename, pBatch->batchId);
+        wsprintf(pBatch->archivePath + len, suffix > 1 ? L"-%u.zip" : L".zip", suffix);
+
+        hFile = CreateFile(pBatch->archivePath, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_NEW,
+                           FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
+        if (hFile == INVALID_HANDLE_VALUE && GetLastError() != ERROR_FILE_EXISTS)
+            break;
+    }
+
+    if (hFile == INVALID_HANDLE_VALUE || !FileWriter_Open(&pBatch->archiveFile, hFile, 0)) {
+        if (hFile != INVALID_HANDLE_VALUE) {
+            CloseHandle(hFile);
+            DeleteFile(pBatch->archivePath);
+        }
+        pBatch->archiveFailed = TRUE;
+        return FALSE;
+    }
+
+    pBatch->archiveStart = GetTickCount();
+    return ZipWriter_Begin(&pBatch->archiveWriter, &pBatch->archiveFile.sink);
+}
+
+// Adds a page to the batch's archive, opening it on the first one. The
+// page is deflated before the lock is taken, so the workers do that in
+// parallel; entries go in one at a time, in the order they're done.
+static BOOL
+PageWriter_AddArchiveEntry(PageWriterBatch *pBatch, const PageWriterFile *pFile, const void *data, size_t size,
+                           PageWriterRecord *r)
+{
+    char name[3 * 1024];
+    if (!WideCharToMultiByte(CP_UTF8, 0, pFile->path, -1, name, sizeof(name), NULL, NULL))
+        return FALSE;
+
+    IC_UINT32 crc = Crc32_Update(0, data, size);
+
+    IcBuffer packed;
+    IcBuffer_Init(&packed);
+    ZipMethod method = ZIP_METHOD_STORE;
+    const void *stored = data;
+    size_t storedSize = size;
+    if (pBatch->settings.archive == PAGEWRITER_ARCHIVE_DEFLATE
+        && Deflate_Compress(data, size, &packed) && packed.size < size) {
+        method = ZIP_METHOD_DEFLATE;
+        stored = packed.data;
+        storedSize = packed.size;
+    }
+
+    SYSTEMTIME now;
+    FILETIME ft;
+    WORD dosDate = 0, dosTime = 0;
+    GetLocalTime(&now);
+    if (SystemTimeToFileTime(&now, &ft))
+        FileTimeToDosDateTime(&ft, &dosDate, &dosTime);
+
+    IC_UINT64 offset = 0;
+    EnterCriticalSection(&pBatch->archiveLock);
+    BOOL ok = PageWriter_OpenArchive(pBatch)
+        && ZipWriter_AddEntry(&pBatch->archiveWriter, name, method, stored, storedSize, crc, size,
+                              ((IC_UINT32)dosDate << 16) | dosTime, &offset);
+    LeaveCriticalSection(&pBatch->archiveLock);
+
+    // the manifest describes the bytes as they are in the archive
+    r->offset = offset;
+    r->size = storedSize;
+    r->crc = method == ZIP_METHOD_STORE || !pBatch->settings.manifest ? crc : Crc32_Update(0, stored, storedSize);
+    r->compression = method == ZIP_METHOD_STORE ? L"store" : L"deflate";
+
+    IcBuffer_Free(&packed);
+    return ok;
+}
+
+// Writes a whole encoded page: into its own file through a FileWriter,
+// closing pFile's handle unless it couldn't be taken over, or into the
+// batch's archive. Fills in the size and checksum for the manifest.
+static BOOL
+PageWriter_WriteFileData(PageWriterBatch *pBatch, PageWriterFile *pFile, const void *data, size_t size,
+                         PageWriterRecord *r)
+{
+    if (pFile->entry)
+        return PageWriter_AddArchiveEntry(pBatch, pFile, data, size, r);
+
+    r->size = size;
+    if (pBatch->settings.manifest)
+        r->crc = Crc32_Update(0, data, size);
+
+    FileWriter writer;
+    if (!FileWriter_Open(&writer, pFile->hFile, size))
+        return FALSE;
+    pFile->hFile = INVALID_HANDLE_VALUE;
+
+    BOOL ok = FileWriter_Write(&writer, data, size);
+    return FileWriter_Close(&writer) && ok;
+}
+
+// Encodes into memory first, so the size is known before the file is written
+static BOOL
+PageWriter_WriteBuiltinImage(PageWriterBatch *pBatch, PageWriterFile *pFile, UINT builtinIndex,
+                             const DibInfo *dib, PageWriterRecord *r)
+{
+    IcImage img;
+    if (!Dib_ToImage(dib, &img))
+        return FALSE;
+
+    IcBuffer buf;
+    IcSink sink;
+    IcBuffer_Init(&buf);
+    IcBuffer_InitSink(&buf, &sink);
+
+    BOOL ok = g_builtinEncoders[builtinIndex].encode(&img, &sink);
+    IcImage_Free(&img);
+
+    if (ok)
+        ok = PageWriter_WriteFileData(pBatch, pFile, buf.data, buf.size, r);
+
+    IcBuffer_Free(&buf);
+    return ok;
+}
+
+// The same for GDI+, which encodes into a stream on an HGLOBAL instead
+// of opening the file again by its name
+static BOOL
+PageWriter_WriteGdiplusImage(PageWriterBatch *pBatch, PageWriterFile *pFile, UINT format,
+                             const void *dibBuf, const DibInfo *dib, PageWriterRecord *r, const WCHAR **pError)
+{
+    Gdiplus::Bitmap bitmap((const BITMAPINFO *)dibBuf, (void *)dib->bits);
+    if (bitmap.GetLastStatus() != Gdiplus::Ok) {
+        *pError = L"failed to create GDI+ bitmap";
+        return FALSE;
+    }
+
+    IStream *stream = NULL;
+    if (FAILED(CreateStreamOnHGlobal(NULL, TRUE, &stream))) {
+        *pError = L"Out of memory";
+        return FALSE;
+    }
+
+    CLSID formatClsid = g_gdiplusEncoders[format].Clsid;
+    STATSTG stat;
+    HGLOBAL hData = NULL;
+    BOOL ok = bitmap.Save(stream, &formatClsid, NULL) == Gdiplus::Ok
+        && SUCCEEDED(stream->Stat(&stat, STATFLAG_NONAME))
+        && SUCCEEDED(GetHGlobalFromStream(stream, &hData))
+        && stat.cbSize.QuadPart <= GlobalSize(hData);
+
+    const void *data = ok ? GlobalLock(hData) : NULL;
+    if (data) {
+        ok = PageWriter_WriteFileData(pBatch, pFile, data, (size_t)stat.cbSize.QuadPart, r);
+        GlobalUnlock(hData);
+    } else {
+        ok = FALSE;
+    }
+
+    stream->Release();
+
+    if (!ok)
+        *pError = L"failed to save file";
+    return ok;
+}
+
+// the number of a name like <filename><digits>[b].<ext>, as we write them
+static BOOL
+PageWriter_ParseNumber(const PageWriterBatch *pBatch, const WCHAR *name, IC_UINT32 *pNumber)
+{
+    int prefixLength = lstrlen(pBatch->settings.filename);
+    if (lstrlen(name) <= prefixLength
+        || CompareString(LOCALE_SYSTEM_DEFAULT, NORM_IGNORECASE, name, prefixLength,
+                         pBatch->settings.filename, prefixLength) != CSTR_EQUAL)
+        return FALSE;
+
+    const WCHAR *p = name + prefixLength;
+    IC_UINT32 number = 0;
+    UINT digits = 0;
+    for (; *p >= '0' && *p <= '9'; ++p, ++digits) {
+        number = number * 10 + (IC_UINT32)(*p - '0');
+        if (number > PAGEWRITER_MAX_NUMBER)
+            return FALSE;
+    }
+
+    if (*p == 'b' || *p == 'B')
+        ++p;
+
+    if (digits < 4 || *p != '.' || lstrcmpi(p + 1, pBatch->ext) != 0)
+        return FALSE;
+
+    *pNumber = number;
+    return TRUE;
+}
+
+// Writes a number the way the manifest has it: decimal, or - if unknown
+static WCHAR *
+PageWriter_FormatField(WCHAR *p, IC_UINT64 value, BOOL known)
+{
+    *p++ = '\t';
+    if (!known) {
+        *p++ = '-';
+        return p;
+    }
+
+    WCHAR digits[24];
+    int n = 0;
+    do {
+        digits[n++] = (WCHAR)('0' + (int)(value % 10));
+        value /= 10;
+    } while (value);
+
+    while (n)
+        *p++ = digits[--n];
+    return p;
+}
+
+// Size and CRC-32 of a finished document, which was patched while it
+// grew; the data is still cached
+static BOOL
+PageWriter_ChecksumFile(const WCHAR *path, IC_UINT64 *pSize, IC_UINT32 *pCrc)
+{
+    HANDLE hFile = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                              FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    const DWORD bufSize = 64 * 1024;
+    void *buf = HeapAlloc(GetProcessHeap(), 0, bufSize);
+
+    BOOL ok = buf != NULL;
+    IC_UINT64 size = 0;
+    IC_UINT32 crc = 0;
+    DWORD got = 0;
+    while (ok && (ok = ReadFile(hFile, buf, bufSize, &got, NULL)) && got) {
+        crc = Crc32_Update(crc, buf, got);
+        size += got;
+    }
+
+    if (buf)
+        HeapFree(GetProcessHeap(), 0, buf);
+    CloseHandle(hFile);
+
+    *pSize = size;
+    *pCrc = crc;
+    return ok;
+}
+
+// Appends a line to the batch's manifest, creating it on the first one.
+// Without a manifest, does nothing.
+static void
+PageWriter_RecordPage(PageWriterBatch *pBatch, const PageWriterRecord *r)
+{
+    if (!pBatch->settings.manifest)
+        return;
+
+    const WCHAR *relative = r->path;
+    int folderLength = lstrlen(pBatch->settings.folder);
+    if (CompareString(LOCALE_SYSTEM_DEFAULT, NORM_IGNORECASE, r->path, folderLength,
+                      pBatch->settings.folder, folderLength) == CSTR_EQUAL
+        && r->path[folderLength] == '\\')
+        relative = r->path + folderLength + 1;
+
+    const PageWriterPageInfo *info = r->info;
+    BOOL isPage = info != NULL;
+    DWORD now = GetTickCount();
+
+    // wsprintf() stops at 1024 characters, so the line is put together piecewise
+    WCHAR line[3072];
+    WCHAR *p = line + wsprintf(line, L"%s", r->kind);
+    p = PageWriter_FormatField(p, r->number, TRUE);
+    p += wsprintf(p, L"\t%s", relative);
+    p = PageWriter_FormatField(p, r->offset, TRUE);
+    p = PageWriter_FormatField(p, r->size, TRUE);
+    p = PageWriter_FormatField(p, r->width, isPage);
+    p = PageWriter_FormatField(p, r->height, isPage);
+    p = PageWriter_FormatField(p, r->xDpi, isPage && r->xDpi);
+    p = PageWriter_FormatField(p, r->yDpi, isPage && r->yDpi);
+    p += wsprintf(p, L"\t%s", pBatch->ext);
+    if (r->hasCrc)
+        p += wsprintf(p, L"\t%08x", r->crc);
+    else
+        p = PageWriter_FormatField(p, 0, FALSE);
+
+    *p++ = '\t';
+    if (isPage) {
+        WCHAR source[34];
+        if (!MultiByteToWideChar(CP_ACP, 0, info->source, -1, source, sizeof(source)/sizeof(source[0])))
+            source[0] = 0;
+        for (WCHAR *c = source; *c; ++c) {
+            if (*c == '\t' || *c == '\r' || *c == '\n')
+                *c = ' ';
+        }
+        p += wsprintf(p, L"%s", source);
+    } else {
+        *p++ = '-';
+    }
+
+    p = PageWriter_FormatField(p, isPage ? info->device : 0, isPage);
+    p = PageWriter_FormatField(p, isPage ? info->transferEnd - info->transferStart : 0, isPage);
+    p = PageWriter_FormatField(p, isPage ? r->writeStart - info->transferEnd : 0, isPage);
+    p = PageWriter_FormatField(p, now - r->writeStart, TRUE);
+
+    SYSTEMTIME st;
+    GetLocalTime(&st);
+    p += wsprintf(p, L"\t%04u-%02u-%02uT%02u:%02u:%02u.%03u\t%s\t%s\r\n",
+                  st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond, st.wMilliseconds,
+                  r->entry ? r->entry : L"-", r->compression ? r->compression : L"-");
+
+    char mb[9300];
+    int mblen = WideCharToMultiByte(CP_UTF8, 0, line, (int)(p - line), mb, sizeof(mb), NULL, NULL);
+    if (mblen <= 0)
+        return;
+
+    EnterCriticalSection(&pBatch->manifestLock);
+
+    // another batch may have started in the same second
+    for (UINT suffix = 1; pBatch->hManifest == INVALID_HANDLE_VALUE && suffix < 100; ++suffix) {
+        WCHAR manifestPath[MAX_PATH + 300];
+        int len = wsprintf(manifestPath, L"%s\\%s-%s", pBatch->settings.folder,
+                           pBatch->settings.filename, pBatch->batchId);
+        wsprintf(manifestPath + len, suffix > 1 ? L"-%u.manifest" : L".manifest", suffix);
+
+        pBatch->hManifest = CreateFile(manifestPath, GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                                       CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (pBatch->hManifest == INVALID_HANDLE_VALUE) {
+            if (GetLastError() != ERROR_FILE_EXISTS)
+                break;
+            continue;
+        }
+
+        static const char header[] =
+            "kind\tnumber\tpath\toffset\tsize\twidth\theight\txdpi\tydpi\tformat\tcrc32"
+            "\tsource\tdevice\ttransfer_ms\twait_ms\twrite_ms\ttime\tentry\tcompression\r\n";
+        DWORD written = 0;
+        WriteFile(pBatch->hManifest, header, sizeof(header) - 1, &written, NULL);
+    }
+
+    DWORD written = 0;
+    if (pBatch->hManifest != INVALID_HANDLE_VALUE)
+        WriteFile(pBatch->hManifest, mb, (DWORD)mblen, &written, NULL);
+
+    LeaveCriticalSection(&pBatch->manifestLock);
+}
+
+// The folder the file with this number goes to
+static void
+PageWriter_ShardDir(const PageWriterBatch *pBatch, UINT number, WCHAR *dir)
+{
+    const PageWriterSettings *s = &pBatch->settings;
+    SYSTEMTIME now;
+
+    switch (s->shard) {
+    case PAGEWRITER_SHARD_DATE:
+        GetLocalTime(&now);
+        wsprintf(dir, L"%s\\%04u-%02u-%02u", s->folder, now.wYear, now.wMonth, now.wDay);
+        break;
+    case PAGEWRITER_SHARD_BATCH:
+        wsprintf(dir, L"%s\\%s", s->folder, pBatch->batchId);
+        break;
+    case PAGEWRITER_SHARD_COUNT:
+        wsprintf(dir, L"%s\\%04u", s->folder, number / s->shardSize);
+        break;
+    default:
+        lstrcpy(dir, s->folder);
+        break;
+    }
+}
+
+// Lists the numbers taken in dir, replacing the previous folder's: the
+// counter only moves forward, so those aren't needed anymore. Creates
+// the folder, and for PAGEWRITER_SHARD_COUNT the next one too, so
+// moving on to it later is quick. Called with nameLock held.
+static void
+PageWriter_ListFolder(PageWriterBatch *pBatch, const WCHAR *dir, UINT number)
+{
+    NumberSet_Free(&pBatch->usedNumbers);
+    NumberSet_Init(&pBatch->usedNumbers);
+    lstrcpy(pBatch->listedDir, dir);
+
+    if (pBatch->settings.shard != PAGEWRITER_SHARD_NONE) {
+        CreateDirectory(dir, NULL);
+
+        if (pBatch->settings.shard == PAGEWRITER_SHARD_COUNT) {
+            UINT shardSize = pBatch->settings.shardSize;
+            UINT next = (number / shardSize + 1) * shardSize;
+            if (next > number && next <= PAGEWRITER_MAX_NUMBER) {
+                WCHAR nextDir[MAX_PATH + 32];
+                PageWriter_ShardDir(pBatch, next, nextDir);
+                CreateDirectory(nextDir, NULL);
+            }
+        }
+    }
+
+    WCHAR pattern[1024];
+    wsprintf(pattern, L"%s\\%s*.%s", dir, pBatch->settings.filename, pBatch->ext);
+
+    WIN32_FIND_DATA fd;
+    HANDLE hFind = FindFirstFile(pattern, &fd);
+    if (hFind != INVALID_HANDLE_VALUE) {
+        do {
+            IC_UINT32 found;
+            if (PageWriter_ParseNumber(pBatch, fd.cFileName, &found) && !NumberSet_Add(&pBatch->usedNumbers, found))
+                break; // the rest is left to CREATE_NEW
+        } while (FindNextFile(hFind, &fd));
+        FindClose(hFind);
+    }
+
+    NumberSet_Seal(&pBatch->usedNumbers);
+}
+
+// Lists the first folder once per batch, while the scanner starts up;
+// on a network share, probing name after name would cost a round trip each
+static DWORD WINAPI
+PageWriter_ListUsedNumbers(LPVOID param)
+{
+    PageWriterBatch *pBatch = (PageWriterBatch *)param;
+
+    EnterCriticalSection(&pBatch->nameLock);
+    UINT number = PageWriter_NextCounter(pBatch);
+    WCHAR dir[MAX_PATH + 32];
+    PageWriter_ShardDir(pBatch, number, dir);
+    PageWriter_ListFolder(pBatch, dir, number);
+    LeaveCriticalSection(&pBatch->nameLock);
+
+    SetEvent(pBatch->hUsedListed);
+
+    PageWriter_ReleaseBatch(pBatch);
+    return 0;
+}
+
+// YYYYMMDD-HHMMSS, with -2, -3, ... if a batch folder of that name exists
+static void
+PageWriter_MakeBatchId(PageWriterBatch *pBatch)
+{
+    SYSTEMTIME now;
+    GetLocalTime(&now);
+
+    WCHAR base[16];
+    wsprintf(base, L"%04u%02u%02u-%02u%02u%02u",
+             now.wYear, now.wMonth, now.wDay, now.wHour, now.wMinute, now.wSecond);
+    lstrcpy(pBatch->batchId, base);
+
+    // an archive has its folders inside
+    if (pBatch->settings.shard != PAGEWRITER_SHARD_BATCH || pBatch->settings.archive)
+        return;
+
+    for (UINT suffix = 2; suffix < 1000; ++suffix) {
+        WCHAR dir[MAX_PATH + 32];
+        PageWriter_ShardDir(pBatch, 0, dir);
+        if (CreateDirectory(dir, NULL) || GetLastError() != ERROR_ALREADY_EXISTS)
+            break; // other errors show up when claiming the first file
+
+        wsprintf(pBatch->batchId, L"%s-%u", base, suffix);
+    }
+}
+
+PageWriterBatch *
+PageWriter_CreateBatch(const PageWriterSettings *pSettings)
+{
+    UINT format = pSettings->format;
+    if (format >= PageWriter_FormatCount())
+        return NULL;
+
+    PageWriterBatch *pBatch = (PageWriterBatch *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(*pBatch));
+    if (!pBatch)
+        return NULL;
+
+    pBatch->settings = *pSettings;
+    if (pBatch->settings.shard == PAGEWRITER_SHARD_COUNT && !pBatch->settings.shardSize)
+        pBatch->settings.shard = PAGEWRITER_SHARD_NONE;
+    // a multi-page document is one file already
+    if (PageWriter_IsMultiPage(pBatch))
+        pBatch->settings.archive = PAGEWRITER_ARCHIVE_NONE;
+    pBatch->refCount = 1;
+    pBatch->nextCounter = (LONG)(pSettings->counter % (PAGEWRITER_MAX_NUMBER + 1));
+    pBatch->docFile.hFile = INVALID_HANDLE_VALUE;
+    pBatch->hManifest = INVALID_HANDLE_VALUE;
+    InitializeCriticalSection(&pBatch->docLock);
+    InitializeCriticalSection(&pBatch->nameLock);
+    InitializeCriticalSection(&pBatch->manifestLock);
+    NumberSet_Init(&pBatch->usedNumbers);
+    NumberSet_Init(&pBatch->docSpoolIds);
+    InitializeCriticalSection(&pBatch->archiveLock);
+    pBatch->archiveFile.hFile = INVALID_HANDLE_VALUE;
+    NumberSet_Init(&pBatch->archiveSpoolIds);
+    PageWriter_MakeBatchId(pBatch);
+
+    if (pBatch->settings.spool)
+        pBatch->spool = Spool_Create(&pBatch->settings, pBatch->batchId);
+
+    BOOL builtin = format >= g_gdiplusEncoderCount;
+    PageWriter_CopyFileExtension(pBatch->ext, sizeof(pBatch->ext)/sizeof(pBatch->ext[0]),
+                                 builtin ? g_builtinEncoders[format - g_gdiplusEncoderCount].extension
+                                         : g_gdiplusEncoders[format].FilenameExtension);
+
+    // an archive has no names taken but its own
+    if (pBatch->settings.archive)
+        return pBatch;
+
+    // without the listing, every name is probed with CreateFile()
+    pBatch->hUsedListed = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (pBatch->hUsedListed) {
+        PageWriter_AddRefBatch(pBatch);
+        HANDLE hThread = CreateThread(NULL, 0, PageWriter_ListUsedNumbers, pBatch, 0, NULL);
+        if (hThread) {
+            CloseHandle(hThread);
+        } else {
+            NumberSet_Seal(&pBatch->usedNumbers);
+            SetEvent(pBatch->hUsedListed);
+            InterlockedDecrement(&pBatch->refCount);
+        }
+    }
+
+    return pBatch;
+}
+
+void
+PageWriter_AddRefBatch(PageWriterBatch *pBatch)
+{
+    InterlockedIncrement(&pBatch->refCount);
+}
+
+static void
+PageWriter_CloseDocument(PageWriterBatch *pBatch)
+{
+    if (pBatch->docFile.hFile == INVALID_HANDLE_VALUE)
+        return;
+
+    BOOL ok = TiffWriter_Finish(&pBatch->docWriter);
+    if (!FileWriter_Close(&pBatch->docFile))
+        ok = FALSE;
+
+    // its pages are safe now, unless it failed
+    if (ok) {
+        for (size_t i = 0; i < pBatch->docSpoolIds.count; ++i)
+            Spool_MarkDone(pBatch->spool, pBatch->docSpoolIds.items[i]);
+    }
+    NumberSet_Free(&pBatch->docSpoolIds);
+    NumberSet_Init(&pBatch->docSpoolIds);
+
+    // the pages have their own lines already, this one has the checksum
+    PageWriterRecord r;
+    ZeroMemory(&r, sizeof(r));
+    if (ok && pBatch->settings.manifest
+        && PageWriter_ChecksumFile(pBatch->docPath, &r.size, &r.crc)) {
+        r.kind = L"document";
+        r.path = pBatch->docPath;
+        r.number = pBatch->docNumber;
+        r.hasCrc = TRUE;
+        r.writeStart = pBatch->docStart;
+        PageWriter_RecordPage(pBatch, &r);
+    }
+}
+
+static void
+PageWriter_CloseArchive(PageWriterBatch *pBatch)
+{
+    if (pBatch->archiveFile.hFile == INVALID_HANDLE_VALUE)
+        return;
+
+    BOOL ok = ZipWriter_Finish(&pBatch->archiveWriter);
+    if (!FileWriter_Close(&pBatch->archiveFile))
+        ok = FALSE;
+
+    // even without the central directory, the entries can be salvaged;
+    // the spool lets go of them only now
+    if (ok) {
+        for (size_t i = 0; i < pBatch->archiveSpoolIds.count; ++i)
+            Spool_MarkDone(pBatch->spool, pBatch->archiveSpoolIds.items[i]);
+    }
+
+    PageWriterRecord r;
+    ZeroMemory(&r, sizeof(r));
+    if (ok && pBatch->settings.manifest
+        && PageWriter_ChecksumFile(pBatch->archivePath, &r.size, &r.crc)) {
+        r.kind = L"archive";
+        r.path = pBatch->archivePath;
+        r.hasCrc = TRUE;
+        r.writeStart = pBatch->archiveStart;
+        PageWriter_RecordPage(pBatch, &r);
+    }
+}
+
+void
+PageWriter_ReleaseBatch(PageWriterBatch *pBatch)
+{
+    if (!pBatch || InterlockedDecrement(&pBatch->refCount) != 0)
+        return;
+
+    // pages nobody drained anymore, e.g. when the pool was stopped
+    while (pBatch->docQueueHead) {
+        PageWriterQueuedPage *page = pBatch->docQueueHead;
+        pBatch->docQueueHead = page->next;
+        Overflow_Drop(&page->front);
+        Overflow_Drop(&page->back);
+        HeapFree(GetProcessHeap(), 0, page);
+    }
+
+    PageWriter_CloseDocument(pBatch);
+    PageWriter_CloseArchive(pBatch);
+    Spool_Close(pBatch->spool);
+    DeleteCriticalSection(&pBatch->docLock);
+    DeleteCriticalSection(&pBatch->archiveLock);
+    DeleteCriticalSection(&pBatch->nameLock);
+    if (pBatch->hManifest != INVALID_HANDLE_VALUE) {
+        // the batch is over, downstream may take the manifest as final
+        FlushFileBuffers(pBatch->hManifest);
+        CloseHandle(pBatch->hManifest);
+    }
+    DeleteCriticalSection(&pBatch->manifestLock);
+    if (pBatch->hUsedListed)
+        CloseHandle(pBatch->hUsedListed);
+    NumberSet_Free(&pBatch->usedNumbers);
+    NumberSet_Free(&pBatch->docSpoolIds);
+    NumberSet_Free(&pBatch->archiveSpoolIds);
+    HeapFree(GetProcessHeap(), 0, pBatch);
+}
+
+UINT
+PageWriter_NextCounter(const PageWriterBatch *pBatch)
+{
+    return (UINT)pBatch->nextCounter % (PAGEWRITER_MAX_NUMBER + 1);
+}
+
+// In an archive, the batch's own names are the only ones: the next number it is
+static BOOL
+PageWriter_ClaimEntry(PageWriterBatch *pBatch, PageWriterFile *pFile)
+{
+    UINT counter = (UINT)(InterlockedIncrement(&pBatch->nextCounter) - 1) % (PAGEWRITER_MAX_NUMBER + 1);
+    InterlockedCompareExchange(&pBatch->nextCounter, 0, (LONG)PAGEWRITER_MAX_NUMBER + 1);
+
+    // shard folders become folders in the archive
+    WCHAR dir[MAX_PATH + 32];
+    PageWriter_ShardDir(pBatch, counter, dir);
+    const WCHAR *sub = dir + lstrlen(pBatch->settings.folder);
+    if (*sub == '\\')
+        ++sub;
+
+    wsprintf(pFile->path, *sub ? L"%s/%s%04u.%s" : L"%s%s%04u.%s",
+             sub, pBatch->settings.filename, counter, pBatch->ext);
+    pFile->hFile = INVALID_HANDLE_VALUE;
+    pFile->number = counter;
+    pFile->entry = TRUE;
+    return TRUE;
+}
+
+BOOL
+PageWriter_ClaimFile(PageWriterBatch *pBatch, PageWriterFile *pFile, const WCHAR **pError)
+{
+    if (pBatch->settings.archive)
+        return PageWriter_ClaimEntry(pBatch, pFile);
+
+    pFile->entry = FALSE;
+    if (pBatch->hUsedListed)
+        WaitForSingleObject(pBatch->hUsedListed, INFINITE);
+
+    EnterCriticalSection(&pBatch->nameLock);
+
+    // numbers found in the folder are skipped without asking it again;
+    // names other programs create meanwhile cost one attempt each
+    BOOL ok = FALSE;
+    size_t skipped = 0;
+    for (UINT attempt = 0; attempt < PAGEWRITER_MAX_CLAIM_ATTEMPTS; ) {
+        UINT counter = (UINT)(InterlockedIncrement(&pBatch->nextCounter) - 1) % (PAGEWRITER_MAX_NUMBER + 1);
+
+        // wrap around like an odometer
+        InterlockedCompareExchange(&pBatch->nextCounter, 0, (LONG)PAGEWRITER_MAX_NUMBER + 1);
+
+        WCHAR dir[MAX_PATH + 32];
+        PageWriter_ShardDir(pBatch, counter, dir);
+        if (lstrcmpi(dir, pBatch->listedDir) != 0) {
+            PageWriter_ListFolder(pBatch, dir, counter);
+            skipped = 0;
+        }
+
+        if (NumberSet_Contains(&pBatch->usedNumbers, counter)) {
+            if (++skipped > pBatch->usedNumbers.count)
+                break; // every number is taken
+            continue;
+        }
+        ++attempt;
+
+        wsprintf(pFile->path, L"%s\\%s%04u.%s", dir, pBatch->settings.filename, counter, pBatch->ext);
+
+        // create with CREATE_NEW to claim the name; the page is written to
+        // the handle later, see PageWriter_WriteFileData()
+        pFile->hFile = CreateFile(pFile->path, GENERIC_WRITE, 0, NULL, CREATE_NEW,
+                                  FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
+        if (pFile->hFile && pFile->hFile != INVALID_HANDLE_VALUE) {
+            pFile->number = counter;
+            ok = TRUE;
+            break;
+        }
+
+        if (GetLastError() != ERROR_FILE_EXISTS)
+            break;
+    }
+
+    LeaveCriticalSection(&pBatch->nameLock);
+
+    if (!ok) {
+        pFile->hFile = INVALID_HANDLE_VALUE;
+        *pError = L"Failed to open file";
+    }
+
+    return ok;
+}
+
+BOOL
+PageWriter_ClaimBackFile(PageWriterBatch *pBatch, const PageWriterFile *pFront, PageWriterFile *pBack, const WCHAR **pError)
+{
+    // the front's path with a b before the extension, in the same folder
+    // even if the date changed in between
+    int extLength = lstrlen(pBatch->ext) + 1;
+    int baseLength = lstrlen(pFront->path) - extLength;
+    lstrcpyn(pBack->path, pFront->path, baseLength + 1);
+    wsprintf(pBack->path + baseLength, L"b.%s", pBatch->ext);
+    pBack->number = pFront->number;
+    pBack->entry = pFront->entry;
+
+    if (pBack->entry) {
+        pBack->hFile = INVALID_HANDLE_VALUE;
+        return TRUE;
+    }
+
+    pBack->hFile = CreateFile(pBack->path, GENERIC_WRITE, 0, NULL, CREATE_NEW,
+                              FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
+    if (!pBack->hFile || pBack->hFile == INVALID_HANDLE_VALUE) {
+        pBack->hFile = INVALID_HANDLE_VALUE;
+        *pError = L"Failed to open file";
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+void
+PageWriter_DiscardFile(PageWriterFile *pFile)
+{
+    if (pFile->hFile != INVALID_HANDLE_VALUE) {
+        CloseHandle(pFile->hFile);
+        pFile->hFile = INVALID_HANDLE_VALUE;
+    }
+
+    if (!pFile->entry)
+        DeleteFile(pFile->path);
+}
+
+void
+PageWriter_PrepareBack(UINT backs, HGLOBAL *phBack)
+{
+    IC_UINT8 *dibBuf = (IC_UINT8 *)GlobalLock(*phBack);
+    DibInfo dib;
+    if (!dibBuf || !Dib_Parse(dibBuf, GlobalSize(*phBack), &dib)) {
+        // the writer reports it
+        if (dibBuf)
+            GlobalUnlock(*phBack);
+        return;
+    }
+
+    BOOL blank = FALSE;
+    if (backs & PAGEWRITER_DROP_BLANK_BACKS) {
+        IcImage img;
+        if (Dib_ToImage(&dib, &img)) {
+            blank = ImgConv_IsBlank(&img, PAGEWRITER_BLANK_MAX_INK);
+            IcImage_Free(&img);
+        }
+    }
+
+    if (!blank && (backs & PAGEWRITER_ROTATE_BACKS))
+        Dib_Rotate180(&dib, dibBuf + dib.bitsOffset);
+
+    GlobalUnlock(*phBack);
+
+    if (blank) {
+        GlobalFree(*phBack);
+        *phBack = NULL;
+    }
+}
+
+void
+PageWriter_PageDropped(PageWriterBatch *pBatch, const PageWriterPageInfo *pInfo)
+{
+    Spool_MarkDone(pBatch->spool, pInfo->spoolId);
+}
+
+BOOL
+PageWriter_WriteImage(PageWriterBatch *pBatch, PageWriterFile *pFile, HGLOBAL hDib,
+                      const PageWriterPageInfo *pInfo, const WCHAR **pError)
+{
+    UINT format = pBatch->settings.format;
+    BOOL builtin = format >= g_gdiplusEncoderCount;
+
+    PageWriterRecord r;
+    ZeroMemory(&r, sizeof(r));
+    r.writeStart = GetTickCount();
+
+    const void *dibBuf = GlobalLock(hDib);
+
+    BOOL ok = TRUE;
+    DibInfo dib;
+    if (!dibBuf || !Dib_Parse(dibBuf, GlobalSize(hDib), &dib)) {
+        *pError = L"Unsupported bitmap format";
+        ok = FALSE;
+    } else if (builtin) {
+        ok = PageWriter_WriteBuiltinImage(pBatch, pFile, format - g_gdiplusEncoderCount, &dib, &r);
+        if (!ok)
+            *pError = L"failed to save file";
+    } else {
+        ok = PageWriter_WriteGdiplusImage(pBatch, pFile, format, dibBuf, &dib, &r, pError);
+    }
+
+    if (ok) {
+        r.width = (UINT)dib.width;
+        r.height = (UINT)dib.height;
+        r.xDpi = pInfo->xDpi ? pInfo->xDpi : dib.xDpi;
+        r.yDpi = pInfo->yDpi ? pInfo->yDpi : dib.yDpi;
+    }
+
+    if (dibBuf)
+        GlobalUnlock(hDib);
+
+    if (pFile->hFile != INVALID_HANDLE_VALUE) {
+        CloseHandle(pFile->hFile);
+        pFile->hFile = INVALID_HANDLE_VALUE;
+    }
+
+    if (!ok) {
+        if (!pFile->entry)
+            DeleteFile(pFile->path);
+        return FALSE;
+    }
+
+    if (pBatch->settings.manifest) {
+        r.kind = L"page";
+        r.hasCrc = TRUE;
+        r.path = pFile->entry ? pBatch->archivePath : pFile->path;
+        r.entry = pFile->entry ? pFile->path : NULL;
+        r.number = pFile->number;
+        r.info = pInfo;
+        PageWriter_RecordPage(pBatch, &r);
+    }
+
+    // an archive entry is safe once the archive is finished
+    if (!pFile->entry) {
+        Spool_MarkDone(pBatch->spool, pInfo->spoolId);
+    } else if (pInfo->spoolId) {
+        EnterCriticalSection(&pBatch->archiveLock);
+        NumberSet_Add(&pBatch->archiveSpoolIds, pInfo->spoolId);
+        LeaveCriticalSection(&pBatch->archiveLock);
+    }
+    return TRUE;
+}
+
+BOOL
+PageWriter_IsMultiPage(const PageWriterBatch *pBatch)
+{
+    UINT format = pBatch->settings.format;
+    return format >= g_gdiplusEncoderCount && !g_builtinEncoders[format - g_gdiplusEncoderCount].encode;
+}
+
+BOOL
+PageWriter_QueueDocumentPage(PageWriterBatch *pBatch, HGLOBAL hDib, const PageWriterPageInfo *pInfo,
+                             BOOL *pScheduleDrain)
+{
+    // may be parked in the overflow file until it's drained
+    OverflowDib front;
+    Overflow_Put(&front, hDib);
+    return PageWriter_QueueDocumentSheet(pBatch, &front, pInfo, NULL, NULL, TRUE, pScheduleDrain) != NULL;
+}
+
+// a drain is needed if nobody drains and the head can be written; called with docLock held
+static BOOL
+PageWriter_StartDrain(PageWriterBatch *pBatch)
+{
+    if (pBatch->docDraining || !pBatch->docQueueHead || !pBatch->docQueueHead->ready)
+        return FALSE;
+
+    pBatch->docDraining = TRUE;
+    return TRUE;
+}
+
+PageWriterQueuedPage *
+PageWriter_QueueDocumentSheet(PageWriterBatch *pBatch, OverflowDib *pFront, const PageWriterPageInfo *pFrontInfo,
+                              OverflowDib *pBack, const PageWriterPageInfo *pBackInfo, BOOL ready,
+                              BOOL *pScheduleDrain)
+{
+    *pScheduleDrain = FALSE;
+
+    PageWriterQueuedPage *page = (PageWriterQueuedPage *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(*page));
+    if (!page) {
+        if (pFront)
+            Overflow_Drop(pFront);
+        if (ready && pBack)
+            Overflow_Drop(pBack);
+        return NULL;
+    }
+
+    // already counted, and maybe parked, while they waited for their turn
+    if (pFront)
+        Overflow_Move(&page->front, pFront);
+    page->ready = ready;
+    if (pFrontInfo)
+        page->info = *pFrontInfo;
+    if (pBackInfo)
+        page->backInfo = *pBackInfo;
+    if (ready && pBack)
+        Overflow_Move(&page->back, pBack);
+
+    EnterCriticalSection(&pBatch->docLock);
+    if (pBatch->docQueueTail)
+        pBatch->docQueueTail->next = page;
+    else
+        pBatch->docQueueHead = page;
+    pBatch->docQueueTail = page;
+
+    *pScheduleDrain = PageWriter_StartDrain(pBatch);
+    LeaveCriticalSection(&pBatch->docLock);
+
+    return page;
+}
+
+BOOL
+PageWriter_QueueDocumentBreak(PageWriterBatch *pBatch, BOOL *pScheduleDrain)
+{
+    // a queue entry without a page
+    return PageWriter_QueueDocumentSheet(pBatch, NULL, NULL, NULL, NULL, TRUE, pScheduleDrain) != NULL;
+}
+
+void
+PageWriter_DocumentSheetReady(PageWriterBatch *pBatch, PageWriterQueuedPage *pSheet, HGLOBAL hBack, BOOL *pScheduleDrain)
+{
+    if (hBack)
+        Overflow_Put(&pSheet->back, hBack);
+    else
+        PageWriter_PageDropped(pBatch, &pSheet->backInfo);
+
+    EnterCriticalSection(&pBatch->docLock);
+    pSheet->ready = TRUE;
+    *pScheduleDrain = PageWriter_StartDrain(pBatch);
+    LeaveCriticalSection(&pBatch->docLock);
+}
+
+static BOOL
+PageWriter_AppendDocumentPage(PageWriterBatch *pBatch, HGLOBAL hDib, const PageWriterPageInfo *pInfo,
+                              const WCHAR **pError)
+{
+    if (pBatch->docFile.hFile == INVALID_HANDLE_VALUE) {
+        PageWriterFile file;
+        if (!PageWriter_ClaimFile(pBatch, &file, pError))
+            return FALSE;
+
+        // pages stream out while the next ones are still being encoded
+        if (!FileWriter_Open(&pBatch->docFile, file.hFile, 0)) {
+            PageWriter_DiscardFile(&file);
+            *pError = L"Out of memory";
+            return FALSE;
+        }
+
+        pBatch->docNumber = file.number;
+        lstrcpy(pBatch->docPath, file.path);
+        pBatch->docStart = GetTickCount();
+
+        // don't leave it open, the next page would be added to a TIFF
+        // without a header
+        if (!TiffWriter_Begin(&pBatch->docWriter, &pBatch->docFile.sink)) {
+            FileWriter_Close(&pBatch->docFile);
+            pBatch->docFile.hFile = INVALID_HANDLE_VALUE;
+            DeleteFile(pBatch->docPath);
+            *pError = L"failed to save file";
+            return FALSE;
+        }
+    }
+
+    PageWriterRecord r;
+    ZeroMemory(&r, sizeof(r));
+    r.writeStart = GetTickCount();
+    r.offset = pBatch->docWriter.pos;
+
+    const void *dibBuf = GlobalLock(hDib);
+
+    BOOL ok = FALSE;
+    DibInfo dib;
+    IcImage img;
+    if (!dibBuf || !Dib_Parse(dibBuf, GlobalSize(hDib), &dib) || !Dib_ToImage(&dib, &img)) {
+        *pError = L"Unsupported bitmap format";
+    } else {
+        ok = TiffWriter_AddPage(&pBatch->docWriter, &img, TIFF_COMPRESSION_PACKBITS);
+        if (!ok)
+            *pError = L"failed to save file";
+        r.width = (UINT)dib.width;
+        r.height = (UINT)dib.height;
+        r.xDpi = pInfo->xDpi ? pInfo->xDpi : dib.xDpi;
+        r.yDpi = pInfo->yDpi ? pInfo->yDpi : dib.yDpi;
+        IcImage_Free(&img);
+    }
+
+    if (dibBuf)
+        GlobalUnlock(hDib);
+
+    // the page's strips and IFD; it can be read as soon as it's linked in
+    if (ok) {
+        r.kind = L"page";
+        r.path = pBatch->docPath;
+        r.number = pBatch->docNumber;
+        r.size = pBatch->docWriter.pos - r.offset;
+        r.info = pInfo;
+        PageWriter_RecordPage(pBatch, &r);
+
+        // a lost id only means the page is written again after a crash
+        if (pInfo->spoolId)
+            NumberSet_Add(&pBatch->docSpoolIds, pInfo->spoolId);
+    }
+
+    return ok;
+}
+
+BOOL
+PageWriter_DrainDocument(PageWriterBatch *pBatch, const WCHAR **pError)
+{
+    BOOL ok = TRUE;
+
+    for (;;) {
+        EnterCriticalSection(&pBatch->docLock);
+        PageWriterQueuedPage *page = pBatch->docQueueHead;
+        if (page && page->ready) {
+            pBatch->docQueueHead = page->next;
+            if (!pBatch->docQueueHead)
+                pBatch->docQueueTail = NULL;
+        } else {
+            // PageWriter_DocumentSheetReady() starts the next drain
+            page = NULL;
+            pBatch->docDraining = FALSE;
+        }
+        LeaveCriticalSection(&pBatch->docLock);
+
+        if (!page)
+            break;
+
+        // read back from the overflow file if they were parked
+        BOOL hasFront = page->front.size != 0;
+        BOOL hasBack = page->back.size != 0;
+        HGLOBAL hDib = Overflow_Take(&page->front);
+        HGLOBAL hBack = Overflow_Take(&page->back);
+        if ((hasFront && !hDib) || (hasBack && !hBack)) {
+            *pError = L"Out of memory";
+            ok = FALSE;
+        }
+
+        // the document itself is only touched by the one draining thread,
+        // both sides of a sheet go in together
+        if (!hasFront)
+            PageWriter_CloseDocument(pBatch);
+        else if (hDib && !PageWriter_AppendDocumentPage(pBatch, hDib, &page->info, pError))
+            ok = FALSE;
+        if (hBack && !PageWriter_AppendDocumentPage(pBatch, hBack, &page->backInfo, pError))
+            ok = FALSE;
+
+        if (hDib)
+            GlobalFree(hDib);
+        if (hBack)
+            GlobalFree(hBack);
+        HeapFree(GetProcessHeap(), 0, page);
+    }
+
+    return ok;
+}
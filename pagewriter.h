@@ -0,0 +1,264 @@
+#pragma once
+
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <windows.h>
+#include "imagecore/tiffenc.h"
+#include "imagecore/numset.h"
+#include "imagecore/zipwriter.h"
+#include "filewriter.h"
+#include "overflow.h"
+
+// file numbers have at least four digits and wrap around after this one
+#define PAGEWRITER_MAX_NUMBER 99999999u
+
+// what happens to the back sides of duplex sheets before they are written
+enum {
+    PAGEWRITER_DROP_BLANK_BACKS = 0x1,
+    PAGEWRITER_ROTATE_BACKS     = 0x2  // sheets flipped top to bottom
+};
+
+// subfolders of the output folder, so none of them grows huge
+enum {
+    PAGEWRITER_SHARD_NONE  = 0,
+    PAGEWRITER_SHARD_DATE  = 1, // YYYY-MM-DD, the day the page is written
+    PAGEWRITER_SHARD_BATCH = 2, // the batch id, see PageWriterBatch
+    PAGEWRITER_SHARD_COUNT = 3  // shardSize numbers each: 0000, 0001, ...
+};
+
+// one ZIP archive per batch instead of a file per page, for single-page formats
+enum {
+    PAGEWRITER_ARCHIVE_NONE    = 0,
+    PAGEWRITER_ARCHIVE_STORE   = 1,
+    PAGEWRITER_ARCHIVE_DEFLATE = 2  // pages deflate doesn't shrink are stored
+};
+
+// Everything needed to save the pages of one batch. The dialog takes a
+// snapshot of its controls when a scan starts, so the TWAIN threads
+// never have to touch the UI.
+struct PageWriterSettings {
+    WCHAR folder[MAX_PATH];
+    WCHAR filename[MAX_PATH];
+    UINT  format;   // index into the format list, see PageWriter_FormatCount()
+    UINT  counter;  // number of the first file, up to PAGEWRITER_MAX_NUMBER
+    UINT  backs;    // PAGEWRITER_DROP_BLANK_BACKS, PAGEWRITER_ROTATE_BACKS
+    UINT  shard;    // PAGEWRITER_SHARD_*
+    UINT  shardSize; // file numbers per subfolder for PAGEWRITER_SHARD_COUNT
+    BOOL  manifest; // describe each page written in <filename>-<batch id>.manifest
+    BOOL  spool;    // journal the pages as they arrive, see spool.h
+    UINT  archive;  // PAGEWRITER_ARCHIVE_*, <filename>-<batch id>.zip
+};
+
+// Where a page came from, for the manifest
+struct PageWriterPageInfo {
+    char  source[34];     // product name of the source, a TW_STR32
+    UINT  device;         // index of the source in the scan job
+    UINT  xDpi, yDpi;     // from DAT_IMAGEINFO, 0 if unknown
+    DWORD transferStart;  // GetTickCount() before and after the transfer
+    DWORD transferEnd;
+    IC_UINT32 spoolId;    // in the batch's spool, 0 if it isn't in there
+};
+
+struct PageWriterQueuedPage;
+struct Spool;
+
+// A batch is shared by every source scanning with the same settings and
+// by the encoder threads writing its pages. File numbers are handed out
+// in output order, encoding may then happen in any order.
+//
+// The numbers already taken in the folder are listed once, in the
+// background while the scanner starts up, so claiming a name costs one
+// CreateFile() even in a folder with thousands of scans. CREATE_NEW
+// still keeps other programs' new files safe. With sharding, only the
+// subfolder of the current number is listed, again when the number moves
+// on to the next one; that one is created ahead of time.
+//
+// The manifest gets a line for each page once it is complete, so
+// downstream systems can follow it instead of listing the folders. It is
+// tab-separated UTF-8, append-only, and flushed to disk when the batch
+// ends; the first line names the columns:
+//
+//   kind       page, or document for a finished multi-page document
+//   number     file number
+//   path       relative to the output folder
+//   offset     of the page in the file (0 for single-page files)
+//   size       bytes
+//   width, height, xdpi, ydpi   pixels, and DPI from DAT_IMAGEINFO
+//   format     file extension
+//   crc32      of the bytes at offset..offset+size; - for pages inside a
+//              document, whose links change later, see its document line
+//   source, device              the scanner and its index in the job
+//   transfer_ms, wait_ms, write_ms
+//              the transfer, the wait for its turn, encoding and writing
+//   time       local time when the page was complete
+//   entry      name in the archive, - for files of their own
+//   compression  store or deflate for archive entries, - otherwise
+//
+// Multi-page formats put all pages of the batch into one document, which
+// is finished when the last reference to the batch goes away.
+//
+// With an archive, pages go into <filename>-<batch id>.zip as they are
+// written, named as their files would be (shard folders become folders
+// in the archive); the central directory follows when the batch ends.
+// The manifest's path is the archive's then, offset and size those of
+// the page's data in it, so pages can be read without unpacking. Like
+// a document, the finished archive gets a line with its own checksum.
+struct PageWriterBatch {
+    PageWriterSettings    settings;
+    WCHAR                 ext[32];
+    volatile LONG         refCount;
+    volatile LONG         nextCounter;
+    WCHAR                 batchId[24];  // YYYYMMDD-HHMMSS[-N] of the creation
+    HANDLE                hUsedListed;  // set once usedNumbers is sealed
+
+    // file names, protected by nameLock
+    CRITICAL_SECTION      nameLock;
+    WCHAR                 listedDir[MAX_PATH + 32];  // where usedNumbers come from
+    NumberSet             usedNumbers;
+
+    CRITICAL_SECTION      manifestLock;
+    HANDLE                hManifest;    // opened on the first file
+
+    Spool                *spool;        // NULL without PageWriterSettings.spool
+
+    // the archive, protected by archiveLock
+    CRITICAL_SECTION      archiveLock;
+    FileWriter            archiveFile;  // hFile is INVALID_HANDLE_VALUE until the first page
+    ZipWriter             archiveWriter;
+    WCHAR                 archivePath[MAX_PATH + 300];
+    BOOL                  archiveFailed;
+    DWORD                 archiveStart; // GetTickCount() when it was opened
+    NumberSet             archiveSpoolIds; // its pages, done once it's finished
+
+    // multi-page document state, protected by docLock
+    CRITICAL_SECTION      docLock;
+    PageWriterQueuedPage *docQueueHead;
+    PageWriterQueuedPage *docQueueTail;
+    BOOL                  docDraining;
+    FileWriter            docFile;      // hFile is INVALID_HANDLE_VALUE between documents
+    UINT                  docNumber;
+    WCHAR                 docPath[1024];
+    DWORD                 docStart;     // GetTickCount() when it was opened
+    TiffWriter            docWriter;
+    NumberSet             docSpoolIds;  // its pages, done once it's closed
+};
+
+// A file name claimed for one page, kept open until the page is written
+struct PageWriterFile {
+    WCHAR  path[1024];   // or the name in the archive
+    HANDLE hFile;        // INVALID_HANDLE_VALUE for archive entries
+    UINT   number;
+    BOOL   entry;        // goes into the batch's archive
+};
+
+// needs GDI+ to be initialized already
+BOOL
+PageWriter_Initialize(void);
+
+void
+PageWriter_Teardown(void);
+
+// GDI+ encoders first, then the built-in ones from imagecore
+UINT
+PageWriter_FormatCount(void);
+
+const WCHAR *
+PageWriter_FormatDescription(UINT format);
+
+// Looks up a format by its index, its description or its file
+// extension (first match wins), e.g. for the command line
+BOOL
+PageWriter_FindFormat(const WCHAR *name, UINT *pFormat);
+
+// returns a batch with a reference count of one, or NULL
+PageWriterBatch *
+PageWriter_CreateBatch(const PageWriterSettings *pSettings);
+
+void
+PageWriter_AddRefBatch(PageWriterBatch *pBatch);
+
+void
+PageWriter_ReleaseBatch(PageWriterBatch *pBatch);
+
+// number of the next file the batch would try
+UINT
+PageWriter_NextCounter(const PageWriterBatch *pBatch);
+
+// Claims the next free file name of the batch. Safe to call from several
+// threads at once. On failure, *pError points to a static message.
+BOOL
+PageWriter_ClaimFile(PageWriterBatch *pBatch, PageWriterFile *pFile, const WCHAR **pError);
+
+// Claims the file for the back side of a duplex sheet, named after the
+// front and next to it: scan0042.tif and scan0042b.tif
+BOOL
+PageWriter_ClaimBackFile(PageWriterBatch *pBatch, const PageWriterFile *pFront, PageWriterFile *pBack, const WCHAR **pError);
+
+// Discards the unused file of a back side that was dropped
+void
+PageWriter_DiscardFile(PageWriterFile *pFile);
+
+// Applies the back side stages (PAGEWRITER_*_BACKS) to the back of a
+// duplex sheet, usually the batch's settings minus what the scanner
+// already did. Sets *phBack to NULL (and frees it) if it was dropped.
+// May run on any thread, sheets are independent of each other.
+void
+PageWriter_PrepareBack(UINT backs, HGLOBAL *phBack);
+
+// A page that is left out on purpose, e.g. a blank back side or a
+// separator sheet, so the spool doesn't keep it
+void
+PageWriter_PageDropped(PageWriterBatch *pBatch, const PageWriterPageInfo *pInfo);
+
+// Encodes the DIB into a claimed file and closes it; may run on any thread.
+// Failed pages don't leave empty files behind.
+BOOL
+PageWriter_WriteImage(PageWriterBatch *pBatch, PageWriterFile *pFile, HGLOBAL hDib,
+                      const PageWriterPageInfo *pInfo, const WCHAR **pError);
+
+BOOL
+PageWriter_IsMultiPage(const PageWriterBatch *pBatch);
+
+// Queues a page for the batch's document, in output order, and takes
+// ownership of hDib. If *pScheduleDrain is set, the caller must make
+// sure PageWriter_DrainDocument() runs afterwards.
+BOOL
+PageWriter_QueueDocumentPage(PageWriterBatch *pBatch, HGLOBAL hDib, const PageWriterPageInfo *pInfo,
+                             BOOL *pScheduleDrain);
+
+// Queues both sides of a duplex sheet as one unit, taking over the
+// queued DIBs (see Overflow_Put()); pBack may be NULL. If ready is FALSE,
+// the back side stays with the caller and the document waits at this
+// sheet until PageWriter_DocumentSheetReady() hands it in, so sheets can
+// be prepared in parallel. Returns NULL if out of memory, the DIBs taken
+// over are dropped then.
+PageWriterQueuedPage *
+PageWriter_QueueDocumentSheet(PageWriterBatch *pBatch, OverflowDib *pFront, const PageWriterPageInfo *pFrontInfo,
+                              OverflowDib *pBack, const PageWriterPageInfo *pBackInfo, BOOL ready,
+                              BOOL *pScheduleDrain);
+
+// Ends the current document after the pages queued so far; the next
+// page starts a new one. Returns FALSE if out of memory.
+BOOL
+PageWriter_QueueDocumentBreak(PageWriterBatch *pBatch, BOOL *pScheduleDrain);
+
+// hBack may be NULL if the back side was dropped
+void
+PageWriter_DocumentSheetReady(PageWriterBatch *pBatch, PageWriterQueuedPage *pSheet, HGLOBAL hBack, BOOL *pScheduleDrain);
+
+// Appends all queued pages to the document, opening it on the first one.
+// Only one drain runs per batch at a time; returns FALSE if a page failed.
+BOOL
+PageWriter_DrainDocument(PageWriterBatch *pBatch, const WCHAR **pError);
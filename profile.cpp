@@ -0,0 +1,272 @@
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "profile.h"
+#include "settings.h"
+
+#include <windows.h>
+
+#define PROFILE_MAGIC 0x31505354 // 'TSP1'
+
+// a driver that wants to store more than this is broken
+#define PROFILE_MAX_DSDATA (16 * 1024 * 1024)
+
+static const WCHAR g_profileExtension[] = L".profile";
+
+// followed by dsDataSize bytes of custom DS data
+struct ProfileFileHeader {
+    DWORD       magic;
+    DWORD       size;        // sizeof(ProfileFileHeader)
+    TW_IDENTITY source;
+    UINT        resolution;
+    int         pixelType;
+    UINT        bitDepth;
+    int         duplex;
+    TW_UINT32   dsDataSize;
+};
+
+static BOOL
+Profile_FilePath(const WCHAR *name, WCHAR *path)
+{
+    WCHAR dir[MAX_PATH];
+    if (!Settings_GetDataDir(L"Profiles", dir))
+        return FALSE;
+
+    return Settings_DataFilePath(dir, name, g_profileExtension, path);
+}
+
+ScanProfile *
+Profile_Create(const TW_IDENTITY *pSource, const TwainScanOptions *pOptions)
+{
+    ScanProfile *p = (ScanProfile *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(*p));
+    if (!p)
+        return NULL;
+
+    p->source = *pSource;
+    p->resolution = pOptions->resolution;
+    p->pixelType = pOptions->pixelType;
+    p->bitDepth = pOptions->bitDepth;
+    p->duplex = pOptions->duplex;
+
+    return p;
+}
+
+static HGLOBAL
+Profile_CopyData(const void *data, TW_UINT32 size)
+{
+    HGLOBAL h = GlobalAlloc(GMEM_MOVEABLE, size);
+    if (!h)
+        return NULL;
+
+    void *p = GlobalLock(h);
+    if (!p) {
+        GlobalFree(h);
+        return NULL;
+    }
+
+    CopyMemory(p, data, size);
+    GlobalUnlock(h);
+    return h;
+}
+
+ScanProfile *
+Profile_Copy(const ScanProfile *pProfile)
+{
+    ScanProfile *p = (ScanProfile *)HeapAlloc(GetProcessHeap(), 0, sizeof(*p));
+    if (!p)
+        return NULL;
+
+    *p = *pProfile;
+    p->hDsData = NULL;
+
+    if (pProfile->hDsData) {
+        const void *data = GlobalLock(pProfile->hDsData);
+        if (data) {
+            p->hDsData = Profile_CopyData(data, pProfile->dsDataSize);
+            GlobalUnlock(pProfile->hDsData);
+        }
+
+        if (!p->hDsData) {
+            HeapFree(GetProcessHeap(), 0, p);
+            return NULL;
+        }
+    }
+
+    return p;
+}
+
+void
+Profile_Free(ScanProfile *pProfile)
+{
+    if (!pProfile)
+        return;
+
+    if (pProfile->hDsData)
+        GlobalFree(pProfile->hDsData);
+
+    HeapFree(GetProcessHeap(), 0, pProfile);
+}
+
+ScanProfile *
+Profile_Load(const WCHAR *name)
+{
+    WCHAR path[MAX_PATH + 80];
+    if (!Profile_FilePath(name, path))
+        return NULL;
+
+    HANDLE hFile = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    ProfileFileHeader header;
+    DWORD read = 0;
+    BOOL ok = ReadFile(hFile, &header, sizeof(header), &read, NULL) && read == sizeof(header)
+           && header.magic == PROFILE_MAGIC && header.size == sizeof(header)
+           && header.dsDataSize <= PROFILE_MAX_DSDATA;
+
+    ScanProfile *p = NULL;
+    if (ok)
+        p = (ScanProfile *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(*p));
+
+    if (p) {
+        header.source.Manufacturer[sizeof(header.source.Manufacturer) - 1] = 0;
+        header.source.ProductFamily[sizeof(header.source.ProductFamily) - 1] = 0;
+        header.source.ProductName[sizeof(header.source.ProductName) - 1] = 0;
+        header.source.Version.Info[sizeof(header.source.Version.Info) - 1] = 0;
+
+        p->source = header.source;
+        p->resolution = header.resolution;
+        p->pixelType = header.pixelType;
+        p->bitDepth = header.bitDepth;
+        p->duplex = header.duplex;
+    }
+
+    if (p && header.dsDataSize) {
+        p->hDsData = GlobalAlloc(GMEM_MOVEABLE, header.dsDataSize);
+        void *data = p->hDsData ? GlobalLock(p->hDsData) : NULL;
+
+        ok = data && ReadFile(hFile, data, header.dsDataSize, &read, NULL) && read == header.dsDataSize;
+        p->dsDataSize = header.dsDataSize;
+
+        if (data)
+            GlobalUnlock(p->hDsData);
+        if (!ok) {
+            Profile_Free(p);
+            p = NULL;
+        }
+    }
+
+    CloseHandle(hFile);
+
+    return p;
+}
+
+BOOL
+Profile_Save(const WCHAR *name, const ScanProfile *pProfile)
+{
+    WCHAR path[MAX_PATH + 80];
+    WCHAR tmp[MAX_PATH + 100];
+    if (!Profile_FilePath(name, path))
+        return FALSE;
+
+    wsprintf(tmp, L"%s.%lu.tmp", path, GetCurrentThreadId());
+
+    HANDLE hFile = CreateFile(tmp, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    ProfileFileHeader header;
+    ZeroMemory(&header, sizeof(header));
+    header.magic = PROFILE_MAGIC;
+    header.size = sizeof(header);
+    header.source = pProfile->source;
+    header.resolution = pProfile->resolution;
+    header.pixelType = pProfile->pixelType;
+    header.bitDepth = pProfile->bitDepth;
+    header.duplex = pProfile->duplex;
+    header.dsDataSize = pProfile->hDsData ? pProfile->dsDataSize : 0;
+
+    DWORD written = 0;
+    BOOL ok = WriteFile(hFile, &header, sizeof(header), &written, NULL) && written == sizeof(header);
+
+    if (ok && header.dsDataSize) {
+        const void *data = GlobalLock(pProfile->hDsData);
+        ok = data && WriteFile(hFile, data, header.dsDataSize, &written, NULL) && written == header.dsDataSize;
+        if (data)
+            GlobalUnlock(pProfile->hDsData);
+    }
+
+    CloseHandle(hFile);
+
+    if (ok)
+        ok = MoveFileEx(tmp, path, MOVEFILE_REPLACE_EXISTING);
+    if (!ok)
+        DeleteFile(tmp);
+
+    return ok;
+}
+
+BOOL
+Profile_MatchesSource(const ScanProfile *pProfile, const TW_IDENTITY *pSource)
+{
+    // the blob's format is up to the driver, so it must be the same one
+    return pProfile->hDsData
+        && TwainHelper_IsSameModel(&pProfile->source, pSource)
+        && lstrcmpA(pProfile->source.Version.Info, pSource->Version.Info) == 0;
+}
+
+void
+Profile_MergeOptions(const ScanProfile *pProfile, TwainScanOptions *pOptions)
+{
+    if (!pOptions->resolution)
+        pOptions->resolution = pProfile->resolution;
+    // the bit depth only makes sense with the pixel type it was made for
+    if (pOptions->pixelType < 0) {
+        pOptions->pixelType = pProfile->pixelType;
+        if (!pOptions->bitDepth)
+            pOptions->bitDepth = pProfile->bitDepth;
+    }
+    if (pOptions->duplex < 0)
+        pOptions->duplex = pProfile->duplex;
+}
+
+void
+Profile_List(ScanProfileList *pList)
+{
+    pList->count = 0;
+
+    WCHAR pattern[MAX_PATH + 20];
+    if (!Settings_GetDataDir(L"Profiles", pattern))
+        return;
+    lstrcat(pattern, L"\\*");
+    lstrcat(pattern, g_profileExtension);
+
+    WIN32_FIND_DATA fd;
+    HANDLE hFind = FindFirstFile(pattern, &fd);
+    if (hFind == INVALID_HANDLE_VALUE)
+        return;
+
+    do {
+        // FindFirstFile also matches "*.profileX" with short names enabled
+        int len = lstrlen(fd.cFileName) - (int)(sizeof(g_profileExtension)/sizeof(WCHAR) - 1);
+        if (len <= 0 || len >= PROFILE_MAX_NAME || (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            || lstrcmpi(fd.cFileName + len, g_profileExtension) != 0)
+            continue;
+
+        lstrcpyn(pList->names[pList->count], fd.cFileName, len + 1);
+        pList->count++;
+    } while (pList->count < PROFILE_MAX_PROFILES && FindNextFile(hFind, &fd));
+
+    FindClose(hFind);
+}
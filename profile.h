@@ -0,0 +1,76 @@
+#pragma once
+
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <windows.h>
+#include "twainthread.h"
+
+// Named scan profiles: the source's own settings as a DAT_CUSTOMDSDATA
+// blob, captured after a batch, plus the capabilities we negotiate
+// ourselves. A session restores the blob with a single MSG_SET instead
+// of negotiating capability by capability, or having the user click
+// through the source's UI again. The capabilities are only replayed if
+// the source can't take the blob, e.g. because it's a different model.
+// Profiles live in
+// %LOCALAPPDATA%\Genosse Einhorn\TWAIN Example Application\Profiles.
+
+enum {
+    PROFILE_MAX_NAME = 64,
+    PROFILE_MAX_PROFILES = 64
+};
+
+struct ScanProfile {
+    TW_IDENTITY source;      // the driver that made the blob
+    UINT        resolution;  // as in TwainScanOptions
+    int         pixelType;
+    UINT        bitDepth;
+    int         duplex;
+    TW_UINT32   dsDataSize;
+    HGLOBAL     hDsData;     // NULL if the source has no DAT_CUSTOMDSDATA
+};
+
+struct ScanProfileList {
+    UINT  count;
+    WCHAR names[PROFILE_MAX_PROFILES][PROFILE_MAX_NAME];
+};
+
+// an empty profile for pSource, with the capabilities of pOptions
+ScanProfile *
+Profile_Create(const TW_IDENTITY *pSource, const TwainScanOptions *pOptions);
+
+ScanProfile *
+Profile_Copy(const ScanProfile *pProfile);
+
+// NULL if there's no such profile
+ScanProfile *
+Profile_Load(const WCHAR *name);
+
+BOOL
+Profile_Save(const WCHAR *name, const ScanProfile *pProfile);
+
+void
+Profile_Free(ScanProfile *pProfile);
+
+// FALSE if the source can't be expected to understand the blob
+BOOL
+Profile_MatchesSource(const ScanProfile *pProfile, const TW_IDENTITY *pSource);
+
+// fills in what pOptions leaves to the source
+void
+Profile_MergeOptions(const ScanProfile *pProfile, TwainScanOptions *pOptions);
+
+// the names of all saved profiles, in no particular order
+void
+Profile_List(ScanProfileList *pList);
@@ -27,6 +27,15 @@
 #define IDC_FILENUMBERUPDOWN           110
 #define IDC_FILEFORMATCOMBO            111
 #define IDC_SCANBTN                    112
+#define IDC_MERGECHECK                 113
+#define IDC_MERGEORDERCOMBO            114
+#define IDC_WARMCHECK                  115
+#define IDC_SOURCECOMBO                116
+#define IDC_PROFILECOMBO               117
+#define IDC_PROFILESAVEBTN             118
+#define IDC_FASTCHECK                  119
+#define IDC_PROGRESSTEXT               120
+#define IDC_BLANKCHECK                 121
 
 #ifndef IDC_STATIC
   #define IDC_STATIC                   -1
@@ -0,0 +1,272 @@
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "scanjob.h"
+#include "encoderpool.h"
+#include "spool.h"
+
+#include <windows.h>
+
+struct ScanJobSheet {
+    OverflowDib        front;
+    OverflowDib        back;      // empty for simplex pages
+    UINT               backs;     // stages left for the back side
+    BOOL               separator; // not written, ends the document
+    PageWriterPageInfo frontInfo;
+    PageWriterPageInfo backInfo;
+};
+
+ScanJob *
+ScanJob_Create(PageWriterBatch *pBatch, UINT deviceCount, ReorderPolicy policy)
+{
+    if (deviceCount < 1 || deviceCount > SCANJOB_MAX_DEVICES)
+        return NULL;
+
+    ScanJob *pJob = (ScanJob *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(*pJob));
+    if (!pJob)
+        return NULL;
+
+    if (!ReorderBuffer_Init(&pJob->reorder, deviceCount, policy)) {
+        HeapFree(GetProcessHeap(), 0, pJob);
+        return NULL;
+    }
+
+    InitializeCriticalSection(&pJob->lock);
+    pJob->refCount = 1;
+    pJob->deviceCount = deviceCount;
+    pJob->batch = pBatch;
+    PageWriter_AddRefBatch(pBatch);
+
+    return pJob;
+}
+
+void
+ScanJob_AddRef(ScanJob *pJob)
+{
+    InterlockedIncrement(&pJob->refCount);
+}
+
+void
+ScanJob_Release(ScanJob *pJob)
+{
+    if (!pJob || InterlockedDecrement(&pJob->refCount) != 0)
+        return;
+
+    // pages still waiting for a device that never finished
+    void *item;
+    for (UINT d = 0; d < pJob->deviceCount; ++d) {
+        ReorderBuffer_Finish(&pJob->reorder, d, pJob->sheetsPushed[d]);
+        Overflow_Drop(&pJob->front[d]);
+    }
+    while (ReorderBuffer_Pop(&pJob->reorder, &item, NULL, NULL)) {
+        ScanJobSheet *sheet = (ScanJobSheet *)item;
+        Overflow_Drop(&sheet->front);
+        Overflow_Drop(&sheet->back);
+        HeapFree(GetProcessHeap(), 0, sheet);
+    }
+
+    ReorderBuffer_Free(&pJob->reorder);
+    PageWriter_ReleaseBatch(pJob->batch);
+    DeleteCriticalSection(&pJob->lock);
+    HeapFree(GetProcessHeap(), 0, pJob);
+}
+
+// Hands every sheet whose turn has come to the batch; the pages stay in
+// the overflow queue, where they may be parked still. Called with the
+// lock held.
+static void
+ScanJob_Flush(ScanJob *pJob)
+{
+    void *item;
+    while (ReorderBuffer_Pop(&pJob->reorder, &item, NULL, NULL)) {
+        ScanJobSheet *sheet = (ScanJobSheet *)item;
+        if (sheet->separator)
+            EncoderPool_QueueSeparator(pJob->batch, &sheet->front, &sheet->frontInfo,
+                                       &sheet->back, &sheet->backInfo);
+        else
+            EncoderPool_QueueSheet(pJob->batch, &sheet->front, &sheet->frontInfo,
+                                   &sheet->back, &sheet->backInfo, sheet->backs);
+        HeapFree(GetProcessHeap(), 0, sheet);
+    }
+}
+
+// takes over the pages; pBack may be NULL. Called with the lock held.
+static void
+ScanJob_PushSheet(ScanJob *pJob, UINT device, OverflowDib *pFront, const PageWriterPageInfo *pFrontInfo,
+                  OverflowDib *pBack, const PageWriterPageInfo *pBackInfo, BOOL separator)
+{
+    UINT backs = pJob->batch->settings.backs & ~pJob->offloaded[device];
+
+    ScanJobSheet *sheet = (ScanJobSheet *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(*sheet));
+    if (sheet) {
+        Overflow_Move(&sheet->front, pFront);
+        if (pBack)
+            Overflow_Move(&sheet->back, pBack);
+        sheet->backs = backs;
+        sheet->separator = separator;
+        sheet->frontInfo = *pFrontInfo;
+        if (pBackInfo)
+            sheet->backInfo = *pBackInfo;
+    }
+
+    if (sheet && ReorderBuffer_Push(&pJob->reorder, device, pJob->sheetsPushed[device], sheet)) {
+        pJob->sheetsPushed[device]++;
+        ScanJob_Flush(pJob);
+    } else {
+        // out of memory: better out of order than lost
+        OverflowDib front, back;
+        ZeroMemory(&back, sizeof(back));
+        if (sheet) {
+            Overflow_Move(&front, &sheet->front);
+            Overflow_Move(&back, &sheet->back);
+            HeapFree(GetProcessHeap(), 0, sheet);
+        } else {
+            Overflow_Move(&front, pFront);
+            if (pBack)
+                Overflow_Move(&back, pBack);
+        }
+        if (separator)
+            EncoderPool_QueueSeparator(pJob->batch, &front, pFrontInfo, &back, pBackInfo);
+        else
+            EncoderPool_QueueSheet(pJob->batch, &front, pFrontInfo, &back, pBackInfo, backs);
+    }
+}
+
+void
+ScanJob_SetDuplex(ScanJob *pJob, UINT device, BOOL duplex)
+{
+    EnterCriticalSection(&pJob->lock);
+    if (device < pJob->deviceCount) {
+        pJob->duplex[device] = duplex;
+        pJob->frontSkipped[device] = FALSE;
+    }
+    LeaveCriticalSection(&pJob->lock);
+}
+
+UINT
+ScanJob_BackStages(ScanJob *pJob)
+{
+    return pJob->batch->settings.backs;
+}
+
+void
+ScanJob_SetOffloaded(ScanJob *pJob, UINT device, UINT backs)
+{
+    EnterCriticalSection(&pJob->lock);
+    if (device < pJob->deviceCount)
+        pJob->offloaded[device] = backs;
+    LeaveCriticalSection(&pJob->lock);
+}
+
+void
+ScanJob_PushPage(ScanJob *pJob, UINT device, HGLOBAL hDib, const PageWriterPageInfo *pPageInfo, BOOL separator)
+{
+    // Queued from here on, so a device that's far ahead of the others
+    // waits in the journal or the overflow file rather than in memory;
+    // the spool's writer thread takes it to disk, the transfer goes on
+    PageWriterPageInfo info = *pPageInfo;
+    OverflowDib page;
+    info.spoolId = Spool_AppendPage(pJob->batch->spool, hDib, pPageInfo, separator, &page);
+    const PageWriterPageInfo *pInfo = &info;
+
+    EnterCriticalSection(&pJob->lock);
+
+    pJob->pageCount++;
+
+    // either side may carry the separator's code
+    if (device >= pJob->deviceCount || pJob->abandoned[device]) {
+        if (separator)
+            EncoderPool_QueueSeparator(pJob->batch, &page, pInfo, NULL, NULL);
+        else
+            EncoderPool_QueuePage(pJob->batch, &page, pInfo);
+    } else if (!pJob->duplex[device] || pJob->frontSkipped[device]) {
+        pJob->frontSkipped[device] = FALSE;
+        ScanJob_PushSheet(pJob, device, &page, pInfo, NULL, NULL, separator);
+    } else if (!pJob->front[device].size) {
+        Overflow_Move(&pJob->front[device], &page);
+        pJob->frontInfo[device] = *pInfo;
+        pJob->frontSeparator[device] = separator;
+    } else {
+        ScanJob_PushSheet(pJob, device, &pJob->front[device], &pJob->frontInfo[device], &page, pInfo,
+                          pJob->frontSeparator[device] || separator);
+    }
+
+    LeaveCriticalSection(&pJob->lock);
+}
+
+void
+ScanJob_SkipPage(ScanJob *pJob, UINT device)
+{
+    EnterCriticalSection(&pJob->lock);
+
+    if (device < pJob->deviceCount && pJob->duplex[device]) {
+        if (pJob->front[device].size) {
+            ScanJob_PushSheet(pJob, device, &pJob->front[device], &pJob->frontInfo[device], NULL, NULL,
+                              pJob->frontSeparator[device]);
+        } else {
+            pJob->frontSkipped[device] = TRUE;
+        }
+    }
+
+    LeaveCriticalSection(&pJob->lock);
+}
+
+void
+ScanJob_DeviceFinished(ScanJob *pJob, UINT device)
+{
+    EnterCriticalSection(&pJob->lock);
+
+    if (device < pJob->deviceCount && !pJob->abandoned[device]) {
+        // a front side whose back never came, e.g. after a page limit
+        if (pJob->front[device].size) {
+            ScanJob_PushSheet(pJob, device, &pJob->front[device], &pJob->frontInfo[device], NULL, NULL,
+                              pJob->frontSeparator[device]);
+        }
+
+        ReorderBuffer_Finish(&pJob->reorder, device, pJob->sheetsPushed[device]);
+        ScanJob_Flush(pJob);
+    }
+
+    LeaveCriticalSection(&pJob->lock);
+}
+
+void
+ScanJob_AbandonDevice(ScanJob *pJob, UINT device)
+{
+    EnterCriticalSection(&pJob->lock);
+
+    if (device < pJob->deviceCount && !pJob->abandoned[device]) {
+        if (pJob->front[device].size) {
+            ScanJob_PushSheet(pJob, device, &pJob->front[device], &pJob->frontInfo[device], NULL, NULL,
+                              pJob->frontSeparator[device]);
+        }
+
+        pJob->abandoned[device] = TRUE;
+        ReorderBuffer_Finish(&pJob->reorder, device, pJob->sheetsPushed[device]);
+        ScanJob_Flush(pJob);
+        EncoderPool_QueueDocumentBreak(pJob->batch);
+    }
+
+    LeaveCriticalSection(&pJob->lock);
+}
+
+UINT
+ScanJob_PageCount(ScanJob *pJob)
+{
+    EnterCriticalSection(&pJob->lock);
+    UINT count = pJob->pageCount;
+    LeaveCriticalSection(&pJob->lock);
+
+    return count;
+}
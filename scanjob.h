@@ -0,0 +1,102 @@
+#pragma once
+
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <windows.h>
+#include "pagewriter.h"
+#include "imagecore/reorder.h"
+
+// One logical batch acquired on several sources at once. Every source
+// tags its pages with its device index and a per-device sequence number,
+// and a reorder buffer merges them into one deterministic page order
+// before they reach the batch, be it a numbered sequence of files or a
+// single multi-page document.
+//
+// Pages that arrive ahead of their turn wait in memory, or in the
+// overflow file once too many pages are waiting (see overflow.h).
+//
+// Devices scanning duplex deliver front, back, front, back; their pages
+// are paired into sheets first, and merged and written sheet by sheet.
+
+enum {
+    SCANJOB_MAX_DEVICES = 8
+};
+
+struct ScanJob {
+    CRITICAL_SECTION   lock;
+    volatile LONG      refCount;
+    PageWriterBatch   *batch;
+    ReorderBuffer      reorder;
+    UINT               deviceCount;
+    IC_UINT32          sheetsPushed[SCANJOB_MAX_DEVICES];
+    UINT               pageCount;
+    BOOL               duplex[SCANJOB_MAX_DEVICES];
+    UINT               offloaded[SCANJOB_MAX_DEVICES]; // PAGEWRITER_*_BACKS done by the scanner
+    OverflowDib        front[SCANJOB_MAX_DEVICES];     // waiting for its back side
+    PageWriterPageInfo frontInfo[SCANJOB_MAX_DEVICES];
+    BOOL               frontSeparator[SCANJOB_MAX_DEVICES];
+    BOOL               frontSkipped[SCANJOB_MAX_DEVICES]; // the next page is a lone back side
+    BOOL               abandoned[SCANJOB_MAX_DEVICES];    // stuck, the others don't wait for it
+};
+
+// returns a job with a reference count of one, or NULL
+ScanJob *
+ScanJob_Create(PageWriterBatch *pBatch, UINT deviceCount, ReorderPolicy policy);
+
+void
+ScanJob_AddRef(ScanJob *pJob);
+
+void
+ScanJob_Release(ScanJob *pJob);
+
+// Whether the device's next pages come in front/back pairs; set before
+// each batch of the device
+void
+ScanJob_SetDuplex(ScanJob *pJob, UINT device, BOOL duplex);
+
+// The back side stages the batch wants, see PageWriterSettings
+UINT
+ScanJob_BackStages(ScanJob *pJob);
+
+// Stages the device's scanner does itself, so they're skipped for its sheets
+void
+ScanJob_SetOffloaded(ScanJob *pJob, UINT device, UINT backs);
+
+// Called by the transfer thread of a device, in transfer order.
+// Takes ownership of hDib, pInfo is copied. A separator page takes its
+// whole sheet out of the output and splits the document there.
+void
+ScanJob_PushPage(ScanJob *pJob, UINT device, HGLOBAL hDib, const PageWriterPageInfo *pInfo, BOOL separator);
+
+// A page of the device that couldn't be transferred, so the pairing of
+// duplex sides stays in step: its other side is written on its own
+void
+ScanJob_SkipPage(ScanJob *pJob, UINT device);
+
+// The device won't deliver any more pages, e.g. because its source was
+// closed or couldn't be opened in the first place
+void
+ScanJob_DeviceFinished(ScanJob *pJob, UINT device);
+
+// Gives up on a device that stopped responding, from any thread: what
+// it delivered so far is written and a multi-page document is finished,
+// so nothing waits for the device anymore. Pages it still delivers are
+// written after everything else.
+void
+ScanJob_AbandonDevice(ScanJob *pJob, UINT device);
+
+// pages pushed by all devices so far
+UINT
+ScanJob_PageCount(ScanJob *pJob);
@@ -0,0 +1,114 @@
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "settings.h"
+
+#include <windows.h>
+#include <shlobj.h>
+
+static const WCHAR g_settingsKey[] = L"Software\\Genosse Einhorn\\TWAIN Example Application";
+
+static BOOL
+Settings_LoadBinary(const WCHAR *name, void *pData, DWORD size)
+{
+    HKEY hKey;
+    if (RegOpenKeyEx(HKEY_CURRENT_USER, g_settingsKey, 0, KEY_QUERY_VALUE, &hKey) != ERROR_SUCCESS)
+        return FALSE;
+
+    DWORD type = 0;
+    DWORD read = size;
+    LONG r = RegQueryValueEx(hKey, name, NULL, &type, (BYTE *)pData, &read);
+
+    RegCloseKey(hKey);
+
+    return r == ERROR_SUCCESS && type == REG_BINARY && read == size;
+}
+
+static void
+Settings_SaveBinary(const WCHAR *name, const void *pData, DWORD size)
+{
+    HKEY hKey;
+    if (RegCreateKeyEx(HKEY_CURRENT_USER, g_settingsKey, 0, NULL, 0, KEY_SET_VALUE, NULL, &hKey, NULL) != ERROR_SUCCESS)
+        return;
+
+    RegSetValueEx(hKey, name, 0, REG_BINARY, (const BYTE *)pData, size);
+
+    RegCloseKey(hKey);
+}
+
+BOOL
+Settings_LoadSource(TW_IDENTITY *pSource)
+{
+    if (!Settings_LoadBinary(L"LastSource", pSource, sizeof(*pSource)))
+        return FALSE;
+
+    // the strings come from the registry, don't trust them
+    pSource->Manufacturer[sizeof(pSource->Manufacturer) - 1] = 0;
+    pSource->ProductFamily[sizeof(pSource->ProductFamily) - 1] = 0;
+    pSource->ProductName[sizeof(pSource->ProductName) - 1] = 0;
+    pSource->Version.Info[sizeof(pSource->Version.Info) - 1] = 0;
+
+    return pSource->ProductName[0] != 0;
+}
+
+void
+Settings_SaveSource(const TW_IDENTITY *pSource)
+{
+    Settings_SaveBinary(L"LastSource", pSource, sizeof(*pSource));
+}
+
+BOOL
+Settings_GetDataDir(const WCHAR *subdir, WCHAR *dir)
+{
+    if (FAILED(SHGetFolderPath(NULL, CSIDL_LOCAL_APPDATA|CSIDL_FLAG_CREATE, NULL, SHGFP_TYPE_CURRENT, dir)))
+        return FALSE;
+
+    const WCHAR *parts[] = {
+        L"Genosse Einhorn",
+        L"TWAIN Example Application",
+        subdir
+    };
+    for (UINT i = 0; i < sizeof(parts)/sizeof(parts[0]); ++i) {
+        if (lstrlen(dir) + 1 + lstrlen(parts[i]) >= MAX_PATH)
+            return FALSE;
+        lstrcat(dir, L"\\");
+        lstrcat(dir, parts[i]);
+        CreateDirectory(dir, NULL);
+    }
+
+    return TRUE;
+}
+
+BOOL
+Settings_DataFilePath(const WCHAR *dir, const WCHAR *name, const WCHAR *ext, WCHAR *path)
+{
+    if (!*name || lstrlen(name) > 70 || lstrlen(ext) > 8)
+        return FALSE;
+
+    wsprintf(path, L"%s\\", dir);
+
+    // names may contain anything
+    WCHAR *p = path + lstrlen(path);
+    for (; *name; ++name) {
+        WCHAR c = *name;
+        if (c < 32 || c == '\\' || c == '/' || c == ':' || c == '*'
+            || c == '?' || c == '"' || c == '<' || c == '>' || c == '|')
+            c = '_';
+        *p++ = c;
+    }
+    *p = 0;
+
+    lstrcat(path, ext);
+    return TRUE;
+}
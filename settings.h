@@ -0,0 +1,37 @@
+#pragma once
+
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <windows.h>
+#include "twain.h"
+
+// Per-user settings under HKEY_CURRENT_USER\Software\Genosse Einhorn\TWAIN Example Application
+// and files under %LOCALAPPDATA%\Genosse Einhorn\TWAIN Example Application
+
+BOOL
+Settings_LoadSource(TW_IDENTITY *pSource);
+
+void
+Settings_SaveSource(const TW_IDENTITY *pSource);
+
+// Creates the data directory "subdir" if necessary and stores its path
+// in dir, which needs to hold MAX_PATH characters
+BOOL
+Settings_GetDataDir(const WCHAR *subdir, WCHAR *dir);
+
+// Sanitizes a name from a driver or the user into a file name:
+// dir\name.ext, with path at least MAX_PATH + 80 characters
+BOOL
+Settings_DataFilePath(const WCHAR *dir, const WCHAR *name, const WCHAR *ext, WCHAR *path);
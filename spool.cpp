@@ -0,0 +1,644 @@
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "spool.h"
+#include "settings.h"
+#include "tracelog.h"
+
+static BOOL
+Spool_Write(HANDLE hFile, const void *data, SIZE_T size)
+{
+    DWORD written = 0;
+    return size <= 0xffffffffu && WriteFile(hFile, data, (DWORD)size, &written, NULL) && written == size;
+}
+
+// FALSE at the end of the journal, also in the middle of a record
+static BOOL
+Spool_Read(HANDLE hFile, void *data, DWORD size)
+{
+    DWORD got = 0;
+    return ReadFile(hFile, data, size, &got, NULL) && got == size;
+}
+
+// One entry of the writer thread's queue: a page, a separator or a done record
+struct SpoolItem {
+    SpoolItem   *next;
+    Spool       *spool;
+    LONG         refCount;    // the writer's, and the OverflowDib's of a page; under the lock
+    HGLOBAL      hDib;        // the page, until it's journaled and nobody waits for it
+    IC_UINT64    offset;      // of the DIB in the journal
+    BOOL         journaled;   // or lost, hDib is kept then
+    BOOL         waiting;     // Spool_TakePage() wants the memory
+    HANDLE       hJournaled;  // set for it, may be NULL
+    SpoolRecord  record;
+};
+
+// Opens the next journal of the batch, named after it; another instance
+// may have started a batch in the same second
+static BOOL
+Spool_OpenJournal(Spool *pSpool)
+{
+    WCHAR dir[MAX_PATH];
+    if (!Settings_GetDataDir(L"Spool", dir))
+        return FALSE;
+
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+    while (hFile == INVALID_HANDLE_VALUE && ++pSpool->suffix < 100000) {
+        WCHAR name[40];
+        wsprintf(name, pSpool->suffix > 1 ? L"%s-%u" : L"%s", pSpool->batchId, pSpool->suffix);
+        if (!Settings_DataFilePath(dir, name, L".spool", pSpool->path))
+            break;
+
+        hFile = CreateFile(pSpool->path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_NEW,
+                           FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (hFile == INVALID_HANDLE_VALUE && GetLastError() != ERROR_FILE_EXISTS)
+            break;
+    }
+    if (hFile == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    SpoolHeader header;
+    ZeroMemory(&header, sizeof(header));
+    header.magic = SPOOL_MAGIC;
+    header.headerSize = sizeof(SpoolHeader);
+    header.recordSize = sizeof(SpoolRecord);
+    header.settings = pSpool->settings;
+
+    HANDLE hRead = CreateFile(pSpool->path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hRead == INVALID_HANDLE_VALUE || !Spool_Write(hFile, &header, sizeof(header))) {
+        if (hRead != INVALID_HANDLE_VALUE)
+            CloseHandle(hRead);
+        CloseHandle(hFile);
+        DeleteFile(pSpool->path);
+        return FALSE;
+    }
+
+    pSpool->hFile = hFile;
+    pSpool->hRead = hRead;
+    pSpool->size = sizeof(header);
+    return TRUE;
+}
+
+// Keeps the journal for Spool_Recover() if pending pages aren't done,
+// deletes it otherwise
+static void
+Spool_CloseJournal(Spool *pSpool, IC_UINT32 pending)
+{
+    if (pSpool->hFile == INVALID_HANDLE_VALUE)
+        return;
+
+    CloseHandle(pSpool->hRead);
+    CloseHandle(pSpool->hFile);
+    pSpool->hFile = INVALID_HANDLE_VALUE;
+    pSpool->hRead = INVALID_HANDLE_VALUE;
+
+    if (pending)
+        TraceLog_Write(L"spool: %lu pages not written, kept in %s", pending, pSpool->path);
+    else
+        DeleteFile(pSpool->path);
+}
+
+// called with the lock held
+static void
+Spool_ReleaseItem(SpoolItem *pItem)
+{
+    if (--pItem->refCount)
+        return;
+
+    if (pItem->hDib)
+        GlobalFree(pItem->hDib);
+    HeapFree(GetProcessHeap(), 0, pItem);
+}
+
+// called with the lock held
+static void
+Spool_Queue(Spool *pSpool, SpoolItem *pItem)
+{
+    if (pSpool->queueTail)
+        pSpool->queueTail->next = pItem;
+    else
+        pSpool->queueHead = pItem;
+    pSpool->queueTail = pItem;
+
+    SetEvent(pSpool->hWork);
+}
+
+// Appends what was queued since the last round and flushes it to disk
+// once for all of it; the journal is only written here
+static void
+Spool_WriteItems(Spool *pSpool, SpoolItem *items, BOOL fresh)
+{
+    BOOL failed = pSpool->failed;
+    BOOL wrote = FALSE;
+    BOOL started = FALSE;
+
+    for (SpoolItem *item = items; item; item = item->next) {
+        BOOL page = item->record.magic == SPOOL_PAGE && !(item->record.flags & SPOOL_SEPARATOR);
+
+        // a new journal has neither the old pages' done records nor any
+        // use for separators before its first page
+        if (fresh && (item->record.magic == SPOOL_DONE || (!page && !started)))
+            continue;
+        if (page)
+            started = TRUE;
+        if (failed)
+            continue;
+
+        const void *data = page ? GlobalLock(item->hDib) : NULL;
+        BOOL ok = (!page || data)
+            && Spool_Write(pSpool->hFile, &item->record, sizeof(item->record))
+            && (!page || Spool_Write(pSpool->hFile, data, item->record.size));
+        if (data)
+            GlobalUnlock(item->hDib);
+
+        // after a failed write, the records wouldn't line up anymore
+        if (!ok) {
+            failed = TRUE;
+            TraceLog_Write(L"spool: failed to append record %lu, error %lu", item->record.id, GetLastError());
+            continue;
+        }
+
+        item->offset = pSpool->size + sizeof(item->record);
+        pSpool->size += sizeof(item->record) + (page ? item->record.size : 0);
+        wrote = TRUE;
+    }
+
+    if (!failed && wrote && !FlushFileBuffers(pSpool->hFile)) {
+        failed = TRUE;
+        TraceLog_Write(L"spool: failed to flush %s, error %lu", pSpool->path, GetLastError());
+    }
+
+    EnterCriticalSection(&pSpool->lock);
+
+    pSpool->failed = failed;
+
+    while (items) {
+        SpoolItem *item = items;
+        items = item->next;
+
+        if (item->record.magic == SPOOL_PAGE && !(item->record.flags & SPOOL_SEPARATOR)) {
+            // Pages of a round that failed aren't safe on disk; they're
+            // written from memory, and their done records are left out.
+            // Every later page is lost as well, so one id marks them all.
+            if (failed) {
+                if (!pSpool->lostFrom || item->record.id < pSpool->lostFrom)
+                    pSpool->lostFrom = item->record.id;
+                pSpool->pending--;
+            } else if (!item->waiting) {
+                GlobalFree(item->hDib);
+                item->hDib = NULL;
+            }
+
+            item->journaled = TRUE;
+            if (item->hJournaled)
+                SetEvent(item->hJournaled);
+        }
+
+        Spool_ReleaseItem(item);
+    }
+
+    LeaveCriticalSection(&pSpool->lock);
+}
+
+static DWORD WINAPI
+Spool_WriterMain(LPVOID param)
+{
+    Spool *pSpool = (Spool *)param;
+
+    for (BOOL stopping = FALSE; !stopping; ) {
+        WaitForSingleObject(pSpool->hWork, INFINITE);
+
+        EnterCriticalSection(&pSpool->lock);
+        SpoolItem *items = pSpool->queueHead;
+        pSpool->queueHead = NULL;
+        pSpool->queueTail = NULL;
+        stopping = pSpool->stopping;
+
+        // Every page in the journal is done, only the queued ones aren't
+        // in there yet: they start a new one, so the disk doesn't fill up
+        // with pages that are written already. Nobody reads from the old
+        // journal anymore, and it's deleted even though this round's done
+        // records never make it in there.
+        BOOL fresh = !pSpool->failed && pSpool->pending == pSpool->queuedPages
+            && pSpool->size >= SPOOL_JOURNAL_SIZE;
+        pSpool->queuedPages = 0;
+        LeaveCriticalSection(&pSpool->lock);
+
+        if (fresh) {
+            Spool_CloseJournal(pSpool, 0);
+            if (Spool_OpenJournal(pSpool)) {
+                TraceLog_Write(L"spool: every page done, continuing in %s", pSpool->path);
+            } else {
+                TraceLog_Write(L"spool: failed to start a new journal, error %lu", GetLastError());
+                EnterCriticalSection(&pSpool->lock);
+                pSpool->failed = TRUE;
+                LeaveCriticalSection(&pSpool->lock);
+            }
+        }
+
+        Spool_WriteItems(pSpool, items, fresh);
+    }
+
+    return 0;
+}
+
+Spool *
+Spool_Create(const PageWriterSettings *pSettings, const WCHAR *batchId)
+{
+    Spool *pSpool = (Spool *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(*pSpool));
+    if (!pSpool)
+        return NULL;
+
+    lstrcpyn(pSpool->batchId, batchId, sizeof(pSpool->batchId)/sizeof(pSpool->batchId[0]));
+    pSpool->settings = *pSettings;
+    pSpool->hFile = INVALID_HANDLE_VALUE;
+    pSpool->hRead = INVALID_HANDLE_VALUE;
+
+    if (!Spool_OpenJournal(pSpool)) {
+        TraceLog_Write(L"spool: failed to create the journal of batch %s, error %lu", batchId, GetLastError());
+        HeapFree(GetProcessHeap(), 0, pSpool);
+        return NULL;
+    }
+
+    InitializeCriticalSection(&pSpool->lock);
+    pSpool->hWork = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (pSpool->hWork)
+        pSpool->hThread = CreateThread(NULL, 0, Spool_WriterMain, pSpool, 0, NULL);
+
+    if (!pSpool->hThread) {
+        TraceLog_Write(L"spool: failed to start the writer of batch %s, error %lu", batchId, GetLastError());
+        Spool_CloseJournal(pSpool, 0);
+        if (pSpool->hWork)
+            CloseHandle(pSpool->hWork);
+        DeleteCriticalSection(&pSpool->lock);
+        HeapFree(GetProcessHeap(), 0, pSpool);
+        return NULL;
+    }
+
+    return pSpool;
+}
+
+void
+Spool_Close(Spool *pSpool)
+{
+    if (!pSpool)
+        return;
+
+    // the writer finishes the queue first
+    EnterCriticalSection(&pSpool->lock);
+    pSpool->stopping = TRUE;
+    SetEvent(pSpool->hWork);
+    LeaveCriticalSection(&pSpool->lock);
+
+    WaitForSingleObject(pSpool->hThread, INFINITE);
+    CloseHandle(pSpool->hThread);
+    CloseHandle(pSpool->hWork);
+
+    EnterCriticalSection(&pSpool->lock);
+    IC_UINT32 pending = pSpool->pending;
+    LeaveCriticalSection(&pSpool->lock);
+    Spool_CloseJournal(pSpool, pending);
+
+    DeleteCriticalSection(&pSpool->lock);
+    HeapFree(GetProcessHeap(), 0, pSpool);
+}
+
+IC_UINT32
+Spool_AppendPage(Spool *pSpool, HGLOBAL hDib, const PageWriterPageInfo *pInfo, BOOL separator,
+                 OverflowDib *pDib)
+{
+    SIZE_T size = GlobalSize(hDib);
+
+    SpoolItem *item = NULL;
+    if (pSpool && (separator || size <= 0xffffffffu))
+        item = (SpoolItem *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(*item));
+
+    if (item) {
+        item->spool = pSpool;
+        item->record.magic = SPOOL_PAGE;
+        item->record.info = *pInfo;
+        item->record.info.spoolId = 0;
+
+        EnterCriticalSection(&pSpool->lock);
+
+        if (pSpool->failed) {
+            HeapFree(GetProcessHeap(), 0, item);
+            item = NULL;
+        } else if (separator) {
+            // a separator only needs its place in the order
+            item->record.id = ++pSpool->lastId;
+            item->record.flags = SPOOL_SEPARATOR;
+            item->refCount = 1;
+            Spool_Queue(pSpool, item);
+            item = NULL;
+        } else {
+            item->record.id = ++pSpool->lastId;
+            item->record.size = (DWORD)size;
+            item->hDib = hDib;
+            item->refCount = 2;
+            pSpool->pending++;
+            pSpool->queuedPages++;
+            Spool_Queue(pSpool, item);
+        }
+
+        LeaveCriticalSection(&pSpool->lock);
+    }
+
+    if (!item) {
+        Overflow_Put(pDib, hDib);
+        return 0;
+    }
+
+    // the writer thread frees it once it's on disk
+    pDib->hDib = NULL;
+    pDib->offset = 0;
+    pDib->size = size;
+    pDib->spooled = item;
+    return item->record.id;
+}
+
+void
+Spool_MarkDone(Spool *pSpool, IC_UINT32 id)
+{
+    if (!pSpool || !id)
+        return;
+
+    SpoolItem *item = (SpoolItem *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(*item));
+
+    EnterCriticalSection(&pSpool->lock);
+
+    // pages that never made it into the journal weren't counted
+    if (!pSpool->lostFrom || id < pSpool->lostFrom) {
+        pSpool->pending--;
+
+        // without the record, the page would be written again after a crash
+        if (item && !pSpool->failed) {
+            item->record.magic = SPOOL_DONE;
+            item->record.id = id;
+            item->refCount = 1;
+            Spool_Queue(pSpool, item);
+            item = NULL;
+        }
+    }
+
+    LeaveCriticalSection(&pSpool->lock);
+
+    if (item)
+        HeapFree(GetProcessHeap(), 0, item);
+}
+
+HGLOBAL
+Spool_TakePage(SpoolItem *pItem)
+{
+    Spool *pSpool = pItem->spool;
+
+    EnterCriticalSection(&pSpool->lock);
+
+    // the writer keeps the memory for us then, no need to read it back
+    if (!pItem->journaled) {
+        HANDLE hJournaled = CreateEvent(NULL, TRUE, FALSE, NULL);
+        pItem->waiting = TRUE;
+        pItem->hJournaled = hJournaled;
+        while (!pItem->journaled) {
+            LeaveCriticalSection(&pSpool->lock);
+            if (hJournaled)
+                WaitForSingleObject(hJournaled, INFINITE);
+            else
+                Sleep(10);
+            EnterCriticalSection(&pSpool->lock);
+        }
+        pItem->hJournaled = NULL;
+        if (hJournaled)
+            CloseHandle(hJournaled);
+    }
+
+    HGLOBAL hDib = pItem->hDib;
+    pItem->hDib = NULL;
+    HANDLE hRead = pSpool->hRead;
+    IC_UINT64 offset = pItem->offset;
+    DWORD size = pItem->record.size;
+    Spool_ReleaseItem(pItem);
+
+    LeaveCriticalSection(&pSpool->lock);
+
+    if (hDib)
+        return hDib;
+
+    // the journal doesn't change under a page that isn't done yet, and
+    // it's most likely still in the file cache
+    hDib = GlobalAlloc(GMEM_MOVEABLE, size);
+    void *dib = hDib ? GlobalLock(hDib) : NULL;
+
+    OVERLAPPED ov;
+    ZeroMemory(&ov, sizeof(ov));
+    ov.Offset = (DWORD)offset;
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+    DWORD got = 0;
+    BOOL ok = dib && ReadFile(hRead, dib, size, &got, &ov) && got == size;
+    if (dib)
+        GlobalUnlock(hDib);
+
+    if (!ok) {
+        if (dib)
+            TraceLog_Write(L"spool: failed to read a page back from %s, error %lu", pSpool->path, GetLastError());
+        if (hDib)
+            GlobalFree(hDib);
+        return NULL;
+    }
+
+    return hDib;
+}
+
+void
+Spool_DropPage(SpoolItem *pItem)
+{
+    Spool *pSpool = pItem->spool;
+
+    EnterCriticalSection(&pSpool->lock);
+    Spool_ReleaseItem(pItem);
+    LeaveCriticalSection(&pSpool->lock);
+}
+
+// Writes one recovered page right away, there is no pool yet; takes ownership of hDib
+static BOOL
+Spool_WritePage(PageWriterBatch *pBatch, HGLOBAL hDib, const PageWriterPageInfo *pInfo)
+{
+    const WCHAR *error = L"Out of memory";
+    BOOL ok;
+
+    if (PageWriter_IsMultiPage(pBatch)) {
+        BOOL drain = FALSE;
+        ok = PageWriter_QueueDocumentPage(pBatch, hDib, pInfo, &drain)
+            && (!drain || PageWriter_DrainDocument(pBatch, &error));
+    } else {
+        PageWriterFile file;
+        ok = PageWriter_ClaimFile(pBatch, &file, &error)
+            && PageWriter_WriteImage(pBatch, &file, hDib, pInfo, &error);
+        GlobalFree(hDib);
+    }
+
+    if (!ok)
+        TraceLog_Write(L"spool: failed to write a recovered page: %s", error);
+    return ok;
+}
+
+static void
+Spool_WriteBreak(PageWriterBatch *pBatch)
+{
+    const WCHAR *error = NULL;
+    BOOL drain = FALSE;
+    if (PageWriter_IsMultiPage(pBatch) && PageWriter_QueueDocumentBreak(pBatch, &drain) && drain)
+        PageWriter_DrainDocument(pBatch, &error);
+}
+
+// Returns the number of pages written
+static UINT
+Spool_RecoverJournal(const WCHAR *path)
+{
+    // exclusive, so journals of batches still running are left alone
+    HANDLE hFile = CreateFile(path, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return 0;
+
+    SpoolHeader header;
+    BOOL ok = Spool_Read(hFile, &header, sizeof(header))
+        && header.magic == SPOOL_MAGIC
+        && header.headerSize == sizeof(SpoolHeader)
+        && header.recordSize == sizeof(SpoolRecord);
+
+    // first pass: which pages are done already
+    NumberSet done;
+    NumberSet_Init(&done);
+    SpoolRecord r;
+    while (ok && Spool_Read(hFile, &r, sizeof(r))) {
+        LARGE_INTEGER skip;
+        skip.QuadPart = r.size;
+        if (r.magic == SPOOL_DONE) {
+            if (!NumberSet_Add(&done, r.id))
+                ok = FALSE;
+        } else if (r.magic != SPOOL_PAGE || !SetFilePointerEx(hFile, skip, NULL, FILE_CURRENT)) {
+            break;
+        }
+    }
+    NumberSet_Seal(&done);
+
+    // second pass: the others, with the batch's settings
+    PageWriterSettings settings = header.settings;
+    settings.spool = FALSE;
+    PageWriterBatch *batch = NULL;
+    UINT written = 0;
+
+    LARGE_INTEGER start;
+    start.QuadPart = sizeof(header);
+    if (ok)
+        ok = SetFilePointerEx(hFile, start, NULL, FILE_BEGIN);
+
+    while (ok && Spool_Read(hFile, &r, sizeof(r))) {
+        if (r.magic == SPOOL_DONE)
+            continue;
+        if (r.magic != SPOOL_PAGE)
+            break;
+
+        if (r.flags & SPOOL_SEPARATOR) {
+            if (batch)
+                Spool_WriteBreak(batch);
+            continue;
+        }
+
+        LARGE_INTEGER skip;
+        skip.QuadPart = r.size;
+        if (NumberSet_Contains(&done, r.id)) {
+            SetFilePointerEx(hFile, skip, NULL, FILE_CURRENT);
+            continue;
+        }
+
+        HGLOBAL hDib = GlobalAlloc(GMEM_MOVEABLE, r.size);
+        void *dib = hDib ? GlobalLock(hDib) : NULL;
+        BOOL complete = dib && Spool_Read(hFile, dib, r.size);
+        if (dib)
+            GlobalUnlock(hDib);
+
+        if (!complete) {
+            if (hDib)
+                GlobalFree(hDib);
+            // out of memory, or the crash cut the page short
+            if (!dib)
+                ok = FALSE;
+            break;
+        }
+
+        if (!batch)
+            batch = PageWriter_CreateBatch(&settings);
+        if (!batch) {
+            GlobalFree(hDib);
+            ok = FALSE;
+            break;
+        }
+
+        r.info.spoolId = 0;
+        if (Spool_WritePage(batch, hDib, &r.info))
+            ++written;
+        else
+            ok = FALSE;
+    }
+
+    NumberSet_Free(&done);
+
+    // finishes the document, if any
+    PageWriter_ReleaseBatch(batch);
+    CloseHandle(hFile);
+
+    TraceLog_Write(L"spool: wrote %u pages left in %s", written, path);
+
+    if (ok) {
+        DeleteFile(path);
+        return written;
+    }
+
+    // not again at every start; the pages stay for a look by hand
+    WCHAR badPath[MAX_PATH + 84];
+    wsprintf(badPath, L"%s.bad", path);
+    MoveFileEx(path, badPath, MOVEFILE_REPLACE_EXISTING);
+    TraceLog_Write(L"spool: kept %s", badPath);
+    return written;
+}
+
+UINT
+Spool_Recover(void)
+{
+    WCHAR dir[MAX_PATH];
+    if (!Settings_GetDataDir(L"Spool", dir))
+        return 0;
+
+    WCHAR pattern[MAX_PATH + 16];
+    wsprintf(pattern, L"%s\\*.spool", dir);
+
+    UINT written = 0;
+    WIN32_FIND_DATA fd;
+    HANDLE hFind = FindFirstFile(pattern, &fd);
+    if (hFind == INVALID_HANDLE_VALUE)
+        return 0;
+
+    do {
+        WCHAR path[MAX_PATH + 80];
+        if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && lstrlen(dir) + lstrlen(fd.cFileName) < MAX_PATH + 78) {
+            wsprintf(path, L"%s\\%s", dir, fd.cFileName);
+            written += Spool_RecoverJournal(path);
+        }
+    } while (FindNextFile(hFind, &fd));
+    FindClose(hFind);
+
+    return written;
+}
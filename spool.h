@@ -0,0 +1,131 @@
+#pragma once
+
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <windows.h>
+#include "pagewriter.h"
+
+// A journal of the transferred pages, so a crash doesn't lose what the
+// scanner already fed through. Every page is handed to the spool's
+// writer thread as it arrives, so the transfer goes on right away; the
+// writer appends the pages that have come in since its last round, raw
+// DIB and all, and flushes them to disk together. Then their memory is
+// freed, and the encoders read each page back from the journal when its
+// turn comes. When a page is written (or left out on purpose), a small
+// done record follows it.
+//
+// The journals live in the Spool data folder. Once every page in the
+// current one is done and it has grown past SPOOL_JOURNAL_SIZE, it's
+// deleted and the next page starts a new one, so a long batch doesn't
+// keep every page on disk; the last one is deleted when the batch ends
+// with every page done. After a crash, Spool_Recover() at the next start
+// writes the pages that aren't done with the settings the batch had;
+// pages of other sources are in their transfer order then.
+//
+// The layout is a SpoolHeader followed by SpoolRecords, each page record
+// followed by its DIB. A record cut short by the crash ends the journal.
+
+#define SPOOL_MAGIC  0x4c4f5053u  // "SPOL"
+#define SPOOL_PAGE   0x45474150u  // "PAGE"
+#define SPOOL_DONE   0x454e4f44u  // "DONE"
+
+enum {
+    SPOOL_SEPARATOR = 0x1  // a separator page, ends the document; no DIB
+};
+
+struct SpoolHeader {
+    DWORD              magic;
+    DWORD              headerSize;  // sizeof(SpoolHeader) and sizeof(SpoolRecord),
+    DWORD              recordSize;  // so another build doesn't misread the journal
+    PageWriterSettings settings;
+};
+
+struct SpoolRecord {
+    DWORD              magic;  // SPOOL_PAGE or SPOOL_DONE
+    DWORD              id;     // of the page, counting from 1
+    DWORD              flags;  // SPOOL_SEPARATOR
+    DWORD              size;   // bytes of DIB that follow
+    PageWriterPageInfo info;
+};
+
+#define SPOOL_JOURNAL_SIZE (64 * 1024 * 1024)
+
+struct SpoolItem;
+
+struct Spool {
+    CRITICAL_SECTION   lock;
+    HANDLE             hFile;       // the current journal, only the writer thread writes
+    HANDLE             hRead;       // the same, for reading pages back
+    IC_UINT64          size;        // of the current journal
+    WCHAR              path[MAX_PATH + 80];
+    WCHAR              batchId[24];
+    UINT               suffix;      // of the current journal's name
+    PageWriterSettings settings;    // for the header of the next one
+    IC_UINT32          lastId;
+    IC_UINT32          pending;     // pages appended and not done yet
+    IC_UINT32          queuedPages; // of those, the ones not handed to the writer yet
+    IC_UINT32          lostFrom;    // pages from this id on aren't in the journal, 0 if all are
+    BOOL               failed;      // a write failed, no more pages are appended
+    SpoolItem         *queueHead;   // for the writer thread
+    SpoolItem         *queueTail;
+    HANDLE             hWork;       // auto-reset, set when something is queued
+    HANDLE             hThread;
+    BOOL               stopping;
+};
+
+// Creates the first journal of a batch and starts its writer thread,
+// NULL if that fails; the batch then goes on without a spool
+Spool *
+Spool_Create(const PageWriterSettings *pSettings, const WCHAR *batchId);
+
+// Lets the writer thread finish what's queued, then deletes the journal
+// if every page is done and keeps it for Spool_Recover() otherwise.
+// Every page taken over by Spool_AppendPage() must be taken or dropped
+// by now.
+void
+Spool_Close(Spool *pSpool);
+
+// Appends a page, from the transfer thread; safe to call from several at
+// once. Takes ownership of hDib and queues it in *pDib, to be taken out
+// with Overflow_Take() or Overflow_Drop(): until it's in the journal it
+// stays in memory, afterwards it's read back from there. Separators, and
+// pages after a failed write, only go through Overflow_Put(), as they do
+// if pSpool is NULL. Returns the page's id for
+// PageWriterPageInfo.spoolId, or 0 if it isn't journaled.
+IC_UINT32
+Spool_AppendPage(Spool *pSpool, HGLOBAL hDib, const PageWriterPageInfo *pInfo, BOOL separator,
+                 OverflowDib *pDib);
+
+// The page is written or dropped. Does nothing for id 0 or a NULL pSpool.
+void
+Spool_MarkDone(Spool *pSpool, IC_UINT32 id);
+
+// For Overflow_Take(): the page's DIB, read back from the journal if it
+// was freed; waits until the writer thread has dealt with the page.
+// NULL if out of memory or the read fails.
+HGLOBAL
+Spool_TakePage(SpoolItem *pItem);
+
+// for Overflow_Drop(); the page stays in the journal until it's marked done
+void
+Spool_DropPage(SpoolItem *pItem);
+
+// Writes out the pages left in the journals of batches that didn't end,
+// e.g. after a crash, and deletes the journals. Journals that are still
+// open by another instance are left alone, those with pages that can't
+// be written are renamed to .bad and kept. Needs PageWriter_Initialize().
+// Returns the number of pages written.
+UINT
+Spool_Recover(void);
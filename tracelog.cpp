@@ -0,0 +1,164 @@
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "tracelog.h"
+#include "settings.h"
+
+#include <windows.h>
+
+// the log starts over once it gets bigger than this
+#define TRACELOG_MAX_FILE_SIZE (1024 * 1024)
+
+static CRITICAL_SECTION g_traceLogLock;
+static BOOL             g_traceLogInitialized;
+static HANDLE           g_hTraceLogFile = INVALID_HANDLE_VALUE;
+
+// a ring of the last lines, protected by g_traceLogLock
+static WCHAR            g_recentLines[TRACELOG_RECENT_LINES][TRACELOG_MAX_LINE + 40];
+static UINT             g_recentNext;
+static UINT             g_recentCount;
+
+static HANDLE
+TraceLog_OpenFile(void)
+{
+    WCHAR path[MAX_PATH + 80];
+    WCHAR dir[MAX_PATH];
+    if (!Settings_GetDataDir(L"Logs", dir) || !Settings_DataFilePath(dir, L"twainclient", L".log", path))
+        return INVALID_HANDLE_VALUE;
+
+    HANDLE hFile = CreateFile(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, 0, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return hFile;
+
+    if (GetFileSize(hFile, NULL) > TRACELOG_MAX_FILE_SIZE) {
+        SetFilePointer(hFile, 0, NULL, FILE_BEGIN);
+        SetEndOfFile(hFile);
+    }
+
+    SetFilePointer(hFile, 0, NULL, FILE_END);
+    return hFile;
+}
+
+void
+TraceLog_Initialize(void)
+{
+    if (g_traceLogInitialized)
+        return;
+
+    InitializeCriticalSection(&g_traceLogLock);
+    g_hTraceLogFile = TraceLog_OpenFile();
+    g_traceLogInitialized = TRUE;
+
+    TraceLog_Write(L"--- started");
+}
+
+void
+TraceLog_Teardown(void)
+{
+    if (!g_traceLogInitialized)
+        return;
+
+    g_traceLogInitialized = FALSE;
+    if (g_hTraceLogFile != INVALID_HANDLE_VALUE)
+        CloseHandle(g_hTraceLogFile);
+    g_hTraceLogFile = INVALID_HANDLE_VALUE;
+    DeleteCriticalSection(&g_traceLogLock);
+}
+
+void
+TraceLog_Write(const WCHAR *format, ...)
+{
+    if (!g_traceLogInitialized)
+        return;
+
+    WCHAR line[TRACELOG_MAX_LINE + 40];
+    int len = wsprintf(line, L"%10lu %5lu ", GetTickCount(), GetCurrentThreadId());
+
+    // wvsprintf stops at 1024 characters, so format into a bigger buffer first
+    WCHAR text[1025];
+    va_list args;
+    va_start(args, format);
+    wvsprintf(text, format, args);
+    va_end(args);
+
+    lstrcpyn(line + len, text, TRACELOG_MAX_LINE);
+    lstrcat(line, L"\r\n");
+
+    char mb[sizeof(line)];
+    int mblen = WideCharToMultiByte(CP_ACP, 0, line, -1, mb, sizeof(mb), NULL, NULL);
+
+    EnterCriticalSection(&g_traceLogLock);
+    if (g_hTraceLogFile != INVALID_HANDLE_VALUE && mblen > 1) {
+        DWORD written;
+        WriteFile(g_hTraceLogFile, mb, (DWORD)(mblen - 1), &written, NULL);
+    }
+
+    lstrcpy(g_recentLines[g_recentNext], line);
+    g_recentNext = (g_recentNext + 1) % TRACELOG_RECENT_LINES;
+    if (g_recentCount < TRACELOG_RECENT_LINES)
+        g_recentCount++;
+    LeaveCriticalSection(&g_traceLogLock);
+}
+
+static void
+TraceLog_WriteText(HANDLE hFile, const WCHAR *text)
+{
+    char mb[1024];
+    while (*text) {
+        // no code page needs more than three bytes per UTF-16 unit
+        int len = lstrlen(text);
+        if (len > 256)
+            len = 256;
+
+        int mblen = WideCharToMultiByte(CP_ACP, 0, text, len, mb, sizeof(mb), NULL, NULL);
+        DWORD written;
+        if (mblen > 0)
+            WriteFile(hFile, mb, (DWORD)mblen, &written, NULL);
+        text += len;
+    }
+}
+
+BOOL
+TraceLog_SaveReport(const WCHAR *kind, const WCHAR *text, WCHAR *pPath)
+{
+    SYSTEMTIME now;
+    GetLocalTime(&now);
+
+    WCHAR name[80];
+    wsprintf(name, L"%s-%04u%02u%02u-%02u%02u%02u", kind,
+             now.wYear, now.wMonth, now.wDay, now.wHour, now.wMinute, now.wSecond);
+
+    WCHAR dir[MAX_PATH];
+    if (!Settings_GetDataDir(L"Logs", dir) || !Settings_DataFilePath(dir, name, L".txt", pPath))
+        return FALSE;
+
+    HANDLE hFile = CreateFile(pPath, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, 0, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    TraceLog_WriteText(hFile, text);
+    TraceLog_WriteText(hFile, L"\r\nRecent trace:\r\n");
+
+    if (g_traceLogInitialized) {
+        EnterCriticalSection(&g_traceLogLock);
+        UINT first = (g_recentNext + TRACELOG_RECENT_LINES - g_recentCount) % TRACELOG_RECENT_LINES;
+        for (UINT i = 0; i < g_recentCount; ++i)
+            TraceLog_WriteText(hFile, g_recentLines[(first + i) % TRACELOG_RECENT_LINES]);
+        LeaveCriticalSection(&g_traceLogLock);
+    }
+
+    BOOL ok = FlushFileBuffers(hFile);
+    CloseHandle(hFile);
+    return ok;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <windows.h>
+
+// A diagnostic log for what isn't worth an error message, e.g. a source
+// that silently ignored a setting. Lines go to
+// %LOCALAPPDATA%\Genosse Einhorn\TWAIN Example Application\Logs\twainclient.log,
+// each with the tick count and thread id. Safe to call from any thread,
+// does nothing before TraceLog_Initialize().
+//
+// The most recent lines are also kept in memory, for diagnostic reports
+// written when something went badly wrong.
+
+enum {
+    TRACELOG_MAX_LINE = 256,
+    TRACELOG_RECENT_LINES = 64
+};
+
+void
+TraceLog_Initialize(void);
+
+void
+TraceLog_Teardown(void);
+
+// wsprintf format, without the line break
+void
+TraceLog_Write(const WCHAR *format, ...);
+
+// Writes a report file next to the log, e.g. Logs\hang-20211231-235959.txt,
+// with the text followed by the recent trace lines. *pPath gets the file
+// name, it needs MAX_PATH + 80 characters.
+BOOL
+TraceLog_SaveReport(const WCHAR *kind, const WCHAR *text, WCHAR *pPath);
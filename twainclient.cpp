@@ -20,29 +20,45 @@
 #include "twainhelper.h"
 #include "folderbrowsehelper.h"
 #include "dpihelper.h"
-
-static Gdiplus::ImageCodecInfo *g_gdiplusEncoders;
-static UINT                     g_gdiplusEncoderCount;
-
-static void
-TC_CopyFileExtension(WCHAR *buf, SIZE_T bufsize, const WCHAR *s)
-{
-    while (*s == '*' || *s == '.')
-        ++s;
-
-    while (*s && *s != ';' && bufsize > 1) {
-        *buf++ = (WCHAR)(DWORD_PTR)CharLowerW((WCHAR *)(DWORD_PTR)*s++);
-        bufsize--;
-    }
-
-    *buf = 0;
-}
+#include "pagewriter.h"
+#include "spool.h"
+#include "twainthread.h"
+#include "encoderpool.h"
+#include "settings.h"
+#include "profile.h"
+#include "tracelog.h"
+#include "batchmode.h"
+
+// session that is still selecting its source, at most one at a time
+static TwainThread     *g_pendingSession;
+
+// batch of the last scan, shared with sources that are still scanning.
+// Multi-page batches aren't kept, so the document is closed once
+// every source has finished.
+static PageWriterBatch *g_batch;
+
+// sessions kept open between batches, one per device of the job
+static TwainThread     *g_warm[SCANJOB_MAX_DEVICES];
+static UINT             g_warmCount;
+static BOOL             g_warmMerged;
+
+// what the source combo box offers, enumerated in the background
+static TwainSourceList *g_sources;
+
+// the source's settings after the last batch, for saving as a profile
+static ScanProfile     *g_lastProfile;
+
+// progress of the running job, shown instead of the driver's dialogs
+static UINT             g_progressPages;
+static UINT             g_progressPending;  // 0xffff if the source doesn't know
+static UINT             g_progressSkipped;
+static DWORD            g_progressStartTicks;
 
 static void
 TC_SetFileNumber(HWND hwndDlg, UINT number)
 {
-    WCHAR buf[5];
-    wsprintf(buf, L"%04u", number % 10000);
+    WCHAR buf[16];
+    wsprintf(buf, L"%04u", number % (PAGEWRITER_MAX_NUMBER + 1));
 
     SetDlgItemText(hwndDlg, IDC_FILENUMBEREDIT, buf);
 }
@@ -57,10 +73,39 @@ TC_FixFileNumber(HWND hwndDlg)
 static void
 TC_UpdateScanBtnState(HWND hwndDlg)
 {
-    BOOL enabled = TwainHelper_CurrentState() >= TH_STATE_DSM_OPEN && TwainHelper_CurrentState() < TH_STATE_SOURCE_ENABLED;
+    BOOL enabled = !g_pendingSession;
     EnableWindow(GetDlgItem(hwndDlg, IDC_SCANBTN), enabled);
 }
 
+static void
+TC_ShowProgress(HWND hwndDlg)
+{
+    WCHAR text[80];
+    DWORD ms = GetTickCount() - g_progressStartTicks;
+    DWORD pagesPerMinute = ms ? (DWORD)((ULONGLONG)g_progressPages * 60000 / ms) : 0;
+
+    int len;
+    if (g_progressPending == 0xffff || g_progressPending == 0)
+        len = wsprintf(text, L"%u pages, %u/min", g_progressPages, pagesPerMinute);
+    else
+        len = wsprintf(text, L"%u pages, %u more, %u/min", g_progressPages, g_progressPending, pagesPerMinute);
+
+    if (g_progressSkipped)
+        wsprintf(text + len, L", %u skipped", g_progressSkipped);
+
+    SetDlgItemText(hwndDlg, IDC_PROGRESSTEXT, text);
+}
+
+static void
+TC_ResetProgress(HWND hwndDlg)
+{
+    g_progressPages = 0;
+    g_progressPending = 0;
+    g_progressSkipped = 0;
+    g_progressStartTicks = GetTickCount();
+    SetDlgItemText(hwndDlg, IDC_PROGRESSTEXT, L"");
+}
+
 static void
 TC_ErrorDialog(HWND hwndDlg, const WCHAR *text)
 {
@@ -74,105 +119,349 @@ TC_ErrorDialog(HWND hwndDlg, const WCHAR *text)
 }
 
 static void
-TC_BeginScan(HWND hwndDlg)
+TC_StopWarmSessions(void)
 {
-    TwainHelper_CloseSource();
+    for (UINT i = 0; i < g_warmCount; ++i)
+        TwainThread_Stop(g_warm[i]);
 
-    TW_IDENTITY source;
-    ZeroMemory(&source, sizeof(source));
+    g_warmCount = 0;
+}
 
-    if (!TwainHelper_UserSelectSource(&source)) {
-        TC_ErrorDialog(hwndDlg, L"Failed to select TWAIN source");
-        goto out;
+// creates the job for the next batch, which then owns g_batch if it is
+// a multi-page document
+static ScanJob *
+TC_CreateJob(HWND hwndDlg, UINT deviceCount)
+{
+    ReorderPolicy policy = REORDER_CONCATENATE;
+    if (SendDlgItemMessage(hwndDlg, IDC_MERGEORDERCOMBO, CB_GETCURSEL, 0, 0) == 1)
+        policy = REORDER_INTERLEAVE;
+
+    ScanJob *job = NULL;
+    if (g_batch)
+        job = ScanJob_Create(g_batch, deviceCount, policy);
+    if (!job) {
+        TC_ErrorDialog(hwndDlg, L"Failed to start scanning");
+        return NULL;
     }
 
-    if (!TwainHelper_OpenSource(&source)) {
-        TC_ErrorDialog(hwndDlg, L"Failed to open TWAIN source");
-        goto out;
+    if (PageWriter_IsMultiPage(g_batch)) {
+        PageWriter_ReleaseBatch(g_batch);
+        g_batch = NULL;
     }
 
-    TwainHelper_SetNumImages((TW_UINT32)-1);
-    // ignore errors - worst case we only transfer one image
+    TC_ResetProgress(hwndDlg);
 
-    if (!TwainHelper_EnableSource(hwndDlg)) {
-        TC_ErrorDialog(hwndDlg, L"Failed to enable TWAIN source");
-        TwainHelper_CloseSource();
+    return job;
+}
+
+static void
+TC_FillProfileCombo(HWND hwndDlg)
+{
+    ScanProfileList *list = (ScanProfileList *)HeapAlloc(GetProcessHeap(), 0, sizeof(*list));
+    if (!list)
+        return;
+
+    Profile_List(list);
+
+    // keep what the user typed
+    WCHAR name[PROFILE_MAX_NAME];
+    GetDlgItemText(hwndDlg, IDC_PROFILECOMBO, name, sizeof(name)/sizeof(name[0]));
+
+    SendDlgItemMessage(hwndDlg, IDC_PROFILECOMBO, CB_RESETCONTENT, 0, 0);
+    for (UINT i = 0; i < list->count; ++i)
+        SendDlgItemMessage(hwndDlg, IDC_PROFILECOMBO, CB_ADDSTRING, 0, (LPARAM)list->names[i]);
+
+    SetDlgItemText(hwndDlg, IDC_PROFILECOMBO, name);
+
+    HeapFree(GetProcessHeap(), 0, list);
+}
+
+// FALSE if the user asked for a profile that can't be loaded,
+// *ppProfile is NULL if no profile was asked for
+static BOOL
+TC_LoadProfile(HWND hwndDlg, ScanProfile **ppProfile)
+{
+    WCHAR name[PROFILE_MAX_NAME];
+    GetDlgItemText(hwndDlg, IDC_PROFILECOMBO, name, sizeof(name)/sizeof(name[0]));
+
+    *ppProfile = NULL;
+    if (!name[0])
+        return TRUE;
+
+    *ppProfile = Profile_Load(name);
+    if (!*ppProfile) {
+        TC_ErrorDialog(hwndDlg, L"The scan profile can't be loaded");
+        return FALSE;
     }
 
-out:
-    TC_UpdateScanBtnState(hwndDlg);
+    return TRUE;
 }
 
 static void
-TC_SaveImage(HWND hwndDlg, HGLOBAL hDibGlobal)
+TC_SaveProfile(HWND hwndDlg)
 {
-    int formatIndex = SendDlgItemMessage(hwndDlg,
-                                         IDC_FILEFORMATCOMBO,
-                                         CB_GETCURSEL,
-                                         0, 0);
-    if (formatIndex < 0 || (UINT)formatIndex >= g_gdiplusEncoderCount) {
-        TC_ErrorDialog(hwndDlg, L"Invalid image format selected");
+    WCHAR name[PROFILE_MAX_NAME];
+    GetDlgItemText(hwndDlg, IDC_PROFILECOMBO, name, sizeof(name)/sizeof(name[0]));
+
+    if (!name[0]) {
+        TC_ErrorDialog(hwndDlg, L"Enter a name for the scan profile");
         return;
     }
 
-    CLSID formatClsid = g_gdiplusEncoders[formatIndex].Clsid;
+    if (!g_lastProfile) {
+        TC_ErrorDialog(hwndDlg, L"Scan with the settings you want to keep first");
+        return;
+    }
 
-    WCHAR ext[32] = L"";
+    if (!Profile_Save(name, g_lastProfile)) {
+        TC_ErrorDialog(hwndDlg, L"Failed to save the scan profile");
+        return;
+    }
 
-    TC_CopyFileExtension(ext, sizeof(ext)/sizeof(ext[0]), g_gdiplusEncoders[formatIndex].FilenameExtension);
+    TC_FillProfileCombo(hwndDlg);
+}
 
-    WCHAR basepath[MAX_PATH] = L"";
-    GetDlgItemText(hwndDlg, IDC_FOLDEREDIT, basepath, sizeof(basepath)/sizeof(basepath[0]));
+// Starts one session per source in pSources, all feeding one job that
+// writes into g_batch. A single session lets the user select the source
+// if pSources is NULL or the source isn't installed (any more).
+static void
+TC_StartJob(HWND hwndDlg, const TW_IDENTITY *pSources, UINT deviceCount)
+{
+    TwainScanOptions options;
+    TwainThread_DefaultOptions(&options);
+    options.flags |= TWAINTHREAD_CAPTURE_PROFILE;
+    if (IsDlgButtonChecked(hwndDlg, IDC_WARMCHECK) == BST_CHECKED)
+        options.flags |= TWAINTHREAD_KEEP_WARM;
+    if (IsDlgButtonChecked(hwndDlg, IDC_FASTCHECK) == BST_CHECKED)
+        options.flags |= TWAINTHREAD_NO_UI | TWAINTHREAD_NO_INDICATORS;
+    if (deviceCount == 1)
+        options.flags |= TWAINTHREAD_ASK_IF_MISSING;
+
+    ScanProfile *profile;
+    if (!TC_LoadProfile(hwndDlg, &profile))
+        return;
+    options.profile = profile;
 
-    WCHAR filename[MAX_PATH] = L"";
-    GetDlgItemText(hwndDlg, IDC_FILENAMEEDIT, filename, sizeof(filename)/sizeof(filename[0]));
+    ScanJob *job = TC_CreateJob(hwndDlg, deviceCount);
+    if (!job) {
+        Profile_Free(profile);
+        return;
+    }
 
-    UINT counter = GetDlgItemInt(hwndDlg, IDC_FILENUMBEREDIT, NULL, FALSE) % 10000;
+    TC_StopWarmSessions();
+    g_warmMerged = IsDlgButtonChecked(hwndDlg, IDC_MERGECHECK) == BST_CHECKED;
+
+    for (UINT i = 0; i < deviceCount; ++i) {
+        // the session answers with TWAINTHREAD_WM_STATE once the source is enabled
+        TwainThread *t = TwainThread_Start(hwndDlg, job, i, pSources ? &pSources[i] : NULL, &options);
+        if (!t) {
+            // the job must not wait for pages that will never come
+            ScanJob_DeviceFinished(job, i);
+            TC_ErrorDialog(hwndDlg, L"Failed to start scanning");
+            continue;
+        }
 
-    WCHAR path[1024] = L"";
+        if (deviceCount == 1)
+            g_pendingSession = t;
+        if (options.flags & TWAINTHREAD_KEEP_WARM)
+            g_warm[g_warmCount++] = t;
+    }
 
-    DWORD error = 0;
-    do {
-        wsprintf(path, L"%s\\%s%04u.%s", basepath, filename, counter, ext);
+    // every session has its own copy
+    Profile_Free(profile);
+    ScanJob_Release(job);
+}
 
-        counter = (counter + 1) % 10000;
+// starts the next batch on the sources that were kept open
+static void
+TC_ResumeJob(HWND hwndDlg)
+{
+    ScanJob *job = TC_CreateJob(hwndDlg, g_warmCount);
+    if (!job)
+        return;
 
-        // create once with CREATE_NEW and then close, GDI+ will open it again
-        HANDLE hFile = CreateFile(path, GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
-        if (!hFile || hFile == INVALID_HANDLE_VALUE) {
-            error = GetLastError();
-        } else {
-            CloseHandle(hFile);
-            error = 0;
+    BOOL busy = FALSE;
+    for (UINT i = 0; i < g_warmCount; ++i) {
+        if (!TwainThread_ScanAgain(g_warm[i], job, i)) {
+            ScanJob_DeviceFinished(job, i);
+            busy = TRUE;
         }
-    } while (error == ERROR_FILE_EXISTS);
+    }
+
+    if (busy)
+        TC_ErrorDialog(hwndDlg, L"The scanner is still busy with the previous batch");
 
-    if (error) {
-        TC_ErrorDialog(hwndDlg, L"Failed to open file");
+    ScanJob_Release(job);
+}
+
+// a session ended, a set of warm sessions is only reused as a whole
+static void
+TC_ForgetSession(TwainThread *pThread)
+{
+    for (UINT i = 0; i < g_warmCount; ++i) {
+        if (g_warm[i] == pThread) {
+            g_warm[i] = g_warm[--g_warmCount];
+            TC_StopWarmSessions();
+            return;
+        }
+    }
+}
+
+// NULL if the user wants to select the source when scanning
+static const TW_IDENTITY *
+TC_SelectedSource(HWND hwndDlg)
+{
+    LRESULT sel = SendDlgItemMessage(hwndDlg, IDC_SOURCECOMBO, CB_GETCURSEL, 0, 0);
+    if (sel == CB_ERR)
+        return NULL;
+
+    LRESULT index = SendDlgItemMessage(hwndDlg, IDC_SOURCECOMBO, CB_GETITEMDATA, (WPARAM)sel, 0);
+    if (!g_sources || index < 0 || (UINT)index >= g_sources->count)
+        return NULL;
+
+    return &g_sources->sources[index];
+}
+
+static void
+TC_FillSourceCombo(HWND hwndDlg, const TW_IDENTITY *pSelect)
+{
+    HWND hwndCombo = GetDlgItem(hwndDlg, IDC_SOURCECOMBO);
+
+    SendMessage(hwndCombo, CB_RESETCONTENT, 0, 0);
+    LRESULT sel = SendMessage(hwndCombo, CB_ADDSTRING, 0, (LPARAM)L"Select when scanning");
+    SendMessage(hwndCombo, CB_SETITEMDATA, (WPARAM)sel, (LPARAM)-1);
+
+    for (UINT i = 0; g_sources && i < g_sources->count; ++i) {
+        WCHAR name[sizeof(g_sources->sources[i].ProductName)];
+        if (!MultiByteToWideChar(CP_ACP, 0, g_sources->sources[i].ProductName, -1,
+                                 name, sizeof(name)/sizeof(name[0])))
+            continue;
+
+        LRESULT item = SendMessage(hwndCombo, CB_ADDSTRING, 0, (LPARAM)name);
+        if (item < 0)
+            continue;
+
+        SendMessage(hwndCombo, CB_SETITEMDATA, (WPARAM)item, (LPARAM)i);
+        if (pSelect && TwainHelper_IsSameSource(&g_sources->sources[i], pSelect))
+            sel = item;
+    }
+
+    SendMessage(hwndCombo, CB_SETCURSEL, (WPARAM)sel, 0);
+}
+
+// takes ownership of pList
+static void
+TC_SetSources(HWND hwndDlg, TwainSourceList *pList)
+{
+    TW_IDENTITY selected;
+    ZeroMemory(&selected, sizeof(selected));
+    const TW_IDENTITY *pSelected = TC_SelectedSource(hwndDlg);
+    if (pSelected)
+        selected = *pSelected;
+
+    TwainThread_FreeSourceList(g_sources);
+    g_sources = pList;
+
+    TC_FillSourceCombo(hwndDlg, pSelected ? &selected : NULL);
+}
+
+// until the enumeration is done, offer the source used last time
+static void
+TC_LoadLastSource(HWND hwndDlg)
+{
+    TwainSourceList *list = (TwainSourceList *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(*list));
+    if (!list)
         return;
+
+    if (Settings_LoadSource(&list->sources[0]))
+        list->count = 1;
+
+    TwainThread_FreeSourceList(g_sources);
+    g_sources = list;
+
+    TC_FillSourceCombo(hwndDlg, list->count ? &list->sources[0] : NULL);
+}
+
+// the selected source and the other sources of the same model that
+// are known to be installed
+static void
+TC_StartMergedJob(HWND hwndDlg, const TW_IDENTITY *pSelected)
+{
+    TW_IDENTITY sources[SCANJOB_MAX_DEVICES];
+    UINT count = 0;
+
+    sources[count++] = *pSelected;
+    for (UINT i = 0; g_sources && i < g_sources->count && count < SCANJOB_MAX_DEVICES; ++i) {
+        const TW_IDENTITY *other = &g_sources->sources[i];
+        BOOL self = other->Id == pSelected->Id && TwainHelper_IsSameSource(other, pSelected);
+        if (!self && TwainHelper_IsSameModel(other, pSelected))
+            sources[count++] = *other;
     }
 
-    TC_SetFileNumber(hwndDlg, counter);
+    TC_StartJob(hwndDlg, sources, count);
+}
 
-    BITMAPINFOHEADER *dibBuf = (BITMAPINFOHEADER *)GlobalLock(hDibGlobal);
+static void
+TC_BeginScan(HWND hwndDlg)
+{
+    PageWriterSettings settings;
+    ZeroMemory(&settings, sizeof(settings));
 
-    int paletteSize = 0;
-    if (dibBuf->biBitCount == 1)
-        paletteSize = 2;
-    if (dibBuf->biBitCount == 4)
-        paletteSize = 16;
-    if (dibBuf->biBitCount == 8)
-        paletteSize = 256;
+    GetDlgItemText(hwndDlg, IDC_FOLDEREDIT, settings.folder, sizeof(settings.folder)/sizeof(settings.folder[0]));
+    GetDlgItemText(hwndDlg, IDC_FILENAMEEDIT, settings.filename, sizeof(settings.filename)/sizeof(settings.filename[0]));
+    settings.counter = GetDlgItemInt(hwndDlg, IDC_FILENUMBEREDIT, NULL, FALSE);
+    if (IsDlgButtonChecked(hwndDlg, IDC_BLANKCHECK) == BST_CHECKED)
+        settings.backs |= PAGEWRITER_DROP_BLANK_BACKS;
 
-    Gdiplus::Bitmap bitmap((BITMAPINFO*)dibBuf,
-                           (char*)dibBuf + dibBuf->biSize + paletteSize * sizeof(RGBQUAD));
-    if (bitmap.GetLastStatus() != Gdiplus::Ok)
-        TC_ErrorDialog(hwndDlg, L"failed to create GDI+ bitmap");
+    int formatIndex = SendDlgItemMessage(hwndDlg,
+                                         IDC_FILEFORMATCOMBO,
+                                         CB_GETCURSEL,
+                                         0, 0);
+    if (formatIndex < 0 || (UINT)formatIndex >= PageWriter_FormatCount()) {
+        TC_ErrorDialog(hwndDlg, L"Invalid image format selected");
+        return;
+    }
+    settings.format = (UINT)formatIndex;
+
+    // sources started with unchanged settings keep sharing one counter
+    if (!g_batch
+        || PageWriter_IsMultiPage(g_batch)
+        || g_batch->settings.format != settings.format
+        || g_batch->settings.backs != settings.backs
+        || PageWriter_NextCounter(g_batch) != settings.counter % (PAGEWRITER_MAX_NUMBER + 1)
+        || lstrcmpi(g_batch->settings.folder, settings.folder) != 0
+        || lstrcmp(g_batch->settings.filename, settings.filename) != 0) {
+        PageWriter_ReleaseBatch(g_batch);
+        g_batch = PageWriter_CreateBatch(&settings);
+        if (!g_batch) {
+            TC_ErrorDialog(hwndDlg, L"Failed to start scanning");
+            return;
+        }
+    }
 
-    if (bitmap.Save(path, &formatClsid, NULL) != Gdiplus::Ok)
-        TC_ErrorDialog(hwndDlg, L"failed to save file");
+    BOOL merge = IsDlgButtonChecked(hwndDlg, IDC_MERGECHECK) == BST_CHECKED;
+    if (g_warmCount && g_warmMerged == merge) {
+        TC_ResumeJob(hwndDlg);
+        TC_UpdateScanBtnState(hwndDlg);
+        return;
+    }
+
+    // different sources this time, let go of the old ones early
+    TC_StopWarmSessions();
+
+    const TW_IDENTITY *source = TC_SelectedSource(hwndDlg);
+    if (merge && source) {
+        TC_StartMergedJob(hwndDlg, source);
+    } else if (merge) {
+        // answers with TWAINTHREAD_WM_SOURCESPICKED, see TC_StartJob()
+        g_pendingSession = TwainThread_StartSourcePicker(hwndDlg);
+        if (!g_pendingSession)
+            TC_ErrorDialog(hwndDlg, L"Failed to start scanning");
+    } else {
+        TC_StartJob(hwndDlg, source, 1);
+    }
 
-    GlobalUnlock(hDibGlobal);
+    TC_UpdateScanBtnState(hwndDlg);
 }
 
 static void
@@ -213,6 +502,24 @@ TC_MainDialogProc(HWND hwndDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
             TC_BrowseForFolder(hwndDlg);
         } else if (LOWORD(wParam) == IDC_SCANBTN) {
             TC_BeginScan(hwndDlg);
+        } else if (LOWORD(wParam) == IDC_SOURCECOMBO && HIWORD(wParam) == CBN_SELCHANGE) {
+            // the sessions kept open are for the old source
+            TC_StopWarmSessions();
+        } else if (LOWORD(wParam) == IDC_PROFILECOMBO
+                   && (HIWORD(wParam) == CBN_SELCHANGE || HIWORD(wParam) == CBN_EDITCHANGE)) {
+            // the sessions kept open restore the old profile
+            TC_StopWarmSessions();
+        } else if (LOWORD(wParam) == IDC_PROFILESAVEBTN) {
+            TC_SaveProfile(hwndDlg);
+        } else if (LOWORD(wParam) == IDC_FASTCHECK) {
+            // the sessions kept open were set up for the other mode
+            TC_StopWarmSessions();
+        } else if (LOWORD(wParam) == IDC_WARMCHECK) {
+            if (IsDlgButtonChecked(hwndDlg, IDC_WARMCHECK) != BST_CHECKED)
+                TC_StopWarmSessions();
+        } else if (LOWORD(wParam) == IDC_MERGECHECK) {
+            EnableWindow(GetDlgItem(hwndDlg, IDC_MERGEORDERCOMBO),
+                         IsDlgButtonChecked(hwndDlg, IDC_MERGECHECK) == BST_CHECKED);
         }
         break;
     case WM_NOTIFY:
@@ -220,25 +527,76 @@ TC_MainDialogProc(HWND hwndDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
             NMUPDOWN *n = (NMUPDOWN *)lParam;
             if (n->iDelta < 0) {
                 UINT n = GetDlgItemInt(hwndDlg, IDC_FILENUMBEREDIT, NULL, FALSE);
-                TC_SetFileNumber(hwndDlg, n >= 9999 ? 0 : n + 1);
+                TC_SetFileNumber(hwndDlg, n >= PAGEWRITER_MAX_NUMBER ? 0 : n + 1);
             }
             if (n->iDelta > 0) {
                 UINT n = GetDlgItemInt(hwndDlg, IDC_FILENUMBEREDIT, NULL, FALSE);
-                TC_SetFileNumber(hwndDlg, n > 0 ? n - 1 : 9999);
+                TC_SetFileNumber(hwndDlg, n > 0 ? n - 1 : PAGEWRITER_MAX_NUMBER);
             }
         }
         break;
+    case TWAINTHREAD_WM_STATE:
+        if ((TwainThread *)lParam == g_pendingSession) {
+            g_pendingSession = NULL;
+            TC_UpdateScanBtnState(hwndDlg);
+        }
+        return (INT_PTR) TRUE;
+    case TWAINTHREAD_WM_ENDED:
+        if ((TwainThread *)lParam == g_pendingSession) {
+            g_pendingSession = NULL;
+            TC_UpdateScanBtnState(hwndDlg);
+        }
+        TC_ForgetSession((TwainThread *)lParam);
+        TwainThread_Reap((TwainThread *)lParam);
+        return (INT_PTR) TRUE;
+    case TWAINTHREAD_WM_SOURCESPICKED:
+        TC_StartJob(hwndDlg, ((TwainSourceList *)lParam)->sources, ((TwainSourceList *)lParam)->count);
+        TwainThread_FreeSourceList((TwainSourceList *)lParam);
+        return (INT_PTR) TRUE;
+    case TWAINTHREAD_WM_SOURCESLISTED:
+        TC_SetSources(hwndDlg, (TwainSourceList *)lParam);
+        return (INT_PTR) TRUE;
+    case TWAINTHREAD_WM_PAGE:
+        g_progressPages++;
+        g_progressPending = (UINT)wParam;
+        TC_ShowProgress(hwndDlg);
+        return (INT_PTR) TRUE;
+    case TWAINTHREAD_WM_HUNG:
+        if ((TwainThread *)lParam == g_pendingSession) {
+            g_pendingSession = NULL;
+            TC_UpdateScanBtnState(hwndDlg);
+        }
+        TC_ForgetSession((TwainThread *)lParam);
+        TC_ErrorDialog(hwndDlg, L"The scanner driver stopped responding. The pages scanned so far "
+                                L"were saved, a report is in the Logs folder.");
+        return (INT_PTR) TRUE;
+    case TWAINTHREAD_WM_PAGESKIPPED:
+        // the batch goes on, no dialog in its way
+        g_progressSkipped++;
+        TC_ShowProgress(hwndDlg);
+        return (INT_PTR) TRUE;
+    case TWAINTHREAD_WM_PROFILECAPTURED:
+        Profile_Free(g_lastProfile);
+        g_lastProfile = (ScanProfile *)lParam;
+        return (INT_PTR) TRUE;
+    case TWAINTHREAD_WM_ERROR:
+    case ENCODERPOOL_WM_ERROR:
+        TC_ErrorDialog(hwndDlg, (const WCHAR *)lParam);
+        return (INT_PTR) TRUE;
+    case ENCODERPOOL_WM_PAGEWRITTEN:
+        TC_SetFileNumber(hwndDlg, (UINT)wParam);
+        return (INT_PTR) TRUE;
     case WM_INITDIALOG:
         TC_FixFileNumber(hwndDlg);
         TC_SetDefaultFolder(hwndDlg);
         SetDlgItemText(hwndDlg, IDC_FILENAMEEDIT, L"scan");
 
-        for (UINT i = 0; i < g_gdiplusEncoderCount; ++i) {
+        for (UINT i = 0; i < PageWriter_FormatCount(); ++i) {
             SendDlgItemMessage(hwndDlg,
                                IDC_FILEFORMATCOMBO,
                                CB_ADDSTRING,
                                (WPARAM)0,
-                               (LPARAM)g_gdiplusEncoders[i].FormatDescription);
+                               (LPARAM)PageWriter_FormatDescription(i));
         }
 
         SendDlgItemMessage(hwndDlg,
@@ -247,6 +605,16 @@ TC_MainDialogProc(HWND hwndDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
                            (WPARAM)0,
                            (LPARAM)0);
 
+        SendDlgItemMessage(hwndDlg, IDC_MERGEORDERCOMBO, CB_ADDSTRING,
+                           0, (LPARAM)L"One pile after another");
+        SendDlgItemMessage(hwndDlg, IDC_MERGEORDERCOMBO, CB_ADDSTRING,
+                           0, (LPARAM)L"Alternating pages");
+        SendDlgItemMessage(hwndDlg, IDC_MERGEORDERCOMBO, CB_SETCURSEL, 0, 0);
+        EnableWindow(GetDlgItem(hwndDlg, IDC_MERGEORDERCOMBO), FALSE);
+
+        TC_LoadLastSource(hwndDlg);
+        TC_FillProfileCombo(hwndDlg);
+
         TC_UpdateScanBtnState(hwndDlg);
 
         return (INT_PTR) TRUE;
@@ -274,6 +642,48 @@ TC_CreateActivationContext(HMODULE self)
     return CreateActCtx(&c);
 }
 
+// returns the exit code
+static int
+TC_RunDialog(HINSTANCE hInstance, int nCmdShow)
+{
+    HWND hwndDlg = CreateDialog(hInstance,
+                                MAKEINTRESOURCE(IDD_MAINWINDOW),
+                                NULL,
+                                TC_MainDialogProc);
+
+    // TWAIN sessions get their own threads when scanning starts,
+    // the pages of all of them are written by a shared pool
+    if (!EncoderPool_Start(hwndDlg, 8)) {
+        TC_ErrorDialog(hwndDlg, L"Failed to start encoder threads");
+    }
+
+    TC_UpdateScanBtnState(hwndDlg);
+
+    // fills the source combo box when done, without any driver UI
+    TwainThread_StartSourceList(hwndDlg);
+
+    ShowWindow(hwndDlg, nCmdShow);
+
+    MSG msg;
+    while (GetMessage(&msg, NULL, 0, 0)) {
+        if (!IsDialogMessage(hwndDlg, &msg)) {
+            TranslateMessage(&msg);
+            DispatchMessage(&msg);
+        }
+    }
+
+    TwainThread_StopAll();
+    EncoderPool_Stop();
+
+    DestroyWindow(hwndDlg);
+
+    PageWriter_ReleaseBatch(g_batch);
+    TwainThread_FreeSourceList(g_sources);
+    Profile_Free(g_lastProfile);
+
+    return (int)msg.wParam;
+}
+
 #ifdef TC_RAW_ENTRY_POINT
 DWORD CALLBACK
 wWinMainCRTStartup(void)
@@ -289,7 +699,8 @@ wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLine, int nCm
 #endif
 
     ULONG_PTR gdiplusToken;
-    HWND hwndDlg;
+    int exitCode;
+    BOOL batchMode = BatchMode_IsRequested();
 
     // activation context for commctl v6
     HANDLE hActCtx = TC_CreateActivationContext((HMODULE)hInstance);
@@ -307,71 +718,23 @@ wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLine, int nCm
     ZeroMemory(&gdipSi, sizeof(gdipSi));
     gdipSi.GdiplusVersion = 1;
     Gdiplus::GpStatus s = Gdiplus::GdiplusStartup(&gdiplusToken, &gdipSi, NULL);
-    if (s) {
+    if (s && !batchMode) {
         TC_ErrorDialog(NULL, L"GDI+ initialization failed");
     }
 
-    UINT bytesize = 0;
-    Gdiplus::GetImageEncodersSize(&g_gdiplusEncoderCount, &bytesize);
-    g_gdiplusEncoders = (Gdiplus::ImageCodecInfo *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, bytesize);
-    Gdiplus::GetImageEncoders(g_gdiplusEncoderCount, bytesize, g_gdiplusEncoders);
+    TraceLog_Initialize();
+    PageWriter_Initialize();
 
-    // Set up the dialog
-    hwndDlg = CreateDialog(hInstance,
-                           MAKEINTRESOURCE(IDD_MAINWINDOW),
-                           NULL,
-                           TC_MainDialogProc);
+    // pages of a batch that didn't end, before anything new is scanned
+    Spool_Recover();
 
-    // Setup TWAIN
-    if (!TwainHelper_Initialize(hwndDlg)) {
-        TC_ErrorDialog(hwndDlg, L"Failed to initialize TWAIN");
-    }
+    if (batchMode)
+        exitCode = BatchMode_Run();
+    else
+        exitCode = TC_RunDialog(hInstance, nCmdShow);
 
-    TC_UpdateScanBtnState(hwndDlg);
-
-    ShowWindow(hwndDlg, nCmdShow);
-
-    MSG msg;
-    while (GetMessage(&msg, NULL, 0, 0)) {
-        TW_UINT16 TWMessage = MSG_NULL;
-        if (TwainHelper_IsTwainMessage(&msg, &TWMessage)) {
-            switch (TWMessage) {
-            case MSG_XFERREADY:
-                for (;;) {
-                    HGLOBAL hBitmap = TwainHelper_BeginTransferImage();
-                    if (hBitmap) {
-                        TC_SaveImage(hwndDlg, hBitmap);
-                        GlobalFree(hBitmap);
-                        TwainHelper_EndTransferImage();
-                    } else if (TwainHelper_CurrentState() == TH_STATE_TRANSFER_READY) {
-                        // something went wrong
-                        TC_ErrorDialog(hwndDlg, L"Failed to transfer image");
-                        TwainHelper_AbortPendingTransfers();
-                        break;
-                    } else {
-                        // all images transferred
-                        break;
-                    }
-                }
-                break;
-            case MSG_CLOSEDSREQ:
-                TwainHelper_CloseSource();
-                TC_UpdateScanBtnState(hwndDlg);
-                break;
-            }
-        } else {
-            if (!IsDialogMessage(hwndDlg, &msg)) {
-                TranslateMessage(&msg);
-                DispatchMessage(&msg);
-            }
-        }
-    }
-
-    TwainHelper_Teardown(hwndDlg);
-
-    DestroyWindow(hwndDlg);
-
-    HeapFree(GetProcessHeap(), 0, g_gdiplusEncoders);
+    PageWriter_Teardown();
+    TraceLog_Teardown();
     Gdiplus::GdiplusShutdown(gdiplusToken);
 
     CoUninitialize();
@@ -380,8 +743,8 @@ wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLine, int nCm
     ReleaseActCtx(hActCtx);
 
 #ifdef TC_RAW_ENTRY_POINT
-    ExitProcess(msg.wParam);
+    ExitProcess((UINT)exitCode);
 #else
-    return (int)msg.wParam;
+    return exitCode;
 #endif
 }
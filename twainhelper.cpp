@@ -18,12 +18,12 @@
 
 #include <windows.h>
 
-static TW_IDENTITY           g_twainApp;
-static TW_IDENTITY           g_twainSource;
-static enum TwainHelperState g_twainState = TH_STATE_DSM_LOADED;
+// newer than our twain.h, e.g. for TWEI_BARCODETEXT
+#define TWAINHELPER_TWTY_HANDLE 0x000f
 
 static TW_UINT16
-TwainHelper_CallDSM(pTW_IDENTITY pDest,
+TwainHelper_CallDSM(TwainSession *pSession,
+                    pTW_IDENTITY pDest,
                     TW_UINT32    DG,
                     TW_UINT16    DAT,
                     TW_UINT16    MSG,
@@ -37,7 +37,21 @@ TwainHelper_CallDSM(pTW_IDENTITY pDest,
     // XXX: disable high-dpi since lots of TWAIN sources can’t deal with it
     DpiHelper_AwarenessLevel oldDpiLevel = DpiHelper_SetThreadAwareness(DPIHELPER_LEVEL_UNAWARE);
 
-    TW_UINT16 r = DSM_Entry(&g_twainApp, pDest, DG, DAT, MSG, pData);
+    // published for TwainHelper_CallInProgress() before the sequence turns odd
+    BOOL track = pSession->callDepth++ == 0;
+    if (track) {
+        pSession->callDG = DG;
+        pSession->callDAT = DAT;
+        pSession->callMSG = MSG;
+        pSession->callStartTicks = GetTickCount();
+        InterlockedIncrement(&pSession->callSeq);
+    }
+
+    TW_UINT16 r = DSM_Entry(&pSession->app, pDest, DG, DAT, MSG, pData);
+
+    if (track)
+        InterlockedIncrement(&pSession->callSeq);
+    pSession->callDepth--;
 
     DpiHelper_SetThreadAwareness(oldDpiLevel);
 
@@ -47,15 +61,32 @@ TwainHelper_CallDSM(pTW_IDENTITY pDest,
 }
 
 enum TwainHelperState
-TwainHelper_CurrentState(void)
+TwainHelper_CurrentState(const TwainSession *pSession)
 {
-    return g_twainState;
+    return pSession->state;
 }
 
 BOOL
-TwainHelper_IsTwainMessage(MSG *pMsg, TW_UINT16 *pTWMessage)
+TwainHelper_CallInProgress(const TwainSession *pSession, TwainCallInfo *pCall)
 {
-    if (g_twainState < TH_STATE_SOURCE_ENABLED)
+    // the fields only change while the sequence is even
+    LONG seq = InterlockedCompareExchange((LONG volatile *)&pSession->callSeq, 0, 0);
+    if (!(seq & 1))
+        return FALSE;
+
+    pCall->seq = seq;
+    pCall->dg = pSession->callDG;
+    pCall->dat = pSession->callDAT;
+    pCall->msg = pSession->callMSG;
+    pCall->startTicks = pSession->callStartTicks;
+
+    return InterlockedCompareExchange((LONG volatile *)&pSession->callSeq, 0, 0) == seq;
+}
+
+BOOL
+TwainHelper_IsTwainMessage(TwainSession *pSession, MSG *pMsg, TW_UINT16 *pTWMessage)
+{
+    if (pSession->state < TH_STATE_SOURCE_ENABLED)
         return FALSE;
 
     TW_EVENT ev;
@@ -63,15 +94,15 @@ TwainHelper_IsTwainMessage(MSG *pMsg, TW_UINT16 *pTWMessage)
     ev.pEvent = pMsg;
     ev.TWMessage = MSG_NULL;
 
-    if (TwainHelper_CallDSM(&g_twainSource,
+    if (TwainHelper_CallDSM(pSession, &pSession->source,
                             DG_CONTROL,
                             DAT_EVENT,
                             MSG_PROCESSEVENT,
                             &ev) == TWRC_DSEVENT) {
         *pTWMessage = ev.TWMessage;
 
-        if (ev.TWMessage == MSG_XFERREADY && g_twainState < TH_STATE_TRANSFER_READY) {
-            g_twainState = TH_STATE_TRANSFER_READY;
+        if (ev.TWMessage == MSG_XFERREADY && pSession->state < TH_STATE_TRANSFER_READY) {
+            pSession->state = TH_STATE_TRANSFER_READY;
         }
 
         return TRUE;
@@ -82,29 +113,31 @@ TwainHelper_IsTwainMessage(MSG *pMsg, TW_UINT16 *pTWMessage)
 }
 
 BOOL
-TwainHelper_Initialize(HWND hwndDlg)
-{
-    g_twainApp.Id = 0;
-    g_twainApp.Version.MajorNum = 1;
-    g_twainApp.Version.MinorNum = 0;
-    g_twainApp.Version.Language = TWLG_USA;
-    g_twainApp.Version.Country = TWCY_USA;
-    lstrcpyA(g_twainApp.Version.Info, "1.0");
-    g_twainApp.ProtocolMajor = TWON_PROTOCOLMAJOR;
-    g_twainApp.ProtocolMinor = TWON_PROTOCOLMINOR;
-    g_twainApp.SupportedGroups = DG_IMAGE | DG_CONTROL;
-    lstrcpyA(g_twainApp.Manufacturer, "Genosse Einhorn");
-    lstrcpyA(g_twainApp.ProductFamily, "Example");
-    lstrcpyA(g_twainApp.ProductName, "TWAIN Example Application");
+TwainHelper_Initialize(TwainSession *pSession, HWND hwndDlg)
+{
+    pSession->app.Id = 0;
+    pSession->app.Version.MajorNum = 1;
+    pSession->app.Version.MinorNum = 0;
+    pSession->app.Version.Language = TWLG_USA;
+    pSession->app.Version.Country = TWCY_USA;
+    lstrcpyA(pSession->app.Version.Info, "1.0");
+    pSession->app.ProtocolMajor = TWON_PROTOCOLMAJOR;
+    pSession->app.ProtocolMinor = TWON_PROTOCOLMINOR;
+    pSession->app.SupportedGroups = DG_IMAGE | DG_CONTROL;
+    lstrcpyA(pSession->app.Manufacturer, "Genosse Einhorn");
+    lstrcpyA(pSession->app.ProductFamily, "Example");
+    lstrcpyA(pSession->app.ProductName, "TWAIN Example Application");
+
+    ZeroMemory(&pSession->source, sizeof(pSession->source));
 
     // We link against twain_32.dll because we won’t work without it anyway.
     // If TWAIN is not necessary for your app, you should LoadLibrary() it.
-    g_twainState = TH_STATE_DSM_LOADED;
+    pSession->state = TH_STATE_DSM_LOADED;
 
     // open the DSM
-    if (TwainHelper_CallDSM(NULL, DG_CONTROL, DAT_PARENT, MSG_OPENDSM, &hwndDlg) == TWRC_SUCCESS) {
+    if (TwainHelper_CallDSM(pSession, NULL, DG_CONTROL, DAT_PARENT, MSG_OPENDSM, &hwndDlg) == TWRC_SUCCESS) {
         // FIXME: handle error
-        g_twainState = TH_STATE_DSM_OPEN;
+        pSession->state = TH_STATE_DSM_OPEN;
         return TRUE;
     }
 
@@ -112,50 +145,56 @@ TwainHelper_Initialize(HWND hwndDlg)
 }
 
 void
-TwainHelper_Teardown(HWND hwndDlg)
+TwainHelper_Teardown(TwainSession *pSession, HWND hwndDlg)
 {
     // disable and close the source
-    TwainHelper_CloseSource();
+    TwainHelper_CloseSource(pSession);
 
     // close DSM
-    if (g_twainState >= TH_STATE_DSM_OPEN) {
-        TwainHelper_CallDSM(NULL, DG_CONTROL, DAT_PARENT, MSG_CLOSEDSM, &hwndDlg);
+    if (pSession->state >= TH_STATE_DSM_OPEN) {
+        TwainHelper_CallDSM(pSession, NULL, DG_CONTROL, DAT_PARENT, MSG_CLOSEDSM, &hwndDlg);
     }
 
-    g_twainState = TH_STATE_DSM_LOADED;
+    if (pSession->hCapContainer) {
+        GlobalFree(pSession->hCapContainer);
+        pSession->hCapContainer = NULL;
+        pSession->capContainerSize = 0;
+    }
+
+    pSession->state = TH_STATE_DSM_LOADED;
 }
 
 void
-TwainHelper_CloseSource(void)
+TwainHelper_CloseSource(TwainSession *pSession)
 {
-    TwainHelper_DisableSource();
+    TwainHelper_DisableSource(pSession);
 
-    if (g_twainState >= TH_STATE_SOURCE_OPEN) {
-        TwainHelper_CallDSM(NULL, DG_CONTROL, DAT_IDENTITY, MSG_CLOSEDS, &g_twainSource);
-        g_twainState = TH_STATE_DSM_OPEN;
+    if (pSession->state >= TH_STATE_SOURCE_OPEN) {
+        TwainHelper_CallDSM(pSession, NULL, DG_CONTROL, DAT_IDENTITY, MSG_CLOSEDS, &pSession->source);
+        pSession->state = TH_STATE_DSM_OPEN;
     }
 }
 
 void
-TwainHelper_DisableSource(void)
+TwainHelper_DisableSource(TwainSession *pSession)
 {
-    TwainHelper_AbortPendingTransfers();
+    TwainHelper_AbortPendingTransfers(pSession);
 
-    if (g_twainState >= TH_STATE_SOURCE_ENABLED) {
+    if (pSession->state >= TH_STATE_SOURCE_ENABLED) {
         TW_USERINTERFACE twUI;
         ZeroMemory(&twUI, sizeof(twUI));
-        TwainHelper_CallDSM(&g_twainSource, DG_CONTROL, DAT_USERINTERFACE, MSG_DISABLEDS, &twUI);
-        g_twainState = TH_STATE_SOURCE_OPEN;
+        TwainHelper_CallDSM(pSession, &pSession->source, DG_CONTROL, DAT_USERINTERFACE, MSG_DISABLEDS, &twUI);
+        pSession->state = TH_STATE_SOURCE_OPEN;
     }
 }
 
 BOOL
-TwainHelper_UserSelectSource(TW_IDENTITY *pSource)
+TwainHelper_UserSelectSource(TwainSession *pSession, TW_IDENTITY *pSource)
 {
-    if (g_twainState < TH_STATE_DSM_OPEN || g_twainState >= TH_STATE_SOURCE_OPEN)
+    if (pSession->state < TH_STATE_DSM_OPEN || pSession->state >= TH_STATE_SOURCE_OPEN)
         return FALSE;
 
-    return TwainHelper_CallDSM(NULL,
+    return TwainHelper_CallDSM(pSession, NULL,
                                DG_CONTROL,
                                DAT_IDENTITY,
                                MSG_USERSELECT,
@@ -163,73 +202,503 @@ TwainHelper_UserSelectSource(TW_IDENTITY *pSource)
 }
 
 BOOL
-TwainHelper_OpenSource(const TW_IDENTITY *pSource)
+TwainHelper_GetFirstSource(TwainSession *pSession, TW_IDENTITY *pSource)
+{
+    if (pSession->state < TH_STATE_DSM_OPEN)
+        return FALSE;
+
+    ZeroMemory(pSource, sizeof(*pSource));
+
+    return TwainHelper_CallDSM(pSession, NULL,
+                               DG_CONTROL,
+                               DAT_IDENTITY,
+                               MSG_GETFIRST,
+                               pSource) == TWRC_SUCCESS;
+}
+
+BOOL
+TwainHelper_GetNextSource(TwainSession *pSession, TW_IDENTITY *pSource)
+{
+    if (pSession->state < TH_STATE_DSM_OPEN)
+        return FALSE;
+
+    ZeroMemory(pSource, sizeof(*pSource));
+
+    return TwainHelper_CallDSM(pSession, NULL,
+                               DG_CONTROL,
+                               DAT_IDENTITY,
+                               MSG_GETNEXT,
+                               pSource) == TWRC_SUCCESS;
+}
+
+BOOL
+TwainHelper_IsSameModel(const TW_IDENTITY *a, const TW_IDENTITY *b)
+{
+    return lstrcmpA(a->Manufacturer, b->Manufacturer) == 0
+        && lstrcmpA(a->ProductFamily, b->ProductFamily) == 0
+        && a->Version.MajorNum == b->Version.MajorNum
+        && a->Version.MinorNum == b->Version.MinorNum;
+}
+
+BOOL
+TwainHelper_IsSameSource(const TW_IDENTITY *a, const TW_IDENTITY *b)
 {
-    if (g_twainState < TH_STATE_DSM_OPEN || g_twainState >= TH_STATE_SOURCE_OPEN)
+    // not the version, the source should survive driver updates
+    return lstrcmpA(a->Manufacturer, b->Manufacturer) == 0
+        && lstrcmpA(a->ProductFamily, b->ProductFamily) == 0
+        && lstrcmpA(a->ProductName, b->ProductName) == 0;
+}
+
+BOOL
+TwainHelper_OpenSource(TwainSession *pSession, const TW_IDENTITY *pSource)
+{
+    if (pSession->state < TH_STATE_DSM_OPEN || pSession->state >= TH_STATE_SOURCE_OPEN)
         return FALSE;
 
-    g_twainSource = *pSource;
+    pSession->source = *pSource;
 
-    if (TwainHelper_CallDSM(NULL,
+    if (TwainHelper_CallDSM(pSession, NULL,
                             DG_CONTROL,
                             DAT_IDENTITY,
                             MSG_OPENDS,
-                            &g_twainSource) == TWRC_SUCCESS) {
-        g_twainState = TH_STATE_SOURCE_OPEN;
+                            &pSession->source) == TWRC_SUCCESS) {
+        pSession->state = TH_STATE_SOURCE_OPEN;
         return TRUE;
     } else {
         return FALSE;
     }
 }
 
+static SIZE_T
+TwainHelper_ItemSize(TW_UINT16 itemType)
+{
+    switch (itemType) {
+    case TWTY_INT8:
+    case TWTY_UINT8:
+        return 1;
+    case TWTY_INT16:
+    case TWTY_UINT16:
+    case TWTY_BOOL:
+        return 2;
+    case TWTY_INT32:
+    case TWTY_UINT32:
+    case TWTY_FIX32:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+static TW_UINT32
+TwainHelper_ReadItem(const TW_UINT8 *p, TW_UINT16 itemType)
+{
+    switch (itemType) {
+    case TWTY_INT8:
+        return (TW_UINT32)(TW_INT32)*(const TW_INT8 *)p;
+    case TWTY_UINT8:
+        return *p;
+    case TWTY_INT16:
+        return (TW_UINT32)(TW_INT32)*(const TW_INT16 UNALIGNED *)p;
+    case TWTY_UINT16:
+    case TWTY_BOOL:
+        return *(const TW_UINT16 UNALIGNED *)p;
+    default:
+        return *(const TW_UINT32 UNALIGNED *)p;
+    }
+}
+
+static void
+TwainHelper_WriteItem(TW_UINT8 *p, TW_UINT16 itemType, TW_UINT32 item)
+{
+    switch (TwainHelper_ItemSize(itemType)) {
+    case 1:
+        *p = (TW_UINT8)item;
+        break;
+    case 2:
+        *(TW_UINT16 UNALIGNED *)p = (TW_UINT16)item;
+        break;
+    default:
+        *(TW_UINT32 UNALIGNED *)p = item;
+        break;
+    }
+}
+
+// one value from a ONEVALUE container: the Item field holds it in its low bytes
+static TW_UINT32
+TwainHelper_ReadOneValueItem(const TW_ONEVALUE *pOne)
+{
+    TW_UINT32 item = pOne->Item;
+    return TwainHelper_ReadItem((const TW_UINT8 *)&item, pOne->ItemType);
+}
+
+static BOOL
+TwainHelper_ParseContainer(TW_UINT16 conType, const void *pContainer, SIZE_T size, TwainCapValue *pValue)
+{
+    pValue->conType = conType;
+
+    switch (conType) {
+    case TWON_ONEVALUE: {
+        if (size < sizeof(TW_ONEVALUE))
+            return FALSE;
+        const TW_ONEVALUE *one = (const TW_ONEVALUE *)pContainer;
+        pValue->itemType = one->ItemType;
+        pValue->items[0] = TwainHelper_ReadOneValueItem(one);
+        pValue->count = 1;
+        return TRUE;
+    }
+    case TWON_RANGE: {
+        if (size < sizeof(TW_RANGE))
+            return FALSE;
+        const TW_RANGE *range = (const TW_RANGE *)pContainer;
+        pValue->itemType = range->ItemType;
+        pValue->minValue = range->MinValue;
+        pValue->maxValue = range->MaxValue;
+        pValue->stepSize = range->StepSize;
+        pValue->defaultValue = range->DefaultValue;
+        pValue->currentValue = range->CurrentValue;
+        return TRUE;
+    }
+    case TWON_ENUMERATION:
+    case TWON_ARRAY: {
+        TW_UINT16 itemType;
+        TW_UINT32 numItems;
+        const TW_UINT8 *list;
+        SIZE_T header;
+
+        if (conType == TWON_ENUMERATION) {
+            header = FIELD_OFFSET(TW_ENUMERATION, ItemList);
+            if (size < header)
+                return FALSE;
+            const TW_ENUMERATION *e = (const TW_ENUMERATION *)pContainer;
+            itemType = e->ItemType;
+            numItems = e->NumItems;
+            list = e->ItemList;
+            pValue->currentIndex = e->CurrentIndex;
+            pValue->defaultIndex = e->DefaultIndex;
+        } else {
+            header = FIELD_OFFSET(TW_ARRAY, ItemList);
+            if (size < header)
+                return FALSE;
+            const TW_ARRAY *a = (const TW_ARRAY *)pContainer;
+            itemType = a->ItemType;
+            numItems = a->NumItems;
+            list = a->ItemList;
+        }
+
+        SIZE_T itemSize = TwainHelper_ItemSize(itemType);
+        if (!itemSize)
+            return FALSE;
+
+        // don't trust NumItems beyond what the source actually allocated
+        if (numItems > (size - header) / itemSize)
+            numItems = (TW_UINT32)((size - header) / itemSize);
+
+        pValue->itemType = itemType;
+        pValue->count = numItems;
+        if (pValue->count > TWAINHELPER_MAX_CAP_ITEMS) {
+            pValue->count = TWAINHELPER_MAX_CAP_ITEMS;
+            pValue->truncated = TRUE;
+        }
+
+        for (TW_UINT32 i = 0; i < pValue->count; ++i)
+            pValue->items[i] = TwainHelper_ReadItem(list + i * itemSize, itemType);
+        return TRUE;
+    }
+    default:
+        return FALSE;
+    }
+}
+
+// builds the container for MSG_SET in the session's reusable handle
+static HGLOBAL
+TwainHelper_BuildContainer(TwainSession *pSession, const TwainCapValue *pValue)
+{
+    SIZE_T itemSize = TwainHelper_ItemSize(pValue->itemType);
+    if (!itemSize || pValue->count > TWAINHELPER_MAX_CAP_ITEMS)
+        return NULL;
+
+    SIZE_T size;
+    switch (pValue->conType) {
+    case TWON_ONEVALUE:
+        size = sizeof(TW_ONEVALUE);
+        break;
+    case TWON_RANGE:
+        size = sizeof(TW_RANGE);
+        break;
+    case TWON_ENUMERATION:
+        size = FIELD_OFFSET(TW_ENUMERATION, ItemList) + pValue->count * itemSize;
+        break;
+    case TWON_ARRAY:
+        size = FIELD_OFFSET(TW_ARRAY, ItemList) + pValue->count * itemSize;
+        break;
+    default:
+        return NULL;
+    }
+
+    if (pSession->capContainerSize < size) {
+        HGLOBAL h = pSession->hCapContainer
+            ? GlobalReAlloc(pSession->hCapContainer, size, GMEM_MOVEABLE | GMEM_ZEROINIT)
+            : GlobalAlloc(GHND, size);
+        if (!h)
+            return NULL;
+        pSession->hCapContainer = h;
+        pSession->capContainerSize = size;
+    }
+
+    TW_UINT8 *p = (TW_UINT8 *)GlobalLock(pSession->hCapContainer);
+    if (!p)
+        return NULL;
+    ZeroMemory(p, size);
+
+    switch (pValue->conType) {
+    case TWON_ONEVALUE: {
+        TW_ONEVALUE *one = (TW_ONEVALUE *)p;
+        one->ItemType = pValue->itemType;
+        TwainHelper_WriteItem((TW_UINT8 *)&one->Item, pValue->itemType, pValue->items[0]);
+        break;
+    }
+    case TWON_RANGE: {
+        TW_RANGE *range = (TW_RANGE *)p;
+        range->ItemType = pValue->itemType;
+        range->MinValue = pValue->minValue;
+        range->MaxValue = pValue->maxValue;
+        range->StepSize = pValue->stepSize;
+        range->DefaultValue = pValue->defaultValue;
+        range->CurrentValue = pValue->currentValue;
+        break;
+    }
+    case TWON_ENUMERATION: {
+        TW_ENUMERATION *e = (TW_ENUMERATION *)p;
+        e->ItemType = pValue->itemType;
+        e->NumItems = pValue->count;
+        e->CurrentIndex = pValue->currentIndex;
+        e->DefaultIndex = pValue->defaultIndex;
+        for (TW_UINT32 i = 0; i < pValue->count; ++i)
+            TwainHelper_WriteItem(e->ItemList + i * itemSize, pValue->itemType, pValue->items[i]);
+        break;
+    }
+    case TWON_ARRAY: {
+        TW_ARRAY *a = (TW_ARRAY *)p;
+        a->ItemType = pValue->itemType;
+        a->NumItems = pValue->count;
+        for (TW_UINT32 i = 0; i < pValue->count; ++i)
+            TwainHelper_WriteItem(a->ItemList + i * itemSize, pValue->itemType, pValue->items[i]);
+        break;
+    }
+    }
+
+    GlobalUnlock(pSession->hCapContainer);
+    return pSession->hCapContainer;
+}
+
+TW_UINT16
+TwainHelper_GetCap(TwainSession *pSession, TW_UINT16 msg, TW_UINT16 cap, TwainCapValue *pValue, TW_UINT16 *pCC)
+{
+    ZeroMemory(pValue, sizeof(*pValue));
+    pValue->cap = cap;
+
+    if (pCC)
+        *pCC = TWCC_SEQERROR;
+    if (pSession->state < TH_STATE_SOURCE_OPEN)
+        return TWRC_FAILURE;
+
+    TW_CAPABILITY twCapability;
+    ZeroMemory(&twCapability, sizeof(twCapability));
+    twCapability.Cap = cap;
+    twCapability.ConType = TWON_DONTCARE16;
+
+    TW_UINT16 rc = TwainHelper_CallDSM(pSession, &pSession->source,
+                                       DG_CONTROL,
+                                       DAT_CAPABILITY,
+                                       msg,
+                                       &twCapability);
+    if (rc != TWRC_SUCCESS) {
+        if (pCC)
+            *pCC = TwainHelper_GetConditionCode(pSession);
+        return rc;
+    }
+
+    // the source allocated the container, it's ours to free
+    BOOL parsed = FALSE;
+    if (twCapability.hContainer) {
+        void *p = GlobalLock(twCapability.hContainer);
+        if (p) {
+            parsed = TwainHelper_ParseContainer(twCapability.ConType, p, GlobalSize(twCapability.hContainer), pValue);
+            GlobalUnlock(twCapability.hContainer);
+        }
+        GlobalFree(twCapability.hContainer);
+    }
+
+    if (!parsed) {
+        if (pCC)
+            *pCC = TWCC_BADVALUE;
+        return TWRC_FAILURE;
+    }
+
+    if (pCC)
+        *pCC = TWCC_SUCCESS;
+    return TWRC_SUCCESS;
+}
+
+TW_UINT16
+TwainHelper_SetCap(TwainSession *pSession, const TwainCapValue *pValue, TW_UINT16 *pCC)
+{
+    if (pCC)
+        *pCC = TWCC_SEQERROR;
+    if (pSession->state != TH_STATE_SOURCE_OPEN)
+        return TWRC_FAILURE;
+
+    TW_CAPABILITY twCapability;
+    twCapability.Cap = pValue->cap;
+    twCapability.ConType = pValue->conType;
+    twCapability.hContainer = TwainHelper_BuildContainer(pSession, pValue);
+    if (!twCapability.hContainer) {
+        if (pCC)
+            *pCC = TWCC_LOWMEMORY;
+        return TWRC_FAILURE;
+    }
+
+    TW_UINT16 rc = TwainHelper_CallDSM(pSession, &pSession->source,
+                                       DG_CONTROL,
+                                       DAT_CAPABILITY,
+                                       MSG_SET,
+                                       &twCapability);
+    if (pCC)
+        *pCC = rc == TWRC_SUCCESS ? TWCC_SUCCESS : TwainHelper_GetConditionCode(pSession);
+
+    return rc;
+}
+
+UINT
+TwainHelper_SetCaps(TwainSession *pSession, TwainCapSetting *pSettings, UINT count)
+{
+    UINT accepted = 0;
+
+    for (UINT i = 0; i < count; ++i) {
+        pSettings[i].rc = TwainHelper_SetCap(pSession, &pSettings[i].value, &pSettings[i].cc);
+        if (pSettings[i].rc == TWRC_SUCCESS || pSettings[i].rc == TWRC_CHECKSTATUS)
+            accepted++;
+    }
+
+    return accepted;
+}
+
+void
+TwainHelper_InitOneValue(TwainCapValue *pValue, TW_UINT16 cap, TW_UINT16 itemType, TW_UINT32 item)
+{
+    ZeroMemory(pValue, sizeof(*pValue));
+    pValue->cap = cap;
+    pValue->conType = TWON_ONEVALUE;
+    pValue->itemType = itemType;
+    pValue->count = 1;
+    pValue->items[0] = item;
+}
+
+BOOL
+TwainHelper_SetCapOneValue(TwainSession *pSession, TW_UINT16 cap, TW_UINT16 itemType, TW_UINT32 value)
+{
+    TwainCapValue v;
+    TwainHelper_InitOneValue(&v, cap, itemType, value);
+
+    TW_UINT16 rc = TwainHelper_SetCap(pSession, &v, NULL);
+    return rc == TWRC_SUCCESS || rc == TWRC_CHECKSTATUS;
+}
+
+BOOL
+TwainHelper_SetNumImages(TwainSession *pSession, TW_UINT32 numImages)
+{
+    return TwainHelper_SetCapOneValue(pSession, CAP_XFERCOUNT, TWTY_INT16, numImages);
+}
+
 BOOL
-TwainHelper_SetNumImages(TW_UINT32 numImages)
+TwainHelper_IsDeviceOnline(TwainSession *pSession)
 {
-    if (g_twainState < TH_STATE_SOURCE_OPEN)
+    // Drivers fail this in all sorts of ways, e.g. TWCC_BUMMER or a
+    // container of the wrong type. A working source must not be closed
+    // for that, so only a plain "no" counts.
+    TwainCapValue v;
+    TW_UINT16 cc;
+    if (TwainHelper_GetCap(pSession, MSG_GETCURRENT, CAP_DEVICEONLINE, &v, &cc) != TWRC_SUCCESS)
+        return TRUE;
+
+    return v.conType != TWON_ONEVALUE || v.count != 1 || v.items[0] != 0;
+}
+
+BOOL
+TwainHelper_GetCustomData(TwainSession *pSession, HGLOBAL *phData, TW_UINT32 *pSize)
+{
+    *phData = NULL;
+    *pSize = 0;
+
+    if (pSession->state != TH_STATE_SOURCE_OPEN)
         return FALSE;
 
-    TW_CAPABILITY   twCapability;
-    pTW_ONEVALUE    pval;
+    // sources without it may still answer DAT_CUSTOMDSDATA with garbage
+    TwainCapValue v;
+    if (TwainHelper_GetCap(pSession, MSG_GETCURRENT, CAP_CUSTOMDSDATA, &v, NULL) != TWRC_SUCCESS
+        || v.conType != TWON_ONEVALUE || !v.items[0])
+        return FALSE;
 
-    twCapability.Cap = CAP_XFERCOUNT;
-    twCapability.ConType = TWON_ONEVALUE;
-    twCapability.hContainer = GlobalAlloc(GHND, sizeof(TW_ONEVALUE));
-    pval = (pTW_ONEVALUE) GlobalLock(twCapability.hContainer);
-    pval->ItemType = TWTY_INT16;
-    pval->Item = numImages;
-    GlobalUnlock(twCapability.hContainer);
+    TW_CUSTOMDSDATA data;
+    ZeroMemory(&data, sizeof(data));
 
-    TW_UINT16 s = TwainHelper_CallDSM(&g_twainSource,
-                                      DG_CONTROL,
-                                      DAT_CAPABILITY,
-                                      MSG_SET,
-                                      &twCapability);
+    if (TwainHelper_CallDSM(pSession, &pSession->source,
+                            DG_CONTROL,
+                            DAT_CUSTOMDSDATA,
+                            MSG_GET,
+                            &data) != TWRC_SUCCESS)
+        return FALSE;
 
-    GlobalFree((HANDLE)twCapability.hContainer);
+    // the handle is ours now
+    if (!data.hData || !data.InfoLength || GlobalSize(data.hData) < data.InfoLength) {
+        if (data.hData)
+            GlobalFree(data.hData);
+        return FALSE;
+    }
 
-    return s == TWRC_SUCCESS;
+    *phData = data.hData;
+    *pSize = data.InfoLength;
+    return TRUE;
+}
+
+BOOL
+TwainHelper_SetCustomData(TwainSession *pSession, HGLOBAL hData, TW_UINT32 size)
+{
+    if (pSession->state != TH_STATE_SOURCE_OPEN)
+        return FALSE;
+
+    TW_CUSTOMDSDATA data;
+    ZeroMemory(&data, sizeof(data));
+    data.InfoLength = size;
+    data.hData = hData;
+
+    return TwainHelper_CallDSM(pSession, &pSession->source,
+                               DG_CONTROL,
+                               DAT_CUSTOMDSDATA,
+                               MSG_SET,
+                               &data) == TWRC_SUCCESS;
 }
 
 BOOL
-TwainHelper_EnableSource(HWND hwndDlg)
+TwainHelper_EnableSource(TwainSession *pSession, HWND hwndDlg, BOOL showUI)
 {
-    if (g_twainState < TH_STATE_SOURCE_OPEN)
+    if (pSession->state < TH_STATE_SOURCE_OPEN)
         return FALSE;
 
-    if (g_twainState >= TH_STATE_SOURCE_ENABLED)
+    if (pSession->state >= TH_STATE_SOURCE_ENABLED)
         return TRUE;
 
     TW_USERINTERFACE twUI;
     ZeroMemory(&twUI, sizeof(twUI));
-    twUI.ShowUI = TRUE;
+    twUI.ShowUI = showUI;
     twUI.hParent = hwndDlg;
 
-    if (TwainHelper_CallDSM(&g_twainSource,
+    if (TwainHelper_CallDSM(pSession, &pSession->source,
                             DG_CONTROL,
                             DAT_USERINTERFACE,
                             MSG_ENABLEDS,
                             &twUI) == TWRC_SUCCESS) {
-        g_twainState = TH_STATE_SOURCE_ENABLED;
+        pSession->state = TH_STATE_SOURCE_ENABLED;
         return TRUE;
     } else {
         // FIXME! handle errors
@@ -237,66 +706,297 @@ TwainHelper_EnableSource(HWND hwndDlg)
     }
 }
 
+TW_UINT16
+TwainHelper_GetConditionCode(TwainSession *pSession)
+{
+    if (pSession->state < TH_STATE_DSM_OPEN)
+        return TWCC_BUMMER;
+
+    TW_STATUS twStatus;
+    ZeroMemory(&twStatus, sizeof(twStatus));
+
+    if (TwainHelper_CallDSM(pSession,
+                            pSession->state >= TH_STATE_SOURCE_OPEN ? &pSession->source : NULL,
+                            DG_CONTROL,
+                            DAT_STATUS,
+                            MSG_GET,
+                            &twStatus) != TWRC_SUCCESS)
+        return TWCC_BUMMER;
+
+    return twStatus.ConditionCode;
+}
+
+BOOL
+TwainHelper_GetImageInfo(TwainSession *pSession, TW_IMAGEINFO *pInfo)
+{
+    if (pSession->state != TH_STATE_TRANSFER_READY)
+        return FALSE;
+
+    ZeroMemory(pInfo, sizeof(*pInfo));
+    return TwainHelper_CallDSM(pSession, &pSession->source,
+                               DG_IMAGE,
+                               DAT_IMAGEINFO,
+                               MSG_GET,
+                               pInfo) == TWRC_SUCCESS;
+}
+
 HGLOBAL
-TwainHelper_BeginTransferImage(void)
+TwainHelper_BeginTransferImage(TwainSession *pSession, TW_UINT16 *pRC, TW_UINT16 *pCC)
 {
-    if (g_twainState >= TH_STATE_TRANSFERRING)
-        TwainHelper_EndTransferImage();
+    TW_UINT16 dummyRC, dummyCC;
+    if (!pRC)
+        pRC = &dummyRC;
+    if (!pCC)
+        pCC = &dummyCC;
+
+    *pRC = TWRC_FAILURE;
+    *pCC = TWCC_SEQERROR;
 
-    if (g_twainState < TH_STATE_TRANSFER_READY)
+    if (pSession->state >= TH_STATE_TRANSFERRING)
+        TwainHelper_EndTransferImage(pSession);
+
+    if (pSession->state < TH_STATE_TRANSFER_READY)
         return NULL;
 
     HGLOBAL hBitmap = NULL;
-    USHORT rc = TwainHelper_CallDSM(&g_twainSource,
-                                    DG_IMAGE,
-                                    DAT_IMAGENATIVEXFER,
-                                    MSG_GET, &hBitmap);
-    if (rc == TWRC_XFERDONE) {
-        g_twainState = TH_STATE_TRANSFERRING;
+    *pRC = TwainHelper_CallDSM(pSession, &pSession->source,
+                               DG_IMAGE,
+                               DAT_IMAGENATIVEXFER,
+                               MSG_GET, &hBitmap);
+    if (*pRC == TWRC_XFERDONE) {
+        *pCC = TWCC_SUCCESS;
+        pSession->state = TH_STATE_TRANSFERRING;
         return hBitmap;
-    } else {
+    }
+
+    if (hBitmap)
         GlobalFree(hBitmap);
+
+    if (*pRC == TWRC_CANCEL) {
+        *pCC = TWCC_SUCCESS;
+        pSession->state = TH_STATE_TRANSFERRING;
+    } else {
+        *pCC = TwainHelper_GetConditionCode(pSession);
+    }
+
+    return NULL;
+}
+
+BOOL
+TwainHelper_SkipTransferImage(TwainSession *pSession, TW_UINT16 *pPending)
+{
+    if (pSession->state != TH_STATE_TRANSFER_READY)
+        return FALSE;
+
+    TW_PENDINGXFERS twPendingXfers;
+    ZeroMemory(&twPendingXfers, sizeof(twPendingXfers));
+    if (TwainHelper_CallDSM(pSession, &pSession->source,
+                            DG_CONTROL,
+                            DAT_PENDINGXFERS,
+                            MSG_ENDXFER,
+                            &twPendingXfers) != TWRC_SUCCESS)
+        return FALSE;
+
+    pSession->state = twPendingXfers.Count > 0 ? TH_STATE_TRANSFER_READY : TH_STATE_SOURCE_ENABLED;
+    *pPending = twPendingXfers.Count;
+    return TRUE;
+}
+
+BOOL
+TwainHelper_GetExtImageInfo(TwainSession *pSession, TW_EXTIMAGEINFO *pInfo)
+{
+    for (TW_UINT32 i = 0; i < pInfo->NumInfos; ++i) {
+        pInfo->Info[i].ItemType = 0;
+        pInfo->Info[i].NumItems = 0;
+        pInfo->Info[i].CondCode = TWRC_INFONOTSUPPORTED;
+        pInfo->Info[i].Item = 0;
+    }
+
+    if (pSession->state != TH_STATE_TRANSFERRING)
+        return FALSE;
+
+    return TwainHelper_CallDSM(pSession, &pSession->source,
+                               DG_IMAGE,
+                               DAT_EXTIMAGEINFO,
+                               MSG_GET,
+                               pInfo) == TWRC_SUCCESS;
+}
+
+// Items that don't fit into TW_INFO.Item come in a handle; a single
+// TWTY_HANDLE item is the handle itself, several are an array of them
+static SIZE_T
+TwainHelper_ExtItemSize(const TW_INFO *pInfo)
+{
+    switch (pInfo->ItemType) {
+    case TWTY_STR32:
+        return sizeof(TW_STR32);
+    case TWTY_STR64:
+        return sizeof(TW_STR64);
+    case TWTY_STR128:
+        return sizeof(TW_STR128);
+    case TWTY_STR255:
+        return sizeof(TW_STR255);
+    case TWAINHELPER_TWTY_HANDLE:
+        return sizeof(TW_HANDLE);
+    default:
+        return TwainHelper_ItemSize(pInfo->ItemType);
+    }
+}
+
+static BOOL
+TwainHelper_ExtItemsInHandle(const TW_INFO *pInfo)
+{
+    SIZE_T size = TwainHelper_ExtItemSize(pInfo);
+    return pInfo->NumItems > 1 || size > sizeof(pInfo->Item);
+}
+
+// locks the items of a successful entry, unlock with GlobalUnlock(*phItems) unless it's NULL
+static const TW_UINT8 *
+TwainHelper_LockExtItems(const TW_INFO *pInfo, UINT index, HGLOBAL *phItems)
+{
+    *phItems = NULL;
+
+    SIZE_T size = TwainHelper_ExtItemSize(pInfo);
+    if (pInfo->CondCode != TWRC_SUCCESS || index >= pInfo->NumItems || !size)
+        return NULL;
+
+    if (!TwainHelper_ExtItemsInHandle(pInfo))
+        return (const TW_UINT8 *)&pInfo->Item;
+
+    HGLOBAL hItems = (HGLOBAL)(UINT_PTR)pInfo->Item;
+    const TW_UINT8 *items = hItems ? (const TW_UINT8 *)GlobalLock(hItems) : NULL;
+    if (!items)
+        return NULL;
+
+    if (GlobalSize(hItems) < (index + 1) * size) {
+        GlobalUnlock(hItems);
         return NULL;
     }
+
+    *phItems = hItems;
+    return items + index * size;
+}
+
+void
+TwainHelper_FreeExtImageInfo(TW_EXTIMAGEINFO *pInfo)
+{
+    for (TW_UINT32 i = 0; i < pInfo->NumInfos; ++i) {
+        TW_INFO *info = &pInfo->Info[i];
+        if (info->CondCode != TWRC_SUCCESS || !info->Item)
+            continue;
+
+        if (info->ItemType == TWAINHELPER_TWTY_HANDLE) {
+            for (UINT j = 0; j < info->NumItems; ++j) {
+                HGLOBAL hItems;
+                const TW_UINT8 *item = TwainHelper_LockExtItems(info, j, &hItems);
+                if (item)
+                    GlobalFree(*(const HGLOBAL UNALIGNED *)item);
+                if (hItems)
+                    GlobalUnlock(hItems);
+            }
+        }
+
+        if (TwainHelper_ExtItemsInHandle(info))
+            GlobalFree((HGLOBAL)(UINT_PTR)info->Item);
+
+        info->Item = 0;
+        info->CondCode = TWRC_DATANOTAVAILABLE;
+    }
+}
+
+BOOL
+TwainHelper_ExtImageInfoNumber(const TW_INFO *pInfo, UINT index, TW_UINT32 *pValue)
+{
+    if (!TwainHelper_ItemSize(pInfo->ItemType))
+        return FALSE;
+
+    HGLOBAL hItems;
+    const TW_UINT8 *item = TwainHelper_LockExtItems(pInfo, index, &hItems);
+    if (!item)
+        return FALSE;
+
+    *pValue = TwainHelper_ReadItem(item, pInfo->ItemType);
+    if (hItems)
+        GlobalUnlock(hItems);
+    return TRUE;
+}
+
+BOOL
+TwainHelper_ExtImageInfoText(const TW_INFO *pInfo, UINT index, char *buf, UINT bufSize)
+{
+    if (!bufSize)
+        return FALSE;
+    buf[0] = 0;
+
+    if (pInfo->ItemType != TWAINHELPER_TWTY_HANDLE && TwainHelper_ItemSize(pInfo->ItemType))
+        return FALSE;
+
+    HGLOBAL hItems;
+    const TW_UINT8 *item = TwainHelper_LockExtItems(pInfo, index, &hItems);
+    if (!item)
+        return FALSE;
+
+    const char *text = (const char *)item;
+    SIZE_T length = TwainHelper_ExtItemSize(pInfo);
+    HGLOBAL hText = NULL;
+    if (pInfo->ItemType == TWAINHELPER_TWTY_HANDLE) {
+        hText = *(const HGLOBAL UNALIGNED *)item;
+        text = hText ? (const char *)GlobalLock(hText) : NULL;
+        length = text ? GlobalSize(hText) : 0;
+    }
+
+    // not necessarily NUL terminated
+    UINT n = 0;
+    while (text && n < length && n + 1 < bufSize && text[n]) {
+        buf[n] = text[n];
+        ++n;
+    }
+    buf[n] = 0;
+
+    if (text && hText)
+        GlobalUnlock(hText);
+    if (hItems)
+        GlobalUnlock(hItems);
+    return text != NULL;
 }
 
 TW_UINT16
-TwainHelper_EndTransferImage(void)
+TwainHelper_EndTransferImage(TwainSession *pSession)
 {
-    if (g_twainState < TH_STATE_TRANSFERRING)
+    if (pSession->state < TH_STATE_TRANSFERRING)
         return (TW_UINT16)-1;
 
     TW_PENDINGXFERS twPendingXfers;
     ZeroMemory(&twPendingXfers, sizeof(twPendingXfers));
-    TwainHelper_CallDSM(&g_twainSource,
+    TwainHelper_CallDSM(pSession, &pSession->source,
                         DG_CONTROL,
                         DAT_PENDINGXFERS,
                         MSG_ENDXFER,
                         &twPendingXfers);
 
-    g_twainState = twPendingXfers.Count > 0 ? TH_STATE_TRANSFER_READY : TH_STATE_SOURCE_ENABLED;
+    pSession->state = twPendingXfers.Count > 0 ? TH_STATE_TRANSFER_READY : TH_STATE_SOURCE_ENABLED;
 
     return twPendingXfers.Count;
 }
 
 BOOL
-TwainHelper_AbortPendingTransfers(void)
+TwainHelper_AbortPendingTransfers(TwainSession *pSession)
 {
-    if (g_twainState < TH_STATE_SOURCE_ENABLED)
+    if (pSession->state < TH_STATE_SOURCE_ENABLED)
         return FALSE;
 
-    if (g_twainState >= TH_STATE_TRANSFERRING)
-        TwainHelper_EndTransferImage();
+    if (pSession->state >= TH_STATE_TRANSFERRING)
+        TwainHelper_EndTransferImage(pSession);
 
     TW_PENDINGXFERS twPendingXfers;
     ZeroMemory(&twPendingXfers, sizeof(twPendingXfers));
-    TW_UINT16 s = TwainHelper_CallDSM(&g_twainSource,
+    TW_UINT16 s = TwainHelper_CallDSM(pSession, &pSession->source,
                                       DG_CONTROL,
                                       DAT_PENDINGXFERS,
                                       MSG_RESET,
                                       &twPendingXfers);
 
-    g_twainState = TH_STATE_SOURCE_ENABLED;
+    pSession->state = TH_STATE_SOURCE_ENABLED;
     return s == TWRC_SUCCESS;
 }
 
@@ -26,32 +26,171 @@ enum TwainHelperState {
     TH_STATE_TRANSFERRING = 7
 };
 
+// One TWAIN session: a connection to the DSM plus at most one open source,
+// with its own state machine. A process may run several sessions at the
+// same time, but each one must only be used from the thread that owns
+// its parent window.
+struct TwainSession {
+    TW_IDENTITY           app;
+    TW_IDENTITY           source;
+    enum TwainHelperState state;
+    HGLOBAL               hCapContainer;    // reused for every MSG_SET
+    SIZE_T                capContainerSize;
+
+    // the DSM call in progress, see TwainHelper_CallInProgress()
+    volatile LONG         callSeq;          // odd during a call
+    UINT                  callDepth;        // calls from inside a call aren't tracked
+    TW_UINT32             callDG;
+    TW_UINT16             callDAT;
+    TW_UINT16             callMSG;
+    DWORD                 callStartTicks;
+};
+
+// A snapshot of the DSM call a session is in
+struct TwainCallInfo {
+    LONG      seq;           // differs for every call
+    TW_UINT32 dg;
+    TW_UINT16 dat;
+    TW_UINT16 msg;
+    DWORD     startTicks;
+};
+
+enum {
+    TWAINHELPER_MAX_CAP_ITEMS = 64
+};
+
+// A capability value in any of the four container types. Items are kept
+// as 32-bit values whatever their TWTY_* type: signed types are sign
+// extended, TW_FIX32 is packed with Whole in the low word (see
+// TwainHelper_Fix32). Strings and frames aren't supported.
+struct TwainCapValue {
+    TW_UINT16 cap;
+    TW_UINT16 conType;       // TWON_ONEVALUE, TWON_ENUMERATION, TWON_RANGE or TWON_ARRAY
+    TW_UINT16 itemType;      // TWTY_*
+    TW_UINT32 count;         // items used (ONEVALUE: 1, RANGE: 0)
+    BOOL      truncated;     // the source sent more than TWAINHELPER_MAX_CAP_ITEMS
+    TW_UINT32 currentIndex;  // ENUMERATION
+    TW_UINT32 defaultIndex;  // ENUMERATION
+    TW_UINT32 minValue, maxValue, stepSize, defaultValue, currentValue; // RANGE
+    TW_UINT32 items[TWAINHELPER_MAX_CAP_ITEMS];
+};
+
+// One entry of a TwainHelper_SetCaps() batch, with its own result
+struct TwainCapSetting {
+    TwainCapValue value;
+    TW_UINT16     rc;        // TWRC_SUCCESS, TWRC_CHECKSTATUS (source picked something close) or TWRC_FAILURE
+    TW_UINT16     cc;        // TWCC_* if it failed
+};
+
 enum TwainHelperState
-TwainHelper_CurrentState(void);
+TwainHelper_CurrentState(const TwainSession *pSession);
 
+// The one function of a session that may be called from another thread,
+// e.g. by a watchdog: FALSE if the session isn't inside DSM_Entry
 BOOL
-TwainHelper_Initialize(HWND hwndParentWindow);
+TwainHelper_CallInProgress(const TwainSession *pSession, TwainCallInfo *pCall);
+
+BOOL
+TwainHelper_Initialize(TwainSession *pSession, HWND hwndParentWindow);
 
 void
-TwainHelper_Teardown(HWND hwndParentWindow);
+TwainHelper_Teardown(TwainSession *pSession, HWND hwndParentWindow);
 
 BOOL
-TwainHelper_OpenSource(const TW_IDENTITY *pSource);
+TwainHelper_OpenSource(TwainSession *pSession, const TW_IDENTITY *pSource);
 
 void
-TwainHelper_CloseSource(void);
+TwainHelper_CloseSource(TwainSession *pSession);
 
 void
-TwainHelper_DisableSource(void);
+TwainHelper_DisableSource(TwainSession *pSession);
 
 BOOL
-TwainHelper_SetNumImages(TW_UINT32 numImages);
+TwainHelper_SetNumImages(TwainSession *pSession, TW_UINT32 numImages);
 
+// Capability negotiation, in state 4 (some sources allow MSG_GET later).
+// All of these return the TWRC_* code and store the TWCC_* condition code
+// in *pCC if it's not NULL.
+//
+// msg is MSG_GET, MSG_GETCURRENT, MSG_GETDEFAULT or MSG_RESET, the
+// latter also returns the value after the reset.
+TW_UINT16
+TwainHelper_GetCap(TwainSession *pSession, TW_UINT16 msg, TW_UINT16 cap, TwainCapValue *pValue, TW_UINT16 *pCC);
+
+TW_UINT16
+TwainHelper_SetCap(TwainSession *pSession, const TwainCapValue *pValue, TW_UINT16 *pCC);
+
+// Sets every capability in order, even if some fail, and returns how
+// many were accepted (TWRC_SUCCESS or TWRC_CHECKSTATUS)
+UINT
+TwainHelper_SetCaps(TwainSession *pSession, TwainCapSetting *pSettings, UINT count);
+
+void
+TwainHelper_InitOneValue(TwainCapValue *pValue, TW_UINT16 cap, TW_UINT16 itemType, TW_UINT32 item);
+
+inline TW_UINT32
+TwainHelper_Fix32(TW_INT16 whole)
+{
+    return (TW_UINT16)whole;
+}
+
+// the whole part of a packed TW_FIX32, rounded
+inline TW_INT32
+TwainHelper_Fix32ToInt(TW_UINT32 fix32)
+{
+    return (TW_INT16)(fix32 & 0xffff) + ((fix32 >> 16) >= 0x8000 ? 1 : 0);
+}
+
+// MSG_SET with a TW_ONEVALUE container
 BOOL
-TwainHelper_EnableSource(HWND hwndParentWindow);
+TwainHelper_SetCapOneValue(TwainSession *pSession, TW_UINT16 cap, TW_UINT16 itemType, TW_UINT32 value);
 
+// The source's complete settings as an opaque blob (DAT_CUSTOMDSDATA),
+// in state 4. GetCustomData fails if the source doesn't report
+// CAP_CUSTOMDSDATA, otherwise the caller owns *phData (GlobalFree).
+// SetCustomData only reads hData, a single call restores everything,
+// including settings made in the source's UI.
 BOOL
-TwainHelper_UserSelectSource(TW_IDENTITY *pSource);
+TwainHelper_GetCustomData(TwainSession *pSession, HGLOBAL *phData, TW_UINT32 *pSize);
+
+BOOL
+TwainHelper_SetCustomData(TwainSession *pSession, HGLOBAL hData, TW_UINT32 size);
+
+// Without the source's UI, the source starts scanning right away and
+// usually doesn't send MSG_CLOSEDSREQ when it's done.
+BOOL
+TwainHelper_EnableSource(TwainSession *pSession, HWND hwndParentWindow, BOOL showUI);
+
+// Condition code of the last failed operation on the open source
+// (or on the DSM if no source is open)
+TW_UINT16
+TwainHelper_GetConditionCode(TwainSession *pSession);
+
+// Asks an open source whether its device is still connected. Only an
+// explicit FALSE means offline; sources that don't implement
+// CAP_DEVICEONLINE, or fail to answer, are assumed to be online.
+BOOL
+TwainHelper_IsDeviceOnline(TwainSession *pSession);
+
+BOOL
+TwainHelper_UserSelectSource(TwainSession *pSession, TW_IDENTITY *pSource);
+
+// Walks the installed sources: call GetFirstSource once, then GetNextSource
+// until it returns FALSE.
+BOOL
+TwainHelper_GetFirstSource(TwainSession *pSession, TW_IDENTITY *pSource);
+
+BOOL
+TwainHelper_GetNextSource(TwainSession *pSession, TW_IDENTITY *pSource);
+
+// Source ids are only valid within one DSM connection, so sources are
+// recognized by their names. Devices of the same model share everything
+// but the product name, at most.
+BOOL
+TwainHelper_IsSameSource(const TW_IDENTITY *a, const TW_IDENTITY *b);
+
+BOOL
+TwainHelper_IsSameModel(const TW_IDENTITY *a, const TW_IDENTITY *b);
 
 // TwainHelper_IsTwainMessage() needs to be called at the top of the message loop.
 // If it returns TRUE, you need to check *pTWMessage for what to do:
@@ -60,15 +199,49 @@ TwainHelper_UserSelectSource(TW_IDENTITY *pSource);
 //      otherwise: Do nothing
 // If it returns FALSE, do your normal message processing (IsDialogMessage, TranslateMessage, DispatchMessage, etc.)
 BOOL
-TwainHelper_IsTwainMessage(MSG *pMsg, TW_UINT16 *pTWMessage);
+TwainHelper_IsTwainMessage(TwainSession *pSession, MSG *pMsg, TW_UINT16 *pTWMessage);
 
+// What the next transfer is going to look like, in state 6
+BOOL
+TwainHelper_GetImageInfo(TwainSession *pSession, TW_IMAGEINFO *pInfo);
+
+// Transfers the next image, in state 6. If that fails, *pRC is
+// TWRC_CANCEL (the user cancelled it in the source, end the transfer with
+// TwainHelper_EndTransferImage()) or TWRC_FAILURE, with the condition
+// code in *pCC, and the source stays in state 6. Both may be NULL.
 HGLOBAL
-TwainHelper_BeginTransferImage(void);
+TwainHelper_BeginTransferImage(TwainSession *pSession, TW_UINT16 *pRC, TW_UINT16 *pCC);
 
-// returns the number of transfers left
-TW_UINT16
-TwainHelper_EndTransferImage(void);
+// Skips the image that failed to transfer (MSG_ENDXFER in state 6).
+// *pPending is what TwainHelper_EndTransferImage() returns. FALSE if the
+// source doesn't allow that.
+BOOL
+TwainHelper_SkipTransferImage(TwainSession *pSession, TW_UINT16 *pPending);
+
+// Extended image info of the image just transferred, in state 7, before
+// TwainHelper_EndTransferImage(). The caller fills in NumInfos and the
+// InfoIDs; pInfo needs room for NumInfos entries. Entries the source
+// doesn't have keep a CondCode other than TWRC_SUCCESS. The source
+// allocates some of the items, free them with
+// TwainHelper_FreeExtImageInfo() even if this fails.
+BOOL
+TwainHelper_GetExtImageInfo(TwainSession *pSession, TW_EXTIMAGEINFO *pInfo);
+
+void
+TwainHelper_FreeExtImageInfo(TW_EXTIMAGEINFO *pInfo);
+
+// Numeric item of an entry, sign extended like TwainCapValue items
+BOOL
+TwainHelper_ExtImageInfoNumber(const TW_INFO *pInfo, UINT index, TW_UINT32 *pValue);
 
+// Text item of an entry (TWTY_STR* or a handle to the text, as with
+// TWEI_BARCODETEXT), NUL terminated and cut to bufSize
 BOOL
-TwainHelper_AbortPendingTransfers(void);
+TwainHelper_ExtImageInfoText(const TW_INFO *pInfo, UINT index, char *buf, UINT bufSize);
 
+// returns the number of transfers left, 0xffff if the source doesn't know
+TW_UINT16
+TwainHelper_EndTransferImage(TwainSession *pSession);
+
+BOOL
+TwainHelper_AbortPendingTransfers(TwainSession *pSession);
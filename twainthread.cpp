@@ -0,0 +1,1312 @@
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include "twainthread.h"
+#include "settings.h"
+#include "capcache.h"
+#include "profile.h"
+#include "tracelog.h"
+
+#include <windows.h>
+
+// commands posted to the hidden window
+enum {
+    TWAINTHREAD_CMD_QUIT = WM_APP + 1,
+    TWAINTHREAD_CMD_SCAN             // picks up pendingJob
+};
+
+// ICAP_AUTODISCARDBLANKPAGES values newer than our twain.h: TWBP_AUTO
+// lets the source decide what's blank, TWBP_DISABLE keeps every page
+#define TWAINTHREAD_DISCARD_BLANK_AUTO    ((TW_UINT32)-1)
+#define TWAINTHREAD_DISCARD_BLANK_DISABLE ((TW_UINT32)-2)
+
+// how often an idle warm source is checked for its device
+#define TWAINTHREAD_HEALTH_CHECK_MS 15000
+#define TWAINTHREAD_HEALTH_TIMER    1
+
+// a page that fails for no particular reason is tried this often, then skipped
+#define TWAINTHREAD_TRANSFER_ATTEMPTS  3
+#define TWAINTHREAD_LOWMEMORY_DELAY_MS 200
+
+// How long a DSM call may take before its session counts as hung. Opening
+// a source may wake up the device, a transfer may scan a whole page.
+#define TWAINTHREAD_CALL_DEADLINE_MS     30000
+#define TWAINTHREAD_OPEN_DEADLINE_MS     60000
+#define TWAINTHREAD_TRANSFER_DEADLINE_MS 120000
+#define TWAINTHREAD_WATCHDOG_INTERVAL_MS 1000
+#define TWAINTHREAD_MAX_FRAMES           32
+
+enum TwainThreadMode {
+    TWAINTHREAD_MODE_SCAN,
+    TWAINTHREAD_MODE_PICK,
+    TWAINTHREAD_MODE_LIST
+};
+
+struct TwainThread {
+    TwainThread     *next;
+    HANDLE           hThread;
+    HANDLE           hReadyEvent;
+    HWND             hwndNotify;
+    HWND             hwndTwain;      // owned by the session thread
+    TwainSession     session;        // only touched on the session thread
+    ScanJob         *job;            // of the running batch, owned by the session thread
+    UINT             device;
+    TW_IDENTITY      source;
+    BOOL             hasSource;      // otherwise the user selects one
+    TwainThreadMode  mode;
+    TwainScanOptions options;
+    ScanProfile     *profile;        // our copy of options.profile
+    UINT             pagesInBatch;
+    UINT             pagesSkipped;   // in this batch, failed to transfer
+    int              expectedPixelType; // what we asked for, checked on every page
+    UINT             expectedBitDepth;
+    UINT             offloaded;      // PAGEWRITER_* back stages the scanner does
+    DWORD            lastPageTicks;  // when the previous page of the batch arrived
+    DWORD            maxPageGap;     // ms between two pages
+    DWORD            totalPageGap;
+    CapCache         caps;
+    BOOL             capsValid;      // caps describes the open source
+    volatile LONG    idle;           // warm and waiting for TwainThread_ScanAgain()
+    ScanJob * volatile pendingJob;   // handed over by TwainThread_ScanAgain()
+    UINT             pendingDevice;
+    BOOL             inTwain;        // a DSM call may be pumping messages
+    BOOL             quitRequested;
+    BOOL             hung;           // the watchdog gave up on it, UI thread only
+};
+
+static const WCHAR g_twainWindowClass[] = L"TwainClientTwainThread";
+
+// all sessions that haven't been reaped yet, only used on the UI thread
+static TwainThread *g_threads;
+
+// checks g_threads for hung DSM calls while there are any
+static UINT_PTR     g_watchdogTimer;
+
+static void
+TwainThread_PostState(TwainThread *t)
+{
+    PostMessage(t->hwndNotify, TWAINTHREAD_WM_STATE, (WPARAM)TwainHelper_CurrentState(&t->session), (LPARAM)t);
+}
+
+static void
+TwainThread_PostError(TwainThread *t, const WCHAR *text)
+{
+    PostMessage(t->hwndNotify, TWAINTHREAD_WM_ERROR, 0, (LPARAM)text);
+}
+
+// the session won't deliver any more pages for the current batch
+static void
+TwainThread_EndJob(TwainThread *t)
+{
+    if (!t->job)
+        return;
+
+    ScanJob_DeviceFinished(t->job, t->device);
+    ScanJob_Release(t->job);
+    t->job = NULL;
+}
+
+static void
+TwainThread_Shutdown(TwainThread *t)
+{
+    // TwainThread_ScanAgain() must not hand over any more batches
+    InterlockedExchange(&t->idle, 0);
+
+    TwainHelper_Teardown(&t->session, t->hwndTwain);
+    DestroyWindow(t->hwndTwain);
+    t->hwndTwain = NULL;
+}
+
+static void
+TwainThread_ListSources(TwainThread *t)
+{
+    TwainSourceList *list = (TwainSourceList *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(*list));
+    if (!list) {
+        TwainThread_PostError(t, L"Out of memory");
+        return;
+    }
+
+    BOOL found = TwainHelper_GetFirstSource(&t->session, &list->sources[0]);
+    while (found && list->count < TWAINTHREAD_MAX_SOURCES) {
+        list->count++;
+        if (list->count < TWAINTHREAD_MAX_SOURCES)
+            found = TwainHelper_GetNextSource(&t->session, &list->sources[list->count]);
+    }
+
+    if (!PostMessage(t->hwndNotify, TWAINTHREAD_WM_SOURCESLISTED, 0, (LPARAM)list))
+        HeapFree(GetProcessHeap(), 0, list);
+}
+
+// Looks up the source by name in this DSM connection, its id may have
+// changed since it was enumerated. Among several sources with the same
+// name, the one with the same id wins.
+static BOOL
+TwainThread_FindSource(TwainThread *t, const TW_IDENTITY *pWanted, TW_IDENTITY *pFound)
+{
+    BOOL matched = FALSE;
+    TW_IDENTITY other;
+
+    BOOL found = TwainHelper_GetFirstSource(&t->session, &other);
+    while (found) {
+        // only a product name, e.g. from the command line
+        BOOL same = pWanted->Manufacturer[0] ? TwainHelper_IsSameSource(&other, pWanted)
+                                             : lstrcmpiA(other.ProductName, pWanted->ProductName) == 0;
+        if (same && (!matched || other.Id == pWanted->Id)) {
+            *pFound = other;
+            matched = TRUE;
+        }
+
+        found = TwainHelper_GetNextSource(&t->session, &other);
+    }
+
+    return matched;
+}
+
+static void
+TwainThread_PickSources(TwainThread *t)
+{
+    TW_IDENTITY selected;
+    ZeroMemory(&selected, sizeof(selected));
+
+    if (!TwainHelper_UserSelectSource(&t->session, &selected)) {
+        TwainThread_PostError(t, L"Failed to select TWAIN source");
+        return;
+    }
+
+    TwainSourceList *list = (TwainSourceList *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(*list));
+    if (!list) {
+        TwainThread_PostError(t, L"Out of memory");
+        return;
+    }
+
+    // the selected source comes first, then its siblings in DSM order
+    list->sources[list->count++] = selected;
+
+    TW_IDENTITY other;
+    BOOL found = TwainHelper_GetFirstSource(&t->session, &other);
+    while (found && list->count < SCANJOB_MAX_DEVICES) {
+        if (other.Id != selected.Id && TwainHelper_IsSameModel(&other, &selected))
+            list->sources[list->count++] = other;
+
+        found = TwainHelper_GetNextSource(&t->session, &other);
+    }
+
+    if (!PostMessage(t->hwndNotify, TWAINTHREAD_WM_SOURCESPICKED, 0, (LPARAM)list))
+        HeapFree(GetProcessHeap(), 0, list);
+}
+
+static const WCHAR *
+TwainThread_CapError(TW_UINT16 cap)
+{
+    switch (cap) {
+    case ICAP_PIXELTYPE:
+        return L"The source doesn't support the pixel type";
+    case ICAP_BITDEPTH:
+        return L"The source doesn't support the bit depth";
+    case ICAP_XRESOLUTION:
+    case ICAP_YRESOLUTION:
+        return L"The source doesn't support the resolution";
+    case CAP_DUPLEXENABLED:
+        return L"The source can't change duplex mode";
+    default:
+        return L"The source rejected a setting";
+    }
+}
+
+// the order matters, e.g. the available resolutions may depend on the pixel type
+static void
+TwainThread_ApplyOptions(TwainThread *t, const TwainScanOptions *o)
+{
+    TwainCapSetting settings[5];
+    UINT count = 0;
+
+    if (o->pixelType >= 0)
+        TwainHelper_InitOneValue(&settings[count++].value, ICAP_PIXELTYPE, TWTY_UINT16, (TW_UINT32)o->pixelType);
+    if (o->bitDepth)
+        TwainHelper_InitOneValue(&settings[count++].value, ICAP_BITDEPTH, TWTY_UINT16, o->bitDepth);
+    if (o->resolution) {
+        TwainHelper_InitOneValue(&settings[count++].value, ICAP_XRESOLUTION, TWTY_FIX32, TwainHelper_Fix32((TW_INT16)o->resolution));
+        TwainHelper_InitOneValue(&settings[count++].value, ICAP_YRESOLUTION, TWTY_FIX32, TwainHelper_Fix32((TW_INT16)o->resolution));
+    }
+    if (o->duplex >= 0)
+        TwainHelper_InitOneValue(&settings[count++].value, CAP_DUPLEXENABLED, TWTY_BOOL, o->duplex ? TRUE : FALSE);
+
+    // don't even ask for what the cached capabilities rule out
+    TW_UINT16 rejected[5];
+    UINT rejectedCount = 0;
+    UINT valid = 0;
+    for (UINT i = 0; i < count; ++i) {
+        if (t->capsValid && !CapCache_Allows(&t->caps, settings[i].value.cap, settings[i].value.items[0]))
+            rejected[rejectedCount++] = settings[i].value.cap;
+        else
+            settings[valid++] = settings[i];
+    }
+
+    TwainHelper_SetCaps(&t->session, settings, valid);
+
+    for (UINT i = 0; i < valid; ++i) {
+        if (settings[i].rc != TWRC_SUCCESS && settings[i].rc != TWRC_CHECKSTATUS)
+            rejected[rejectedCount++] = settings[i].value.cap;
+    }
+
+    // the source keeps its own value for everything it didn't accept
+    const WCHAR *last = NULL;
+    for (UINT i = 0; i < rejectedCount; ++i) {
+        const WCHAR *error = TwainThread_CapError(rejected[i]);
+        if (error != last)
+            TwainThread_PostError(t, error);
+        last = error;
+    }
+}
+
+// One MSG_SET brings back everything the profile knows, otherwise its
+// capabilities are negotiated one by one. Explicit options still win.
+static void
+TwainThread_ApplyProfile(TwainThread *t, TwainScanOptions *pOptions)
+{
+    TwainScanOptions wanted = *pOptions;
+    if (t->profile)
+        Profile_MergeOptions(t->profile, &wanted);
+
+    t->expectedPixelType = wanted.pixelType;
+    t->expectedBitDepth = wanted.bitDepth;
+
+    // the blob knows whether the user scanned from the feeder, unless
+    // /feeder says otherwise
+    if (t->profile && Profile_MatchesSource(t->profile, &t->session.source)
+        && TwainHelper_SetCustomData(&t->session, t->profile->hDsData, t->profile->dsDataSize))
+        return;
+
+    if (t->profile)
+        *pOptions = wanted;
+    if (pOptions->feeder < 0)
+        pOptions->feeder = TRUE;
+}
+
+// Drivers that draw and pump their own progress dialog for every page
+// are measurably slower, and the dialog steals the focus
+static void
+TwainThread_ApplyIndicators(TwainThread *t, const TwainScanOptions *o)
+{
+    if (!(o->flags & TWAINTHREAD_NO_INDICATORS))
+        return;
+    if (t->capsValid && !CapCache_Allows(&t->caps, CAP_INDICATORS, FALSE))
+        return;
+
+    if (!TwainHelper_SetCapOneValue(&t->session, CAP_INDICATORS, TWTY_BOOL, FALSE))
+        TraceLog_Write(L"%hs: can't turn off the progress indicators", t->session.source.ProductName);
+}
+
+// Asked again once the first page is ready, the user may have switched
+// sides in the source's UI
+static BOOL
+TwainThread_IsDuplex(TwainThread *t)
+{
+    const CapCacheEntry *e = t->capsValid ? CapCache_Find(&t->caps, CAP_DUPLEXENABLED) : NULL;
+    if (e && !e->supported)
+        return FALSE;
+
+    TwainCapValue v;
+    if (TwainHelper_GetCap(&t->session, MSG_GETCURRENT, CAP_DUPLEXENABLED, &v, NULL) != TWRC_SUCCESS)
+        return FALSE;
+
+    return v.conType == TWON_ONEVALUE && v.items[0] != 0;
+}
+
+// the largest CAP_MAXBATCHBUFFERS the source offers, 0 if unknown
+static TW_UINT32
+TwainThread_MaxBatchBuffers(TwainThread *t)
+{
+    TwainCapValue queried;
+    const TwainCapValue *v = NULL;
+
+    // the cache may be from a batch without the feeder, which some
+    // sources don't offer any buffers for
+    const CapCacheEntry *e = t->capsValid ? CapCache_Find(&t->caps, CAP_MAXBATCHBUFFERS) : NULL;
+    if (e && e->supported)
+        v = &e->value;
+    else if (TwainHelper_GetCap(&t->session, MSG_GET, CAP_MAXBATCHBUFFERS, &queried, NULL) == TWRC_SUCCESS)
+        v = &queried;
+
+    if (!v)
+        return 0;
+    if (v->conType == TWON_RANGE)
+        return v->maxValue;
+
+    TW_UINT32 max = 0;
+    for (UINT i = 0; i < v->count; ++i) {
+        if (v->items[i] > max)
+            max = v->items[i];
+    }
+    return max;
+}
+
+// Keeps the paper moving: the feeder scans ahead into the source's
+// buffers while we transfer earlier pages. Flatbeds reject all of this,
+// so nothing is reported but a trace line.
+static void
+TwainThread_ApplyFeeder(TwainThread *t, const TwainScanOptions *o)
+{
+    if (o->feeder < 0)
+        return;
+
+    TwainCapSetting settings[4];
+    UINT count = 0;
+
+    // the others depend on the feeder being enabled
+    TwainHelper_InitOneValue(&settings[count++].value, CAP_FEEDERENABLED, TWTY_BOOL, o->feeder ? TRUE : FALSE);
+    if (o->feeder) {
+        TwainHelper_InitOneValue(&settings[count++].value, CAP_AUTOFEED, TWTY_BOOL, TRUE);
+
+        TW_UINT32 buffers = TwainThread_MaxBatchBuffers(t);
+        if (buffers)
+            TwainHelper_InitOneValue(&settings[count++].value, CAP_MAXBATCHBUFFERS, TWTY_UINT32, buffers);
+    }
+    TwainHelper_InitOneValue(&settings[count++].value, CAP_AUTOSCAN, TWTY_BOOL, o->feeder ? TRUE : FALSE);
+
+    UINT valid = 0;
+    for (UINT i = 0; i < count; ++i) {
+        if (!t->capsValid || CapCache_Allows(&t->caps, settings[i].value.cap, settings[i].value.items[0]))
+            settings[valid++] = settings[i];
+    }
+
+    TwainHelper_SetCaps(&t->session, settings, valid);
+
+    for (UINT i = 0; i < valid; ++i) {
+        if (settings[i].rc != TWRC_SUCCESS && settings[i].rc != TWRC_CHECKSTATUS)
+            TraceLog_Write(L"%hs: feeder capability 0x%04x rejected, condition code %u",
+                           t->session.source.ProductName, settings[i].value.cap, settings[i].cc);
+    }
+}
+
+// MSG_SET unless the cache knows better; FALSE if the source didn't take it
+static BOOL
+TwainThread_TrySetCap(TwainThread *t, TW_UINT16 cap, TW_UINT16 itemType, TW_UINT32 value)
+{
+    if (t->capsValid && !CapCache_Allows(&t->caps, cap, value))
+        return FALSE;
+
+    return TwainHelper_SetCapOneValue(&t->session, cap, itemType, value);
+}
+
+// The scanner's own image processing costs us nothing, so it replaces
+// our back side stages where it can. Automatic rotation also turns
+// flipped back sides. The scanner discards blank fronts as well, and
+// it only does so if the batch wants blank backs dropped on a duplex
+// scan. A warm source keeps its settings, so what the last batch turned
+// on is turned off again.
+static void
+TwainThread_ApplyOffload(TwainThread *t, const TwainScanOptions *o)
+{
+    if (o->deskew >= 0 && !TwainThread_TrySetCap(t, ICAP_AUTOMATICDESKEW, TWTY_BOOL, o->deskew ? TRUE : FALSE))
+        TraceLog_Write(L"%hs: can't change automatic deskew", t->session.source.ProductName);
+
+    UINT wanted = ScanJob_BackStages(t->job);
+    UINT offloaded = 0;
+
+    if ((wanted & PAGEWRITER_ROTATE_BACKS)
+        && TwainThread_TrySetCap(t, ICAP_AUTOMATICROTATE, TWTY_BOOL, TRUE))
+        offloaded |= PAGEWRITER_ROTATE_BACKS;
+
+    if ((wanted & PAGEWRITER_DROP_BLANK_BACKS) && TwainThread_IsDuplex(t)
+        && TwainThread_TrySetCap(t, ICAP_AUTODISCARDBLANKPAGES, TWTY_INT32, TWAINTHREAD_DISCARD_BLANK_AUTO))
+        offloaded |= PAGEWRITER_DROP_BLANK_BACKS;
+
+    UINT stale = t->offloaded & ~offloaded;
+    if (stale & PAGEWRITER_ROTATE_BACKS)
+        TwainHelper_SetCapOneValue(&t->session, ICAP_AUTOMATICROTATE, TWTY_BOOL, FALSE);
+    if (stale & PAGEWRITER_DROP_BLANK_BACKS)
+        TwainHelper_SetCapOneValue(&t->session, ICAP_AUTODISCARDBLANKPAGES, TWTY_INT32, TWAINTHREAD_DISCARD_BLANK_DISABLE);
+
+    if (offloaded)
+        TraceLog_Write(L"%hs: scanner does back side stages 0x%x", t->session.source.ProductName, offloaded);
+
+    t->offloaded = offloaded;
+    ScanJob_SetOffloaded(t->job, t->device, offloaded);
+}
+
+// Separator sheets are recognized by the scanner while it scans, so
+// splitting the batch costs us no pass over the images
+static void
+TwainThread_ApplySeparators(TwainThread *t, const TwainScanOptions *o)
+{
+    if (!o->separators)
+        return;
+
+    BOOL ok = TwainThread_TrySetCap(t, ICAP_EXTIMAGEINFO, TWTY_BOOL, TRUE);
+    if (ok && (o->separators & TWAINTHREAD_SEPARATE_PATCHCODE))
+        ok = TwainThread_TrySetCap(t, ICAP_PATCHCODEDETECTIONENABLED, TWTY_BOOL, TRUE);
+    if (ok && (o->separators & TWAINTHREAD_SEPARATE_BARCODE))
+        ok = TwainThread_TrySetCap(t, ICAP_BARCODEDETECTIONENABLED, TWTY_BOOL, TRUE);
+
+    // the pages are still worth saving, just not split
+    if (!ok) {
+        TraceLog_Write(L"%hs: can't detect separator sheets", t->session.source.ProductName);
+        TwainThread_PostError(t, L"The source can't detect separator sheets");
+    }
+}
+
+// FALSE only if the source knows its feeder is empty
+static BOOL
+TwainThread_FeederLoaded(TwainThread *t)
+{
+    TwainCapValue v;
+    if (TwainHelper_GetCap(&t->session, MSG_GETCURRENT, CAP_FEEDERLOADED, &v, NULL) != TWRC_SUCCESS)
+        return TRUE;
+
+    return v.conType != TWON_ONEVALUE || v.items[0] != 0;
+}
+
+static BOOL
+TwainThread_Enable(TwainThread *t)
+{
+    TwainScanOptions options = t->options;
+    const TwainScanOptions *o = &options;
+
+    TwainThread_ApplyProfile(t, &options);
+
+    TwainHelper_SetNumImages(&t->session, o->pageLimit ? o->pageLimit : (TW_UINT32)-1);
+    // ignore errors - worst case we only transfer one image
+
+    TwainThread_ApplyOptions(t, o);
+    TwainThread_ApplyFeeder(t, o);
+    TwainThread_ApplyIndicators(t, o);
+    TwainThread_ApplyOffload(t, o);
+    TwainThread_ApplySeparators(t, o);
+
+    // without UI, nobody would notice the source waiting for paper
+    if (o->feeder > 0 && (o->flags & TWAINTHREAD_NO_UI) && !TwainThread_FeederLoaded(t)) {
+        TwainThread_PostError(t, L"The document feeder is empty");
+        return FALSE;
+    }
+
+    t->pagesInBatch = 0;
+    t->pagesSkipped = 0;
+    t->maxPageGap = 0;
+    t->totalPageGap = 0;
+
+    if (!TwainHelper_EnableSource(&t->session, t->hwndTwain, !(o->flags & TWAINTHREAD_NO_UI))) {
+        TwainThread_PostError(t, L"Failed to enable TWAIN source");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static BOOL
+TwainThread_DoScan(TwainThread *t)
+{
+    TW_IDENTITY source;
+    ZeroMemory(&source, sizeof(source));
+
+    if (t->mode == TWAINTHREAD_MODE_PICK) {
+        TwainThread_PickSources(t);
+        return FALSE;
+    } else if (t->mode == TWAINTHREAD_MODE_LIST) {
+        TwainThread_ListSources(t);
+        return FALSE;
+    }
+
+    BOOL found = t->hasSource && TwainThread_FindSource(t, &t->source, &source);
+    if (t->hasSource && !found && !(t->options.flags & TWAINTHREAD_ASK_IF_MISSING)) {
+        TwainThread_PostError(t, L"The TWAIN source is not available");
+        return FALSE;
+    }
+
+    if (!found && !TwainHelper_UserSelectSource(&t->session, &source)) {
+        TwainThread_PostError(t, L"Failed to select TWAIN source");
+        return FALSE;
+    }
+
+    if (!TwainHelper_OpenSource(&t->session, &source)) {
+        TwainThread_PostError(t, L"Failed to open TWAIN source");
+        return FALSE;
+    }
+
+    // the first device of a job is what the user picked
+    if (t->device == 0)
+        Settings_SaveSource(&t->session.source);
+
+    // reopened by the health check if the device goes away
+    t->source = t->session.source;
+    t->hasSource = TRUE;
+
+    // a missing or outdated cache is refreshed after the batch
+    t->capsValid = CapCache_Load(&t->session.source, &t->caps);
+
+    return TwainThread_Enable(t);
+}
+
+// a warm session was asked for the next batch
+static void
+TwainThread_ScanCommand(TwainThread *t)
+{
+    ScanJob *job = (ScanJob *)InterlockedExchangePointer((PVOID volatile *)&t->pendingJob, NULL);
+    if (!job)
+        return;
+
+    TwainThread_EndJob(t);
+    t->job = job;
+    t->device = t->pendingDevice;
+
+    t->inTwain = TRUE;
+    BOOL enabled = TwainThread_Enable(t);
+    t->inTwain = FALSE;
+
+    TwainThread_PostState(t);
+
+    if (!enabled) {
+        TwainThread_EndJob(t);
+        InterlockedExchange(&t->idle, 1);
+    }
+}
+
+// Reopens an idle warm source whose device went away. Gives up and ends
+// the session if that doesn't help either, the next batch will then
+// select a source from scratch.
+static void
+TwainThread_CheckHealth(TwainThread *t)
+{
+    if (!t->idle || t->inTwain || TwainHelper_CurrentState(&t->session) != TH_STATE_SOURCE_OPEN)
+        return;
+
+    t->inTwain = TRUE;
+
+    BOOL healthy = TwainHelper_IsDeviceOnline(&t->session);
+    if (!healthy) {
+        TwainHelper_CloseSource(&t->session);
+        t->offloaded = 0;
+        healthy = TwainHelper_OpenSource(&t->session, &t->source)
+               && TwainHelper_IsDeviceOnline(&t->session);
+    }
+
+    t->inTwain = FALSE;
+
+    if (t->quitRequested) {
+        TwainThread_Shutdown(t);
+    } else if (!healthy && InterlockedCompareExchange(&t->idle, 0, 1) == 1) {
+        // nobody claimed the session in the meantime
+        TwainThread_PostError(t, L"The scanner is no longer available");
+        TwainThread_Shutdown(t);
+    }
+}
+
+// Fills in where the next page comes from and its resolution, for the
+// manifest. Also notes pages that don't have the pixel type or bit depth
+// asked for: some sources silently keep their own, e.g. from their UI,
+// and then send up to 24 times the data we wanted.
+static void
+TwainThread_DescribePage(TwainThread *t, PageWriterPageInfo *pPage)
+{
+    ZeroMemory(pPage, sizeof(*pPage));
+    lstrcpynA(pPage->source, t->session.source.ProductName, sizeof(pPage->source));
+    pPage->device = t->device;
+
+    TW_IMAGEINFO info;
+    if (!TwainHelper_GetImageInfo(&t->session, &info))
+        return;
+
+    // TW_FIX32, rounded
+    if (info.XResolution.Whole > 0)
+        pPage->xDpi = (UINT)info.XResolution.Whole + (info.XResolution.Frac >= 0x8000);
+    if (info.YResolution.Whole > 0)
+        pPage->yDpi = (UINT)info.YResolution.Whole + (info.YResolution.Frac >= 0x8000);
+
+    if ((t->expectedPixelType >= 0 && info.PixelType != t->expectedPixelType)
+        || (t->expectedBitDepth && (UINT)info.BitsPerPixel != t->expectedBitDepth)) {
+        TraceLog_Write(L"%hs: page %u is pixel type %d with %d bits, asked for %d with %u bits",
+                       t->session.source.ProductName, t->pagesInBatch + 1,
+                       (int)info.PixelType, (int)info.BitsPerPixel,
+                       t->expectedPixelType, t->expectedBitDepth);
+    }
+}
+
+// asks the source what it found on the page just transferred, in state 7
+static BOOL
+TwainThread_IsSeparator(TwainThread *t)
+{
+    const TwainScanOptions *o = &t->options;
+    if (!o->separators)
+        return FALSE;
+
+    // TW_EXTIMAGEINFO has room for one entry only
+    struct {
+        TW_UINT32 NumInfos;
+        TW_INFO   Info[2];
+    } ext;
+    ext.NumInfos = 2;
+    ext.Info[0].InfoID = TWEI_PATCHCODE;
+    ext.Info[1].InfoID = TWEI_BARCODETEXT;
+
+    TW_EXTIMAGEINFO *info = (TW_EXTIMAGEINFO *)&ext;
+    TwainHelper_GetExtImageInfo(&t->session, info);
+
+    BOOL separator = FALSE;
+    TW_UINT32 patch;
+    if ((o->separators & TWAINTHREAD_SEPARATE_PATCHCODE)
+        && TwainHelper_ExtImageInfoNumber(&info->Info[0], 0, &patch)) {
+        TraceLog_Write(L"%hs: page %u has patch code %lu", t->session.source.ProductName, t->pagesInBatch + 1, patch);
+        separator = TRUE;
+    }
+
+    if (o->separators & TWAINTHREAD_SEPARATE_BARCODE) {
+        char text[256];
+        for (UINT i = 0; !separator && TwainHelper_ExtImageInfoText(&info->Info[1], i, text, sizeof(text)); ++i) {
+            TraceLog_Write(L"%hs: page %u has barcode %hs", t->session.source.ProductName, t->pagesInBatch + 1, text);
+
+            // barcode text is bytes, compared as such
+            const char *p = o->separatorPrefix;
+            const char *q = text;
+            while (*p && *p == *q) {
+                ++p;
+                ++q;
+            }
+            separator = !*p;
+        }
+    }
+
+    TwainHelper_FreeExtImageInfo(info);
+    return separator;
+}
+
+// A stalling feeder shows up as gaps between pages that are much
+// longer than the average
+static void
+TwainThread_PageArrived(TwainThread *t)
+{
+    DWORD now = GetTickCount();
+
+    if (t->pagesInBatch) {
+        DWORD gap = now - t->lastPageTicks;
+        t->totalPageGap += gap;
+        if (gap > t->maxPageGap)
+            t->maxPageGap = gap;
+
+        TraceLog_Write(L"%hs: page %u after %lu ms", t->session.source.ProductName, t->pagesInBatch + 1, gap);
+    }
+
+    t->lastPageTicks = now;
+}
+
+// What a failed transfer means for the rest of the batch. Returns TRUE
+// if the batch goes on, with the same page again or with the next one;
+// pages that are skipped are reported with TWAINTHREAD_WM_PAGESKIPPED.
+static BOOL
+TwainThread_RecoverTransfer(TwainThread *t, TW_UINT16 rc, TW_UINT16 cc, UINT *pAttempts)
+{
+    UINT page = t->pagesInBatch + t->pagesSkipped + 1;
+    TraceLog_Write(L"%hs: page %u failed, rc %u, cc %u, attempt %u",
+                   t->session.source.ProductName, page, rc, cc, *pAttempts);
+
+    // the user pressed cancel in the source's progress dialog
+    if (rc == TWRC_CANCEL)
+        return FALSE;
+
+    switch (cc) {
+    case TWCC_LOWMEMORY:
+        // the encoders free memory as they catch up
+        if (*pAttempts < TWAINTHREAD_TRANSFER_ATTEMPTS)
+            Sleep(TWAINTHREAD_LOWMEMORY_DELAY_MS * *pAttempts);
+        // fall through
+    case TWCC_BUMMER:
+    case TWCC_OPERATIONERROR:
+        if (*pAttempts < TWAINTHREAD_TRANSFER_ATTEMPTS)
+            return TRUE;
+        break;
+    case TWCC_PAPERDOUBLEFEED:
+        // the same image again wouldn't be any better
+        break;
+    case TWCC_PAPERJAM:
+        TwainThread_PostError(t, L"The document feeder is jammed");
+        return FALSE;
+    case TWCC_CHECKDEVICEONLINE:
+        TwainThread_PostError(t, L"The scanner went offline");
+        return FALSE;
+    default:
+        // the source is confused, the rest of the batch can't be trusted
+        TwainThread_PostError(t, L"Failed to transfer image");
+        return FALSE;
+    }
+
+    TW_UINT16 pending;
+    if (!TwainHelper_SkipTransferImage(&t->session, &pending)) {
+        TwainThread_PostError(t, L"Failed to transfer image");
+        return FALSE;
+    }
+
+    TraceLog_Write(L"%hs: skipped page %u", t->session.source.ProductName, page);
+    t->pagesSkipped++;
+    *pAttempts = 0;
+    ScanJob_SkipPage(t->job, t->device);
+    PostMessage(t->hwndNotify, TWAINTHREAD_WM_PAGESKIPPED, (WPARAM)page, (LPARAM)t);
+    return TRUE;
+}
+
+static void
+TwainThread_TransferImages(TwainThread *t)
+{
+    // front and back sides are paired into sheets, unless the scanner
+    // drops blank ones and the order tells nothing
+    if (t->pagesInBatch == 0)
+        ScanJob_SetDuplex(t->job, t->device, !(t->offloaded & PAGEWRITER_DROP_BLANK_BACKS) && TwainThread_IsDuplex(t));
+
+    UINT attempts = 0;
+    for (;;) {
+        PageWriterPageInfo page;
+        TwainThread_DescribePage(t, &page);
+
+        TW_UINT16 rc, cc;
+        page.transferStart = GetTickCount();
+        HGLOBAL hBitmap = TwainHelper_BeginTransferImage(&t->session, &rc, &cc);
+        if (hBitmap) {
+            page.transferEnd = GetTickCount();
+            attempts = 0;
+            TwainThread_PageArrived(t);
+            ScanJob_PushPage(t->job, t->device, hBitmap, &page, TwainThread_IsSeparator(t));
+            t->pagesInBatch++;
+
+            TW_UINT16 pending = TwainHelper_EndTransferImage(&t->session);
+            PostMessage(t->hwndNotify, TWAINTHREAD_WM_PAGE, (WPARAM)pending, (LPARAM)t);
+
+            if (pending > 0 && t->options.pageLimit && t->pagesInBatch >= t->options.pageLimit) {
+                // the source didn't honor CAP_XFERCOUNT
+                TwainHelper_AbortPendingTransfers(&t->session);
+                break;
+            }
+        } else if (TwainHelper_CurrentState(&t->session) >= TH_STATE_TRANSFER_READY) {
+            // one bad page shouldn't cost the rest of the feeder
+            ++attempts;
+            if (!TwainThread_RecoverTransfer(t, rc, cc, &attempts)) {
+                TwainHelper_AbortPendingTransfers(&t->session);
+                break;
+            }
+        } else {
+            // all images transferred
+            break;
+        }
+    }
+
+    TwainThread_PostState(t);
+}
+
+// the settings the user ended up with, maybe after changing them in the
+// source's UI
+static void
+TwainThread_CaptureProfile(TwainThread *t)
+{
+    TwainScanOptions options = t->options;
+    if (t->profile)
+        Profile_MergeOptions(t->profile, &options);
+
+    ScanProfile *profile = Profile_Create(&t->session.source, &options);
+    if (!profile)
+        return;
+
+    // a profile without the blob still has our capabilities
+    t->inTwain = TRUE;
+    TwainHelper_GetCustomData(&t->session, &profile->hDsData, &profile->dsDataSize);
+    t->inTwain = FALSE;
+
+    if (!PostMessage(t->hwndNotify, TWAINTHREAD_WM_PROFILECAPTURED, 0, (LPARAM)profile))
+        Profile_Free(profile);
+}
+
+// the source is done with the batch
+static void
+TwainThread_EndBatch(TwainThread *t)
+{
+    TwainThread_EndJob(t);
+
+    if (t->pagesInBatch > 1)
+        TraceLog_Write(L"%hs: %u pages, %lu ms between pages on average, %lu ms at most",
+                       t->session.source.ProductName, t->pagesInBatch,
+                       t->totalPageGap / (t->pagesInBatch - 1), t->maxPageGap);
+
+    // back to state 4
+    TwainHelper_DisableSource(&t->session);
+
+    // the pages are out, so nobody waits for the queries now
+    if (!t->capsValid && !t->quitRequested) {
+        t->inTwain = TRUE;
+        CapCache_Query(&t->session, &t->caps);
+        t->inTwain = FALSE;
+        t->capsValid = TRUE;
+        CapCache_Save(&t->caps);
+    }
+
+    if ((t->options.flags & TWAINTHREAD_CAPTURE_PROFILE) && !t->quitRequested)
+        TwainThread_CaptureProfile(t);
+
+    if ((t->options.flags & TWAINTHREAD_KEEP_WARM) && !t->quitRequested) {
+        // ready for TwainThread_ScanAgain()
+        TwainThread_PostState(t);
+        SetTimer(t->hwndTwain, TWAINTHREAD_HEALTH_TIMER, TWAINTHREAD_HEALTH_CHECK_MS, NULL);
+        InterlockedExchange(&t->idle, 1);
+    } else {
+        TwainHelper_CloseSource(&t->session);
+        TwainThread_PostState(t);
+        TwainThread_Shutdown(t);
+    }
+}
+
+static LRESULT CALLBACK
+TwainThread_WndProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
+{
+    TwainThread *t = (TwainThread *)GetWindowLongPtr(hwnd, GWLP_USERDATA);
+
+    switch (uMsg) {
+    case TWAINTHREAD_CMD_QUIT:
+        // never tear down the session underneath a running DSM call
+        if (t->inTwain)
+            t->quitRequested = TRUE;
+        else
+            TwainThread_Shutdown(t);
+        return 0;
+    case TWAINTHREAD_CMD_SCAN:
+        if (t->inTwain)
+            PostMessage(hwnd, TWAINTHREAD_CMD_SCAN, 0, 0); // try again later
+        else
+            TwainThread_ScanCommand(t);
+        return 0;
+    case WM_TIMER:
+        if (wParam == TWAINTHREAD_HEALTH_TIMER)
+            TwainThread_CheckHealth(t);
+        return 0;
+    case WM_DESTROY:
+        PostQuitMessage(0);
+        return 0;
+    }
+
+    return DefWindowProc(hwnd, uMsg, wParam, lParam);
+}
+
+static DWORD WINAPI
+TwainThread_Main(LPVOID param)
+{
+    TwainThread *t = (TwainThread *)param;
+
+    // some drivers use COM or OLE without initializing it themselves
+    CoInitialize(NULL);
+
+    // an invisible top-level window, drivers may parent their UI to it
+    t->hwndTwain = CreateWindow(g_twainWindowClass, L"", WS_POPUP,
+                                0, 0, 0, 0, NULL, NULL, GetModuleHandle(NULL), NULL);
+    if (t->hwndTwain)
+        SetWindowLongPtr(t->hwndTwain, GWLP_USERDATA, (LONG_PTR)t);
+
+    SetEvent(t->hReadyEvent);
+
+    if (!t->hwndTwain)
+        goto out;
+
+    if (!TwainHelper_Initialize(&t->session, t->hwndTwain)) {
+        TwainThread_PostError(t, L"Failed to initialize TWAIN");
+        TwainThread_Shutdown(t);
+    } else {
+        t->inTwain = TRUE;
+        BOOL enabled = TwainThread_DoScan(t);
+        t->inTwain = FALSE;
+
+        TwainThread_PostState(t);
+
+        if (!enabled || t->quitRequested)
+            TwainThread_Shutdown(t);
+    }
+
+    MSG msg;
+    while (GetMessage(&msg, NULL, 0, 0)) {
+        TW_UINT16 TWMessage = MSG_NULL;
+        if (TwainHelper_IsTwainMessage(&t->session, &msg, &TWMessage)) {
+            switch (TWMessage) {
+            case MSG_XFERREADY:
+                t->inTwain = TRUE;
+                TwainThread_TransferImages(t);
+                t->inTwain = FALSE;
+                if (t->quitRequested)
+                    TwainThread_Shutdown(t);
+                else if ((t->options.flags & TWAINTHREAD_NO_UI)
+                         && TwainHelper_CurrentState(&t->session) == TH_STATE_SOURCE_ENABLED)
+                    TwainThread_EndBatch(t); // nobody is going to press "close"
+                break;
+            case MSG_CLOSEDSREQ:
+                TwainThread_EndBatch(t);
+                break;
+            }
+        } else {
+            TranslateMessage(&msg);
+            DispatchMessage(&msg);
+        }
+    }
+
+out:
+    CoUninitialize();
+
+    TwainThread_EndJob(t);
+
+    // a batch handed over just before the session ended
+    t->job = (ScanJob *)InterlockedExchangePointer((PVOID volatile *)&t->pendingJob, NULL);
+    t->device = t->pendingDevice;
+    TwainThread_EndJob(t);
+
+    PostMessage(t->hwndNotify, TWAINTHREAD_WM_ENDED, 0, (LPARAM)t);
+
+    return 0;
+}
+
+// How long the call may take, 0 while the user may be busy in a dialog
+// of the source
+static DWORD
+TwainThread_CallDeadline(const TwainThread *t, const TwainCallInfo *pCall)
+{
+    switch (pCall->dat) {
+    case DAT_IDENTITY:
+        return pCall->msg == MSG_USERSELECT ? 0 : TWAINTHREAD_OPEN_DEADLINE_MS;
+    case DAT_PARENT:
+        return TWAINTHREAD_OPEN_DEADLINE_MS;
+    case DAT_USERINTERFACE:
+    case DAT_EVENT:
+        // with its UI shown, a source may scan while handling an event
+        return (t->options.flags & TWAINTHREAD_NO_UI) ? TWAINTHREAD_TRANSFER_DEADLINE_MS : 0;
+    case DAT_IMAGENATIVEXFER:
+        return TWAINTHREAD_TRANSFER_DEADLINE_MS;
+    default:
+        return TWAINTHREAD_CALL_DEADLINE_MS;
+    }
+}
+
+// Return addresses along the frame pointer chain, starting with the
+// instruction pointer. Drivers built without frame pointers cut it short,
+// but the innermost module is usually what matters.
+static UINT
+TwainThread_WalkStack(const CONTEXT *pContext, DWORD_PTR *frames, UINT maxFrames)
+{
+    UINT count = 0;
+
+#if defined(_M_IX86) || defined(__i386__)
+    frames[count++] = pContext->Eip;
+
+    // ReadProcessMemory() fails instead of faulting on a broken chain
+    DWORD_PTR fp = pContext->Ebp;
+    while (count < maxFrames) {
+        DWORD_PTR frame[2]; // saved frame pointer, return address
+        SIZE_T read = 0;
+        if (!ReadProcessMemory(GetCurrentProcess(), (LPCVOID)fp, frame, sizeof(frame), &read)
+            || read != sizeof(frame) || !frame[1] || frame[0] <= fp)
+            break;
+
+        frames[count++] = frame[1];
+        fp = frame[0];
+    }
+#else
+    (void)pContext;
+    (void)frames;
+    (void)maxFrames;
+#endif
+
+    return count;
+}
+
+static int
+TwainThread_FormatFrame(WCHAR *buf, DWORD_PTR address)
+{
+    // the allocation of a loaded image starts at its module handle
+    MEMORY_BASIC_INFORMATION mbi;
+    WCHAR module[MAX_PATH];
+    if (!VirtualQuery((LPCVOID)address, &mbi, sizeof(mbi))
+        || !GetModuleFileName((HMODULE)mbi.AllocationBase, module, MAX_PATH))
+        return wsprintf(buf, L"  0x%08lx\r\n", (DWORD)address);
+
+    const WCHAR *name = module;
+    for (const WCHAR *p = module; *p; ++p) {
+        if (*p == '\\' || *p == '/')
+            name = p + 1;
+    }
+
+    return wsprintf(buf, L"  %s+0x%lx\r\n", name, (DWORD)(address - (DWORD_PTR)mbi.AllocationBase));
+}
+
+static void
+TwainThread_ReportHang(TwainThread *t, const TwainCallInfo *pCall, DWORD elapsed, const DWORD_PTR *frames, UINT frameCount)
+{
+    TraceLog_Write(L"%hs: DG 0x%lx DAT 0x%04x MSG 0x%04x hasn't returned for %lu ms",
+                   t->session.source.ProductName, pCall->dg, pCall->dat, pCall->msg, elapsed);
+
+    WCHAR text[4096];
+    int len = wsprintf(text, L"%hs stopped responding in DG 0x%lx DAT 0x%04x MSG 0x%04x after %lu ms\r\n\r\nStack:\r\n",
+                       t->session.source.ProductName, pCall->dg, pCall->dat, pCall->msg, elapsed);
+    for (UINT i = 0; i < frameCount && len < (int)(sizeof(text)/sizeof(text[0])) - MAX_PATH - 40; ++i)
+        len += TwainThread_FormatFrame(text + len, frames[i]);
+
+    WCHAR path[MAX_PATH + 80];
+    if (TraceLog_SaveReport(L"hang", text, path))
+        TraceLog_Write(L"hang report saved as %s", path);
+}
+
+// Runs on the UI thread. A session stuck in a driver call can't be
+// cancelled, but it can be diagnosed, and the pages it delivered so far
+// are written instead of waiting for it forever.
+static void
+TwainThread_CheckHung(TwainThread *t, DWORD now)
+{
+    TwainCallInfo call;
+    if (t->hung || !TwainHelper_CallInProgress(&t->session, &call))
+        return;
+
+    DWORD deadline = TwainThread_CallDeadline(t, &call);
+    if (!deadline || now - call.startTicks < deadline)
+        return;
+
+    // while the thread is suspended, neither its call nor its job change;
+    // nothing in here may take a lock the thread could be holding
+    CONTEXT context;
+    ZeroMemory(&context, sizeof(context));
+    context.ContextFlags = CONTEXT_CONTROL;
+    BOOL haveContext = FALSE;
+    BOOL stuck = FALSE;
+    ScanJob *job = NULL;
+    UINT device = 0;
+
+    if (SuspendThread(t->hThread) == (DWORD)-1)
+        return;
+
+    TwainCallInfo again;
+    if (TwainHelper_CallInProgress(&t->session, &again) && again.seq == call.seq) {
+        stuck = TRUE;
+        haveContext = GetThreadContext(t->hThread, &context);
+        job = t->job;
+        device = t->device;
+        if (job)
+            ScanJob_AddRef(job);
+    }
+
+    ResumeThread(t->hThread);
+
+    if (!stuck)
+        return;
+
+    t->hung = TRUE;
+
+    // the stack of a hung thread stays put, so it's walked afterwards
+    DWORD_PTR frames[TWAINTHREAD_MAX_FRAMES];
+    UINT frameCount = haveContext ? TwainThread_WalkStack(&context, frames, TWAINTHREAD_MAX_FRAMES) : 0;
+    TwainThread_ReportHang(t, &call, now - call.startTicks, frames, frameCount);
+
+    if (job) {
+        ScanJob_AbandonDevice(job, device);
+        ScanJob_Release(job);
+    }
+
+    PostMessage(t->hwndNotify, TWAINTHREAD_WM_HUNG, 0, (LPARAM)t);
+}
+
+static VOID CALLBACK
+TwainThread_WatchdogProc(HWND hwnd, UINT uMsg, UINT_PTR idEvent, DWORD dwTime)
+{
+    (void)hwnd;
+    (void)uMsg;
+    (void)idEvent;
+    (void)dwTime;
+
+    DWORD now = GetTickCount();
+    for (TwainThread *t = g_threads; t; t = t->next)
+        TwainThread_CheckHung(t, now);
+}
+
+static void
+TwainThread_UpdateWatchdog(void)
+{
+    if (g_threads && !g_watchdogTimer) {
+        g_watchdogTimer = SetTimer(NULL, 0, TWAINTHREAD_WATCHDOG_INTERVAL_MS, TwainThread_WatchdogProc);
+    } else if (!g_threads && g_watchdogTimer) {
+        KillTimer(NULL, g_watchdogTimer);
+        g_watchdogTimer = 0;
+    }
+}
+
+static TwainThread *
+TwainThread_Spawn(HWND hwndNotify, TwainThreadMode mode, ScanJob *pJob, UINT device, const TW_IDENTITY *pSource, const TwainScanOptions *pOptions)
+{
+    static BOOL classRegistered = FALSE;
+    if (!classRegistered) {
+        WNDCLASS wc;
+        ZeroMemory(&wc, sizeof(wc));
+        wc.lpfnWndProc = TwainThread_WndProc;
+        wc.hInstance = GetModuleHandle(NULL);
+        wc.lpszClassName = g_twainWindowClass;
+        classRegistered = RegisterClass(&wc) != 0;
+    }
+
+    TwainThread *t = (TwainThread *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(*t));
+    if (!t)
+        return NULL;
+
+    t->hwndNotify = hwndNotify;
+    t->session.state = TH_STATE_DSM_LOADED;
+    t->job = pJob;
+    t->device = device;
+    if (pSource) {
+        t->source = *pSource;
+        t->hasSource = TRUE;
+    }
+    if (pJob)
+        ScanJob_AddRef(pJob);
+    t->mode = mode;
+    if (pOptions)
+        t->options = *pOptions;
+    else
+        TwainThread_DefaultOptions(&t->options);
+    t->options.profile = NULL;
+    if (pOptions && pOptions->profile) {
+        t->profile = Profile_Copy(pOptions->profile);
+        if (!t->profile) {
+            ScanJob_Release(t->job);
+            HeapFree(GetProcessHeap(), 0, t);
+            return NULL;
+        }
+    }
+
+    t->hReadyEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (t->hReadyEvent)
+        t->hThread = CreateThread(NULL, 0, TwainThread_Main, t, 0, NULL);
+
+    if (!t->hThread) {
+        if (t->hReadyEvent)
+            CloseHandle(t->hReadyEvent);
+        Profile_Free(t->profile);
+        ScanJob_Release(t->job);
+        HeapFree(GetProcessHeap(), 0, t);
+        return NULL;
+    }
+
+    // wait for the hidden window, so TwainThread_StopAll() can reach it
+    WaitForSingleObject(t->hReadyEvent, INFINITE);
+
+    t->next = g_threads;
+    g_threads = t;
+    TwainThread_UpdateWatchdog();
+
+    return t;
+}
+
+void
+TwainThread_DefaultOptions(TwainScanOptions *pOptions)
+{
+    ZeroMemory(pOptions, sizeof(*pOptions));
+    pOptions->pixelType = -1;
+    pOptions->duplex = -1;
+    pOptions->feeder = -1;
+    pOptions->deskew = -1;
+}
+
+TwainThread *
+TwainThread_Start(HWND hwndNotify, ScanJob *pJob, UINT device, const TW_IDENTITY *pSource, const TwainScanOptions *pOptions)
+{
+    return TwainThread_Spawn(hwndNotify, TWAINTHREAD_MODE_SCAN, pJob, device, pSource, pOptions);
+}
+
+TwainThread *
+TwainThread_StartSourcePicker(HWND hwndNotify)
+{
+    return TwainThread_Spawn(hwndNotify, TWAINTHREAD_MODE_PICK, NULL, 0, NULL, NULL);
+}
+
+TwainThread *
+TwainThread_StartSourceList(HWND hwndNotify)
+{
+    return TwainThread_Spawn(hwndNotify, TWAINTHREAD_MODE_LIST, NULL, 0, NULL, NULL);
+}
+
+BOOL
+TwainThread_ScanAgain(TwainThread *pThread, ScanJob *pJob, UINT device)
+{
+    // hand over the job first, so the session thread either picks it up
+    // or releases it on its way out
+    ScanJob_AddRef(pJob);
+    pThread->pendingDevice = device;
+    InterlockedExchangePointer((PVOID volatile *)&pThread->pendingJob, pJob);
+
+    if (InterlockedCompareExchange(&pThread->idle, 0, 1) != 1) {
+        ScanJob *job = (ScanJob *)InterlockedExchangePointer((PVOID volatile *)&pThread->pendingJob, NULL);
+        ScanJob_Release(job);
+        return FALSE;
+    }
+
+    HWND hwndTwain = pThread->hwndTwain;
+    if (hwndTwain)
+        PostMessage(hwndTwain, TWAINTHREAD_CMD_SCAN, 0, 0);
+
+    return TRUE;
+}
+
+void
+TwainThread_Stop(TwainThread *pThread)
+{
+    HWND hwndTwain = pThread->hwndTwain;
+    if (hwndTwain)
+        PostMessage(hwndTwain, TWAINTHREAD_CMD_QUIT, 0, 0);
+}
+
+void
+TwainThread_FreeSourceList(TwainSourceList *pList)
+{
+    if (pList)
+        HeapFree(GetProcessHeap(), 0, pList);
+}
+
+static void
+TwainThread_Free(TwainThread *t, DWORD timeout)
+{
+    WaitForSingleObject(t->hThread, timeout);
+    CloseHandle(t->hThread);
+    CloseHandle(t->hReadyEvent);
+    ScanJob_Release(t->job);
+    Profile_Free(t->profile);
+    HeapFree(GetProcessHeap(), 0, t);
+}
+
+void
+TwainThread_Reap(TwainThread *pThread)
+{
+    for (TwainThread **pp = &g_threads; *pp; pp = &(*pp)->next) {
+        if (*pp == pThread) {
+            *pp = pThread->next;
+            TwainThread_UpdateWatchdog();
+            TwainThread_Free(pThread, INFINITE);
+            return;
+        }
+    }
+}
+
+void
+TwainThread_StopAll(void)
+{
+    for (TwainThread *t = g_threads; t; t = t->next)
+        TwainThread_Stop(t);
+
+    while (g_threads) {
+        TwainThread *t = g_threads;
+        g_threads = t->next;
+
+        // don't hang forever on shutdown if a driver got stuck
+        if (WaitForSingleObject(t->hThread, t->hung ? 0 : 10000) == WAIT_TIMEOUT) {
+            // the thread still uses t, so leak it rather than free it
+            CloseHandle(t->hThread);
+            continue;
+        }
+
+        TwainThread_Free(t, 0);
+    }
+
+    TwainThread_UpdateWatchdog();
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+// Copyright © 2021 Jonas Kümmerlin <jonas@kuemmerlin.eu>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <windows.h>
+#include "twainhelper.h"
+#include "scanjob.h"
+
+// Every TWAIN session lives on its own thread, with a hidden window as
+// the DSM parent and its own message loop. Slow driver calls don't block
+// the UI, a busy UI doesn't delay MSG_XFERREADY handling, and several
+// sources can transfer at the same time. Transferred pages go to a scan
+// job, which may collect the pages of several sessions.
+//
+// The threads report back by posting these messages to the notify window:
+enum {
+    TWAINTHREAD_WM_STATE = WM_APP + 0x100, // wParam: enum TwainHelperState, lParam: TwainThread *
+    TWAINTHREAD_WM_ERROR,                  // lParam: static error message (const WCHAR *)
+    TWAINTHREAD_WM_ENDED,                  // lParam: TwainThread *, call TwainThread_Reap()
+    TWAINTHREAD_WM_SOURCESPICKED,          // lParam: TwainSourceList *, free with TwainThread_FreeSourceList()
+    TWAINTHREAD_WM_SOURCESLISTED,          // lParam: TwainSourceList *, free with TwainThread_FreeSourceList()
+    TWAINTHREAD_WM_PROFILECAPTURED,        // lParam: ScanProfile *, free with Profile_Free()
+    TWAINTHREAD_WM_PAGE,                   // wParam: transfers pending (0xffff: unknown), lParam: TwainThread *
+    TWAINTHREAD_WM_PAGESKIPPED,            // wParam: page number in the batch, from 1, lParam: TwainThread *
+    TWAINTHREAD_WM_HUNG                    // lParam: TwainThread *, stuck in the driver, see below
+};
+
+// A watchdog on the UI thread notices sessions that are stuck in a driver
+// call for too long. It saves a report with the stack and the recent
+// trace to the Logs folder, lets the scan job write what the session
+// delivered so far and posts TWAINTHREAD_WM_HUNG. The session itself
+// can't be stopped; it gets TWAINTHREAD_WM_ENDED if it ever comes back,
+// and TwainThread_StopAll() doesn't wait for it.
+
+enum {
+    TWAINTHREAD_MAX_SOURCES = 32
+};
+
+// flags for TwainScanOptions
+enum {
+    TWAINTHREAD_KEEP_WARM      = 0x1,
+    TWAINTHREAD_ASK_IF_MISSING = 0x2, // let the user select if pSource isn't installed
+    TWAINTHREAD_NO_UI          = 0x4, // enable the source with ShowUI=FALSE
+    TWAINTHREAD_CAPTURE_PROFILE = 0x8, // post the source's settings after every batch
+    TWAINTHREAD_NO_INDICATORS  = 0x10  // CAP_INDICATORS=FALSE, no progress dialog per page
+};
+
+// what makes a page a separator sheet, detected by the source itself
+enum {
+    TWAINTHREAD_SEPARATE_PATCHCODE = 0x1, // any patch code
+    TWAINTHREAD_SEPARATE_BARCODE   = 0x2  // a barcode starting with separatorPrefix
+};
+
+struct ScanProfile;
+
+// How a session sets up its source for every batch. Zero means the
+// source's own default, all of it is applied in state 4 right before
+// the source is enabled. The feeder is on unless set otherwise (or a
+// profile's driver data decides), so the scanner keeps pulling paper
+// while earlier pages are still being transferred.
+struct TwainScanOptions {
+    UINT flags;
+    UINT pageLimit;   // abort the batch after this many pages
+    UINT resolution;  // dpi
+    int  pixelType;   // TWPT_*, or -1
+    UINT bitDepth;    // ICAP_BITDEPTH for the pixel type, e.g. 1 for TWPT_BW
+    int  duplex;      // CAP_DUPLEXENABLED, or -1
+    int  feeder;      // FEEDERENABLED, AUTOFEED and AUTOSCAN with all buffers, or -1: on (see above)
+    int  deskew;      // ICAP_AUTOMATICDESKEW, or -1
+    UINT separators;  // TWAINTHREAD_SEPARATE_*
+    char separatorPrefix[32]; // empty: any barcode
+    const ScanProfile *profile; // restored first, copied by TwainThread_Start()
+};
+
+void
+TwainThread_DefaultOptions(TwainScanOptions *pOptions);
+
+struct TwainSourceList {
+    UINT        count;
+    TW_IDENTITY sources[TWAINTHREAD_MAX_SOURCES];
+};
+
+struct TwainThread;
+
+// Starts a session that opens pSource, or lets the user select a source
+// if pSource is NULL, enables it and pushes every transferred page into
+// pJob as the given device (the job gets a reference). The first device
+// of a job is remembered as the user's source, see Settings_LoadSource().
+//
+// The session ends by itself once the source asks to be closed, or once
+// all pages are transferred without UI, unless TWAINTHREAD_KEEP_WARM is
+// set: then the source only goes back to state 4 and waits for
+// TwainThread_ScanAgain(), skipping the device initialization many
+// drivers do on MSG_OPENDS. While it waits, the device is checked
+// periodically and the source reopened if the device went away.
+TwainThread *
+TwainThread_Start(HWND hwndNotify, ScanJob *pJob, UINT device, const TW_IDENTITY *pSource, const TwainScanOptions *pOptions);
+
+// Starts the next batch on a warm session. Returns FALSE if the session
+// isn't waiting (still scanning, or about to end).
+BOOL
+TwainThread_ScanAgain(TwainThread *pThread, ScanJob *pJob, UINT device);
+
+// Asks a session to close its source and end
+void
+TwainThread_Stop(TwainThread *pThread);
+
+// Starts a session that lets the user select a source and reports it,
+// together with all other installed sources of the same make and model,
+// as TWAINTHREAD_WM_SOURCESPICKED. Nothing is posted if the user cancels.
+TwainThread *
+TwainThread_StartSourcePicker(HWND hwndNotify);
+
+// Starts a session that enumerates the installed sources without any
+// UI and reports them as TWAINTHREAD_WM_SOURCESLISTED
+TwainThread *
+TwainThread_StartSourceList(HWND hwndNotify);
+
+void
+TwainThread_FreeSourceList(TwainSourceList *pList);
+
+// Frees a session after it posted TWAINTHREAD_WM_ENDED
+void
+TwainThread_Reap(TwainThread *pThread);
+
+// Closes all sources and DSM connections and waits for the threads to exit
+void
+TwainThread_StopAll(void);